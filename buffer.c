@@ -8,24 +8,71 @@
 #include "undo.h"
 #include "prompt.h"
 #include "display.h"
+#include "grep.h"
+#include "occur.h"
+#include "trigram.h"
 #include "util.h"
 #include "terminal.h"
+#include "syntax.h"
 
 extern struct editorConfig E;
 
+/* Source of erow.gen; unique across every row of every buffer */
+static unsigned int row_generation;
+
+/*
+ * The screen line index holds, for every row, the screen line it starts
+ * on in wrapped mode, plus one trailing entry with the total number of
+ * screen lines.  Only the first screen_line_cache_rows entries are known
+ * to be good; an edit to row n only throws away the entries after it.
+ * Lookups only extend the good prefix as far as they need.
+ *
+ * Alongside it, screen_row_width keeps the width of each row, which does
+ * not depend on the screen width, or -1 for a row with wide characters,
+ * whose lines can break early and are counted from the row itself.  A
+ * resize throws away the line index but not the widths, so rebuilding
+ * walks that array rather than the rows themselves, and only up to the
+ * windows shown; the rest is filled in by extendScreenCaches while
+ * waiting for keys.
+ */
+static void invalidateScreenCacheFrom(struct editorBuffer *buf, int at) {
+	if (at < 0)
+		at = 0;
+	if (buf->screen_line_cache_rows > at + 1)
+		buf->screen_line_cache_rows = at + 1;
+	if (buf->screen_width_rows > at)
+		buf->screen_width_rows = at;
+}
+
 void invalidateScreenCache(struct editorBuffer *buf) {
-	buf->screen_line_cache_valid = 0;
-	for (int i = 0; i < buf->numrows; i++) {
-		buf->row[i].width_valid = 0;
-	}
+	buf->screen_line_cache_rows = 0;
+	buf->screen_width_rows = 0;
 }
 
-void buildScreenCache(struct editorBuffer *buf) {
-	if (buf->screen_line_cache_valid)
+void invalidateRow(struct editorBuffer *buf, int at) {
+	if (at < 0 || at >= buf->numrows)
 		return;
+	buf->row[at].render_valid = 0;
+	buf->row[at].width_valid = 0;
+	if (buf->trigrams)
+		trigramForgetRow(buf, &buf->row[at]);
+	invalidateScreenCacheFrom(buf, at);
+	syntaxInvalidate(buf, at + 1, at + 1);
+}
 
-	if (buf->screen_line_cache_size < buf->numrows) {
-		size_t new_size = buf->numrows;
+/* Make entries 0..upto of the index good */
+static void extendScreenCache(struct editorBuffer *buf, int upto) {
+	if (buf->screen_line_cache_cols != E.screencols) {
+		buf->screen_line_cache_cols = E.screencols;
+		buf->screen_line_cache_rows = 0;
+	}
+	if (upto > buf->numrows)
+		upto = buf->numrows;
+	if (buf->screen_line_cache_rows > upto)
+		return;
+
+	if (buf->screen_line_cache_size < buf->numrows + 1) {
+		size_t new_size = buf->numrows + 1;
 		if (new_size <= SIZE_MAX - 100) {
 			new_size += 100;
 		}
@@ -36,37 +83,192 @@ void buildScreenCache(struct editorBuffer *buf) {
 		buf->screen_line_start =
 			xrealloc(buf->screen_line_start,
 				 buf->screen_line_cache_size * sizeof(int));
+		buf->screen_row_width =
+			xrealloc(buf->screen_row_width,
+				 buf->screen_line_cache_size * sizeof(int));
 	}
 
-	if (!buf->screen_line_start)
-		return;
-
-	int screen_line = 0;
-	for (int i = 0; i < buf->numrows; i++) {
-		buf->screen_line_start[i] = screen_line;
+	int i = buf->screen_line_cache_rows;
+	if (i == 0) {
+		buf->screen_line_start[0] = 0;
+		i = 1;
+	}
+	int screen_line = buf->screen_line_start[i - 1];
+	for (; i <= upto; i++) {
 		if (buf->truncate_lines) {
 			screen_line += 1;
 		} else {
-			int width = calculateLineWidth(&buf->row[i]);
-			int lines_used = (width / E.screencols) + 1;
-			screen_line += lines_used;
+			erow *row = &buf->row[i - 1];
+			int width;
+			if (i - 1 < buf->screen_width_rows) {
+				width = buf->screen_row_width[i - 1];
+			} else {
+				width = calculateLineWidth(row);
+				if (row->wide)
+					width = -1;
+				buf->screen_row_width[i - 1] = width;
+				buf->screen_width_rows = i;
+			}
+			if (width < 0)
+				screen_line +=
+					rowScreenLines(row, E.screencols);
+			else
+				screen_line += width / E.screencols + 1;
 		}
+		buf->screen_line_start[i] = screen_line;
 	}
 
-	buf->screen_line_cache_valid = 1;
+	buf->screen_line_cache_rows = upto + 1;
+}
+
+void buildScreenCache(struct editorBuffer *buf) {
+	extendScreenCache(buf, buf->numrows);
+}
+
+/* Rows of index filled in per step of extendScreenCaches */
+#define SCREEN_CACHE_STEP 16384
+
+static int screenCacheBehind(struct editorBuffer *buf) {
+	return !buf->truncate_lines &&
+	       (buf->screen_line_cache_cols != E.screencols ||
+		buf->screen_line_cache_rows <= buf->numrows);
+}
+
+/*
+ * Extend the index of one buffer that is behind by a bounded step, the
+ * buffers on screen first.  Returns 0 once every index is complete.
+ */
+int extendScreenCaches(void) {
+	struct editorBuffer *buf = NULL;
+	for (int i = 0; i < E.nwindows && !buf; i++) {
+		if (screenCacheBehind(E.windows[i]->buf))
+			buf = E.windows[i]->buf;
+	}
+	for (struct editorBuffer *b = E.headbuf; b && !buf; b = b->next) {
+		if (screenCacheBehind(b))
+			buf = b;
+	}
+	if (!buf)
+		return 0;
+	extendScreenCache(buf, buf->screen_line_cache_cols == E.screencols ?
+				       buf->screen_line_cache_rows +
+					       SCREEN_CACHE_STEP :
+				       SCREEN_CACHE_STEP);
+	return 1;
 }
 
+/* Screen line that row starts on; row == numrows gives the total. */
 int getScreenLineForRow(struct editorBuffer *buf, int row) {
-	if (!buf->screen_line_cache_valid) {
-		buildScreenCache(buf);
-	}
-	if (row >= buf->numrows || row < 0)
+	if (row <= 0)
 		return 0;
+	if (row > buf->numrows)
+		row = buf->numrows;
+	if (buf->truncate_lines)
+		return row;
+	extendScreenCache(buf, row);
 	return buf->screen_line_start[row];
 }
 
+/* The row displayed on the given screen line, by binary search. */
+int getRowForScreenLine(struct editorBuffer *buf, int line) {
+	if (line <= 0 || buf->numrows == 0)
+		return 0;
+	if (buf->truncate_lines)
+		return line < buf->numrows ? line : buf->numrows;
+
+	/* Every row takes at least one line, so the row is at most line;
+	 * past the good prefix, extend it a step at a time until it
+	 * reaches the line */
+	int upto = line < buf->numrows ? line : buf->numrows;
+	extendScreenCache(buf, 0);
+	while (buf->screen_line_cache_rows <= upto &&
+	       buf->screen_line_start[buf->screen_line_cache_rows - 1] <=
+		       line)
+		extendScreenCache(buf, buf->screen_line_cache_rows +
+					       SCREEN_CACHE_STEP);
+
+	int lo = 0, hi = buf->screen_line_cache_rows - 1;
+	if (hi > upto)
+		hi = upto;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (buf->screen_line_start[mid] <= line)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+int getRowScreenHeight(struct editorBuffer *buf, int row) {
+	if (row < 0 || row >= buf->numrows || buf->truncate_lines)
+		return 1;
+	return rowScreenLines(&buf->row[row], E.screencols);
+}
+
+/*
+ * A wrapped row takes screen lines cols wide, but a wide character that
+ * would straddle the edge starts the next line instead; see
+ * wrapLineStarts.  Only a row with wide characters can break early, so
+ * only those have their line starts worked out, once per screen width.
+ */
+static void rowWrap(erow *row, int cols) {
+	calculateLineWidth(row);
+	if (!row->wide || row->wrap_cols == cols)
+		return;
+	int n = wrapLineStarts(row->chars, row->size, cols, NULL, 0);
+	row->wraps = xrealloc(row->wraps, (n + 1) * sizeof(int));
+	row->nwraps = wrapLineStarts(row->chars, row->size, cols, row->wraps,
+				     n);
+	row->wrap_cols = cols;
+}
+
+/* Screen lines a row takes wrapped to cols columns */
+int rowScreenLines(erow *row, int cols) {
+	rowWrap(row, cols);
+	if (!row->wide)
+		return row->cached_width / cols + 1;
+	return row->nwraps + 1;
+}
+
+/* Render column screen line subline of a wrapped row starts at */
+int rowSublineColumn(erow *row, int subline, int cols) {
+	rowWrap(row, cols);
+	if (subline <= 0)
+		return 0;
+	if (!row->wide)
+		return subline * cols;
+	if (subline > row->nwraps)
+		subline = row->nwraps;
+	return subline ? row->wraps[subline - 1] : 0;
+}
+
+/* Screen line of a wrapped row render column col is drawn on */
+int rowColumnSubline(erow *row, int col, int cols) {
+	rowWrap(row, cols);
+	if (!row->wide)
+		return col / cols;
+	int lo = 0, hi = row->nwraps;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (row->wraps[mid - 1] <= col)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/*
+ * Rows longer than ROW_CHECKPOINT_BYTES get a render column recorded at
+ * the first character boundary past every ROW_CHECKPOINT_BYTES bytes, so
+ * converting between bytes and columns only walks from the nearest
+ * checkpoint rather than from the start of the row.
+ */
+#define ROW_CHECKPOINT_BYTES 1024
+
 int calculateLineWidth(erow *row) {
-	if (row->width_valid) {
+	if (row->width_valid && row->render_valid) {
 		return row->cached_width;
 	}
 
@@ -74,17 +276,116 @@ int calculateLineWidth(erow *row) {
 		updateRow(row);
 	}
 
-	int screen_x = 0;
-	for (int i = 0; i < row->size;) {
-		screen_x = nextScreenX(row->chars, &i, screen_x);
+	int ncheckpoints = 0;
+	if (row->size > ROW_CHECKPOINT_BYTES &&
+	    row->ascii_prefix < row->size) {
+		row->checkpoints =
+			xrealloc(row->checkpoints,
+				 (row->size / ROW_CHECKPOINT_BYTES) *
+					 sizeof(struct rowCheckpoint));
+	}
+
+	/* Columns equal bytes through the ASCII prefix, so checkpoints are
+	 * only needed after it */
+	int plain = row->ascii_prefix;
+	int screen_x = plain;
+	int wide = 0;
+	int next_checkpoint = (plain / ROW_CHECKPOINT_BYTES + 1) *
+			      ROW_CHECKPOINT_BYTES;
+	for (int i = plain; i < row->size;) {
+		if (i >= next_checkpoint) {
+			row->checkpoints[ncheckpoints].byte = i;
+			row->checkpoints[ncheckpoints].col = screen_x;
+			ncheckpoints++;
+			next_checkpoint += ROW_CHECKPOINT_BYTES;
+		}
+		int x = nextScreenX(row->chars, &i, screen_x);
+		if (x - screen_x > 1 && row->chars[i] != '\t')
+			wide = 1;
+		screen_x = x;
 		i++;
 	}
 
+	row->ncheckpoints = ncheckpoints;
+	row->wide = wide;
+	row->wrap_cols = 0;
 	row->cached_width = screen_x;
 	row->width_valid = 1;
 	return screen_x;
 }
 
+/* Length of the printable ASCII run the row starts with, where byte
+ * offsets and render columns coincide.  0 until the row is rendered. */
+int rowAsciiPrefix(erow *row) {
+	return row->render_valid ? row->ascii_prefix : 0;
+}
+
+/* Last checkpoint at or before byte, or -1 */
+static int checkpointForByte(erow *row, int byte) {
+	int lo = 0, hi = row->ncheckpoints - 1, found = -1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (row->checkpoints[mid].byte <= byte) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+/*
+ * Start of the walk to render column col: the byte offset of the last
+ * checkpoint at or before it, with its column in *render_x.
+ */
+int rowSeekColumn(erow *row, int col, int *render_x) {
+	*render_x = 0;
+	if (row->size <= ROW_CHECKPOINT_BYTES) {
+		int plain = rowAsciiPrefix(row);
+		*render_x = col < plain ? col : plain;
+		return *render_x;
+	}
+	calculateLineWidth(row);
+	if (col <= row->ascii_prefix) {
+		*render_x = col;
+		return col;
+	}
+
+	int lo = 0, hi = row->ncheckpoints - 1, found = -1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (row->checkpoints[mid].col <= col) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (found < 0) {
+		*render_x = row->ascii_prefix;
+		return row->ascii_prefix;
+	}
+	*render_x = row->checkpoints[found].col;
+	return row->checkpoints[found].byte;
+}
+
+/* Byte offset of the character drawn at render column col. */
+int displayColumnToChars(erow *row, int col) {
+	int render_x;
+	int i = rowSeekColumn(row, col, &render_x);
+
+	while (i < row->size) {
+		int next = i;
+		int x = nextScreenX(row->chars, &next, render_x);
+		if (x > col)
+			break;
+		render_x = x;
+		i = next + 1;
+	}
+	return i;
+}
+
 int charsToDisplayColumn(erow *row, int char_pos) {
 	if (!row || char_pos < 0)
 		return 0;
@@ -92,8 +393,22 @@ int charsToDisplayColumn(erow *row, int char_pos) {
 		return calculateLineWidth(row);
 	}
 
-	int col = 0;
-	for (int i = 0; i < char_pos && i < row->size; i++) {
+	if (row->size > ROW_CHECKPOINT_BYTES)
+		calculateLineWidth(row);
+	int plain = rowAsciiPrefix(row);
+	if (char_pos <= plain)
+		return char_pos;
+
+	int col = plain;
+	int i = plain;
+	if (row->size > ROW_CHECKPOINT_BYTES) {
+		int cp = checkpointForByte(row, char_pos);
+		if (cp >= 0) {
+			i = row->checkpoints[cp].byte;
+			col = row->checkpoints[cp].col;
+		}
+	}
+	for (; i < char_pos && i < row->size; i++) {
 		if (row->chars[i] == '\t') {
 			col = (col + EMSYS_TAB_STOP) / EMSYS_TAB_STOP *
 			      EMSYS_TAB_STOP;
@@ -112,8 +427,10 @@ int charsToDisplayColumn(erow *row, int char_pos) {
 void updateRow(erow *row) {
 	int tabs = 0;
 	int extra = 0;
+	int plain = asciiPrefixLength(row->chars, row->size);
 	int j;
-	for (j = 0; j < row->size; j++) {
+	row->ascii_prefix = plain;
+	for (j = plain; j < row->size; j++) {
 		if (row->chars[j] == '\t') {
 			tabs++;
 		} else if (ISCTRL(row->chars[j])) {
@@ -143,10 +460,12 @@ void updateRow(erow *row) {
 
 	render_size += tab_expansion + extra + 1;
 	row->render = xmalloc(render_size);
-	row->renderwidth = 0;
+	/* The printable ASCII prefix renders as itself */
+	memcpy(row->render, row->chars, plain);
+	row->renderwidth = plain;
 
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
+	int idx = plain;
+	for (j = plain; j < row->size; j++) {
 		/* Ensure we have enough space for worst case (control char = 9 bytes) */
 		if ((size_t)(idx + 10) >= render_size) {
 			break;
@@ -194,6 +513,10 @@ void updateRow(erow *row) {
 	row->render[idx] = 0;
 	row->rsize = idx;
 	row->render_valid = 1;
+	/* Every edit clears render_valid, so this is where rows change */
+	if (++row_generation == 0)
+		row_generation = 1;
+	row->gen = row_generation;
 }
 
 void editorInsertRow(struct editorBuffer *bufr, int at, char *s, size_t len) {
@@ -228,33 +551,53 @@ void editorInsertRow(struct editorBuffer *bufr, int at, char *s, size_t len) {
 	bufr->row[at].cached_width = 0;
 	bufr->row[at].width_valid = 0;
 	bufr->row[at].render_valid = 0;
+	bufr->row[at].gen = 0;
+	bufr->row[at].checkpoints = NULL;
+	bufr->row[at].ncheckpoints = 0;
+	bufr->row[at].wide = 0;
+	bufr->row[at].wraps = NULL;
+	bufr->row[at].nwraps = 0;
+	bufr->row[at].wrap_cols = 0;
+	bufr->row[at].ascii_prefix = 0;
+	bufr->row[at].hl_state = 0;
+	bufr->row[at].trigram_id = 0;
+	if (bufr->trigrams)
+		trigramForgetRow(bufr, &bufr->row[at]);
 
 	bufr->numrows++;
 	bufr->dirty = 1;
-	if (at < bufr->numrows - 1 || bufr->screen_line_cache_valid) {
-		invalidateScreenCache(bufr);
-	}
+	invalidateScreenCacheFrom(bufr, at);
+	syntaxInvalidate(bufr, at, at + 1);
 }
 
 void freeRow(erow *row) {
+	free(row->checkpoints);
+	free(row->wraps);
 	free(row->render);
 	free(row->chars);
 }
 
 void editorDelRow(struct editorBuffer *bufr, int at) {
-	if (at < 0 || at >= bufr->numrows)
+	editorDelRows(bufr, at, 1);
+}
+
+/* Delete n rows from at, moving the rows after them down only once */
+void editorDelRows(struct editorBuffer *bufr, int at, int n) {
+	if (at < 0 || at >= bufr->numrows || n <= 0)
 		return;
-	freeRow(&bufr->row[at]);
-	if (at == bufr->numrows - 1) {
-		// Last row, no need to memmove
-		bufr->numrows--;
-	} else {
-		memmove(&bufr->row[at], &bufr->row[at + 1],
-			sizeof(erow) * (bufr->numrows - at - 1));
-		bufr->numrows--;
-	}
+	if (n > bufr->numrows - at)
+		n = bufr->numrows - at;
+	for (int i = at; i < at + n; i++) {
+		if (bufr->trigrams)
+			trigramForgetRow(bufr, &bufr->row[i]);
+		freeRow(&bufr->row[i]);
+	}
+	memmove(&bufr->row[at], &bufr->row[at + n],
+		sizeof(erow) * (bufr->numrows - at - n));
+	bufr->numrows -= n;
 	bufr->dirty = 1;
-	invalidateScreenCache(bufr);
+	invalidateScreenCacheFrom(bufr, at);
+	syntaxInvalidate(bufr, at, at);
 }
 
 void rowInsertChar(struct editorBuffer *bufr, erow *row, int at, int c) {
@@ -270,10 +613,8 @@ void rowInsertChar(struct editorBuffer *bufr, erow *row, int at, int c) {
 	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
 	row->size++;
 	row->chars[at] = c;
-	row->render_valid = 0;
 	bufr->dirty = 1;
-	row->width_valid = 0;
-	invalidateScreenCache(bufr);
+	invalidateRow(bufr, row - bufr->row);
 }
 
 void editorRowInsertUnicode(struct editorConfig *ed, struct editorBuffer *bufr,
@@ -285,8 +626,8 @@ void editorRowInsertUnicode(struct editorConfig *ed, struct editorBuffer *bufr,
 		row->size - at + 1);
 	row->size += ed->nunicode;
 	memcpy(&row->chars[at], ed->unicode, ed->nunicode);
-	row->render_valid = 0;
 	bufr->dirty = 1;
+	invalidateRow(bufr, row - bufr->row);
 }
 
 void rowAppendString(struct editorBuffer *bufr, erow *row, char *s,
@@ -295,8 +636,31 @@ void rowAppendString(struct editorBuffer *bufr, erow *row, char *s,
 	memcpy(&row->chars[row->size], s, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
-	row->render_valid = 0;
 	bufr->dirty = 1;
+	invalidateRow(bufr, row - bufr->row);
+}
+
+void rowSetString(struct editorBuffer *bufr, erow *row, char *s,
+		  size_t len) {
+	row->chars = xrealloc(row->chars, len + 1);
+	memcpy(row->chars, s, len);
+	row->size = len;
+	row->chars[row->size] = '\0';
+	bufr->dirty = 1;
+	invalidateRow(bufr, row - bufr->row);
+}
+
+/* Put s in place of the len bytes at at */
+void rowReplaceString(struct editorBuffer *bufr, erow *row, int at, int len,
+		      char *s, size_t slen) {
+	if (slen > (size_t)len)
+		row->chars = xrealloc(row->chars, row->size + slen - len + 1);
+	memmove(&row->chars[at + slen], &row->chars[at + len],
+		row->size - at - len + 1);
+	memcpy(&row->chars[at], s, slen);
+	row->size += slen - len;
+	bufr->dirty = 1;
+	invalidateRow(bufr, row - bufr->row);
 }
 
 void rowDelChar(struct editorBuffer *bufr, erow *row, int at) {
@@ -306,8 +670,8 @@ void rowDelChar(struct editorBuffer *bufr, erow *row, int at) {
 	memmove(&row->chars[at], &row->chars[at + size],
 		row->size - ((at + size) - 1));
 	row->size -= size;
-	row->render_valid = 0;
 	bufr->dirty = 1;
+	invalidateRow(bufr, row - bufr->row);
 }
 
 struct editorBuffer *newBuffer(void) {
@@ -322,6 +686,8 @@ struct editorBuffer *newBuffer(void) {
 	ret->row = NULL;
 	ret->filename = NULL;
 	ret->query = NULL;
+	ret->query_regex = 0;
+	ret->match = 0;
 	ret->dirty = 0;
 	ret->special_buffer = 0;
 	ret->undo = newUndo();
@@ -336,17 +702,25 @@ struct editorBuffer *newBuffer(void) {
 	ret->rectangle_mode = 0;
 	ret->single_line = 0;
 	ret->screen_line_start = NULL;
+	ret->screen_row_width = NULL;
+	ret->screen_width_rows = 0;
 	ret->screen_line_cache_size = 0;
-	ret->screen_line_cache_valid = 0;
+	ret->screen_line_cache_rows = 0;
+	ret->screen_line_cache_cols = 0;
+	ret->syntax = NULL;
+	ret->hl_valid_rows = 0;
 	ret->read_only = 0;
+	ret->trigrams = NULL;
 	return ret;
 }
 
 void destroyBuffer(struct editorBuffer *buf) {
 	clearUndosAndRedos(buf);
+	trigramFree(buf);
 	free(buf->filename);
 	free(buf->query);
 	free(buf->screen_line_start);
+	free(buf->screen_row_width);
 	free(buf->completion_state.last_completed_text);
 	for (int i = 0; i < buf->numrows; i++) {
 		freeRow(&buf->row[i]);
@@ -359,6 +733,15 @@ void editorUpdateBuffer(struct editorBuffer *buf) {
 	for (int i = 0; i < buf->numrows; i++) {
 		buf->row[i].render_valid = 0;
 	}
+	invalidateScreenCache(buf);
+	syntaxInvalidate(buf, 0, buf->numrows - 1);
+}
+
+void editorSetSyntax(struct editorBuffer *buf,
+		     const struct editorSyntax *syntax) {
+	buf->syntax = syntax;
+	/* Old states and cached screen lines belong to the old lexer */
+	editorUpdateBuffer(buf);
 }
 
 void editorSwitchToNamedBuffer(struct editorConfig *ed,
@@ -561,5 +944,7 @@ void editorKillBuffer(void) {
 		E.buf = (bufr->next != NULL) ? bufr->next : prevBuf;
 	}
 
+	occurForgetBuffer(bufr);
+	grepForgetBuffer(bufr);
 	destroyBuffer(bufr);
 }
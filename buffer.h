@@ -5,22 +5,38 @@ void updateRow(erow *row);
 void editorInsertRow(struct editorBuffer *bufr, int at, char *s, size_t len);
 void freeRow(erow *row);
 void editorDelRow(struct editorBuffer *bufr, int at);
+void editorDelRows(struct editorBuffer *bufr, int at, int n);
 void rowInsertChar(struct editorBuffer *bufr, erow *row, int at, int c);
 void editorRowInsertUnicode(struct editorConfig *ed, struct editorBuffer *bufr,
 			    erow *row, int at);
 void rowAppendString(struct editorBuffer *bufr, erow *row, char *s, size_t len);
+void rowSetString(struct editorBuffer *bufr, erow *row, char *s, size_t len);
+void rowReplaceString(struct editorBuffer *bufr, erow *row, int at, int len,
+		      char *s, size_t slen);
 void rowDelChar(struct editorBuffer *bufr, erow *row, int at);
 struct editorBuffer *newBuffer(void);
 void destroyBuffer(struct editorBuffer *buf);
 void editorUpdateBuffer(struct editorBuffer *buf);
+void editorSetSyntax(struct editorBuffer *buf,
+		     const struct editorSyntax *syntax);
 void editorSwitchToNamedBuffer(struct editorConfig *ed,
 			       struct editorBuffer *current);
 void editorNextBuffer(void);
 void editorPreviousBuffer(void);
 void editorKillBuffer(void);
 void invalidateScreenCache(struct editorBuffer *buf);
+void invalidateRow(struct editorBuffer *buf, int at);
 void buildScreenCache(struct editorBuffer *buf);
+int extendScreenCaches(void);
 int getScreenLineForRow(struct editorBuffer *buf, int row);
+int getRowForScreenLine(struct editorBuffer *buf, int line);
+int getRowScreenHeight(struct editorBuffer *buf, int row);
+int rowScreenLines(erow *row, int cols);
+int rowSublineColumn(erow *row, int subline, int cols);
+int rowColumnSubline(erow *row, int col, int cols);
 int calculateLineWidth(erow *row);
 int charsToDisplayColumn(erow *row, int char_pos);
+int displayColumnToChars(erow *row, int col);
+int rowAsciiPrefix(erow *row);
+int rowSeekColumn(erow *row, int col, int *render_x);
 #endif
@@ -15,7 +15,7 @@
 #include "edit.h"
 #include "unicode.h"
 #include "undo.h"
-#include <regex.h>
+#include "re.h"
 
 extern struct editorConfig E;
 
@@ -503,12 +503,12 @@ void editorCompleteWord(struct editorConfig *ed, struct editorBuffer *bufr) {
 	regexWord[regexPos++] = '*';
 	regexWord[regexPos] = 0;
 
-	/* Compile a regex out of it. This is slow, but Russ Cox said
-	 * regexes are fast, so he's probably got a C regex library
-	 * just lying around that we could use. */
-	regex_t regex;
-	int reti = regcomp(&regex, regexWord, REG_EXTENDED | REG_NEWLINE);
-	if (reti) {
+	/* Compile a regex out of it, with re.c: Russ Cox said regexes
+	 * are fast, and he was right. */
+	char error[80];
+	struct re *regex = reCompile((uint8_t *)regexWord, regexPos, 0, error,
+				     sizeof(error));
+	if (!regex) {
 		editorSetStatusMessage("Could not compile regex: %s",
 				       regexWord);
 		return;
@@ -530,27 +530,30 @@ void editorCompleteWord(struct editorConfig *ed, struct editorBuffer *bufr) {
 		}
 		for (int rownum = 0; rownum < scanbuf->numrows; rownum++) {
 			struct erow *scanrow = &scanbuf->row[rownum];
-			regmatch_t pmatch;
+			struct reSpan pmatch;
 			char *line = (char *)scanrow->chars;
 			char *cursor = line;
 
-			while (regexec(&regex, cursor, 1, &pmatch, 0) == 0) {
+			while (reSearch(regex, scanrow->chars, scanrow->size,
+					cursor - line, &pmatch, 1)) {
+				pmatch.start -= cursor - line;
+				pmatch.end -= cursor - line;
 				/* Did we match at the beginning of the
 				 * string or is the previous character not
 				 * alnum? If not, then we didn't match the
 				 * beginning of a word. */
 				if (!((cursor == line ||
-				       !alnum(*(cursor + pmatch.rm_so - 1))))) {
-					cursor += pmatch.rm_eo;
+				       !alnum(*(cursor + pmatch.start - 1))))) {
+					cursor += pmatch.end;
 					continue;
 				}
 
 				/* Copy the whole word */
-				int candidateLen = pmatch.rm_eo - pmatch.rm_so;
-				while (candidateLen + pmatch.rm_so <
+				int candidateLen = pmatch.end - pmatch.start;
+				while (candidateLen + pmatch.start <
 					       scanrow->size &&
 				       alnum(scanrow->chars[cursor - line +
-							    pmatch.rm_so +
+							    pmatch.start +
 							    candidateLen])) {
 					candidateLen++;
 				}
@@ -579,12 +582,12 @@ void editorCompleteWord(struct editorConfig *ed, struct editorBuffer *bufr) {
 				emsys_strlcpy(
 					candidates[ncand],
 					(char *)&scanrow->chars[cursor - line +
-								pmatch.rm_so],
+								pmatch.start],
 					candidateLen + 1);
 				ncand++;
 
 				/* Onward! */
-				cursor += pmatch.rm_so + candidateLen;
+				cursor += pmatch.start + candidateLen;
 			}
 
 			/* Also add keywords if they match. */
@@ -638,11 +641,12 @@ void editorCompleteWord(struct editorConfig *ed, struct editorBuffer *bufr) {
 			 * reduce the number of regex invocations to one,
 			 * by searching for the regex only at the
 			 * beginning of the string. */
-			regmatch_t pmatch2;
+			struct reSpan pmatch2;
 			for (int i = 0; keywords[i] != NULL; i++) {
-				if (regexec(&regex, keywords[i], 1, &pmatch2,
-					    0) == 0 &&
-				    pmatch2.rm_so == 0) {
+				if (reSearch(regex, (uint8_t *)keywords[i],
+					     strlen(keywords[i]), 0, &pmatch2,
+					     1) &&
+				    pmatch2.start == 0) {
 					/* Copy it. */
 					if (ncand >= scand) {
 						/* Out of space, add more. */
@@ -727,7 +731,7 @@ COMPLETE_WORD_DONE:;
 	/* No else clause, they're equal, nothing to do. */
 
 COMPLETE_WORD_CLEANUP:
-	regfree(&regex);
+	reFree(regex);
 	for (int i = 0; i < ncand; i++) {
 		free(candidates[i]);
 	}
@@ -0,0 +1,13 @@
+#ifndef _EMSYS_CONFIG_H
+#define _EMSYS_CONFIG_H
+
+/* Make a copy of this file, call it config.h, and change it however you like */
+/* By default, it will be copied as-is by the makefile. */
+
+/* Universal Argument C-u */
+/* #define EMSYS_CU_UARG */
+
+/* CUA mode*/
+/* #define EMSYS_CUA */
+
+#endif /* _EMSYS_CONFIG_H */
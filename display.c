@@ -7,6 +7,8 @@
 #include "buffer.h"
 #include "util.h"
 #include "wcwidth.h"
+#include "syntax.h"
+#include "search.h"
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -25,36 +27,14 @@ extern void updateRow(erow *row);
 const int minibuffer_height = 1;
 const int statusbar_height = 1;
 
-/* Append buffer implementation */
-void abAppend(struct abuf *ab, const char *s, int len) {
-	if (ab->len + len > ab->capacity) {
-		int new_capacity = ab->capacity == 0 ? 1024 : ab->capacity * 2;
-		while (new_capacity < ab->len + len) {
-			if (new_capacity > INT_MAX / 2) {
-				die("buffer size overflow");
-			}
-			new_capacity *= 2;
-		}
-		ab->b = xrealloc(ab->b, new_capacity);
-		ab->capacity = new_capacity;
-	}
-	memcpy(&ab->b[ab->len], s, len);
-	ab->len += len;
-}
+/* Render columns of the marked region on a row */
+static struct hlSpan regionSpan(struct editorBuffer *buf, int row) {
+	struct hlSpan span = { 0, 0 };
 
-void abFree(struct abuf *ab) {
-	free(ab->b);
-}
-
-/* Check if a render position is within the marked region */
-static int isRenderPosInRegion(struct editorBuffer *buf, int row,
-			       int render_pos) {
 	if (markInvalidSilent())
-		return 0;
+		return span;
 
 	erow *erow_ptr = &buf->row[row];
-	if (!erow_ptr)
-		return 0;
 
 	if (buf->rectangle_mode) {
 		int top_row = buf->cy < buf->marky ? buf->cy : buf->marky;
@@ -63,12 +43,10 @@ static int isRenderPosInRegion(struct editorBuffer *buf, int row,
 		int right_col = buf->cx > buf->markx ? buf->cx : buf->markx;
 
 		if (row < top_row || row > bottom_row)
-			return 0;
-
-		int left_render = charsToDisplayColumn(erow_ptr, left_col);
-		int right_render = charsToDisplayColumn(erow_ptr, right_col);
+			return span;
 
-		return (render_pos >= left_render && render_pos < right_render);
+		span.start = charsToDisplayColumn(erow_ptr, left_col);
+		span.end = charsToDisplayColumn(erow_ptr, right_col);
 	} else {
 		int start_row = buf->cy < buf->marky ? buf->cy : buf->marky;
 		int end_row = buf->cy > buf->marky ? buf->cy : buf->marky;
@@ -84,149 +62,369 @@ static int isRenderPosInRegion(struct editorBuffer *buf, int row,
 				buf->markx;
 
 		if (row < start_row || row > end_row)
-			return 0;
-
-		if (row == start_row && row == end_row) {
-			int start_render =
-				charsToDisplayColumn(erow_ptr, start_col);
-			int end_render =
-				charsToDisplayColumn(erow_ptr, end_col);
-			return (render_pos >= start_render &&
-				render_pos < end_render);
-		}
-		if (row == start_row) {
-			int start_render =
-				charsToDisplayColumn(erow_ptr, start_col);
-			return (render_pos >= start_render);
-		}
-		if (row == end_row) {
-			int end_render =
-				charsToDisplayColumn(erow_ptr, end_col);
-			return (render_pos < end_render);
-		}
-		return 1; /* Entire middle row is in region */
+			return span;
+
+		/* Middle rows are highlighted up to the window edge */
+		span.end = INT_MAX;
+		if (row == start_row)
+			span.start = charsToDisplayColumn(erow_ptr, start_col);
+		if (row == end_row)
+			span.end = charsToDisplayColumn(erow_ptr, end_col);
 	}
+	return span;
 }
 
-/* Check if a render position is at the current search match */
-static int isRenderPosCurrentSearchMatch(struct editorBuffer *buf, int row,
-					 int render_pos) {
-	if (!buf->query || !buf->query[0] || !buf->match)
-		return 0;
-	if (row != buf->cy)
-		return 0;
+/* Render columns of the current search match on a row */
+static struct hlSpan searchMatchSpan(struct editorBuffer *buf, int row) {
+	struct hlSpan span = { 0, 0 };
 
+	if (!buf->query || !buf->query[0] || !buf->match)
+		return span;
+	if (row < buf->cy)
+		return span;
+	if (searchSetPattern(buf->query, buf->query_regex) ||
+	    (row != buf->cy && !searchSpansRows()))
+		return span;
+
+	/* The match is at point; a regex match is as long as it matched,
+	 * and may go on over the next rows */
+	int start, end, endrow, endx;
+	if (!searchNext(buf, buf->cy, buf->cx, &start, &end) ||
+	    start != buf->cx)
+		return span;
+	searchEndPosition(buf, buf->cy, end, &endrow, &endx);
+	if (row > endrow)
+		return span;
 	erow *erow_ptr = &buf->row[row];
-	if (!erow_ptr)
-		return 0;
+	if (row == buf->cy)
+		span.start = charsToDisplayColumn(erow_ptr, start);
+	/* Like the region, a matched newline runs to the window edge */
+	span.end = row == endrow ? charsToDisplayColumn(erow_ptr, endx) :
+				   INT_MAX;
+	return span;
+}
 
-	int match_len = strlen((char *)buf->query);
-	int start_render = charsToDisplayColumn(erow_ptr, buf->cx);
-	int end_render = charsToDisplayColumn(erow_ptr, buf->cx + match_len);
+/*
+ * Highlighting for one row: the region and the current match in reverse
+ * video (HL_REVERSE), the other isearch matches underlined (HL_LAZY).
+ */
+#define HL_REVERSE 1
+#define HL_LAZY 2
+
+struct rowHighlight {
+	struct hlSpan hl[2];
+	const struct hlSpan *matches; /* sorted, not overlapping */
+	int nmatches;
+	unsigned int match_key; /* see searchRowMatches */
+};
+
+static void rowHighlightSpans(struct editorBuffer *buf, int row,
+			      struct rowHighlight *h) {
+	h->hl[0] = regionSpan(buf, row);
+	h->hl[1] = searchMatchSpan(buf, row);
+	for (int i = 0; i < 2; i++) {
+		if (h->hl[i].end <= h->hl[i].start)
+			h->hl[i].start = h->hl[i].end = 0;
+	}
+	h->matches = searchRowMatches(buf, &buf->row[row], &h->nmatches,
+				      &h->match_key);
+}
 
-	return (render_pos >= start_render && render_pos < end_render);
+/* Index of the first match ending after render_x */
+static int matchAfter(const struct rowHighlight *h, int render_x) {
+	int lo = 0, hi = h->nmatches;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (h->matches[mid].end <= render_x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int isHighlighted(const struct rowHighlight *h, int render_x) {
+	if ((render_x >= h->hl[0].start && render_x < h->hl[0].end) ||
+	    (render_x >= h->hl[1].start && render_x < h->hl[1].end))
+		return HL_REVERSE;
+	int m = matchAfter(h, render_x);
+	if (m < h->nmatches && h->matches[m].start <= render_x)
+		return HL_LAZY;
+	return 0;
+}
+
+/* First column after render_x where isHighlighted may change */
+static int nextHighlightChange(const struct rowHighlight *h, int render_x) {
+	int next = INT_MAX;
+	for (int i = 0; i < 2; i++) {
+		if (h->hl[i].start > render_x && h->hl[i].start < next)
+			next = h->hl[i].start;
+		if (h->hl[i].end > render_x && h->hl[i].end < next)
+			next = h->hl[i].end;
+	}
+	int m = matchAfter(h, render_x);
+	if (m < h->nmatches) {
+		int edge = h->matches[m].start > render_x ?
+				   h->matches[m].start :
+				   h->matches[m].end;
+		if (edge < next)
+			next = edge;
+	}
+	return next;
 }
 
 /* Calculate number of rows to scroll for smooth scrolling */
 int calculateRowsToScroll(struct editorBuffer *buf, struct editorWindow *win,
 			  int direction) {
-	int rendered_lines = 0;
-	int rows_to_scroll = 0;
-	int start_row = (direction > 0) ? win->rowoff : win->rowoff - 1;
+	int top = getScreenLineForRow(buf, win->rowoff);
 
-	while (rendered_lines < win->height) {
-		if (start_row < 0 || start_row >= buf->numrows)
-			break;
-		erow *row = &buf->row[start_row];
-		int line_height =
-			buf->truncate_lines ?
-				1 :
-				((calculateLineWidth(row) / E.screencols) + 1);
-		if (rendered_lines + line_height > win->height && direction < 0)
-			break;
-		rendered_lines += line_height;
-		rows_to_scroll++;
-		start_row += direction;
+	if (direction > 0) {
+		if (win->rowoff >= buf->numrows)
+			return 0;
+		int row = getRowForScreenLine(buf, top + win->height);
+		if (getScreenLineForRow(buf, row) < top + win->height)
+			row++;
+		if (row > buf->numrows)
+			row = buf->numrows;
+		/* Always make progress, even past a row taller than the window */
+		return row > win->rowoff ? row - win->rowoff : 1;
 	}
 
-	return rows_to_scroll;
+	if (win->rowoff <= 0)
+		return 0;
+	/* Whole rows only: the first one must start within a window's height */
+	int row = getRowForScreenLine(buf, top - win->height);
+	if (getScreenLineForRow(buf, row) < top - win->height)
+		row++;
+	return row < win->rowoff ? win->rowoff - row : 0;
 }
 
-/* Render a line with highlighting support */
+/* Foreground colours for the syntax classes in syntax.h */
+static const char *const syntax_colors[HL_NCLASSES] = {
+	[HL_COMMENT] = CSI "36m", [HL_KEYWORD] = CSI "35m",
+	[HL_TYPE] = CSI "32m",	  [HL_STRING] = CSI "33m",
+	[HL_NUMBER] = CSI "31m",  [HL_PREPROC] = CSI "34m",
+	[HL_ADDED] = CSI "32m",	  [HL_REMOVED] = CSI "31m",
+	[HL_HEADER] = CSI "1m",	  [HL_HUNK] = CSI "36m",
+	[HL_ERROR] = CSI "1;31m", [HL_WARNING] = CSI "33m",
+	[HL_INFO] = CSI "32m",	  [HL_DEBUG] = CSI "34m",
+};
+
+/* Switch to the colour for cls, with the given HL_ highlight on top.
+ * *current holds the attributes in effect, 0 for none. */
+static void setHighlight(struct abuf *ab, int *current, int cls,
+			 int highlight) {
+	int attr = cls << 2 | highlight;
+	if (attr == *current)
+		return;
+	if (*current)
+		abAppend(ab, "\x1b[0m", 4);
+	if (highlight == HL_REVERSE)
+		abAppend(ab, "\x1b[7m", 4); /* Reverse video */
+	else if (highlight == HL_LAZY)
+		abAppend(ab, "\x1b[4m", 4); /* Underline */
+	if (syntax_colors[cls])
+		abAppend(ab, syntax_colors[cls], strlen(syntax_colors[cls]));
+	*current = attr;
+}
+
+/*
+ * Render the columns [start_col, end_col) of a row.  A tab, wide
+ * character or ^X sequence that straddles either edge is drawn as
+ * spaces, so the output never spills over into the next screen line.
+ * Wrapped lines break before a wide character rather than through it,
+ * so there it is the blank end of the line and starts the next one.
+ * With fill set, a highlight running past the end of the text is
+ * carried on to end_col.  cls, if not NULL, gives each byte's syntax
+ * class.
+ */
 static void renderLineWithHighlighting(erow *row, struct abuf *ab,
 				       int start_col, int end_col,
-				       struct editorBuffer *buf, int filerow) {
+				       const struct rowHighlight *hl, int fill,
+				       const unsigned char *cls) {
 	int render_x = 0;
 	int char_idx = 0;
 	int current_highlight = 0;
+	int plain = rowAsciiPrefix(row);
 
-	/* Skip to start column */
+	/* Skip to start column, from the nearest checkpoint */
+	char_idx = rowSeekColumn(row, start_col, &render_x);
 	while (char_idx < row->size && render_x < start_col) {
+		int next;
 		if (row->chars[char_idx] < 0x80 &&
 		    !ISCTRL(row->chars[char_idx])) {
-			render_x += 1;
-			char_idx++;
+			next = render_x + 1;
 		} else {
-			render_x = nextScreenX(row->chars, &char_idx, render_x);
-			char_idx++;
+			int idx = char_idx;
+			next = nextScreenX(row->chars, &idx, render_x);
+			if (next <= start_col)
+				char_idx = idx;
 		}
+		if (next > start_col)
+			break;
+		render_x = next;
+		char_idx++;
 	}
 
 	/* Render visible portion */
 	while (char_idx < row->size && render_x < end_col) {
 		uint8_t c = row->chars[char_idx];
-
-		int in_region = isRenderPosInRegion(buf, filerow, render_x);
-		int is_current_match =
-			isRenderPosCurrentSearchMatch(buf, filerow, render_x);
-		int new_highlight = (in_region || is_current_match) ? 1 : 0;
-
-		if (new_highlight != current_highlight) {
-			if (current_highlight > 0) {
-				abAppend(ab, "\x1b[0m", 4);
+		int k = cls ? cls[char_idx] : HL_NORMAL;
+		int width;
+
+		if (char_idx < plain) {
+			/* Printable ASCII, one column per byte: copy up to the
+			 * next highlight or colour change in one go */
+			int run = plain - char_idx;
+			int stop = nextHighlightChange(hl, render_x);
+			if (run > end_col - render_x)
+				run = end_col - render_x;
+			if (run > stop - render_x)
+				run = stop - render_x;
+			if (cls) {
+				int n = 1;
+				while (n < run && cls[char_idx + n] == k)
+					n++;
+				run = n;
 			}
-			if (new_highlight == 1) {
-				abAppend(ab, "\x1b[7m", 4); /* Reverse video */
-			}
-			current_highlight = new_highlight;
+			setHighlight(ab, &current_highlight, k,
+				     isHighlighted(hl, render_x));
+			abAppend(ab, (char *)&row->chars[char_idx], run);
+			render_x += run;
+			char_idx += run;
+			continue;
 		}
 
 		if (c == '\t') {
-			int next_tab_stop = (render_x + EMSYS_TAB_STOP) /
-					    EMSYS_TAB_STOP * EMSYS_TAB_STOP;
-			while (render_x < next_tab_stop && render_x < end_col) {
-				if (render_x >= start_col) {
-					abAppend(ab, " ", 1);
-				}
-				render_x++;
-			}
+			width = EMSYS_TAB_STOP - render_x % EMSYS_TAB_STOP;
 		} else if (ISCTRL(c)) {
-			if (render_x >= start_col) {
-				abAppend(ab, "^", 1);
-				if (c == 0x7f) {
-					abAppend(ab, "?", 1);
-				} else {
-					char sym = c | 0x40;
-					abAppend(ab, &sym, 1);
-				}
+			width = 2;
+		} else {
+			width = charInStringWidth(row->chars, char_idx);
+		}
+
+		if (c == '\t' || render_x < start_col ||
+		    render_x + width > end_col) {
+			for (int x = render_x; x < render_x + width && x < end_col;
+			     x++) {
+				if (x < start_col)
+					continue;
+				setHighlight(ab, &current_highlight, k,
+					     isHighlighted(hl, x));
+				abAppend(ab, " ", 1);
 			}
-			render_x += 2;
 		} else {
-			int width = charInStringWidth(row->chars, char_idx);
-			if (render_x >= start_col) {
-				int bytes = utf8_nBytes(c);
+			setHighlight(ab, &current_highlight, k,
+				     isHighlighted(hl, render_x));
+			if (ISCTRL(c)) {
+				char sym[2] = { '^', c == 0x7f ? '?' : c | 0x40 };
+				abAppend(ab, sym, 2);
+			} else {
 				abAppend(ab, (char *)&row->chars[char_idx],
-					 bytes);
+					 utf8_nBytes(c));
 			}
+		}
+
+		if (width > 0)
 			render_x += width;
+		char_idx += utf8_nBytes(c);
+	}
+
+	if (fill) {
+		if (render_x < start_col)
+			render_x = start_col;
+		while (render_x < end_col && isHighlighted(hl, render_x)) {
+			setHighlight(ab, &current_highlight, HL_NORMAL,
+				     isHighlighted(hl, render_x));
+			abAppend(ab, " ", 1);
+			render_x++;
 		}
+	}
+
+	setHighlight(ab, &current_highlight, HL_NORMAL, 0);
+}
 
-		char_idx += utf8_nBytes(row->chars[char_idx]);
+/*
+ * Syntax classes for a row, lexed from its start state.  The last row
+ * lexed is kept, as a wrapped row is drawn one screen line at a time.
+ */
+static const unsigned char *rowClasses(const struct editorSyntax *syntax,
+				       erow *row) {
+	static unsigned char *classes;
+	static int capacity;
+	static unsigned int gen;
+	static unsigned char state;
+	static const struct editorSyntax *lexed;
+
+	if (row->gen == gen && row->hl_state == state && syntax == lexed)
+		return classes;
+	if (row->size > capacity) {
+		capacity = row->size;
+		classes = xrealloc(classes, capacity);
 	}
+	syntaxLexRow(syntax, row->chars, row->size, row->hl_state, classes);
+	gen = row->gen;
+	state = row->hl_state;
+	lexed = syntax;
+	return classes;
+}
 
-	if (current_highlight > 0) {
-		abAppend(ab, "\x1b[0m", 4);
+/*
+ * Each window keeps the bytes last emitted for each of its screen lines.
+ * Row generations are unique across all buffers, so a line whose row,
+ * columns and highlighting are unchanged is copied back as it was.
+ */
+static void resizeRenderCache(struct editorWindow *win, int lines) {
+	if (win->render_cache_size == lines)
+		return;
+	freeRenderCache(win);
+	win->render_cache = xcalloc(lines, sizeof(struct renderedLine));
+	win->render_cache_size = lines;
+}
+
+void freeRenderCache(struct editorWindow *win) {
+	for (int i = 0; i < win->render_cache_size; i++)
+		free(win->render_cache[i].bytes);
+	free(win->render_cache);
+	win->render_cache = NULL;
+	win->render_cache_size = 0;
+}
+
+static void drawScreenLine(struct editorWindow *win, struct abuf *ab, int y,
+			   erow *row, int col, int width,
+			   const struct rowHighlight *hl, int fill) {
+	struct renderedLine *line = &win->render_cache[y];
+	const struct editorSyntax *syntax = win->buf->syntax;
+
+	if (line->gen == row->gen && line->col == col &&
+	    line->width == width && line->fill == fill &&
+	    line->syntax == syntax &&
+	    (!syntax || line->hl_state == row->hl_state) &&
+	    line->match_key == hl->match_key &&
+	    memcmp(line->hl, hl->hl, sizeof(line->hl)) == 0) {
+		abAppend(ab, line->bytes, line->len);
+		return;
+	}
+
+	int start = ab->len;
+	renderLineWithHighlighting(row, ab, col, col + width, hl, fill,
+				   syntax ? rowClasses(syntax, row) : NULL);
+
+	line->len = ab->len - start;
+	if (line->len > line->capacity) {
+		line->capacity = line->len;
+		line->bytes = xrealloc(line->bytes, line->capacity);
 	}
+	if (line->len > 0)
+		memcpy(line->bytes, &ab->b[start], line->len);
+	line->gen = row->gen;
+	line->col = col;
+	line->width = width;
+	line->fill = fill;
+	line->syntax = syntax;
+	line->hl_state = row->hl_state;
+	line->match_key = hl->match_key;
+	memcpy(line->hl, hl->hl, sizeof(line->hl));
 }
 
 /* Window management functions */
@@ -249,6 +447,40 @@ int findBufferWindow(struct editorBuffer *buf) {
 	return -1;
 }
 
+/* Put buf in a window other than the focused one, splitting if need be,
+ * and return that window */
+int otherWindow(struct editorBuffer *buf) {
+	int idx = findBufferWindow(buf);
+	if (idx >= 0 && !E.windows[idx]->focused)
+		return idx;
+	if (E.nwindows == 1)
+		editorCreateWindow();
+	idx = (windowFocusedIdx() + 1) % E.nwindows;
+	if (E.windows[idx]->buf != buf) {
+		E.windows[idx]->buf = buf;
+		E.windows[idx]->cx = buf->cx;
+		E.windows[idx]->cy = buf->cy;
+		E.windows[idx]->rowoff = 0;
+		E.windows[idx]->lineoff = 0;
+		E.windows[idx]->coloff = 0;
+	}
+	return idx;
+}
+
+/* Show buf at row and byte col in another window and focus it, keeping
+ * the focused buffer in view */
+void focusOtherWindow(struct editorBuffer *buf, int row, int col) {
+	int cur = windowFocusedIdx();
+	int idx = otherWindow(buf);
+	E.windows[cur]->cx = E.buf->cx;
+	E.windows[cur]->cy = E.buf->cy;
+	E.windows[cur]->focused = 0;
+	E.windows[idx]->focused = 1;
+	E.buf = buf;
+	buf->cy = E.windows[idx]->cy = row;
+	buf->cx = E.windows[idx]->cx = col;
+}
+
 void synchronizeBufferCursor(struct editorBuffer *buf,
 			     struct editorWindow *win) {
 	// Ensure the cursor is within the buffer's bounds
@@ -295,6 +527,37 @@ void editorSwitchWindow(void) {
 	synchronizeBufferCursor(E.buf, nextWindow);
 }
 
+/* Screen line the cursor is on, counted from the buffer start */
+int cursorScreenLine(struct editorBuffer *buf) {
+	int line = getScreenLineForRow(buf, buf->cy);
+	if (!buf->truncate_lines && buf->cy < buf->numrows) {
+		erow *row = &buf->row[buf->cy];
+		int col = charsToDisplayColumn(row, buf->cx);
+		line += rowColumnSubline(row, col, E.screencols);
+	}
+	return line;
+}
+
+/* First screen line shown in a window, counted from the buffer start */
+int windowTopLine(struct editorWindow *win) {
+	if (win->buf->truncate_lines)
+		return win->rowoff;
+	return getScreenLineForRow(win->buf, win->rowoff) + win->lineoff;
+}
+
+void setWindowTopLine(struct editorWindow *win, int line) {
+	struct editorBuffer *buf = win->buf;
+
+	if (line < 0)
+		line = 0;
+	/* Lines past the end clamp to the end, without having to index the
+	 * whole buffer to know where that is */
+	win->rowoff = getRowForScreenLine(buf, line);
+	win->lineoff = win->rowoff < buf->numrows ?
+			       line - getScreenLineForRow(buf, win->rowoff) :
+			       0;
+}
+
 /* Display functions */
 void setScxScy(struct editorWindow *win) {
 	struct editorBuffer *buf = win->buf;
@@ -304,32 +567,9 @@ void setScxScy(struct editorWindow *win) {
 	win->scx = 0;
 
 	if (!buf->truncate_lines) {
-		if (buf->cy >= buf->numrows) {
-			// For virtual line, calculate position as if there's a line at buf->numrows
-			if (buf->numrows > 0) {
-				int virtual_screen_line = getScreenLineForRow(
-					buf, buf->numrows - 1);
-				// Add one line for the virtual line position
-				virtual_screen_line +=
-					((calculateLineWidth(
-						  &buf->row[buf->numrows - 1]) /
-					  E.screencols) +
-					 1);
-				int rowoff_screen_line =
-					getScreenLineForRow(buf, win->rowoff);
-				win->scy = virtual_screen_line -
-					   rowoff_screen_line;
-			} else {
-				// Empty buffer case - virtual line is at position 0
-				win->scy = 0 - win->rowoff;
-			}
-		} else {
-			int cursor_screen_line =
-				getScreenLineForRow(buf, buf->cy);
-			int rowoff_screen_line =
-				getScreenLineForRow(buf, win->rowoff);
-			win->scy = cursor_screen_line - rowoff_screen_line;
-		}
+		/* The virtual line past the end starts on the total line count */
+		win->scy = getScreenLineForRow(buf, buf->cy) -
+			   windowTopLine(win);
 	} else {
 		win->scy = buf->cy - win->rowoff;
 	}
@@ -343,9 +583,10 @@ void setScxScy(struct editorWindow *win) {
 	if (buf->truncate_lines) {
 		win->scx = total_width - win->coloff;
 	} else {
-		int render_pos = charsToDisplayColumn(row, buf->cx);
-		win->scy += render_pos / E.screencols;
-		win->scx = render_pos % E.screencols;
+		int subline = rowColumnSubline(row, total_width, E.screencols);
+		win->scy += subline;
+		win->scx = total_width -
+			   rowSublineColumn(row, subline, E.screencols);
 	}
 
 	if (win->scy < 0)
@@ -370,66 +611,30 @@ void scroll(void) {
 	}
 
 	if (!buf->truncate_lines) {
-		if (buf->cy < win->rowoff) {
-			win->rowoff = buf->cy;
-		} else {
-			int cursor_screen_row = 0;
-
-			for (int i = win->rowoff;
-			     i < buf->cy && i < buf->numrows; i++) {
-				int line_height =
-					(calculateLineWidth(&buf->row[i]) /
-					 E.screencols) +
-					1;
-				cursor_screen_row += line_height;
-			}
-
-			if (buf->cy < buf->numrows) {
-				erow *row = &buf->row[buf->cy];
-				int cursor_x = 0;
-				for (int j = 0; j < buf->cx;) {
-					int char_width;
-					if (j < row->size &&
-					    row->chars[j] == '\t') {
-						char_width = EMSYS_TAB_STOP -
-							     (cursor_x %
-							      EMSYS_TAB_STOP);
-					} else {
-						char_width = charInStringWidth(
-							row->chars, j);
-					}
-					cursor_x += char_width;
-					j += utf8_nBytes(row->chars[j]);
-				}
-				cursor_screen_row += cursor_x / E.screencols;
-			}
-
-			if (cursor_screen_row >= win->height) {
-				int visible_rows = 0;
-				if (buf->cy == buf->numrows) {
-					visible_rows = 1;
-				}
-				for (int i = buf->cy; i >= 0; i--) {
-					if (i < buf->numrows) {
-						int line_height =
-							(calculateLineWidth(
-								 &buf->row[i]) /
-							 E.screencols) +
-							1;
-						if (visible_rows + line_height >
-						    win->height) {
-							win->rowoff = i + 1;
-							break;
-						}
-						visible_rows += line_height;
-					}
-					if (i == 0) {
-						win->rowoff = 0;
-						break;
-					}
-				}
-			}
+		int top = windowTopLine(win);
+		int row_start = getScreenLineForRow(buf, buf->cy);
+		int cursor_line = cursorScreenLine(buf);
+		int row_end = buf->cy < buf->numrows ?
+				      getScreenLineForRow(buf, buf->cy + 1) :
+				      row_start + 1;
+
+		if (cursor_line < top) {
+			/* Show the cursor row from its start if it fits */
+			top = row_start;
+		} else if (cursor_line - top >= win->height) {
+			/* Bring the whole cursor row in at the bottom */
+			int row = getRowForScreenLine(buf,
+						      row_end - win->height);
+			if (getScreenLineForRow(buf, row) <
+			    row_end - win->height)
+				row++;
+			top = getScreenLineForRow(
+				buf, row < buf->cy ? row : buf->cy);
 		}
+		/* A row taller than the window scrolls within itself */
+		if (cursor_line - top >= win->height)
+			top = cursor_line - win->height + 1;
+		setWindowTopLine(win, top);
 	} else {
 		if (buf->cy < win->rowoff) {
 			win->rowoff = buf->cy;
@@ -441,23 +646,7 @@ void scroll(void) {
 	if (buf->truncate_lines) {
 		int rx = 0;
 		if (buf->cy < buf->numrows) {
-			erow *row = &buf->row[buf->cy];
-			for (int j = 0; j < buf->cx;) {
-				if (j < row->size) {
-					if (row->chars[j] == '\t') {
-						rx += EMSYS_TAB_STOP -
-						      (rx % EMSYS_TAB_STOP);
-					} else {
-						int char_width =
-							charInStringWidth(
-								row->chars, j);
-						rx += char_width;
-					}
-					j += utf8_nBytes(row->chars[j]);
-				} else {
-					break;
-				}
-			}
+			rx = charsToDisplayColumn(&buf->row[buf->cy], buf->cx);
 		}
 		if (rx < win->coloff) {
 			win->coloff = rx;
@@ -474,216 +663,43 @@ void scroll(void) {
 void drawRows(struct editorWindow *win, struct abuf *ab, int screenrows,
 	      int screencols) {
 	struct editorBuffer *buf = win->buf;
-	int y;
 	int filerow = win->rowoff;
+	int subline = buf->truncate_lines ? 0 : win->lineoff;
+	int height = 1;
+	int prepared = -1;
+	struct rowHighlight hl;
 
-	for (y = 0; y < screenrows; y++) {
+	resizeRenderCache(win, screenrows);
+
+	for (int y = 0; y < screenrows; y++) {
 		if (filerow >= buf->numrows) {
 			abAppend(ab, CSI "34m~" CSI "0m", 10);
 		} else {
 			erow *row = &buf->row[filerow];
-			if (!row->render_valid) {
-				updateRow(row);
+			if (prepared != filerow) {
+				prepared = filerow;
+				if (!row->render_valid) {
+					updateRow(row);
+				}
+				syntaxUpdateStates(buf, filerow);
+				height = getRowScreenHeight(buf, filerow);
+				rowHighlightSpans(buf, filerow, &hl);
+				if (subline >= height)
+					subline = height - 1;
 			}
 			if (buf->truncate_lines) {
-				// Truncated mode with visual marking
-				renderLineWithHighlighting(
-					row, ab, win->coloff,
-					win->coloff + screencols, buf, filerow);
+				drawScreenLine(win, ab, y, row, win->coloff,
+					       screencols, &hl, 0);
 				filerow++;
 			} else {
-				// Wrapped mode with visual marking support
-				int render_x = 0;
-				int char_idx = 0;
-				int current_highlight = 0;
-				int line_start_render_x = 0;
-
-				while (char_idx < row->size && y < screenrows) {
-					// Track start of current screen line
-					line_start_render_x = render_x;
-
-					// Render one screen line worth of content
-					while (char_idx < row->size &&
-					       render_x - line_start_render_x <
-						       screencols) {
-						uint8_t c =
-							row->chars[char_idx];
-
-						int in_region =
-							isRenderPosInRegion(
-								buf, filerow,
-								render_x);
-						int is_current_match =
-							isRenderPosCurrentSearchMatch(
-								buf, filerow,
-								render_x);
-						int new_highlight =
-							(in_region ||
-							 is_current_match) ?
-								1 :
-								0;
-
-						if (new_highlight !=
-						    current_highlight) {
-							if (current_highlight >
-							    0) {
-								abAppend(
-									ab,
-									"\x1b[0m",
-									4);
-							}
-							if (new_highlight ==
-							    1) {
-								abAppend(
-									ab,
-									"\x1b[7m",
-									4); /* Reverse video */
-							}
-							current_highlight =
-								new_highlight;
-						}
-
-						if (c == '\t') {
-							int next_tab_stop =
-								(render_x +
-								 EMSYS_TAB_STOP) /
-								EMSYS_TAB_STOP *
-								EMSYS_TAB_STOP;
-							int tab_end =
-								next_tab_stop;
-							if (tab_end -
-								    line_start_render_x >
-							    screencols) {
-								tab_end =
-									line_start_render_x +
-									screencols;
-							}
-							while (render_x <
-							       tab_end) {
-								// Check highlighting for each space in tab
-								int space_in_region = isRenderPosInRegion(
-									buf,
-									filerow,
-									render_x);
-								int space_is_match = isRenderPosCurrentSearchMatch(
-									buf,
-									filerow,
-									render_x);
-								int space_highlight =
-									(space_in_region ||
-									 space_is_match) ?
-										1 :
-										0;
-								if (space_highlight !=
-								    current_highlight) {
-									if (current_highlight >
-									    0) {
-										abAppend(
-											ab,
-											"\x1b[0m",
-											4);
-									}
-									if (space_highlight ==
-									    1) {
-										abAppend(
-											ab,
-											"\x1b[7m",
-											4);
-									}
-									current_highlight =
-										space_highlight;
-								}
-								abAppend(ab,
-									 " ",
-									 1);
-								render_x++;
-							}
-						} else if (ISCTRL(c)) {
-							abAppend(ab, "^", 1);
-							if (c == 0x7f) {
-								abAppend(ab,
-									 "?",
-									 1);
-							} else {
-								char sym = c |
-									   0x40;
-								abAppend(ab,
-									 &sym,
-									 1);
-							}
-							render_x += 2;
-						} else {
-							int width = charInStringWidth(
-								row->chars,
-								char_idx);
-							int bytes =
-								utf8_nBytes(c);
-							abAppend(
-								ab,
-								(char *)&row->chars
-									[char_idx],
-								bytes);
-							render_x += width;
-						}
-
-						char_idx += utf8_nBytes(
-							row->chars[char_idx]);
-					}
-
-					// Fill rest of line with highlighted spaces if in region
-					while (render_x - line_start_render_x <
-					       screencols) {
-						int space_in_region =
-							isRenderPosInRegion(
-								buf, filerow,
-								render_x);
-						int space_is_match =
-							isRenderPosCurrentSearchMatch(
-								buf, filerow,
-								render_x);
-						int space_highlight =
-							(space_in_region ||
-							 space_is_match) ?
-								1 :
-								0;
-						if (space_highlight !=
-						    current_highlight) {
-							if (current_highlight >
-							    0) {
-								abAppend(
-									ab,
-									"\x1b[0m",
-									4);
-							}
-							if (space_highlight ==
-							    1) {
-								abAppend(
-									ab,
-									"\x1b[7m",
-									4);
-							}
-							current_highlight =
-								space_highlight;
-						}
-						abAppend(ab, " ", 1);
-						render_x++;
-					}
-
-					// Reset highlighting at end of screen line
-					if (current_highlight > 0) {
-						abAppend(ab, "\x1b[0m", 4);
-						current_highlight = 0;
-					}
-
-					// Move to next screen line if there's more content
-					if (char_idx < row->size &&
-					    y < screenrows - 1) {
-						abAppend(ab, "\r\n", 2);
-						y++;
-					}
+				drawScreenLine(win, ab, y, row,
+					       rowSublineColumn(row, subline,
+								screencols),
+					       screencols, &hl, 1);
+				if (++subline >= height) {
+					subline = 0;
+					filerow++;
 				}
-
-				filerow++;
 			}
 		}
 		abAppend(ab, "\x1b[K", 3);
@@ -848,6 +864,7 @@ void refreshScreen(void) {
 		}
 	}
 
+	searchStartFrame();
 	for (int i = 0; i < E.nwindows; i++) {
 		struct editorWindow *win = E.windows[i];
 
@@ -888,7 +905,7 @@ void refreshScreen(void) {
 
 	abAppend(&ab, "\x1b[?25h", 6); // Show cursor
 
-	write(STDOUT_FILENO, ab.b, ab.len);
+	editorWriteFrame(ab.b, ab.len);
 
 	abFree(&ab);
 }
@@ -896,7 +913,7 @@ void refreshScreen(void) {
 void cursorBottomLine(int curs) {
 	char cbuf[32];
 	snprintf(cbuf, sizeof(cbuf), CSI "%d;%dH", E.screenrows, curs);
-	write(STDOUT_FILENO, cbuf, strlen(cbuf));
+	editorWriteOutput(cbuf, strlen(cbuf));
 }
 
 void cursorBottomLineLong(long curs) {
@@ -908,7 +925,7 @@ void cursorBottomLineLong(long curs) {
 	}
 	minibuf_row++; /* minibuffer is after all windows/status bars */
 	snprintf(cbuf, sizeof(cbuf), CSI "%d;%ldH", minibuf_row, curs);
-	write(STDOUT_FILENO, cbuf, strlen(cbuf));
+	editorWriteOutput(cbuf, strlen(cbuf));
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -955,6 +972,7 @@ void editorDestroyWindow(int window_idx) {
 		editorSwitchWindow();
 	}
 
+	freeRenderCache(E.windows[window_idx]);
 	free(E.windows[window_idx]);
 	struct editorWindow **windows =
 		xmalloc(sizeof(struct editorWindow *) * (--E.nwindows));
@@ -983,6 +1001,7 @@ void editorDestroyOtherWindows(void) {
 	struct editorWindow **windows = xmalloc(sizeof(struct editorWindow *));
 	for (int i = 0; i < E.nwindows; i++) {
 		if (i != idx) {
+			freeRenderCache(E.windows[i]);
 			free(E.windows[i]);
 		}
 	}
@@ -1037,7 +1056,14 @@ void editorWhatCursor(void) {
 }
 
 void recenter(struct editorWindow *win) {
-	win->rowoff = win->buf->cy - (win->height / 2);
+	struct editorBuffer *buf = win->buf;
+
+	if (!buf->truncate_lines) {
+		setWindowTopLine(win, cursorScreenLine(buf) - win->height / 2);
+		return;
+	}
+
+	win->rowoff = buf->cy - (win->height / 2);
 	if (win->rowoff < 0) {
 		win->rowoff = 0;
 	}
@@ -1050,6 +1076,22 @@ void editorToggleTruncateLines(void) {
 				       "Truncate long lines disabled");
 }
 
+void editorToggleSyntax(void) {
+	if (E.buf->syntax) {
+		editorSetSyntax(E.buf, NULL);
+		editorSetStatusMessage("Font-Lock mode disabled");
+		return;
+	}
+	const struct editorSyntax *syntax =
+		syntaxForFilename(E.buf->filename);
+	if (!syntax) {
+		editorSetStatusMessage("No syntax highlighting for this buffer");
+		return;
+	}
+	editorSetSyntax(E.buf, syntax);
+	editorSetStatusMessage("Font-Lock mode enabled (%s)", syntax->name);
+}
+
 void editorVersion(void) {
 	editorSetStatusMessage("emsys version " EMSYS_VERSION);
 }
@@ -1060,6 +1102,12 @@ void editorVersionWrapper(struct editorConfig *UNUSED(ed),
 	editorVersion();
 }
 
+/* Wrapper for command table */
+void editorToggleSyntaxWrapper(struct editorConfig *UNUSED(ed),
+			       struct editorBuffer *UNUSED(buf)) {
+	editorToggleSyntax();
+}
+
 /* Wrapper for command table */
 void editorToggleTruncateLinesWrapper(struct editorConfig *UNUSED(ed),
 				      struct editorBuffer *UNUSED(buf)) {
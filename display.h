@@ -2,37 +2,51 @@
 #define DISPLAY_H
 
 #include <stddef.h>
+#include "util.h"
 
 /* Forward declarations */
 struct editorWindow;
 struct editorBuffer;
 struct editorConfig;
+struct editorSyntax;
 
-/* Append buffer for efficient screen updates */
-struct abuf {
-	char *b;
+/* Render columns [start, end) drawn in reverse video */
+struct hlSpan {
+	int start;
+	int end;
+};
+
+/* One screen line of a window as last encoded, see drawRows */
+struct renderedLine {
+	unsigned int gen; /* generation of the row drawn, 0 if none */
+	int col;
+	int width;
+	int fill;
+	const struct editorSyntax *syntax;
+	unsigned char hl_state;
+	unsigned int match_key;
+	struct hlSpan hl[2];
+	char *bytes;
 	int len;
 	int capacity;
 };
 
-#define ABUF_INIT { NULL, 0, 0 }
-
 /* Display constants */
 extern const int minibuffer_height;
 extern const int statusbar_height;
 
-/* Append buffer operations */
-void abAppend(struct abuf *ab, const char *s, int len);
-void abFree(struct abuf *ab);
-
 /* Display functions */
 void refreshScreen(void);
 void drawRows(struct editorWindow *win, struct abuf *ab, int screenrows,
 	      int screencols);
+void freeRenderCache(struct editorWindow *win);
 void drawStatusBar(struct editorWindow *win, struct abuf *ab, int line);
 void drawMinibuffer(struct abuf *ab);
 void scroll(void);
 void setScxScy(struct editorWindow *win);
+int cursorScreenLine(struct editorBuffer *buf);
+int windowTopLine(struct editorWindow *win);
+void setWindowTopLine(struct editorWindow *win, int line);
 int calculateRowsToScroll(struct editorBuffer *buf, struct editorWindow *win,
 			  int direction);
 void cursorBottomLine(int curs);
@@ -41,15 +55,20 @@ void editorSetStatusMessage(const char *fmt, ...);
 void editorResizeScreen(int sig);
 void recenter(struct editorWindow *win);
 void editorToggleTruncateLines(void);
+void editorToggleSyntax(void);
 void editorVersion(void);
 /* Wrappers for command table */
 void editorVersionWrapper(struct editorConfig *ed, struct editorBuffer *buf);
 void editorToggleTruncateLinesWrapper(struct editorConfig *ed,
 				      struct editorBuffer *buf);
+void editorToggleSyntaxWrapper(struct editorConfig *ed,
+			       struct editorBuffer *buf);
 
 /* Window management functions */
 int windowFocusedIdx(void);
 int findBufferWindow(struct editorBuffer *buf);
+int otherWindow(struct editorBuffer *buf);
+void focusOtherWindow(struct editorBuffer *buf, int row, int col);
 void editorSwitchWindow(void);
 void synchronizeBufferCursor(struct editorBuffer *buf,
 			     struct editorWindow *win);
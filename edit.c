@@ -40,7 +40,12 @@ void editorInsertChar(struct editorBuffer *bufr, int c, int count) {
 		if (bufr->cy == bufr->numrows) {
 			editorInsertRow(bufr, bufr->numrows, "", 0);
 		}
-		rowInsertChar(bufr, &bufr->row[bufr->cy], bufr->cx, c);
+		erow *row = &bufr->row[bufr->cy];
+		int size = row->size;
+		rowInsertChar(bufr, row, bufr->cx, c);
+		/* A row at its length limit takes no more */
+		if (row->size == size)
+			break;
 		bufr->cx++;
 	}
 }
@@ -87,7 +92,6 @@ cancel:
 void editorInsertNewline(struct editorBuffer *bufr, int count) {
 	int times = count ? count : 1;
 	for (int i = 0; i < times; i++) {
-		editorUndoAppendChar(bufr, '\n');
 		if (bufr->cx == 0) {
 			editorInsertRow(bufr, bufr->cy, "", 0);
 		} else {
@@ -98,7 +102,7 @@ void editorInsertNewline(struct editorBuffer *bufr, int count) {
 			row = &bufr->row[bufr->cy];
 			row->size = bufr->cx;
 			row->chars[row->size] = '\0';
-			row->render_valid = 0;
+			invalidateRow(bufr, bufr->cy);
 		}
 		bufr->cy++;
 		bufr->cx = 0;
@@ -112,6 +116,7 @@ void editorOpenLine(struct editorBuffer *bufr, int count) {
 	for (int i = 0; i < count; i++) {
 		int ccx = bufr->cx;
 		int ccy = bufr->cy;
+		editorUndoAppendChar(bufr, '\n');
 		editorInsertNewline(bufr, 1);
 		bufr->cx = ccx;
 		bufr->cy = ccy;
@@ -209,7 +214,7 @@ UNINDENT_PERFORM:
 	memmove(&row->chars[0], &row->chars[trunc], row->size - trunc);
 	row->size -= trunc;
 	bufr->cx -= trunc;
-	updateRow(row);
+	invalidateRow(bufr, bufr->cy);
 	bufr->dirty = 1;
 }
 
@@ -653,7 +658,7 @@ void editorKillLine(int count) {
 
 			row->size = E.buf->cx;
 			row->chars[row->size] = '\0';
-			row->render_valid = 0;
+			invalidateRow(E.buf, E.buf->cy);
 			E.buf->dirty = 1;
 			editorClearMark();
 		}
@@ -697,13 +702,24 @@ void editorKillLineBackwards(void) {
 	row->size -= E.buf->cx;
 	memmove(row->chars, &row->chars[E.buf->cx], row->size);
 	row->chars[row->size] = '\0';
-	updateRow(row);
+	invalidateRow(E.buf, E.buf->cy);
 	E.buf->cx = 0;
 	E.buf->dirty = 1;
 }
 
 /* Navigation */
 
+/* Put the cursor on a screen line; cx only moves inside a wrapped row */
+static void moveCursorToScreenLine(struct editorBuffer *buf, int line) {
+	buf->cy = getRowForScreenLine(buf, line);
+	int subline = line - getScreenLineForRow(buf, buf->cy);
+	if (buf->cy < buf->numrows && subline > 0) {
+		erow *row = &buf->row[buf->cy];
+		buf->cx = displayColumnToChars(
+			row, rowSublineColumn(row, subline, E.screencols));
+	}
+}
+
 void editorPageUp(int count) {
 	struct editorWindow *win = E.windows[windowFocusedIdx()];
 	int times = count ? count : 1;
@@ -727,28 +743,14 @@ void editorPageUp(int count) {
 			}
 			/* If cursor is above window, it's already visible */
 		} else {
-			/* In wrapped mode, need to handle variable line heights */
-			int lines_scrolled = 0;
-			int new_rowoff = win->rowoff;
-
-			/* Scroll up by the desired number of screen lines */
-			while (lines_scrolled < scroll_lines &&
-			       new_rowoff > 0) {
-				new_rowoff--;
-				int line_height =
-					(calculateLineWidth(
-						 &E.buf->row[new_rowoff]) /
-					 E.screencols) +
-					1;
-				lines_scrolled += line_height;
-			}
-			win->rowoff = new_rowoff;
+			/* In wrapped mode, step back through the screen line index */
+			int window_start_screen_line =
+				windowTopLine(win) - scroll_lines;
+			setWindowTopLine(win, window_start_screen_line);
+			window_start_screen_line = windowTopLine(win);
 
 			/* Ensure cursor is visible - calculate screen position */
-			int cursor_screen_line =
-				getScreenLineForRow(E.buf, E.buf->cy);
-			int window_start_screen_line =
-				getScreenLineForRow(E.buf, win->rowoff);
+			int cursor_screen_line = cursorScreenLine(E.buf);
 
 			/* If not in a short buffer & cursor is off
 			   the end of the file, move it up &
@@ -756,23 +758,15 @@ void editorPageUp(int count) {
 			if (window_start_screen_line > 0 &&
 			    E.buf->numrows > 0 && E.buf->cy >= E.buf->numrows) {
 				E.buf->cy = E.buf->numrows - 1;
-				cursor_screen_line =
-					getScreenLineForRow(E.buf, E.buf->cy);
+				cursor_screen_line = cursorScreenLine(E.buf);
 			}
 
 			if (cursor_screen_line >=
 			    window_start_screen_line + win->height) {
-				/* Cursor is below window - move it up to be within window */
-				while (E.buf->cy > 0) {
-					cursor_screen_line =
-						getScreenLineForRow(E.buf,
-								    E.buf->cy);
-					if (cursor_screen_line <
-					    window_start_screen_line +
-						    win->height)
-						break;
-					E.buf->cy--;
-				}
+				/* Cursor is below window - move it to the last line shown */
+				moveCursorToScreenLine(
+					E.buf, window_start_screen_line +
+						       win->height - 1);
 			}
 		}
 
@@ -811,37 +805,12 @@ void editorPageDown(int count) {
 			}
 			/* If cursor is below window, it's already visible */
 		} else {
-			/* In wrapped mode, need to handle variable line heights */
-			int lines_scrolled = 0;
-			int new_rowoff = win->rowoff;
-
-			/* Scroll down by the desired number of screen lines */
-			while (lines_scrolled < scroll_lines &&
-			       new_rowoff < E.buf->numrows) {
-				int line_height =
-					(calculateLineWidth(
-						 &E.buf->row[new_rowoff]) /
-					 E.screencols) +
-					1;
-				lines_scrolled += line_height;
-				new_rowoff++;
-			}
-
-			/* Don't scroll too far */
-			if (new_rowoff > E.buf->numrows) {
-				new_rowoff = E.buf->numrows;
-			}
-			win->rowoff = new_rowoff;
+			/* In wrapped mode, step on through the screen line index */
+			setWindowTopLine(win, windowTopLine(win) + scroll_lines);
 
-			/* Ensure cursor is visible - calculate screen position */
-			int cursor_screen_line =
-				getScreenLineForRow(E.buf, E.buf->cy);
-			int window_start_screen_line =
-				getScreenLineForRow(E.buf, win->rowoff);
-
-			if (cursor_screen_line < window_start_screen_line) {
-				/* Cursor is above window - move it down to be within window */
-				E.buf->cy = win->rowoff;
+			if (cursorScreenLine(E.buf) < windowTopLine(win)) {
+				/* Cursor is above window - move it to the first line shown */
+				moveCursorToScreenLine(E.buf, windowTopLine(win));
 			}
 		}
 
@@ -28,6 +28,11 @@ enum promptType {
 };
 /*** data ***/
 
+struct rowCheckpoint {
+	int byte;
+	int col;
+};
+
 typedef struct erow {
 	int size;
 	int rsize;
@@ -37,8 +42,30 @@ typedef struct erow {
 	int cached_width;
 	int width_valid;
 	int render_valid;
+	unsigned int gen; /* bumped whenever the row is re-rendered */
+	struct rowCheckpoint *checkpoints; /* long rows only, see buffer.c */
+	int ncheckpoints;
+	int wide; /* has characters two columns wide, other than tabs */
+	int *wraps; /* wrapped line starts of a wide row, see buffer.c */
+	int nwraps;
+	int wrap_cols; /* screen width wraps is for, 0 if none */
+	int ascii_prefix; /* leading printable ASCII bytes, set by updateRow */
+	unsigned char hl_state;	  /* lexer state at the start of the row */
+	unsigned char hl_changed; /* hl_state needs rechecking, see syntax.c */
+	unsigned int trigram_id; /* as indexed, 0 if not; see trigram.c */
 } erow;
 
+/* Text old at col in row, replaced by new; the texts are in the undo's
+ * data, and col is where new starts */
+struct editorReplacement {
+	int row;
+	int col;
+	int old;
+	int oldlen;
+	int new;
+	int newlen;
+};
+
 struct editorUndo {
 	struct editorUndo *prev;
 	int startx;
@@ -51,6 +78,11 @@ struct editorUndo {
 	int delete;
 	int paired;
 	uint8_t *data;
+	/* Replacements within rows, in buffer order, or NULL; see
+	 * editorUndoReplaceBegin */
+	struct editorReplacement *replaced;
+	int nreplaced;
+	int replacedsize;
 };
 
 struct completion_state {
@@ -68,6 +100,9 @@ struct completion_result {
 	int prefix_len;
 };
 
+struct editorSyntax;
+struct trigramIndex;
+
 struct editorBuffer {
 	int indent;
 	int cx, cy;
@@ -85,13 +120,20 @@ struct editorBuffer {
 	erow *row;
 	char *filename;
 	uint8_t *query;
+	uint8_t query_regex; /* query is a regular expression */
 	uint8_t match;
 	struct editorUndo *undo;
 	struct editorUndo *redo;
 	struct editorBuffer *next;
 	int *screen_line_start;
 	int screen_line_cache_size;
-	int screen_line_cache_valid;
+	int screen_line_cache_rows; /* leading entries known to be good */
+	int screen_line_cache_cols; /* screen width the index was built for */
+	int *screen_row_width;
+	int screen_width_rows; /* leading entries known to be good */
+	const struct editorSyntax *syntax; /* NULL for no highlighting */
+	int hl_valid_rows; /* leading rows with a known good hl_state */
+	struct trigramIndex *trigrams; /* NULL unless turned on */
 	struct completion_state completion_state;
 };
 
@@ -101,8 +143,11 @@ struct editorWindow {
 	int scx, scy;
 	int cx, cy; // Buffer cx,cy  (only updated when switching windows)
 	int rowoff;
+	int lineoff; /* screen lines of the top row above the window */
 	int coloff;
 	int height;
+	struct renderedLine *render_cache;
+	int render_cache_size;
 };
 
 struct editorMacro {
@@ -18,6 +18,7 @@
 #include "undo.h"
 #include "keymap.h"
 #include "unused.h"
+#include "syntax.h"
 
 /* Access global editor state */
 extern struct editorConfig E;
@@ -50,6 +51,7 @@ char *editorRowsToString(struct editorBuffer *bufr, int *buflen) {
 void editorOpen(struct editorBuffer *bufr, char *filename) {
 	free(bufr->filename);
 	bufr->filename = xstrdup(filename);
+	editorSetSyntax(bufr, syntaxForFilename(filename));
 
 	FILE *fp = fopen(filename, "r");
 	if (!fp) {
@@ -121,6 +123,7 @@ void editorSave(struct editorBuffer *bufr) {
 			editorSetStatusMessage("Save aborted.");
 			return;
 		}
+		editorSetSyntax(bufr, syntaxForFilename(bufr->filename));
 	}
 
 	int len;
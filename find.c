@@ -4,7 +4,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include <regex.h>
 #include <stdint.h>
 #include "display.h"
 #include "keymap.h"
@@ -18,245 +17,472 @@
 #include "util.h"
 #include "history.h"
 #include "buffer.h"
+#include "search.h"
 
 extern struct editorConfig E;
 static int regex_mode = 0;
 
-/* Helper function to search for regex match in a string */
-static uint8_t *regexSearch(uint8_t *text, uint8_t *pattern) {
-	if (!pattern || !text || strlen((char *)pattern) == 0) {
-		return NULL;
+#define FIND_PROMPT "Search (C-g to cancel): %s"
+#define REGEX_FIND_PROMPT "Regex search (C-g to cancel): %s"
+#define REGEX_FIND_BACKWARD_PROMPT "Regex search backward (C-g to cancel): %s"
+
+uint8_t *orig;
+uint8_t *repl;
+
+/*
+ * isearch looks for the query in rows taken in order from a starting
+ * point, wrapping around the buffer, and stops at the first row with a
+ * match.  The scan is kept between keys: a longer literal query can only
+ * match at or after the current match, so it carries on from there with
+ * the rows the scan had left, and a failing query stays failing.  Rows
+ * are looked at in chunks; when a key is waiting the scan is put aside
+ * and resumed once the key has been dealt with, unless the key made it
+ * stale.
+ *
+ * Once there is a match, the matches in the buffer are counted, along
+ * with those before point, to show which match of how many it is.  The
+ * count is a SEARCH_COUNT job polled between keys like a scan put aside;
+ * the buffer cannot change under it while the prompt is up, and a key
+ * that changes the query gives it up.  C-s and C-r move the index along
+ * a match at a time rather than counting again.
+ */
+#define ISEARCH_CHUNK_BYTES (256 * 1024)
+#define ISEARCH_PARALLEL_ROWS 16384
+
+static struct {
+	uint8_t *query; /* the query being searched for, NULL for none */
+	int direction;
+	int row; /* row to look in next */
+	int from; /* look at starts >= from going forward, < from backward;
+		     -1 for the whole row */
+	int left; /* rows still to look in, counting row */
+	int wrapped; /* the scan has gone past the end of the buffer */
+	int matched; /* stopped at a match in row */
+	int repeats; /* C-s and C-r typed before the scan got to a match */
+	int repeat_direction;
+	int step; /* direction of the repeat being looked for, or 0 */
+	int step_row; /* the match that repeat started from */
+	int step_x;
+	int parallel; /* the rest of the scan is with the search workers */
+	int backward; /* new queries are looked for back from the origin */
+	int origin_row;
+	int origin_x;
+	int counting; /* the search workers are counting the matches */
+	long index; /* of the current match, from 1; 0 until counted */
+	long total; /* matches of the query, -1 until counted */
+	long moved; /* matches stepped over since the count started */
+} isearch;
+
+static void isearchStopWorkers(void) {
+	if (isearch.parallel || isearch.counting)
+		searchJobCancel();
+	isearch.parallel = 0;
+	isearch.counting = 0;
+}
+
+static void isearchReset(void) {
+	isearchStopWorkers();
+	free(isearch.query);
+	isearch.query = NULL;
+	isearch.direction = 1;
+	isearch.left = 0;
+	isearch.matched = 0;
+	isearch.wrapped = 0;
+	isearch.repeats = 0;
+	isearch.step = 0;
+	isearch.index = 0;
+	isearch.total = -1;
+	isearch.moved = 0;
+}
+
+/* Start of the match in row at that the scan wants, or -1 */
+static int isearchInRow(struct editorBuffer *bufr, int at, int from,
+			int direction) {
+	erow *row = &bufr->row[at];
+	int start, end;
+	if (direction > 0) {
+		if (from < 0)
+			from = 0;
+		if (from > row->size ||
+		    !searchNext(bufr, at, from, &start, &end))
+			return -1;
+		return start;
 	}
 
-	regex_t regex;
-	regmatch_t match[1];
+	/* Backward: the last match starting before from */
+	if (!searchLast(bufr, at, from, &start, &end))
+		return -1;
+	return start;
+}
 
-	/* Try to compile regex, fall back to literal search if invalid */
-	if (regcomp(&regex, (char *)pattern, REG_EXTENDED) != 0) {
-		return strstr((char *)text, (char *)pattern);
+/* Move the index a match along for a repeat that found the match at x
+ * in row at; any other match is counted afresh */
+static void isearchStepIndex(int at, int x) {
+	int step = isearch.step;
+	isearch.step = 0;
+	if (!step) {
+		isearch.index = 0;
+		return;
+	}
+	if (isearch.counting) {
+		/* Applied once the count has placed point */
+		isearch.moved += step;
+		if (isearch.index > 0)
+			isearch.index += step;
+		return;
 	}
+	if (isearch.total <= 0)
+		return;
+	/* A repeat that did not get further wrapped round the buffer */
+	if (step > 0 && (at > isearch.step_row ||
+			 (at == isearch.step_row && x > isearch.step_x)))
+		isearch.index++;
+	else if (step > 0)
+		isearch.index = 1;
+	else if (at < isearch.step_row ||
+		 (at == isearch.step_row && x < isearch.step_x))
+		isearch.index--;
+	else
+		isearch.index = isearch.total;
+	/* Overlapping matches are counted once */
+	if (isearch.index > isearch.total)
+		isearch.index = isearch.total;
+	if (isearch.index < 1)
+		isearch.index = 1;
+}
 
-	/* Execute regex search */
-	if (regexec(&regex, (char *)text, 1, match, 0) == 0) {
-		regfree(&regex);
-		return text + match[0].rm_so;
+/* Stop at the match found in row at */
+static void isearchFound(struct editorBuffer *bufr, int at, int start) {
+	erow *row = &bufr->row[at];
+	isearch.matched = 1;
+	isearch.row = at;
+	isearch.from = start;
+	bufr->cy = at;
+	bufr->cx = start;
+	/* Ensure we're at a character boundary */
+	while (bufr->cx > 0 && utf8_isCont(row->chars[bufr->cx])) {
+		bufr->cx--;
 	}
+	isearchStepIndex(at, bufr->cx);
+}
 
-	regfree(&regex);
-	return NULL;
+/* Wait for the workers scanning the rest of the rows; see isearchScan */
+static int isearchWait(struct editorBuffer *bufr, int interruptible) {
+	struct searchResult res;
+	while (!searchJobPoll(&res, 10)) {
+		if (interruptible && !E.playback && editorInputPending())
+			return 0;
+	}
+	isearch.parallel = 0;
+
+	int rows = res.found ? res.index : isearch.left;
+	int past = isearch.row + isearch.direction * rows;
+	if (past >= bufr->numrows || past < 0)
+		isearch.wrapped = 1;
+	isearch.left -= rows;
+	if (res.found)
+		isearchFound(bufr, res.row, res.start);
+	return 1;
 }
 
-// https://stackoverflow.com/a/779960
-// You must free the result if result is non-NULL.
-uint8_t *orig;
-uint8_t *repl;
+/*
+ * Run the scan on until it finds a match or runs out of rows.  Returns 0
+ * if it was put aside for a waiting key, when interruptible.  Once only
+ * whole rows are left, a long scan is handed to the search workers.
+ */
+static int isearchScan(struct editorBuffer *bufr, int interruptible) {
+	long bytes = 0;
+
+	while (isearch.left > 0) {
+		if (isearch.parallel)
+			return isearchWait(bufr, interruptible);
+		if (isearch.row < 0 || isearch.row >= bufr->numrows) {
+			isearch.left = 0;
+			break;
+		}
+		if (isearch.from < 0 && isearch.left >= ISEARCH_PARALLEL_ROWS &&
+		    searchWorkers() > 0) {
+			isearchStopWorkers();
+			searchJobStart(bufr, SEARCH_FIND, isearch.row,
+				       isearch.left, isearch.direction);
+			isearch.parallel = 1;
+			continue;
+		}
+		erow *row = &bufr->row[isearch.row];
+		int start = isearchInRow(bufr, isearch.row, isearch.from,
+					 isearch.direction);
+		if (start >= 0) {
+			isearchFound(bufr, isearch.row, start);
+			return 1;
+		}
 
-char *str_replace(char *orig, char *rep, char *with) {
-	char *result;	  // the return string
-	char *ins;	  // the next insert point
-	char *tmp;	  // varies
-	size_t len_rep;	  // length of rep (the string to remove)
-	size_t len_with;  // length of with (the string to replace rep with)
-	size_t len_front; // distance between rep and end of last rep
-	size_t count;	  // number of replacements
-
-	// sanity checks and initialization
-	if (!orig || !rep)
-		return NULL;
-	len_rep = strlen(rep);
-	if (len_rep == 0)
-		return NULL; // empty rep causes infinite loop during count
-	if (!with)
-		with = "";
-	len_with = strlen(with);
-
-	// count the number of replacements needed
-	ins = orig;
-	for (count = 0; (tmp = strstr(ins, rep)); ++count) {
-		ins = tmp + len_rep;
-	}
-
-	// Check for potential overflow
-	size_t orig_len = strlen(orig);
-	size_t result_size;
-	if (len_with > len_rep) {
-		// Check if multiplication would overflow
-		size_t diff = len_with - len_rep;
-		if (count > 0 && diff > (SIZE_MAX - orig_len - 1) / count) {
-			return NULL; // Overflow would occur
+		isearch.left--;
+		isearch.from = -1;
+		isearch.row += isearch.direction;
+		if (isearch.row == bufr->numrows) {
+			isearch.row = 0;
+			isearch.wrapped = 1;
+		} else if (isearch.row < 0) {
+			isearch.row = bufr->numrows - 1;
+			isearch.wrapped = 1;
 		}
-		result_size = orig_len + diff * count + 1;
-	} else if (len_with < len_rep) {
-		// Shrinking - need to handle underflow
-		size_t diff = len_rep - len_with;
-		if (diff * count > orig_len) {
-			// Would result in negative size
-			return NULL;
+
+		bytes += row->size + 1;
+		if (bytes >= ISEARCH_CHUNK_BYTES) {
+			bytes = 0;
+			if (interruptible && !E.playback &&
+			    editorInputPending())
+				return 0;
 		}
-		result_size = orig_len - diff * count + 1;
+	}
+	return 1;
+}
+
+/* Start looking again from just past the current match.  A count going
+ * on is kept: the total stays the same. */
+static void isearchAgain(struct editorBuffer *bufr, int direction) {
+	isearch.direction = direction;
+	isearch.step = 0;
+	if (isearch.matched) {
+		isearch.from = direction > 0 ? bufr->cx + 1 : bufr->cx;
+		isearch.step = direction;
+		isearch.step_row = bufr->cy;
+		isearch.step_x = bufr->cx;
 	} else {
-		// len_with == len_rep, no size change
-		result_size = orig_len + 1;
-	}
-	tmp = result = xmalloc(result_size);
-
-	if (!result)
-		return NULL;
-
-	// first time through the loop, all the variable are set correctly
-	// from here on,
-	//    tmp points to the end of the result string
-	//    ins points to the next occurrence of rep in orig
-	//    orig points to the remainder of orig after "end of rep"
-	while (count--) {
-		ins = strstr(orig, rep);
-		len_front = ins - orig;
-		size_t remaining = result_size - (tmp - result);
-		memcpy(tmp, orig, len_front);
-		tmp += len_front;
-		remaining = result_size - (tmp - result);
-		int written = snprintf(tmp, remaining, "%s", with);
-		if (written >= 0 && (size_t)written < remaining) {
-			tmp += written;
+		isearch.from = -1;
+	}
+	/* Every row, and the rest of this one again at the end */
+	isearch.left = bufr->numrows + 1;
+	isearch.matched = 0;
+}
+
+/* Scan, then go on to any repeats that were waiting for a match.
+ * Returns 0 if put aside for a waiting key. */
+static int isearchRun(struct editorBuffer *bufr, int interruptible) {
+	for (;;) {
+		if (!isearch.matched && isearch.left > 0 &&
+		    !isearchScan(bufr, interruptible))
+			return 0;
+		if (!isearch.matched || !isearch.repeats)
+			return 1;
+		isearch.repeats--;
+		isearchAgain(bufr, isearch.repeat_direction);
+	}
+}
+
+/* Show how the search went after the query in the prompt */
+static void isearchReport(const uint8_t *query, const char *what) {
+	if (regex_mode && isearch.backward)
+		editorSetStatusMessage(REGEX_FIND_BACKWARD_PROMPT " [%s]", query,
+				       what);
+	else if (regex_mode)
+		editorSetStatusMessage(REGEX_FIND_PROMPT " [%s]", query, what);
+	else
+		editorSetStatusMessage(FIND_PROMPT " [%s]", query, what);
+	E.minibuf->completion_state.preserve_message = 1;
+}
+
+/* Show which match point is at, of how many, as far as counted */
+static void isearchReportCount(const uint8_t *query, long counted) {
+	char what[64], index[24] = "?";
+	if (isearch.index > 0)
+		snprintf(index, sizeof(index), "%ld", isearch.index);
+	if (isearch.total >= 0)
+		snprintf(what, sizeof(what), "%s%s/%ld",
+			 isearch.wrapped ? "Wrapped " : "", index,
+			 isearch.total);
+	else
+		snprintf(what, sizeof(what), "%s%s/%ld+",
+			 isearch.wrapped ? "Wrapped " : "", index, counted);
+	isearchReport(query, what);
+}
+
+/* Count the matches in between keys, showing the count as it goes */
+static void isearchCount(struct editorBuffer *bufr, const uint8_t *query) {
+	struct searchResult res;
+	int polls = 0;
+
+	if (E.playback) {
+		if (isearch.wrapped)
+			isearchReport(query, "Wrapped");
+		return;
+	}
+	if (!isearch.counting && (isearch.index == 0 || isearch.total < 0)) {
+		searchJobStart(bufr, SEARCH_COUNT, 0, bufr->numrows, 1);
+		isearch.counting = 1;
+		isearch.moved = 0;
+	}
+	while (isearch.counting) {
+		int done = searchJobPoll(&res, 10);
+		/* Point has moved on by any repeats since the count began */
+		if (res.placed)
+			isearch.index = res.before + 1 + isearch.moved;
+		if (done) {
+			isearch.counting = 0;
+			isearch.total = res.count;
+			/* Repeats may have gone round the buffer */
+			if (isearch.moved && isearch.total > 0) {
+				long i = (isearch.index - 1) % isearch.total;
+				if (i < 0)
+					i += isearch.total;
+				isearch.index = i + 1;
+			}
+			/* Overlapping matches are counted once */
+			if (isearch.index > isearch.total)
+				isearch.index = isearch.total;
+			break;
+		}
+		if (editorInputPending()) {
+			isearchReportCount(query, res.count);
+			return;
+		}
+		/* Without workers every poll is one chunk */
+		if (++polls % (searchWorkers() > 0 ? 5 : 64) == 0) {
+			isearchReportCount(query, res.count);
+			refreshScreen();
 		}
-		orig += len_front + len_rep; // move to next "end of rep"
 	}
-	size_t final_remaining = result_size - (tmp - result);
-	snprintf(tmp, final_remaining, "%s", orig);
-	return result;
+	isearchReportCount(query, isearch.total);
 }
 
 void editorFindCallback(struct editorBuffer *bufr, uint8_t *query, int key) {
-	static int last_match = -1;
-	static int direction = 1;
-
 	if (bufr->query != query) {
 		free(bufr->query);
 		bufr->query = query ? xstrdup((char *)query) : NULL;
 	}
+	bufr->query_regex = regex_mode;
 	bufr->match = 0;
 
 	if (key == CTRL('g') || key == CTRL('c') || key == '\r') {
-		last_match = -1;
-		direction = 1;
+		isearchReset();
 		regex_mode = 0; /* Reset regex mode on exit */
 		return;
-	} else if (key == CTRL('s')) {
-		direction = 1;
-	} else if (key == CTRL('r')) {
-		direction = -1;
-	} else {
-		last_match = -1;
-		direction = 1;
 	}
 
 	if (!query || strlen((char *)query) == 0) {
+		isearchReset();
 		return;
 	}
 
-	if (last_match == -1)
-		direction = 1;
-	int current = last_match;
-	if (current >= 0 && current < bufr->numrows) {
-		erow *row = &bufr->row[current];
-		uint8_t *match;
-		if (bufr->cx + 1 >= row->size) {
-			match = NULL;
-		} else {
-			if (regex_mode) {
-				match = regexSearch(&(row->chars[bufr->cx + 1]),
-						    query);
-			} else {
-				match = strstr(
-					(char *)&(row->chars[bufr->cx + 1]),
-					(char *)query);
-			}
-		}
-		if (match) {
-			last_match = current;
-			bufr->cy = current;
-			bufr->cx = match - row->chars;
-			/* Ensure we're at a character boundary */
-			while (bufr->cx > 0 &&
-			       utf8_isCont(row->chars[bufr->cx])) {
-				bufr->cx--;
-			}
-			scroll();
-			bufr->match = 1;
-			return;
-		}
+	/* Compiled once per change of query, not per row searched */
+	const char *error = searchSetPattern(query, regex_mode);
+	if (error) {
+		isearchReset();
+		isearchReport(query, error);
+		return;
 	}
-	for (int i = 0; i < bufr->numrows; i++) {
-		current += direction;
-		if (current == -1)
-			current = bufr->numrows - 1;
-		else if (current == bufr->numrows)
-			current = 0;
-
-		erow *row = &bufr->row[current];
-		uint8_t *match;
-		if (regex_mode) {
-			match = regexSearch(row->chars, query);
-		} else {
-			match = strstr((char *)row->chars, (char *)query);
-		}
-		if (match) {
-			last_match = current;
-			bufr->cy = current;
-			bufr->cx = match - row->chars;
-			/* Ensure we're at a character boundary */
-			while (bufr->cx > 0 &&
-			       utf8_isCont(row->chars[bufr->cx])) {
-				bufr->cx--;
-			}
-			scroll();
-			bufr->match = 1;
-			break;
+
+	size_t oldlen = isearch.query ? strlen((char *)isearch.query) : 0;
+	int same = isearch.query && strcmp((char *)isearch.query,
+					   (char *)query) == 0;
+	int grown = isearch.query && !regex_mode && oldlen > 0 &&
+		    strlen((char *)query) > oldlen &&
+		    strncmp((char *)isearch.query, (char *)query, oldlen) == 0;
+
+	/* The workers have the old query; a grown one starts them again */
+	if (!same)
+		isearchStopWorkers();
+	if (same && (key == CTRL('s') || key == CTRL('r'))) {
+		/* Look again past the current match, once there is one */
+		isearch.repeat_direction = key == CTRL('s') ? 1 : -1;
+		if (!isearch.matched && isearch.left > 0)
+			isearch.repeats++;
+		else
+			isearchAgain(bufr, isearch.repeat_direction);
+	} else if (grown && isearch.matched) {
+		/* The same scan, from the current match itself */
+		isearch.from = isearch.direction > 0 ? bufr->cx : bufr->cx + 1;
+		isearch.matched = 0;
+	} else if (!same && !grown) {
+		/* Forward from the top, or backward from where the search
+		 * started and round to the rest of that row */
+		isearch.direction = isearch.backward ? -1 : 1;
+		isearch.row = isearch.backward ? bufr->numrows - 1 : 0;
+		isearch.from = -1;
+		isearch.left = bufr->numrows;
+		if (isearch.backward && isearch.origin_row < bufr->numrows) {
+			isearch.row = isearch.origin_row;
+			isearch.from = isearch.origin_x;
+			isearch.left = bufr->numrows + 1;
 		}
+		isearch.wrapped = 0;
+		isearch.matched = 0;
+		isearch.repeats = 0;
+	}
+	/* Otherwise, an unchanged query resumes the scan where it was put
+	 * aside, and a grown one carries on with it */
+	if (!same) {
+		free(isearch.query);
+		isearch.query = (uint8_t *)xstrdup((char *)query);
+		isearch.total = -1;
 	}
-}
-
-void editorFind(struct editorBuffer *bufr) {
-	regex_mode = 0; /* Start in normal mode */
-	int saved_cx = bufr->cx;
-	int saved_cy = bufr->cy;
-	//	int saved_rowoff = bufr->rowoff;
-
-	uint8_t *query = editorPrompt(bufr, "Search (C-g to cancel): %s",
-				      PROMPT_SEARCH, editorFindCallback);
 
-	free(bufr->query);
-	bufr->query = NULL;
-	if (query) {
-		free(query);
+	if (!isearchRun(bufr, 1))
+		return;
+	if (isearch.matched) {
+		scroll();
+		bufr->match = 1;
+		isearchCount(bufr, query);
 	} else {
-		bufr->cx = saved_cx;
-		bufr->cy = saved_cy;
-		//		bufr->rowoff = saved_rowoff;
+		isearchReport(query, "Failing");
 	}
 }
 
-void editorRegexFind(struct editorBuffer *bufr) {
-	regex_mode = 1; /* Start in regex mode */
+/* Finish a scan put aside when the prompt was accepted */
+static void isearchFinish(struct editorBuffer *bufr) {
+	if (isearch.query && !searchSetPattern(isearch.query, regex_mode) &&
+	    (!isearch.matched || isearch.repeats) && isearchRun(bufr, 0) &&
+	    isearch.matched)
+		scroll();
+	isearchReset();
+}
+
+/* Run isearch in the minibuffer, leaving point at the match accepted */
+static void isearchPrompt(struct editorBuffer *bufr, const char *prompt,
+			  int regex, int backward) {
+	regex_mode = regex;
 	int saved_cx = bufr->cx;
 	int saved_cy = bufr->cy;
 
-	uint8_t *query = editorPrompt(bufr, "Regex search (C-g to cancel): %s",
-				      PROMPT_SEARCH, editorFindCallback);
+	isearchReset();
+	isearch.backward = backward;
+	isearch.origin_row = saved_cy;
+	isearch.origin_x = saved_cx;
+	uint8_t *query = editorPrompt(bufr, (uint8_t *)prompt, PROMPT_SEARCH,
+				      editorFindCallback);
 
 	free(bufr->query);
 	bufr->query = NULL;
-	regex_mode = 0; /* Reset after search */
 	if (query) {
+		isearchFinish(bufr);
 		free(query);
 	} else {
+		isearchReset();
 		bufr->cx = saved_cx;
 		bufr->cy = saved_cy;
 	}
+	isearch.backward = 0;
+	regex_mode = 0; /* Reset after search */
+}
+
+void editorFind(struct editorBuffer *bufr) {
+	isearchPrompt(bufr, FIND_PROMPT, 0, 0);
 }
 
+void editorRegexFind(struct editorBuffer *bufr) {
+	isearchPrompt(bufr, REGEX_FIND_PROMPT, 1, 0);
+}
+
+/* orig replaced with repl in input, matched as a search matches it */
 uint8_t *transformerReplaceString(uint8_t *input) {
-	return str_replace(input, orig, repl);
+	int fold = searchFoldsCase(orig, 0);
+	uint8_t *what = (uint8_t *)xstrdup((char *)orig);
+	if (fold)
+		emsys_fold(what, strlen((char *)what));
+	uint8_t *result = (uint8_t *)str_replace(
+		(char *)input, (char *)what, (char *)repl, fold);
+	free(what);
+	return result;
 }
 
 void editorReplaceString(struct editorConfig *ed, struct editorBuffer *buf) {
@@ -279,31 +505,85 @@ void editorReplaceString(struct editorConfig *ed, struct editorBuffer *buf) {
 		return;
 	}
 
-	editorTransformRegion(ed, buf, transformerReplaceString);
+	/* Text with newlines is replaced through the kill ring, all else a
+	 * row at a time */
+	if (strchr((char *)orig, '\n') || strchr((char *)repl, '\n')) {
+		editorTransformRegion(ed, buf, transformerReplaceString);
+	} else if (!markInvalid()) {
+		int n = editorReplaceInRegion(buf, orig, repl,
+					      strlen((char *)repl));
+		editorSetStatusMessage("Replaced %d instance%s", n,
+				       n == 1 ? "" : "s");
+	}
 
 	free(orig);
 	free(repl);
 }
 
-static int nextOccur(struct editorBuffer *buf, uint8_t *needle, int ocheck) {
-	int ox = buf->cx;
-	int oy = buf->cy;
-	if (!ocheck) {
-		ox = -69;
+void editorToggleCaseFold(struct editorConfig *UNUSED(ed),
+			  struct editorBuffer *UNUSED(buf)) {
+	searchSetCaseFold(!searchCaseFold());
+	editorSetStatusMessage(searchCaseFold() ?
+				       "Searches ignore case unless the query "
+				       "has capitals" :
+				       "Searches are case sensitive");
+}
+
+/* Count the matches of a regexp in the whole buffer.  The count runs on
+ * the search workers; C-g gives it up. */
+void editorCountMatches(struct editorConfig *UNUSED(ed),
+			struct editorBuffer *buf) {
+	uint8_t *regex = editorPrompt(buf, "Count matches for regexp: %s",
+				      PROMPT_BASIC, NULL);
+	if (regex == NULL) {
+		editorSetStatusMessage("Canceled count-matches.");
+		return;
 	}
+	const char *error = searchSetPattern(regex, 1);
+	free(regex);
+	if (error) {
+		editorSetStatusMessage("Regex error: %s", error);
+		return;
+	}
+
+	struct searchResult res;
+	int polls = 0, typed_ahead = 0;
+	searchJobStart(buf, SEARCH_COUNT, 0, buf->numrows, 1);
+	while (!searchJobPoll(&res, 50)) {
+		if (!E.playback && !typed_ahead && editorInputPending()) {
+			/* Only C-g is ours; any other key waits for the
+			 * command loop until the count is done */
+			int c = editorReadKey();
+			if (c == CTRL('g')) {
+				searchJobCancel();
+				editorSetStatusMessage("Quit");
+				return;
+			}
+			editorUnreadKey(c);
+			typed_ahead = 1;
+		}
+		/* Without workers every poll is one chunk */
+		if (++polls % (searchWorkers() > 0 ? 1 : 64) == 0) {
+			editorSetStatusMessage("Counting... %ld so far",
+					       res.count);
+			refreshScreen();
+		}
+	}
+	editorSetStatusMessage("%ld occurrence%s", res.count,
+			       res.count == 1 ? "" : "s");
+}
+
+/* Mark the next match of the search pattern at or after point */
+static int nextOccur(struct editorBuffer *buf) {
 	while (buf->cy < buf->numrows) {
 		erow *row = &buf->row[buf->cy];
-		uint8_t *match =
-			strstr((char *)&(row->chars[buf->cx]), (char *)needle);
-		if (match) {
-			if (!(buf->cx == ox && buf->cy == oy)) {
-				buf->cx = match - row->chars;
-				buf->marky = buf->cy;
-				buf->markx = buf->cx + strlen(needle);
-				/* buf->rowoff = buf->numrows; */
-				return 1;
-			}
-			buf->cx++;
+		int start, end;
+		if (buf->cx <= row->size &&
+		    searchNext(buf, buf->cy, buf->cx, &start, &end)) {
+			buf->cx = start;
+			buf->marky = buf->cy;
+			buf->markx = end;
+			return 1;
 		}
 		buf->cx = 0;
 		buf->cy++;
@@ -311,6 +591,43 @@ static int nextOccur(struct editorBuffer *buf, uint8_t *needle, int ocheck) {
 	return 0;
 }
 
+/* Replace the occurrence from point to the mark with, leaving point after
+ * it.  Within a row it is replaced in place as one undo step, and a
+ * replacement with newlines goes through the kill ring. */
+static void replaceOccur(struct editorConfig *ed, struct editorBuffer *buf,
+			 uint8_t *with) {
+	if (strchr((char *)with, '\n')) {
+		uint8_t *saved = repl;
+		repl = with;
+		editorTransformRegion(ed, buf, transformerReplaceString);
+		repl = saved;
+		return;
+	}
+	erow *row = &buf->row[buf->cy];
+	int len = buf->markx - buf->cx;
+	int wlen = strlen((char *)with);
+	struct editorUndo *undo = editorUndoReplaceBegin(buf);
+	editorUndoReplaced(undo, buf->cy, buf->cx, &row->chars[buf->cx], len,
+			   with, wlen);
+	editorUndoReplaceEnd(buf, undo);
+	rowReplaceString(buf, row, buf->cx, len, (char *)with, wlen);
+	buf->cx += wlen;
+}
+
+/* Point on the occurrence a query-replace step undid */
+static void undidOccur(struct editorBuffer *buf) {
+	int len = strlen((char *)orig);
+	if (buf->redo && buf->redo->replaced) {
+		/* Point is at its start */
+		buf->markx = buf->cx + len;
+	} else {
+		/* The kill ring's undo leaves point at its end */
+		buf->markx = buf->cx;
+		buf->cx -= len;
+	}
+	buf->marky = buf->cy;
+}
+
 void editorQueryReplace(struct editorConfig *ed, struct editorBuffer *buf) {
 	orig = NULL;
 	repl = NULL;
@@ -319,6 +636,11 @@ void editorQueryReplace(struct editorConfig *ed, struct editorBuffer *buf) {
 		editorSetStatusMessage("Canceled query-replace.");
 		return;
 	}
+	if (orig[0] == '\0') {
+		free(orig);
+		editorSetStatusMessage("Nothing to replace");
+		return;
+	}
 
 	uint8_t *prompt = xmalloc(strlen(orig) + 25);
 	snprintf(prompt, strlen(orig) + 25, "Query replace %s with: %%s", orig);
@@ -339,14 +661,16 @@ void editorQueryReplace(struct editorConfig *ed, struct editorBuffer *buf) {
 	struct editorUndo *first = buf->undo;
 	uint8_t *newStr = NULL;
 	buf->query = orig;
+	buf->query_regex = 0;
+	searchSetPattern(orig, 0);
 	int currentIdx = windowFocusedIdx();
 	struct editorWindow *currentWindow = ed->windows[currentIdx];
 
-#define NEXT_OCCUR(ocheck)                 \
-	if (!nextOccur(buf, orig, ocheck)) \
+#define NEXT_OCCUR()              \
+	if (!nextOccur(buf))       \
 	goto QR_CLEANUP
 
-	NEXT_OCCUR(false);
+	NEXT_OCCUR();
 
 	for (;;) {
 		editorSetStatusMessage(prompt);
@@ -358,16 +682,15 @@ void editorQueryReplace(struct editorConfig *ed, struct editorBuffer *buf) {
 		switch (c) {
 		case ' ':
 		case 'y':
-			editorTransformRegion(ed, buf,
-					      transformerReplaceString);
-			NEXT_OCCUR(true);
+			replaceOccur(ed, buf, repl);
+			NEXT_OCCUR();
 			break;
 		case CTRL('h'):
 		case BACKSPACE:
 		case DEL_KEY:
 		case 'n':
 			buf->cx++;
-			NEXT_OCCUR(true);
+			NEXT_OCCUR();
 			break;
 		case '\r':
 		case 'q':
@@ -376,64 +699,66 @@ void editorQueryReplace(struct editorConfig *ed, struct editorBuffer *buf) {
 			goto QR_CLEANUP;
 			break;
 		case '.':
-			editorTransformRegion(ed, buf,
-					      transformerReplaceString);
+			replaceOccur(ed, buf, repl);
 			goto QR_CLEANUP;
 			break;
 		case '!':
 		case 'Y':
 			buf->marky = buf->numrows - 1;
 			buf->markx = buf->row[buf->marky].size;
-			editorTransformRegion(ed, buf,
-					      transformerReplaceString);
+			if (strchr((char *)repl, '\n'))
+				editorTransformRegion(ed, buf,
+						      transformerReplaceString);
+			else
+				editorReplaceInRegion(buf, orig, repl,
+						      strlen((char *)repl));
 			goto QR_CLEANUP;
 			break;
 		case 'u':
+			if (buf->undo == first)
+				break;
 			editorDoUndo(buf, 1);
-			buf->markx = buf->cx;
-			buf->marky = buf->cy;
-			buf->cx -= strlen(orig);
+			undidOccur(buf);
 			break;
 		case 'U':
+			if (buf->undo == first)
+				break;
 			while (buf->undo != first)
 				editorDoUndo(buf, 1);
-			buf->markx = buf->cx;
-			buf->marky = buf->cy;
-			buf->cx -= strlen(orig);
+			undidOccur(buf);
 			break;
 		case CTRL('r'):
+			free(prompt);
 			prompt = xmalloc(strlen(orig) + 25);
 			snprintf(prompt, strlen(orig) + 25,
 				 "Replace this %s with: %%s", orig);
 			newStr = editorPrompt(buf, prompt, PROMPT_BASIC, NULL);
 			free(prompt);
+			prompt = NULL;
 			if (newStr == NULL) {
 				goto RESET_PROMPT;
 			}
-			uint8_t *tmp = repl;
-			repl = newStr;
-			editorTransformRegion(ed, buf,
-					      transformerReplaceString);
+			replaceOccur(ed, buf, newStr);
 			free(newStr);
-			repl = tmp;
-			NEXT_OCCUR(true);
+			NEXT_OCCUR();
 			goto RESET_PROMPT;
 			break;
 		case 'e':
 		case 'E':
+			free(prompt);
 			prompt = xmalloc(strlen(orig) + 25);
 			snprintf(prompt, strlen(orig) + 25,
 				 "Query replace %s with: %%s", orig);
 			newStr = editorPrompt(buf, prompt, PROMPT_BASIC, NULL);
 			free(prompt);
+			prompt = NULL;
 			if (newStr == NULL) {
 				goto RESET_PROMPT;
 			}
 			free(repl);
 			repl = newStr;
-			editorTransformRegion(ed, buf,
-					      transformerReplaceString);
-			NEXT_OCCUR(true);
+			replaceOccur(ed, buf, repl);
+			NEXT_OCCUR();
 RESET_PROMPT:
 			prompt = xmalloc(strlen(orig) + strlen(repl) + 32);
 			snprintf(prompt, strlen(orig) + strlen(repl) + 32,
@@ -464,13 +789,9 @@ void editorRegexFindWrapper(struct editorConfig *UNUSED(ed),
 	editorRegexFind(buf);
 }
 
-/* Backward regex find - not yet implemented */
+/* Regex isearch, looking back from point */
 void editorBackwardRegexFind(struct editorBuffer *bufr) {
-	(void)bufr;	/* Unused parameter */
-	regex_mode = 1; /* Start in regex mode */
-
-	editorSetStatusMessage("Backward regex search not yet implemented");
-	regex_mode = 0; /* Reset after search */
+	isearchPrompt(bufr, REGEX_FIND_BACKWARD_PROMPT, 1, 1);
 }
 
 /* Wrapper for backward regex find */
@@ -2,7 +2,6 @@
 #define EMSYS_FIND_H
 #include <stdint.h>
 #include "emsys.h"
-char *str_replace(char *orig, char *rep, char *with);
 void editorFindCallback(struct editorBuffer *bufr, uint8_t *query, int key);
 void editorFind(struct editorBuffer *bufr);
 void editorRegexFind(struct editorBuffer *bufr);
@@ -12,5 +11,7 @@ void editorBackwardRegexFindWrapper(struct editorConfig *ed,
 				    struct editorBuffer *buf);
 uint8_t *transformerReplaceString(uint8_t *input);
 void editorReplaceString(struct editorConfig *ed, struct editorBuffer *buf);
+void editorToggleCaseFold(struct editorConfig *ed, struct editorBuffer *buf);
+void editorCountMatches(struct editorConfig *ed, struct editorBuffer *buf);
 void editorQueryReplace(struct editorConfig *ed, struct editorBuffer *buf);
 #endif
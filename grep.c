@@ -0,0 +1,615 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef EMSYS_DISABLE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+#include "emsys.h"
+#include "buffer.h"
+#include "display.h"
+#include "fileio.h"
+#include "grep.h"
+#include "prompt.h"
+#include "search.h"
+#include "unused.h"
+#include "util.h"
+
+extern struct editorConfig E;
+
+/*
+ * grep lists the lines of the files under a directory that match a
+ * regexp in *grep*, as FILE:LINE:TEXT, and RET on one of them visits it.
+ *
+ * The tree is walked by a pool of worker threads sharing a stack of paths
+ * still to look at: a directory pushes its entries, and a file is read
+ * whole and searched with searchMatcherNextLine, which passes over most
+ * of it at memmem speed.  Each worker has a matcher of its own, since
+ * a compiled regex keeps the state of its search.  The lines a worker
+ * finds go to the main thread a file at a time, and into *grep* in
+ * between keys, as occur's do.  Without workers the main thread walks the
+ * tree itself, a slice at a time.
+ *
+ * Version control directories are not gone into, symlinks are not
+ * followed, and a file with a NUL byte near its start is taken to be
+ * binary and skipped.
+ */
+
+#define GREP_BUFFER "*grep*"
+#define GREP_MAX_WORKERS 8
+#define GREP_SLICE_NANOS 20000000L /* listing and walking between keys */
+#define GREP_BINARY_PROBE 8192 /* bytes looked at for a NUL */
+#define GREP_MAX_LISTED 1000 /* bytes of a matching line listed */
+#define GREP_CANCEL_BYTES (1 << 20) /* bytes searched between looks at
+				       grep.cancel */
+
+struct grepPath {
+	char *path;
+	int dir;
+};
+
+static struct {
+	struct editorBuffer *out;
+	char *query;
+	char *dir; /* paths are listed relative to this */
+	struct matcher *m[GREP_MAX_WORKERS + 1]; /* the last for the main
+						    thread */
+	struct grepPath *todo;
+	int ntodo;
+	int todocap;
+	int busy; /* paths being looked at */
+	struct abuf found; /* lines for *grep* not yet in it, each ending
+			      in a newline */
+	long lines;
+	long files;
+	int active; /* started and not yet reported done */
+	int cancel;
+	int running; /* workers busy with the walk */
+	unsigned int gen; /* bumped for every walk started */
+	struct timespec started;
+} grep;
+
+#ifndef EMSYS_DISABLE_THREADS
+static pthread_mutex_t grep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t grep_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t grep_progress = PTHREAD_COND_INITIALIZER;
+static int nworkers = -1; /* -1 until the pool is started */
+
+#define LOCK() pthread_mutex_lock(&grep_lock)
+#define UNLOCK() pthread_mutex_unlock(&grep_lock)
+#else
+static int nworkers = 0;
+
+#define LOCK() ((void)0)
+#define UNLOCK() ((void)0)
+#endif
+
+static long nanosSince(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+	       (now.tv_nsec - start->tv_nsec);
+}
+
+/* Push a path to look at; called with the lock held */
+static void pushPath(char *path, int dir) {
+	if (grep.ntodo == grep.todocap) {
+		grep.todocap = grep.todocap ? grep.todocap * 2 : 256;
+		grep.todo = xrealloc(grep.todo,
+				     grep.todocap * sizeof(*grep.todo));
+	}
+	grep.todo[grep.ntodo].path = path;
+	grep.todo[grep.ntodo].dir = dir;
+	grep.ntodo++;
+}
+
+static int skippedDir(const char *name) {
+	return strcmp(name, ".git") == 0 || strcmp(name, ".hg") == 0 ||
+	       strcmp(name, ".svn") == 0 || strcmp(name, "CVS") == 0;
+}
+
+/* Push the files and directories in dir */
+static void walkDir(const char *dir) {
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	struct grepPath *entries = NULL;
+	int n = 0, cap = 0;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		const char *name = de->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		size_t len = strlen(dir) + strlen(name) + 2;
+		char *path = xmalloc(len);
+		snprintf(path, len, "%s/%s", dir, name);
+		int type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			type = lstat(path, &st) != 0 ? DT_UNKNOWN :
+			       S_ISDIR(st.st_mode)  ? DT_DIR :
+			       S_ISREG(st.st_mode)  ? DT_REG :
+						      DT_UNKNOWN;
+		}
+		if ((type != DT_DIR && type != DT_REG) ||
+		    (type == DT_DIR && skippedDir(name))) {
+			free(path);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 32;
+			entries = xrealloc(entries, cap * sizeof(*entries));
+		}
+		entries[n].path = path;
+		entries[n].dir = type == DT_DIR;
+		n++;
+	}
+	closedir(d);
+
+	/* Last pushed is looked at first, so push in reverse to go through
+	 * a directory in the order it lists */
+	LOCK();
+	for (int i = n - 1; i >= 0; i--)
+		pushPath(entries[i].path, entries[i].dir);
+#ifndef EMSYS_DISABLE_THREADS
+	if (n > 0)
+		pthread_cond_broadcast(&grep_work);
+#endif
+	UNLOCK();
+	free(entries);
+}
+
+static int walkCancelled(void) {
+	LOCK();
+	int cancel = grep.cancel;
+	UNLOCK();
+	return cancel;
+}
+
+/* Append "NAME:LINE:TEXT\n" to lines */
+static void listLine(struct abuf *lines, const char *name, long line,
+		     const uint8_t *text, size_t len) {
+	char number[24];
+	int n = snprintf(number, sizeof(number), ":%ld:", line);
+	if (len > GREP_MAX_LISTED)
+		len = GREP_MAX_LISTED;
+	if (len > 0 && text[len - 1] == '\r')
+		len--;
+	abAppend(lines, name, strlen(name));
+	abAppend(lines, number, n);
+	abAppend(lines, (const char *)text, len);
+	abAppend(lines, "\n", 1);
+}
+
+/*
+ * List the lines of the file at path that m matches.  The file is read
+ * rather than mapped: a mapped file that is cut short while it is being
+ * searched, as a log or build output can be, raises SIGBUS, which would
+ * take the editor down from a worker thread.  The matcher reads the text
+ * in place, so one copy is all it costs.
+ */
+static void grepFile(const char *path, struct matcher *m) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	size_t size = st.st_size, got = 0;
+	uint8_t *text = malloc(size);
+	if (!text) {
+		close(fd);
+		return;
+	}
+	while (got < size) {
+		ssize_t r = read(fd, text + got, size - got);
+		if (r <= 0)
+			break;
+		got += r;
+	}
+	close(fd);
+	size = got;
+	if (memchr(text, '\0', size < GREP_BINARY_PROBE ? size :
+							  GREP_BINARY_PROBE)) {
+		free(text);
+		return;
+	}
+
+	const char *name = path + strlen(grep.dir) + 1;
+	struct abuf lines = ABUF_INIT;
+	size_t from = 0, window, start, end, counted = 0;
+	long line = 1, nlines = 0;
+	for (; from < size && !walkCancelled(); from = window) {
+		/* Search up to a line end past the next GREP_CANCEL_BYTES */
+		uint8_t *nl = NULL;
+		if (size - from > GREP_CANCEL_BYTES)
+			nl = memchr(text + from + GREP_CANCEL_BYTES, '\n',
+				    size - from - GREP_CANCEL_BYTES);
+		window = nl ? (size_t)(nl - text) + 1 : size;
+		while (searchMatcherNextLine(m, text, window, from, &start,
+					     &end)) {
+			while ((nl = memchr(text + counted, '\n',
+					    start - counted))) {
+				counted = nl - text + 1;
+				line++;
+			}
+			listLine(&lines, name, line, text + start,
+				 end - start);
+			nlines++;
+			from = end + 1;
+		}
+	}
+	free(text);
+
+	if (nlines > 0) {
+		LOCK();
+		abAppend(&grep.found, lines.b, lines.len);
+		grep.lines += nlines;
+		grep.files++;
+#ifndef EMSYS_DISABLE_THREADS
+		pthread_cond_broadcast(&grep_progress);
+#endif
+		UNLOCK();
+	}
+	abFree(&lines);
+}
+
+/* Look at the next path, if there is one; called with the lock held */
+static int lookAtNext(struct matcher *m) {
+	if (grep.cancel || grep.ntodo == 0)
+		return 0;
+	struct grepPath p = grep.todo[--grep.ntodo];
+	grep.busy++;
+	UNLOCK();
+	if (p.dir)
+		walkDir(p.path);
+	else
+		grepFile(p.path, m);
+	free(p.path);
+	LOCK();
+	grep.busy--;
+	return 1;
+}
+
+static int walkDone(void) {
+	return grep.ntodo == 0 && grep.busy == 0;
+}
+
+#ifndef EMSYS_DISABLE_THREADS
+static void *grepWorker(void *arg) {
+	int id = (int)(intptr_t)arg;
+	unsigned int seen = 0;
+	LOCK();
+	for (;;) {
+		while (grep.gen == seen)
+			pthread_cond_wait(&grep_work, &grep_lock);
+		seen = grep.gen;
+		if (!grep.active || grep.cancel)
+			continue;
+		grep.running++;
+		while (!grep.cancel && !walkDone()) {
+			if (!lookAtNext(grep.m[id]))
+				pthread_cond_wait(&grep_work, &grep_lock);
+		}
+		/* Others waiting for work are done too */
+		pthread_cond_broadcast(&grep_work);
+		grep.running--;
+		pthread_cond_broadcast(&grep_progress);
+	}
+	return NULL;
+}
+#endif
+
+/* Worker threads walking the tree, started the first time; 0 if none */
+static int grepWorkers(void) {
+#ifndef EMSYS_DISABLE_THREADS
+	if (nworkers >= 0)
+		return nworkers;
+	nworkers = 0;
+	long cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (cpus <= 1)
+		return nworkers;
+	if (cpus > GREP_MAX_WORKERS)
+		cpus = GREP_MAX_WORKERS;
+
+	/* Signals are for the main thread */
+	sigset_t all, saved;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (int i = 0; i < cpus; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, grepWorker,
+				   (void *)(intptr_t)i) != 0)
+			break;
+		pthread_detach(thread);
+		nworkers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+#endif
+	return nworkers;
+}
+
+/* Stop the walk, if any, waiting for the workers to let go of it */
+static void grepCancel(void) {
+	LOCK();
+	grep.cancel = 1;
+#ifndef EMSYS_DISABLE_THREADS
+	pthread_cond_broadcast(&grep_work);
+	while (grep.running > 0)
+		pthread_cond_wait(&grep_progress, &grep_lock);
+#endif
+	for (int i = 0; i < grep.ntodo; i++)
+		free(grep.todo[i].path);
+	grep.ntodo = 0;
+	grep.found.len = 0;
+	grep.active = 0;
+	UNLOCK();
+}
+
+int grepRunning(void) {
+	return grep.active;
+}
+
+/* Move the lines found so far into *grep* */
+static void listFound(void) {
+	struct abuf found;
+	LOCK();
+	found = grep.found;
+	grep.found.b = NULL;
+	grep.found.len = grep.found.capacity = 0;
+	UNLOCK();
+	for (int at = 0; at < found.len;) {
+		char *nl = memchr(found.b + at, '\n', found.len - at);
+		editorInsertRow(grep.out, grep.out->numrows, found.b + at,
+				nl - (found.b + at));
+		at = nl - found.b + 1;
+	}
+	abFree(&found);
+}
+
+/* List what the walk has found, walking for a slice of time if there
+ * are no workers to */
+void grepStep(void) {
+	if (!grep.active)
+		return;
+	LOCK();
+	if (nworkers == 0) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (nanosSince(&start) < GREP_SLICE_NANOS &&
+		       lookAtNext(grep.m[GREP_MAX_WORKERS]))
+			;
+	}
+#ifndef EMSYS_DISABLE_THREADS
+	else if (grep.found.len == 0 && !walkDone()) {
+		/* Nothing to show yet: wait a little for some */
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += GREP_SLICE_NANOS;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&grep_progress, &grep_lock, &until);
+	}
+#endif
+	int done = walkDone();
+	long lines = grep.lines, files = grep.files;
+	UNLOCK();
+
+	listFound();
+	grep.out->dirty = 0; /* there is no file to save it to */
+	if (!done) {
+		editorSetStatusMessage("Searching... %ld matching line%s so far",
+				       lines, lines == 1 ? "" : "s");
+		return;
+	}
+	char footer[80];
+	snprintf(footer, sizeof(footer), "Grep finished with %ld match%s found",
+		 lines, lines == 1 ? "" : "es");
+	editorInsertRow(grep.out, grep.out->numrows, footer, strlen(footer));
+	grep.out->dirty = 0;
+	editorSetStatusMessage("%ld matching line%s in %ld file%s (%.2fs)",
+			       lines, lines == 1 ? "" : "s",
+			       files, files == 1 ? "" : "s",
+			       nanosSince(&grep.started) / 1e9);
+	grep.active = 0;
+}
+
+/* The directory of buf's file, or the current one */
+static char *defaultDir(struct editorBuffer *buf) {
+	const char *slash = buf->filename ? strrchr(buf->filename, '/') : NULL;
+	if (!slash || buf->special_buffer)
+		return xstrdup(".");
+	if (slash == buf->filename)
+		return xstrdup("/");
+	char *dir = xstrdup(buf->filename);
+	dir[slash - buf->filename] = '\0';
+	return dir;
+}
+
+void editorGrep(struct editorConfig *UNUSED(ed), struct editorBuffer *buf) {
+	char error[80] = "";
+	uint8_t *query = editorPrompt(buf, "Grep for regexp: %s", PROMPT_BASIC,
+				      NULL);
+	if (query == NULL) {
+		editorSetStatusMessage("Canceled grep.");
+		return;
+	}
+	uint8_t *dir = editorPrompt(buf, "Grep in directory (RET for this "
+					 "one): %s",
+				    PROMPT_FILES, NULL);
+	if (dir == NULL) {
+		editorSetStatusMessage("Canceled grep.");
+		free(query);
+		return;
+	}
+	if (dir[0] == '\0') {
+		free(dir);
+		dir = (uint8_t *)defaultDir(buf);
+	}
+	size_t dirlen = strlen((char *)dir);
+	while (dirlen > 1 && dir[dirlen - 1] == '/')
+		dir[--dirlen] = '\0';
+	struct stat st;
+	if (stat((char *)dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		editorSetStatusMessage("%s is not a directory", dir);
+		free(query);
+		free(dir);
+		return;
+	}
+
+	grepCancel();
+	int n = grepWorkers();
+	struct matcher *m[GREP_MAX_WORKERS + 1] = { NULL };
+	for (int i = 0; i <= GREP_MAX_WORKERS; i++) {
+		if (i < n || i == GREP_MAX_WORKERS) {
+			m[i] = searchMatcherNew(query, 1, error,
+						sizeof(error));
+			if (!m[i])
+				break;
+		}
+	}
+	if (!m[GREP_MAX_WORKERS]) {
+		editorSetStatusMessage("Regex error: %s", error);
+		for (int i = 0; i <= GREP_MAX_WORKERS; i++)
+			searchMatcherFree(m[i]);
+		free(query);
+		free(dir);
+		return;
+	}
+
+	for (int i = 0; i <= GREP_MAX_WORKERS; i++) {
+		searchMatcherFree(grep.m[i]);
+		grep.m[i] = m[i];
+	}
+	free(grep.query);
+	free(grep.dir);
+	grep.query = (char *)query;
+	grep.dir = (char *)dir;
+
+	if (!grep.out) {
+		struct editorBuffer *out = newBuffer();
+		out->filename = xstrdup(GREP_BUFFER);
+		out->special_buffer = 1;
+		out->read_only = 1;
+		struct editorBuffer *last = E.headbuf;
+		while (last->next)
+			last = last->next;
+		last->next = out;
+		grep.out = out;
+	}
+	while (grep.out->numrows > 0)
+		editorDelRow(grep.out, grep.out->numrows - 1);
+	grep.out->cx = grep.out->cy = 0;
+	char header[256];
+	snprintf(header, sizeof(header), "grep for \"%s\" in %s", grep.query,
+		 grep.dir);
+	editorInsertRow(grep.out, 0, header, strlen(header));
+
+	LOCK();
+	grep.lines = grep.files = 0;
+	grep.cancel = 0;
+	grep.busy = 0;
+	pushPath(xstrdup(grep.dir), 1);
+	grep.active = 1;
+	clock_gettime(CLOCK_MONOTONIC, &grep.started);
+	grep.gen++;
+#ifndef EMSYS_DISABLE_THREADS
+	pthread_cond_broadcast(&grep_work);
+#endif
+	UNLOCK();
+
+	int idx = findBufferWindow(grep.out);
+	if (idx < 0)
+		idx = otherWindow(grep.out);
+	E.windows[idx]->cx = E.windows[idx]->cy = 0;
+	E.windows[idx]->rowoff = E.windows[idx]->lineoff = 0;
+	grepStep();
+}
+
+/*
+ * In *grep*, visit the file and line listed at point.  The name runs up
+ * to the first ":LINE:".  Returns 0 if bufr is not *grep*.
+ */
+int grepGoto(struct editorBuffer *bufr) {
+	if (bufr != grep.out)
+		return 0;
+	erow *row = bufr->cy < bufr->numrows ? &bufr->row[bufr->cy] : NULL;
+	int colon = -1, line = 0;
+	for (int i = 0; row && i < row->size && colon < 0; i++) {
+		if (row->chars[i] != ':')
+			continue;
+		int j = i + 1, n = 0;
+		while (j < row->size && row->chars[j] >= '0' &&
+		       row->chars[j] <= '9')
+			n = n * 10 + row->chars[j++] - '0';
+		if (j > i + 1 && j < row->size && row->chars[j] == ':' &&
+		    i > 0) {
+			colon = i;
+			line = n;
+		}
+	}
+	if (colon < 0 || line == 0) {
+		editorSetStatusMessage("No match on this line");
+		return 1;
+	}
+
+	/* Names under "." are as the user would type them */
+	size_t len = strlen(grep.dir) + colon + 2;
+	char *path = xmalloc(len);
+	if (strcmp(grep.dir, ".") == 0)
+		snprintf(path, len, "%.*s", colon, row->chars);
+	else
+		snprintf(path, len, "%s/%.*s", grep.dir, colon, row->chars);
+	struct editorBuffer *target = NULL;
+	for (struct editorBuffer *b = E.headbuf; b; b = b->next) {
+		if (b->filename && !b->special_buffer &&
+		    strcmp(b->filename, path) == 0) {
+			target = b;
+			break;
+		}
+	}
+	if (!target) {
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			editorSetStatusMessage("File %s is gone", path);
+			free(path);
+			return 1;
+		}
+		target = newBuffer();
+		editorOpen(target, path);
+		target->next = E.headbuf;
+		E.headbuf = target;
+	}
+	free(path);
+
+	int at = line - 1, s = 0, e;
+	if (at >= target->numrows)
+		at = target->numrows > 0 ? target->numrows - 1 : 0;
+	if (at < target->numrows &&
+	    !searchMatcherNext(grep.m[GREP_MAX_WORKERS], target, at, 0, &s,
+			       &e))
+		s = 0;
+
+	/* Leave *grep* in view */
+	focusOtherWindow(target, at, s);
+	return 1;
+}
+
+/* buf is being killed: stop the walk if it is *grep* */
+void grepForgetBuffer(struct editorBuffer *buf) {
+	if (buf != grep.out)
+		return;
+	grepCancel();
+	grep.out = NULL;
+}
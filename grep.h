@@ -0,0 +1,11 @@
+#ifndef EMSYS_GREP_H
+#define EMSYS_GREP_H
+#include "emsys.h"
+
+void editorGrep(struct editorConfig *ed, struct editorBuffer *buf);
+int grepRunning(void);
+void grepStep(void);
+int grepGoto(struct editorBuffer *bufr);
+void grepForgetBuffer(struct editorBuffer *buf);
+
+#endif
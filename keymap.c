@@ -17,12 +17,15 @@
 #include "util.h"
 #include "fileio.h"
 #include "find.h"
+#include "grep.h"
+#include "occur.h"
 #include "pipe.h"
 #include "region.h"
 #include "register.h"
 #include "buffer.h"
 #include "completion.h"
 #include "transform.h"
+#include "trigram.h"
 #include "undo.h"
 #include "unicode.h"
 #include "unused.h"
@@ -50,16 +53,24 @@ static int compare_commands(const void *a, const void *b) {
 void setupCommands(struct editorConfig *ed) {
 	static struct editorCommand commands[] = {
 		{ "capitalize-region", editorCapitalizeRegion },
+		{ "count-matches", editorCountMatches },
+		{ "font-lock-mode", editorToggleSyntaxWrapper },
+		{ "grep", editorGrep },
 		{ "indent-spaces", editorIndentSpaces },
 		{ "indent-tabs", editorIndentTabs },
 		{ "insert-file", editorInsertFile },
 		{ "isearch-forward-regexp", editorRegexFindWrapper },
 		{ "kanaya", editorCapitalizeRegion },
+		{ "multi-occur", editorMultiOccur },
+		{ "occur", editorOccur },
 		{ "query-replace", editorQueryReplace },
 		{ "replace-regexp", editorReplaceRegex },
 		{ "replace-string", editorReplaceString },
 		{ "revert", editorRevert },
+		{ "toggle-case-fold-search", editorToggleCaseFold },
 		{ "toggle-truncate-lines", editorToggleTruncateLinesWrapper },
+		{ "trigram-index", editorTrigramIndex },
+		{ "trigram-index-stats", editorTrigramIndexStats },
 		{ "version", editorVersionWrapper },
 		{ "view-register", editorViewRegister },
 		{ "whitespace-cleanup", editorWhitespaceCleanup },
@@ -489,9 +500,16 @@ void editorProcessKeypress(int c) {
 	int uarg = E.uarg;
 
 	switch (c) {
-	case '\r':
-		editorInsertNewline(E.buf, uarg);
+	case '\r': {
+		if (occurGoto(E.buf) || grepGoto(E.buf))
+			break;
+		int count = uarg ? uarg : 1;
+		for (int i = 0; i < count; i++) {
+			editorUndoAppendChar(E.buf, '\n');
+			editorInsertNewline(E.buf, 1);
+		}
 		break;
+	}
 	case BACKSPACE:
 	case CTRL('h'):
 		editorBackSpace(E.buf, uarg);
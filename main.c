@@ -28,6 +28,9 @@
 #include "terminal.h"
 #include "display.h"
 #include "keymap.h"
+#include "grep.h"
+#include "occur.h"
+#include "trigram.h"
 #include "util.h"
 
 const int page_overlap = 2;
@@ -147,6 +150,19 @@ int main(int argc, char *argv[]) {
 
 	for (;;) {
 		refreshScreen();
+		/* occur and grep search in between keys, showing their lines
+		 * as they go, and trigram indexes are built and kept up to
+		 * date */
+		while (!editorInputPending() &&
+		       (occurScanning() || grepRunning() || trigramPending())) {
+			if (occurScanning())
+				occurStep();
+			else if (grepRunning())
+				grepStep();
+			else
+				trigramStep();
+			refreshScreen();
+		}
 
 		int c = editorReadKey();
 		if (c == MACRO_RECORD) {
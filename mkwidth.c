@@ -0,0 +1,97 @@
+/*
+ * mkwidth - generate widthtab.h, the two-stage width table used by
+ * ucsWidth() in unicode.c.
+ *
+ * The widths come from mk_wcwidth() in wcwidth.c, which holds the
+ * Unicode combining and East Asian wide ranges plus the emoji block
+ * generated from txt/emoji-sequences.txt (see HACKING.md), so there is
+ * still only one place to update when the Unicode data changes.
+ *
+ * Code points are split into pages of 256.  Stage one maps a page number
+ * to a leaf; stage two holds each distinct leaf once, packed four widths
+ * to a byte.  The Makefile runs this at build time:
+ *
+ *     ./mkwidth > widthtab.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wcwidth.h"
+
+#define MAX_UCS 0x110000
+#define PAGE_SIZE 256
+#define NPAGES (MAX_UCS / PAGE_SIZE)
+#define LEAF_BYTES (PAGE_SIZE / 4)
+
+static unsigned char leaves[NPAGES][LEAF_BYTES];
+static int page_leaf[NPAGES];
+
+/* 2-bit codes: widths 0, 1 and 2 as themselves, -1 as 3 */
+static int encode(int width) {
+	switch (width) {
+	case 0:
+	case 1:
+	case 2:
+		return width;
+	case -1:
+		return 3;
+	default:
+		fprintf(stderr, "mkwidth: unexpected width %d\n", width);
+		exit(1);
+	}
+}
+
+int main(void) {
+	int nleaves = 0;
+
+	for (int page = 0; page < NPAGES; page++) {
+		unsigned char leaf[LEAF_BYTES];
+		memset(leaf, 0, sizeof(leaf));
+		for (int i = 0; i < PAGE_SIZE; i++) {
+			int code = encode(mk_wcwidth(page * PAGE_SIZE + i));
+			leaf[i / 4] |= code << ((i % 4) * 2);
+		}
+
+		int found = -1;
+		for (int j = 0; j < nleaves; j++) {
+			if (memcmp(leaves[j], leaf, LEAF_BYTES) == 0) {
+				found = j;
+				break;
+			}
+		}
+		if (found < 0) {
+			found = nleaves++;
+			memcpy(leaves[found], leaf, LEAF_BYTES);
+		}
+		page_leaf[page] = found;
+	}
+
+	if (nleaves > 256) {
+		fprintf(stderr, "mkwidth: %d leaves do not fit a byte index\n",
+			nleaves);
+		return 1;
+	}
+
+	printf("/* Generated by mkwidth from wcwidth.c - do not edit. */\n");
+	printf("#define WIDTH_TABLE_LIMIT 0x%X\n\n", MAX_UCS);
+	printf("static const unsigned char width_pages[%d] = {", NPAGES);
+	for (int page = 0; page < NPAGES; page++) {
+		printf("%s%d,", page % 16 ? " " : "\n\t", page_leaf[page]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const unsigned char width_leaves[%d][%d] = {", nleaves,
+	       LEAF_BYTES);
+	for (int j = 0; j < nleaves; j++) {
+		printf("\n\t{");
+		for (int i = 0; i < LEAF_BYTES; i++) {
+			printf("%s0x%02X,", i % 8 ? " " : "\n\t\t",
+			       leaves[j][i]);
+		}
+		printf("\n\t},");
+	}
+	printf("\n};\n");
+
+	return 0;
+}
@@ -0,0 +1,300 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emsys.h"
+#include "buffer.h"
+#include "display.h"
+#include "occur.h"
+#include "prompt.h"
+#include "search.h"
+#include "unused.h"
+#include "util.h"
+
+extern struct editorConfig E;
+
+/*
+ * occur lists the lines of the buffer that match a regexp in *Occur*,
+ * and multi-occur those of every buffer.  The buffers are scanned in
+ * between keys a slice at a time, so a big one does not hold up typing,
+ * and the lines found go into *Occur* as each slice ends.  The lines of
+ * each buffer come under a header naming it, and RET on one of them goes
+ * to it; the header and the line number are all it takes, so nothing
+ * has to be kept in step with the rows of *Occur*.
+ */
+
+#define OCCUR_BUFFER "*Occur*"
+#define OCCUR_HEADER " in buffer: "
+#define OCCUR_SLICE_NANOS 20000000L /* scanning between screen updates */
+#define OCCUR_CLOCK_ROWS 256 /* rows scanned between looks at the clock */
+
+static struct {
+	int scanning;
+	struct editorBuffer *out; /* *Occur* */
+	struct matcher *m; /* kept after the scan to find the match again */
+	char *regex;
+	struct editorBuffer **bufs; /* still to scan; NULL once killed */
+	int nbufs;
+	int cur;
+	int row; /* next row of bufs[cur] to look at */
+	int header; /* row of out that heads the lines of bufs[cur] */
+	char *name; /* of bufs[cur] */
+	long found; /* lines of bufs[cur] listed */
+	long total;
+} occur;
+
+static long nanosSince(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+	       (now.tv_nsec - start->tv_nsec);
+}
+
+static const char *bufferName(struct editorBuffer *buf) {
+	return buf->filename ? buf->filename : "*scratch*";
+}
+
+static void setRow(struct editorBuffer *buf, int at, const char *text) {
+	if (at >= buf->numrows)
+		return;
+	editorDelRow(buf, at);
+	editorInsertRow(buf, at, (char *)text, strlen(text));
+}
+
+/* Head the lines of the next buffer with a header, or finish */
+static void startBuffer(void) {
+	char header[256];
+	free(occur.name);
+	occur.name = NULL;
+	occur.row = 0;
+	occur.found = 0;
+	while (occur.cur < occur.nbufs && !occur.bufs[occur.cur])
+		occur.cur++;
+	if (occur.cur >= occur.nbufs)
+		return;
+	occur.name = xstrdup(bufferName(occur.bufs[occur.cur]));
+	snprintf(header, sizeof(header), "Searching for \"%s\"" OCCUR_HEADER
+		 "%s", occur.regex, occur.name);
+	occur.header = occur.out->numrows;
+	editorInsertRow(occur.out, occur.header, header, strlen(header));
+}
+
+/* Count up the lines listed under the header, or drop it if none were */
+static void finishBuffer(void) {
+	char header[256];
+	if (occur.found == 0) {
+		if (occur.header < occur.out->numrows)
+			editorDelRow(occur.out, occur.header);
+	} else {
+		snprintf(header, sizeof(header),
+			 "%ld matching line%s for \"%s\"" OCCUR_HEADER "%s",
+			 occur.found, occur.found == 1 ? "" : "s", occur.regex,
+			 occur.name);
+		setRow(occur.out, occur.header, header);
+	}
+	occur.cur++;
+	startBuffer();
+}
+
+static void stopScan(void) {
+	free(occur.bufs);
+	occur.bufs = NULL;
+	occur.nbufs = 0;
+	free(occur.name);
+	occur.name = NULL;
+	occur.scanning = 0;
+}
+
+int occurScanning(void) {
+	return occur.scanning;
+}
+
+/* Scan for a slice of time, listing the matching lines found */
+void occurStep(void) {
+	struct timespec start;
+	struct abuf line = ABUF_INIT;
+	char number[16];
+	int s, e;
+
+	if (!occur.scanning)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 1; occur.cur < occur.nbufs; n++) {
+		struct editorBuffer *buf = occur.bufs[occur.cur];
+		if (!buf || occur.row >= buf->numrows) {
+			finishBuffer();
+			continue;
+		}
+		if (searchMatcherNext(occur.m, buf, occur.row, 0, &s, &e)) {
+			erow *row = &buf->row[occur.row];
+			int len = snprintf(number, sizeof(number), "%7d:",
+					   occur.row + 1);
+			line.len = 0;
+			abAppend(&line, number, len);
+			abAppend(&line, (char *)row->chars, row->size);
+			editorInsertRow(occur.out, occur.out->numrows, line.b,
+					line.len);
+			occur.found++;
+			occur.total++;
+		}
+		occur.row++;
+		if (n % OCCUR_CLOCK_ROWS == 0 &&
+		    nanosSince(&start) > OCCUR_SLICE_NANOS)
+			break;
+	}
+	abFree(&line);
+	occur.out->dirty = 0; /* there is no file to save it to */
+
+	if (occur.cur < occur.nbufs) {
+		editorSetStatusMessage("Searching... %ld matching line%s so far",
+				       occur.total, occur.total == 1 ? "" : "s");
+		return;
+	}
+	if (occur.total == 0)
+		editorSetStatusMessage("No matches for \"%s\"", occur.regex);
+	else
+		editorSetStatusMessage("%ld matching line%s for \"%s\"",
+				       occur.total, occur.total == 1 ? "" : "s",
+				       occur.regex);
+	stopScan();
+}
+
+static void startOccur(struct editorBuffer *buf, int all) {
+	char error[80] = "";
+	uint8_t *regex = editorPrompt(
+		buf,
+		all ? "List lines in all buffers matching regexp: %s" :
+		      "List lines matching regexp: %s",
+		PROMPT_BASIC, NULL);
+	if (regex == NULL) {
+		editorSetStatusMessage(all ? "Canceled multi-occur." :
+					     "Canceled occur.");
+		return;
+	}
+	struct matcher *m = searchMatcherNew(regex, 1, error, sizeof(error));
+	if (!m) {
+		editorSetStatusMessage("Regex error: %s", error);
+		free(regex);
+		return;
+	}
+
+	stopScan();
+	searchMatcherFree(occur.m);
+	free(occur.regex);
+	occur.m = m;
+	occur.regex = (char *)regex;
+
+	if (!occur.out) {
+		struct editorBuffer *out = newBuffer();
+		out->filename = xstrdup(OCCUR_BUFFER);
+		out->special_buffer = 1;
+		out->read_only = 1;
+		struct editorBuffer *last = E.headbuf;
+		while (last->next)
+			last = last->next;
+		last->next = out;
+		occur.out = out;
+	}
+	while (occur.out->numrows > 0)
+		editorDelRow(occur.out, occur.out->numrows - 1);
+	occur.out->cx = occur.out->cy = 0;
+
+	for (struct editorBuffer *b = E.headbuf; b; b = b->next) {
+		if (b == occur.out || (!all && b != buf))
+			continue;
+		occur.bufs = xrealloc(occur.bufs,
+				      (occur.nbufs + 1) * sizeof(*occur.bufs));
+		occur.bufs[occur.nbufs++] = b;
+	}
+	occur.cur = 0;
+	occur.total = 0;
+	occur.scanning = 1;
+	startBuffer();
+
+	int idx = findBufferWindow(occur.out);
+	if (idx < 0)
+		idx = otherWindow(occur.out);
+	E.windows[idx]->cx = E.windows[idx]->cy = 0;
+	E.windows[idx]->rowoff = E.windows[idx]->lineoff = 0;
+	occurStep();
+}
+
+void editorOccur(struct editorConfig *UNUSED(ed), struct editorBuffer *buf) {
+	startOccur(buf, 0);
+}
+
+void editorMultiOccur(struct editorConfig *UNUSED(ed),
+		      struct editorBuffer *buf) {
+	startOccur(buf, 1);
+}
+
+/* The line number a row of *Occur* lists, or 0 for a header */
+static int listedLine(erow *row) {
+	int i = 0, n = 0;
+	while (i < row->size && row->chars[i] == ' ')
+		i++;
+	if (i == row->size || row->chars[i] < '0' || row->chars[i] > '9')
+		return 0;
+	while (i < row->size && row->chars[i] >= '0' && row->chars[i] <= '9')
+		n = n * 10 + row->chars[i++] - '0';
+	return i < row->size && row->chars[i] == ':' ? n : 0;
+}
+
+/*
+ * In *Occur*, go to the line listed at point in the buffer named by the
+ * header above it.  Returns 0 if bufr is not *Occur*.
+ */
+int occurGoto(struct editorBuffer *bufr) {
+	if (bufr != occur.out)
+		return 0;
+	int line = bufr->cy < bufr->numrows ? listedLine(&bufr->row[bufr->cy]) :
+					      0;
+	if (line == 0) {
+		editorSetStatusMessage("No occurrence on this line");
+		return 1;
+	}
+	int at = bufr->cy;
+	while (at > 0 && listedLine(&bufr->row[at]))
+		at--;
+	const char *header = (char *)bufr->row[at].chars, *name = NULL;
+	for (const char *p = header; (p = strstr(p, OCCUR_HEADER)); p++)
+		name = p + strlen(OCCUR_HEADER);
+
+	struct editorBuffer *target = NULL;
+	for (struct editorBuffer *b = E.headbuf; b && name; b = b->next) {
+		if (b != occur.out && strcmp(bufferName(b), name) == 0) {
+			target = b;
+			break;
+		}
+	}
+	if (!target) {
+		editorSetStatusMessage("Buffer %s is gone", name ? name : "");
+		return 1;
+	}
+
+	int row = line - 1, s = 0, e;
+	if (row >= target->numrows)
+		row = target->numrows > 0 ? target->numrows - 1 : 0;
+	if (row < target->numrows && occur.m &&
+	    !searchMatcherNext(occur.m, target, row, 0, &s, &e))
+		s = 0;
+
+	/* Leave *Occur* in view */
+	focusOtherWindow(target, row, s);
+	return 1;
+}
+
+/* buf is being killed: stop listing its lines, or all of them if it is
+ * *Occur* itself */
+void occurForgetBuffer(struct editorBuffer *buf) {
+	if (buf == occur.out) {
+		stopScan();
+		occur.out = NULL;
+		return;
+	}
+	for (int i = 0; i < occur.nbufs; i++) {
+		if (occur.bufs[i] == buf)
+			occur.bufs[i] = NULL;
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef EMSYS_OCCUR_H
+#define EMSYS_OCCUR_H
+#include "emsys.h"
+
+void editorOccur(struct editorConfig *ed, struct editorBuffer *buf);
+void editorMultiOccur(struct editorConfig *ed, struct editorBuffer *buf);
+int occurScanning(void);
+void occurStep(void);
+int occurGoto(struct editorBuffer *bufr);
+void occurForgetBuffer(struct editorBuffer *buf);
+
+#endif
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "output.h"
+#include "unicode.h"
+#include "util.h"
+
+/*
+ * Screen output encoding.
+ *
+ * refreshScreen draws every frame in full, which on a slow link is mostly
+ * the same bytes again.  Instead each frame is played on a model of the
+ * screen, and only the cells that differ from what the terminal already
+ * shows are sent, with whichever cursor motion, erase or repeat sequence
+ * is shortest.  Everything sent is played on the model too, so it stays
+ * what the terminal shows.  A frame the model does not understand is sent
+ * as it is, and the next one repaints the screen.
+ */
+
+#define ATTR_BOLD 1
+#define ATTR_UNDERLINE 2
+#define ATTR_REVERSE 4
+#define ATTR_FG_SHIFT 3 /* 0 default, 1-8 for SGR 30-37, 9-16 for 90-97 */
+
+static const struct vtCell blank = { " ", 1, 1, 0 };
+
+/* (Re)size s to a blank screen with the cursor somewhere unknown.  s must
+ * be zeroed or have been through vtInit before. */
+void vtInit(struct vtScreen *s, int rows, int cols) {
+	if (rows < 1)
+		rows = 1;
+	if (cols < 1)
+		cols = 1;
+	if (s->rows * s->cols != rows * cols)
+		s->cells = xrealloc(s->cells,
+				    (size_t)rows * cols * sizeof(struct vtCell));
+	s->rows = rows;
+	s->cols = cols;
+	for (int i = 0; i < rows * cols; i++)
+		s->cells[i] = blank;
+	s->y = 0;
+	s->x = 0;
+	s->cursor_known = 0;
+	s->cursor_visible = 1;
+	s->attr = 0;
+	s->last.len = 0;
+}
+
+void vtFree(struct vtScreen *s) {
+	free(s->cells);
+	s->cells = NULL;
+	s->rows = s->cols = 0;
+}
+
+static int cellEqual(const struct vtCell *a, const struct vtCell *b) {
+	return a->len == b->len && a->width == b->width &&
+	       a->attr == b->attr && memcmp(a->ch, b->ch, a->len) == 0;
+}
+
+/* Blank columns [from, to) of row y; a wide character cut in half by
+ * either edge goes entirely, as it does on a terminal */
+static void eraseCells(struct vtScreen *s, int y, int from, int to) {
+	struct vtCell *row = &s->cells[y * s->cols];
+	if (from > 0 && from < s->cols && row[from].width == 0)
+		row[from - 1] = blank;
+	if (to < s->cols && row[to].width == 0)
+		row[to] = blank;
+	for (int x = from; x < to; x++)
+		row[x] = blank;
+}
+
+static void putChar(struct vtScreen *s, const uint8_t *ch, int len,
+		    int width) {
+	struct vtCell *row = &s->cells[s->y * s->cols];
+	int x = s->x;
+
+	if (row[x].width == 0 && x > 0)
+		row[x - 1] = blank;
+	if (x + width < s->cols && row[x + width].width == 0)
+		row[x + width] = blank;
+
+	struct vtCell *c = &row[x];
+	memcpy(c->ch, ch, len);
+	c->len = len;
+	c->width = width;
+	c->attr = s->attr;
+	/* Spaces only show underline and reverse video */
+	if (len == 1 && ch[0] == ' ' &&
+	    !(s->attr & (ATTR_UNDERLINE | ATTR_REVERSE)))
+		c->attr = 0;
+	if (width == 2) {
+		row[x + 1].len = 0;
+		row[x + 1].width = 0;
+		row[x + 1].attr = c->attr;
+	}
+	s->last = *c;
+	s->x += width;
+}
+
+static int setAttributes(struct vtScreen *s, const int *params, int n) {
+	for (int i = 0; i < n; i++) {
+		int p = params[i];
+		int fg = -1;
+		if (p == 0)
+			s->attr = 0;
+		else if (p == 1)
+			s->attr |= ATTR_BOLD;
+		else if (p == 4)
+			s->attr |= ATTR_UNDERLINE;
+		else if (p == 7)
+			s->attr |= ATTR_REVERSE;
+		else if (p == 22)
+			s->attr &= ~ATTR_BOLD;
+		else if (p == 24)
+			s->attr &= ~ATTR_UNDERLINE;
+		else if (p == 27)
+			s->attr &= ~ATTR_REVERSE;
+		else if (p >= 30 && p <= 37)
+			fg = p - 30 + 1;
+		else if (p == 39)
+			fg = 0;
+		else if (p >= 90 && p <= 97)
+			fg = p - 90 + 9;
+		else
+			return 0;
+		if (fg >= 0)
+			s->attr = (s->attr & ((1 << ATTR_FG_SHIFT) - 1)) |
+				  fg << ATTR_FG_SHIFT;
+	}
+	return 1;
+}
+
+/* Play the control sequence at seq; returns its length, 0 if not known */
+static int feedSequence(struct vtScreen *s, const uint8_t *seq, int len) {
+	int params[16] = { 0 };
+	int nparams = 1;
+	int private = 0, intermediate = 0;
+	int i = 2;
+
+	if (len < 3 || seq[1] != '[')
+		return 0;
+	if (seq[i] == '?') {
+		private = 1;
+		i++;
+	}
+	while (i < len && ((seq[i] >= '0' && seq[i] <= '9') || seq[i] == ';')) {
+		if (seq[i] == ';') {
+			if (nparams == 16)
+				return 0;
+			nparams++;
+		} else if (params[nparams - 1] < 100000) {
+			params[nparams - 1] =
+				params[nparams - 1] * 10 + seq[i] - '0';
+		}
+		i++;
+	}
+	while (i < len && seq[i] >= 0x20 && seq[i] <= 0x2f)
+		intermediate = seq[i++];
+	if (i >= len || seq[i] < 0x40 || seq[i] > 0x7e)
+		return 0;
+	int final = seq[i++];
+	int n = params[0] ? params[0] : 1;
+
+	if (intermediate)
+		return 0;
+	if (private) {
+		if (final != 'h' && final != 'l')
+			return 0;
+		for (int k = 0; k < nparams; k++) {
+			if (params[k] == 25)
+				s->cursor_visible = final == 'h';
+			else if (params[k] != 2026)
+				return 0;
+		}
+		return i;
+	}
+	if (final == 'm')
+		return setAttributes(s, params, nparams) ? i : 0;
+	if (final == 'H' || final == 'f') {
+		s->y = (params[0] ? params[0] : 1) - 1;
+		s->x = (nparams > 1 && params[1] ? params[1] : 1) - 1;
+		if (s->y >= s->rows)
+			s->y = s->rows - 1;
+		if (s->x >= s->cols)
+			s->x = s->cols - 1;
+		s->cursor_known = 1;
+		return i;
+	}
+
+	if (!s->cursor_known)
+		return 0;
+	/* Erasing with underline or reverse video on is up to the terminal */
+	if ((final == 'K' || final == 'J' || final == 'X') &&
+	    (s->attr & (ATTR_UNDERLINE | ATTR_REVERSE)))
+		return 0;
+
+	switch (final) {
+	case 'K':
+		if (params[0] != 0)
+			return 0;
+		/* After the last column, EL has nothing left to erase */
+		if (s->x < s->cols)
+			eraseCells(s, s->y, s->x, s->cols);
+		return i;
+	case 'J':
+		if (params[0] == 2) {
+			for (int y = 0; y < s->rows; y++)
+				eraseCells(s, y, 0, s->cols);
+			return i;
+		}
+		if (params[0] != 0)
+			return 0;
+		if (s->x < s->cols)
+			eraseCells(s, s->y, s->x, s->cols);
+		for (int y = s->y + 1; y < s->rows; y++)
+			eraseCells(s, y, 0, s->cols);
+		return i;
+	}
+
+	/* What follows is ambiguous right after the last column */
+	if (s->x >= s->cols)
+		return 0;
+	switch (final) {
+	case 'A':
+		s->y = s->y - n < 0 ? 0 : s->y - n;
+		return i;
+	case 'B':
+		s->y = s->y + n >= s->rows ? s->rows - 1 : s->y + n;
+		return i;
+	case 'C':
+		s->x = s->x + n >= s->cols ? s->cols - 1 : s->x + n;
+		return i;
+	case 'D':
+		s->x = s->x - n < 0 ? 0 : s->x - n;
+		return i;
+	case 'X':
+		eraseCells(s, s->y, s->x,
+			   s->x + n > s->cols ? s->cols : s->x + n);
+		return i;
+	case 'b':
+		if (s->last.len == 0 || s->last.width != 1 ||
+		    s->x + n > s->cols)
+			return 0;
+		for (int k = 0; k < n; k++)
+			putChar(s, s->last.ch, s->last.len, 1);
+		return i;
+	}
+	return 0;
+}
+
+/* Play seq on s; returns 0 if it holds anything s cannot follow */
+int vtFeed(struct vtScreen *s, const char *seq, int len) {
+	const uint8_t *p = (const uint8_t *)seq;
+	int i = 0;
+
+	while (i < len) {
+		uint8_t c = p[i];
+		if (c == 033) {
+			int n = feedSequence(s, &p[i], len - i);
+			if (n == 0)
+				return 0;
+			i += n;
+			continue;
+		}
+		if (!s->cursor_known)
+			return 0;
+		if (c == '\r') {
+			s->x = 0;
+			i++;
+			continue;
+		}
+		if (c == '\n') {
+			/* Scrolling is never wanted */
+			if (s->x >= s->cols || s->y >= s->rows - 1)
+				return 0;
+			s->y++;
+			i++;
+			continue;
+		}
+		if (c < 0x20 || c == 0x7f)
+			return 0;
+
+		int n = utf8_nBytes(c);
+		if (i + n > len)
+			return 0;
+		for (int k = 1; k < n; k++) {
+			if (!utf8_isCont(p[k + i]))
+				return 0;
+		}
+		int width = c < 0x80 ? 1 : charInStringWidth((uint8_t *)p, i);
+		if (width < 0)
+			return 0;
+		if (width == 0) {
+			/* Combining mark: goes with the character before */
+			int x = s->x - 1;
+			struct vtCell *row = &s->cells[s->y * s->cols];
+			if (x >= 0 && row[x].width == 0)
+				x--;
+			if (x < 0 || row[x].len + n > VT_CELL_BYTES)
+				return 0;
+			memcpy(&row[x].ch[row[x].len], &p[i], n);
+			row[x].len += n;
+		} else {
+			if (s->x + width > s->cols)
+				return 0;
+			putChar(s, &p[i], n, width);
+		}
+		i += n;
+	}
+	return 1;
+}
+
+static int digits(int n) {
+	int d = 1;
+	while (n >= 10) {
+		n /= 10;
+		d++;
+	}
+	return d;
+}
+
+/* Send s, keeping the model of the terminal in step */
+static void emit(struct outputEncoder *enc, struct abuf *ab, const char *s,
+		 int len) {
+	abAppend(ab, s, len);
+	if (!vtFeed(&enc->front, s, len))
+		enc->valid = 0;
+}
+
+static int fgParam(int fg) {
+	if (fg == 0)
+		return 39;
+	return fg <= 8 ? 30 + fg - 1 : 90 + fg - 9;
+}
+
+/* Shortest SGR sequence taking attributes from to to */
+static int sgrSequence(uint16_t from, uint16_t to, char *buf, int size) {
+	char reset[32], change[32];
+	int rlen, clen;
+	int fg_from = from >> ATTR_FG_SHIFT, fg_to = to >> ATTR_FG_SHIFT;
+
+	if (from == to)
+		return 0;
+
+	rlen = snprintf(reset, sizeof(reset), "\x1b[%s", to ? "0" : "");
+	if (to & ATTR_BOLD)
+		rlen += snprintf(&reset[rlen], sizeof(reset) - rlen, ";1");
+	if (to & ATTR_UNDERLINE)
+		rlen += snprintf(&reset[rlen], sizeof(reset) - rlen, ";4");
+	if (to & ATTR_REVERSE)
+		rlen += snprintf(&reset[rlen], sizeof(reset) - rlen, ";7");
+	if (fg_to)
+		rlen += snprintf(&reset[rlen], sizeof(reset) - rlen, ";%d",
+				 fgParam(fg_to));
+	rlen += snprintf(&reset[rlen], sizeof(reset) - rlen, "m");
+
+	clen = snprintf(change, sizeof(change), "\x1b[");
+	const char *sep = "";
+	for (int bit = ATTR_BOLD; bit <= ATTR_REVERSE; bit <<= 1) {
+		static const int on[] = { 0, 1, 4, 0, 7 };
+		static const int off[] = { 0, 22, 24, 0, 27 };
+		if ((from ^ to) & bit) {
+			clen += snprintf(&change[clen], sizeof(change) - clen,
+					 "%s%d", sep,
+					 to & bit ? on[bit] : off[bit]);
+			sep = ";";
+		}
+	}
+	if (fg_from != fg_to)
+		clen += snprintf(&change[clen], sizeof(change) - clen, "%s%d",
+				 sep, fgParam(fg_to));
+	clen += snprintf(&change[clen], sizeof(change) - clen, "m");
+
+	if (clen < rlen) {
+		snprintf(buf, size, "%s", change);
+		return clen;
+	}
+	snprintf(buf, size, "%s", reset);
+	return rlen;
+}
+
+static void setAttr(struct outputEncoder *enc, struct abuf *ab,
+		    uint16_t attr) {
+	char buf[32];
+	int len = sgrSequence(enc->front.attr, attr, buf, sizeof(buf));
+	if (len)
+		emit(enc, ab, buf, len);
+}
+
+/* Relative motion by dy rows, then from column x to tx on that row */
+static int relativeMove(char *buf, int dy, int x, int tx) {
+	int len = 0;
+	if (dy > 0 && dy <= 3) {
+		/* Raw mode LF: down one row, same column */
+		for (int i = 0; i < dy; i++)
+			buf[len++] = '\n';
+	} else if (dy != 0) {
+		int n = dy > 0 ? dy : -dy;
+		len += n == 1 ? sprintf(buf, "\x1b[%c", dy > 0 ? 'B' : 'A') :
+				sprintf(buf, "\x1b[%d%c", n,
+					dy > 0 ? 'B' : 'A');
+	}
+	if (tx != x) {
+		int n = tx > x ? tx - x : x - tx;
+		char dir = tx > x ? 'C' : 'D';
+		len += n == 1 ? sprintf(&buf[len], "\x1b[%c", dir) :
+				sprintf(&buf[len], "\x1b[%d%c", n, dir);
+	}
+	return len;
+}
+
+static void moveTo(struct outputEncoder *enc, struct abuf *ab, int ty,
+		   int tx) {
+	struct vtScreen *f = &enc->front;
+	char best[48], buf[48];
+	int bestlen, len;
+
+	if (f->cursor_known && f->y == ty && f->x == tx)
+		return;
+
+	if (tx == 0)
+		bestlen = ty == 0 ? sprintf(best, "\x1b[H") :
+				    sprintf(best, "\x1b[%dH", ty + 1);
+	else
+		bestlen = sprintf(best, "\x1b[%d;%dH", ty + 1, tx + 1);
+
+	if (f->cursor_known) {
+		/* Carriage return first, which also leaves the last column */
+		buf[0] = '\r';
+		len = 1 + relativeMove(&buf[1], ty - f->y, 0, tx);
+		if (len < bestlen) {
+			memcpy(best, buf, len);
+			bestlen = len;
+		}
+	}
+	if (f->cursor_known && f->x < f->cols) {
+		len = relativeMove(buf, ty - f->y, f->x, tx);
+		if (len < bestlen) {
+			memcpy(best, buf, len);
+			bestlen = len;
+		}
+
+		/* Or write out again what is already there */
+		if (ty == f->y && tx > f->x) {
+			struct vtCell *row = &f->cells[ty * f->cols];
+			int x = f->x;
+			len = 0;
+			while (x < tx && len < bestlen) {
+				if (row[x].width == 0 || row[x].attr != f->attr ||
+				    len + row[x].len >= bestlen)
+					break;
+				memcpy(&buf[len], row[x].ch, row[x].len);
+				len += row[x].len;
+				x += row[x].width;
+			}
+			if (x == tx && len < bestlen) {
+				memcpy(best, buf, len);
+				bestlen = len;
+			}
+		}
+	}
+	emit(enc, ab, best, bestlen);
+}
+
+/* Number of blank cells from x on */
+static int blankRun(const struct vtCell *row, int x, int cols) {
+	int n = 0;
+	while (x + n < cols && cellEqual(&row[x + n], &blank))
+		n++;
+	return n;
+}
+
+void outputInvalidate(struct outputEncoder *enc) {
+	enc->valid = 0;
+	enc->front.cursor_known = 0;
+}
+
+/*
+ * Append to ab what turns the terminal into frame drawn on it.  A full
+ * frame draws every cell; anything else, such as a lone cursor motion,
+ * is only worked out against a screen known to be up to date.
+ */
+void outputEncode(struct outputEncoder *enc, const char *frame, int len,
+		  int rows, int cols, int full, struct abuf *ab) {
+	struct vtScreen *f = &enc->front, *b = &enc->back;
+
+	if (f->rows != rows || f->cols != cols) {
+		vtInit(f, rows, cols);
+		enc->valid = 0;
+	}
+	if (!enc->valid && !full) {
+		abAppend(ab, frame, len);
+		f->cursor_known = 0;
+		return;
+	}
+
+	/* Over an unknown screen the frame is drawn on a cleared one */
+	if (!enc->valid || b->rows != rows || b->cols != cols)
+		vtInit(b, rows, cols);
+	if (enc->valid) {
+		memcpy(b->cells, f->cells,
+		       (size_t)rows * cols * sizeof(struct vtCell));
+		b->y = f->y;
+		b->x = f->x;
+		b->cursor_known = f->cursor_known;
+		b->cursor_visible = f->cursor_visible;
+		b->attr = f->attr;
+		b->last = f->last;
+	}
+	if (!vtFeed(b, frame, len)) {
+		abAppend(ab, frame, len);
+		outputInvalidate(enc);
+		return;
+	}
+
+	if (!enc->valid) {
+		vtInit(f, rows, cols);
+		f->cursor_visible = 0;
+		abAppend(ab, "\x1b[?25l\x1b[m\x1b[H\x1b[2J", 16);
+		f->cursor_known = 1;
+		enc->valid = 1;
+	}
+
+	for (int y = 0; y < rows; y++) {
+		struct vtCell *fr = &f->cells[y * cols];
+		const struct vtCell *br = &b->cells[y * cols];
+		int x = 0;
+
+		while (x < cols) {
+			if (cellEqual(&fr[x], &br[x])) {
+				x++;
+				continue;
+			}
+			if (br[x].width == 0 && x > 0)
+				x--;
+			if (f->cursor_visible)
+				emit(enc, ab, "\x1b[?25l", 6);
+
+			int blanks = blankRun(br, x, cols);
+			if (x + blanks == cols) {
+				moveTo(enc, ab, y, x);
+				setAttr(enc, ab, 0);
+				emit(enc, ab, "\x1b[K", 3);
+				break;
+			}
+			if (2 * (3 + digits(blanks)) < blanks) {
+				char buf[16];
+				moveTo(enc, ab, y, x);
+				setAttr(enc, ab, 0);
+				emit(enc, ab, buf,
+				     sprintf(buf, "\x1b[%dX", blanks));
+				x += blanks;
+				continue;
+			}
+
+			moveTo(enc, ab, y, x);
+			setAttr(enc, ab, br[x].attr);
+			emit(enc, ab, (const char *)br[x].ch, br[x].len);
+			if (enc->rep && br[x].width == 1 && br[x].len == 1 &&
+			    br[x].ch[0] < 0x80) {
+				int run = 0;
+				while (x + 1 + run < cols &&
+				       cellEqual(&br[x + 1 + run], &br[x]))
+					run++;
+				if (run > 3 + digits(run)) {
+					char buf[16];
+					emit(enc, ab, buf,
+					     sprintf(buf, "\x1b[%db", run));
+					x += run;
+				}
+			}
+			x += br[x].width ? br[x].width : 1;
+		}
+	}
+
+	if (b->cursor_known && b->x < cols)
+		moveTo(enc, ab, b->y, b->x);
+	setAttr(enc, ab, b->attr);
+	if (b->cursor_visible != f->cursor_visible)
+		emit(enc, ab, b->cursor_visible ? "\x1b[?25h" : "\x1b[?25l",
+		     6);
+}
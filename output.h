@@ -0,0 +1,48 @@
+#ifndef EMSYS_OUTPUT_H
+#define EMSYS_OUTPUT_H
+#include <stdint.h>
+#include "util.h"
+
+/* One character cell: the bytes drawn there, with any combining marks,
+ * and their attributes.  The right half of a wide character is a cell of
+ * width 0 with no bytes. */
+#define VT_CELL_BYTES 12
+
+struct vtCell {
+	uint8_t ch[VT_CELL_BYTES];
+	uint8_t len;
+	uint8_t width;
+	uint16_t attr;
+};
+
+/* A terminal screen, as far as the sequences emsys sends go */
+struct vtScreen {
+	int rows;
+	int cols;
+	struct vtCell *cells;
+	int y;
+	int x; /* cols when the last column has just been written */
+	int cursor_known;
+	int cursor_visible;
+	uint16_t attr;
+	struct vtCell last; /* last character written, for REP */
+};
+
+void vtInit(struct vtScreen *s, int rows, int cols);
+void vtFree(struct vtScreen *s);
+int vtFeed(struct vtScreen *s, const char *seq, int len);
+
+/* Turns frames into the bytes that change the terminal from what it
+ * shows to what the frame draws */
+struct outputEncoder {
+	struct vtScreen front; /* the terminal once all output is written */
+	struct vtScreen back;
+	int valid; /* front is known to match the terminal */
+	int rep; /* the terminal understands REP */
+};
+
+void outputInvalidate(struct outputEncoder *enc);
+void outputEncode(struct outputEncoder *enc, const char *frame, int len,
+		  int rows, int cols, int full, struct abuf *ab);
+
+#endif
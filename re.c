@@ -0,0 +1,1663 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "re.h"
+#include "unicode.h"
+#include "util.h"
+
+/*
+ * Regular expressions matched in time linear in the text, after Russ
+ * Cox's articles on RE2.
+ *
+ * A pattern is parsed to a tree and compiled to a program for a machine
+ * that reads a byte at a time, a character outside ASCII becoming a
+ * sequence of byte ranges.  Whether the text has a match at all is told
+ * by a DFA built lazily from the program: each of its states is the list
+ * of instructions the machine can be at, and once a state has been met
+ * a byte of text costs a table lookup.  The same DFA, run on past a
+ * match, tells where the match ends, and one built from the program
+ * compiled backwards, run back from there, where it starts.  What the
+ * groups in it matched is then found by running the program as a Pike
+ * VM, all the threads it can be in stepped together, from that start.
+ * Before any of them, the text is searched with memmem for the literal
+ * that every match has in it, if there is one.
+ *
+ * The syntax is POSIX extended, as regcomp has it with REG_NEWLINE: .
+ * and [^...] match any character but a newline, ^ and $ match at the ends
+ * of lines as well as of the text, and \n is a newline.  There are also
+ * \w \W \s \S \d \D, the assertions \b \B \< \> \` \', groups that do
+ * not capture as (?:...), and the lazy *? +? ?? and {m,n}?.  Back
+ * references are not regular, and are refused.  Text is taken as UTF-8:
+ * . and brackets match whole characters, and stray bytes on their own.
+ * Characters outside ASCII count as word characters.
+ *
+ * Matching is leftmost first, as in Emacs and Perl: of the matches at
+ * the leftmost place, the one that takes the first alternative that
+ * works, and repeats as often as it can, or as seldom for a lazy one.
+ */
+
+#define RE_MAX_INSTS 20000
+#define RE_MAX_REPEAT 255
+#define RE_MAX_DEPTH 500 /* groups in groups, repeats of repeats */
+#define RE_MAX_LITERAL 255
+#define RE_MAX_SLOTS 20 /* group 0 and \1 to \9 */
+#define FOLD_LIMIT 0x590 /* emsys_fold_char folds nothing from here on */
+#define DFA_MAX_STATES 1024 /* about a megabyte of tables */
+#define DFA_HASH 1024
+
+/*** Character sets ***/
+
+struct cpRange {
+	uint32_t lo;
+	uint32_t hi;
+};
+
+/* A run of bytes a character outside ASCII is encoded as, a range each */
+struct byteSeq {
+	uint8_t lo[4];
+	uint8_t hi[4];
+	int n;
+};
+
+struct charSet {
+	uint32_t bytes[8]; /* matched on their own: ASCII, and stray bytes */
+	struct cpRange *ranges; /* code points from 0x80 on, as UTF-8 */
+	int n;
+	int cap;
+	struct byteSeq *seqs; /* the ranges as byte sequences */
+	int nseqs;
+};
+
+#define HAS_BYTE(bits, c) ((bits)[(c) >> 5] & (1u << ((c) & 31)))
+
+static void setAddByte(struct charSet *s, int c) {
+	s->bytes[c >> 5] |= 1u << (c & 31);
+}
+
+static void setAddRange(struct charSet *s, uint32_t lo, uint32_t hi) {
+	for (; lo <= hi && lo < 0x80; lo++)
+		setAddByte(s, lo);
+	if (lo > hi)
+		return;
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 8;
+		s->ranges = xrealloc(s->ranges, s->cap * sizeof(*s->ranges));
+	}
+	s->ranges[s->n].lo = lo;
+	s->ranges[s->n].hi = hi;
+	s->n++;
+}
+
+/* c, or the byte b when it does not start a character */
+static void setAddChar(struct charSet *s, long c, uint8_t b) {
+	if (c < 0)
+		setAddByte(s, b);
+	else
+		setAddRange(s, c, c);
+}
+
+static int compareRanges(const void *a, const void *b) {
+	const struct cpRange *x = a, *y = b;
+	return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/* Sort the ranges and merge those that touch */
+static void setNormalise(struct charSet *s) {
+	if (s->n < 2)
+		return;
+	qsort(s->ranges, s->n, sizeof(*s->ranges), compareRanges);
+	int n = 0;
+	for (int i = 1; i < s->n; i++) {
+		if (s->ranges[i].lo <= s->ranges[n].hi + 1) {
+			if (s->ranges[i].hi > s->ranges[n].hi)
+				s->ranges[n].hi = s->ranges[i].hi;
+		} else {
+			s->ranges[++n] = s->ranges[i];
+		}
+	}
+	s->n = n + 1;
+}
+
+/* Every character but those of s and a newline, and every stray byte */
+static void setNegate(struct charSet *s) {
+	for (int i = 0; i < 4; i++)
+		s->bytes[i] = ~s->bytes[i];
+	for (int i = 4; i < 8; i++)
+		s->bytes[i] = ~0u;
+	s->bytes['\n' >> 5] &= ~(1u << ('\n' & 31));
+
+	setNormalise(s);
+	struct cpRange *old = s->ranges;
+	int n = s->n;
+	uint32_t next = 0x80;
+	s->ranges = NULL;
+	s->n = s->cap = 0;
+	for (int i = 0; i < n; i++) {
+		if (old[i].lo > next)
+			setAddRange(s, next, old[i].lo - 1);
+		next = old[i].hi + 1;
+	}
+	if (next <= 0x10ffff)
+		setAddRange(s, next, 0x10ffff);
+	free(old);
+}
+
+/* Add the other cases of the letters in s, as emsys_fold_char has them */
+static void setFold(struct charSet *s) {
+	for (int c = 'A'; c <= 'Z'; c++) {
+		if (HAS_BYTE(s->bytes, c) || HAS_BYTE(s->bytes, c + 32)) {
+			setAddByte(s, c);
+			setAddByte(s, c + 32);
+		}
+	}
+	if (s->n == 0)
+		return;
+
+	uint8_t folded[FOLD_LIMIT] = { 0 };
+	int n = s->n, any = 0;
+	for (int i = 0; i < n; i++) {
+		uint32_t hi = s->ranges[i].hi < FOLD_LIMIT ? s->ranges[i].hi :
+							     FOLD_LIMIT - 1;
+		for (uint32_t c = s->ranges[i].lo; c <= hi; c++) {
+			int f = emsys_fold_char(c);
+			if (f < FOLD_LIMIT) {
+				folded[f] = 1;
+				any = 1;
+			}
+		}
+	}
+	if (!any)
+		return;
+	for (int c = 0x80; c < FOLD_LIMIT; c++) {
+		int f = emsys_fold_char(c);
+		if (f < FOLD_LIMIT && folded[f])
+			setAddRange(s, c, c);
+	}
+	setNormalise(s);
+}
+
+static int encodeUtf8(uint32_t c, uint8_t *out) {
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		out[0] = 0xc0 | c >> 6;
+		out[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	if (c < 0x10000) {
+		out[0] = 0xe0 | c >> 12;
+		out[1] = 0x80 | (c >> 6 & 0x3f);
+		out[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | c >> 18;
+	out[1] = 0x80 | (c >> 12 & 0x3f);
+	out[2] = 0x80 | (c >> 6 & 0x3f);
+	out[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/* The character at p, or -1 if its bytes are not UTF-8; *len is how many
+ * bytes it takes, 1 for one that is not */
+static long decodeUtf8(const uint8_t *p, const uint8_t *end, int *len) {
+	static const long least[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	int n = utf8_nBytes(*p);
+	*len = 1;
+	if (n == 1 || end - p < n)
+		return *p < 0x80 ? *p : -1;
+	long c = *p & (0x7f >> n);
+	for (int i = 1; i < n; i++) {
+		if (!utf8_isCont(p[i]))
+			return -1;
+		c = c << 6 | (p[i] & 0x3f);
+	}
+	if (c < least[n] || c > 0x10ffff)
+		return -1;
+	*len = n;
+	return c;
+}
+
+/* Split lo..hi into byte sequences each a range per byte, as in RE2 */
+static void addSeqs(struct charSet *s, uint32_t lo, uint32_t hi) {
+	static const uint32_t last[] = { 0x7ff, 0xffff };
+	for (int i = 0; i < 2; i++) {
+		if (lo <= last[i] && hi > last[i]) {
+			addSeqs(s, lo, last[i]);
+			addSeqs(s, last[i] + 1, hi);
+			return;
+		}
+	}
+	for (int i = 1; i < 4; i++) {
+		uint32_t m = (1u << (6 * i)) - 1;
+		if ((lo & ~m) == (hi & ~m))
+			continue;
+		if (lo & m) {
+			addSeqs(s, lo, lo | m);
+			addSeqs(s, (lo | m) + 1, hi);
+			return;
+		}
+		if ((hi & m) != m) {
+			addSeqs(s, lo, (hi & ~m) - 1);
+			addSeqs(s, hi & ~m, hi);
+			return;
+		}
+	}
+	struct byteSeq *seq;
+	s->seqs = xrealloc(s->seqs, (s->nseqs + 1) * sizeof(*s->seqs));
+	seq = &s->seqs[s->nseqs++];
+	seq->n = encodeUtf8(lo, seq->lo);
+	encodeUtf8(hi, seq->hi);
+}
+
+/*** Parsing ***/
+
+enum {
+	NODE_EMPTY,
+	NODE_SET,
+	NODE_CAT,
+	NODE_ALT,
+	NODE_REPEAT,
+	NODE_GROUP,
+	NODE_ASSERT,
+};
+
+enum {
+	AT_BOL,
+	AT_EOL,
+	AT_TEXT_START,
+	AT_TEXT_END,
+	AT_WORD_BOUNDARY,
+	AT_NOT_WORD_BOUNDARY,
+	AT_WORD_START,
+	AT_WORD_END,
+	AT_NOT_CONTINUED, /* no UTF-8 continuation byte follows */
+	AT_CHAR_START, /* not inside a UTF-8 sequence */
+};
+
+struct node {
+	int type;
+	struct node **kids; /* CAT and ALT; one for REPEAT and GROUP */
+	int nkids;
+	struct charSet set;
+	int min, max; /* REPEAT; max is -1 for no limit */
+	int greedy;
+	int n; /* GROUP number, ASSERT kind */
+	struct node *all; /* the node made before, for freeing */
+};
+
+struct parser {
+	const uint8_t *p;
+	const uint8_t *end;
+	int fold;
+	int ngroups;
+	int depth;
+	const char *error;
+	struct node *all;
+};
+
+static struct node *newNode(struct parser *ps, int type) {
+	struct node *n = xcalloc(1, sizeof(*n));
+	n->type = type;
+	n->all = ps->all;
+	ps->all = n;
+	return n;
+}
+
+static void addKid(struct node *n, struct node *kid) {
+	if ((n->nkids & (n->nkids - 1)) == 0)
+		n->kids = xrealloc(n->kids, (n->nkids ? n->nkids * 2 : 1) *
+						    sizeof(*n->kids));
+	n->kids[n->nkids++] = kid;
+}
+
+static struct node *wrap(struct parser *ps, int type, struct node *kid) {
+	struct node *n = newNode(ps, type);
+	addKid(n, kid);
+	return n;
+}
+
+static void freeNodes(struct node *n) {
+	while (n) {
+		struct node *all = n->all;
+		free(n->kids);
+		free(n->set.ranges);
+		free(n->set.seqs);
+		free(n);
+		n = all;
+	}
+}
+
+static struct node *fail(struct parser *ps, const char *error) {
+	if (!ps->error)
+		ps->error = error;
+	return NULL;
+}
+
+/* A set is complete: fold it if need be, negate it if asked, and work
+ * out the byte sequences it matches */
+static struct node *finishSet(struct parser *ps, struct node *n, int negate) {
+	if (ps->fold)
+		setFold(&n->set);
+	if (negate)
+		setNegate(&n->set);
+	setNormalise(&n->set);
+	for (int i = 0; i < n->set.n; i++)
+		addSeqs(&n->set, n->set.ranges[i].lo, n->set.ranges[i].hi);
+	return n;
+}
+
+static const struct {
+	const char *name;
+	int (*is)(int);
+} classes[] = {
+	{ "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+	{ "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+	{ "lower", islower }, { "print", isprint }, { "punct", ispunct },
+	{ "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+};
+
+/* Add the ASCII class called name to s; 0 if there is none */
+static int setAddClass(struct charSet *s, const char *name, size_t len) {
+	for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		if (strlen(classes[i].name) != len ||
+		    memcmp(classes[i].name, name, len) != 0)
+			continue;
+		for (int c = 0; c < 0x80; c++) {
+			if (classes[i].is(c))
+				setAddByte(s, c);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* The character at ps->p, moved past; b is its first byte */
+static long nextChar(struct parser *ps, uint8_t *b) {
+	int len;
+	long c = decodeUtf8(ps->p, ps->end, &len);
+	*b = *ps->p;
+	ps->p += len;
+	return c;
+}
+
+static struct node *literal(struct parser *ps) {
+	uint8_t b;
+	long c = nextChar(ps, &b);
+	struct node *n = newNode(ps, NODE_SET);
+	setAddChar(&n->set, c, b);
+	return finishSet(ps, n, 0);
+}
+
+static struct node *parseBracket(struct parser *ps) {
+	static const char *unmatched = "Unmatched [, [^, [:, [., or [=";
+	struct node *n = newNode(ps, NODE_SET);
+	int negate = 0;
+	ps->p++;
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = 1;
+		ps->p++;
+	}
+	for (int first = 1;; first = 0) {
+		if (ps->p >= ps->end)
+			return fail(ps, unmatched);
+		if (*ps->p == ']' && !first) {
+			ps->p++;
+			break;
+		}
+		long lo, hi;
+		uint8_t lob, hib;
+		if (*ps->p == '[' && ps->end - ps->p > 1 &&
+		    (ps->p[1] == ':' || ps->p[1] == '.' || ps->p[1] == '=')) {
+			uint8_t kind = ps->p[1];
+			const uint8_t *name = ps->p + 2, *close = name;
+			while (close + 1 < ps->end &&
+			       !(close[0] == kind && close[1] == ']'))
+				close++;
+			if (close + 1 >= ps->end)
+				return fail(ps, unmatched);
+			ps->p = close + 2;
+			if (kind == ':') {
+				if (!setAddClass(&n->set, (const char *)name,
+						 close - name))
+					return fail(ps, "Invalid character "
+							"class name");
+				continue;
+			}
+			/* [.c.] and [=c=] are the char c */
+			int len;
+			if (close == name)
+				return fail(ps, "Invalid collation character");
+			lo = decodeUtf8(name, close, &len);
+			lob = *name;
+		} else if (ps->end - ps->p > 1 && ps->p[0] == '\\' &&
+			   ps->p[1] == 'n') {
+			/* The one escape in brackets, so [^\n] can be put */
+			lo = lob = '\n';
+			ps->p += 2;
+		} else {
+			lo = nextChar(ps, &lob);
+		}
+		if (ps->end - ps->p > 1 && *ps->p == '-' && ps->p[1] != ']') {
+			ps->p++;
+			hi = nextChar(ps, &hib);
+			if (lo < 0 || hi < 0 || hi < lo)
+				return fail(ps, "Invalid range end");
+			setAddRange(&n->set, lo, hi);
+		} else {
+			setAddChar(&n->set, lo, lob);
+		}
+	}
+	return finishSet(ps, n, negate);
+}
+
+static struct node *assertion(struct parser *ps, int kind) {
+	struct node *n = newNode(ps, NODE_ASSERT);
+	n->n = kind;
+	ps->p++;
+	return n;
+}
+
+/* \w \s \d, or \W \S \D */
+static struct node *escapeClass(struct parser *ps, uint8_t c) {
+	struct node *n = newNode(ps, NODE_SET);
+	ps->p++;
+	switch (tolower(c)) {
+	case 'w':
+		setAddClass(&n->set, "alnum", 5);
+		setAddByte(&n->set, '_');
+		for (int b = 0x80; b < 0x100; b++)
+			setAddByte(&n->set, b);
+		setAddRange(&n->set, 0x80, 0x10ffff);
+		break;
+	case 's':
+		setAddClass(&n->set, "space", 5);
+		break;
+	default:
+		setAddClass(&n->set, "digit", 5);
+	}
+	return finishSet(ps, n, isupper(c));
+}
+
+static struct node *parseEscape(struct parser *ps) {
+	struct node *n;
+	ps->p++;
+	if (ps->p >= ps->end)
+		return fail(ps, "Trailing backslash");
+	uint8_t c = *ps->p;
+	switch (c) {
+	case 'w': case 'W': case 's': case 'S': case 'd': case 'D':
+		return escapeClass(ps, c);
+	case 'b':
+		return assertion(ps, AT_WORD_BOUNDARY);
+	case 'B':
+		return assertion(ps, AT_NOT_WORD_BOUNDARY);
+	case '<':
+		return assertion(ps, AT_WORD_START);
+	case '>':
+		return assertion(ps, AT_WORD_END);
+	case '`':
+		return assertion(ps, AT_TEXT_START);
+	case '\'':
+		return assertion(ps, AT_TEXT_END);
+	case 'n':
+	case 't':
+		ps->p++;
+		n = newNode(ps, NODE_SET);
+		setAddByte(&n->set, c == 'n' ? '\n' : '\t');
+		return finishSet(ps, n, 0);
+	}
+	if (c >= '1' && c <= '9')
+		return fail(ps, "Back references are not supported");
+	return literal(ps);
+}
+
+static struct node *parseAlt(struct parser *ps);
+
+static struct node *parseGroup(struct parser *ps) {
+	int group = 0;
+	ps->p++;
+	if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':')
+		ps->p += 2;
+	else
+		group = ++ps->ngroups;
+	if (++ps->depth > RE_MAX_DEPTH)
+		return fail(ps, "Regular expression too big");
+	struct node *n = parseAlt(ps);
+	ps->depth--;
+	if (!n)
+		return NULL;
+	if (ps->p >= ps->end)
+		return fail(ps, "Unmatched ( or \\(");
+	ps->p++;
+	if (!group)
+		return n;
+	n = wrap(ps, NODE_GROUP, n);
+	n->n = group;
+	return n;
+}
+
+static struct node *parseAtom(struct parser *ps) {
+	switch (*ps->p) {
+	case '(':
+		return parseGroup(ps);
+	case '[':
+		return parseBracket(ps);
+	case '.':
+		ps->p++;
+		return finishSet(ps, newNode(ps, NODE_SET), 1);
+	case '^':
+		return assertion(ps, AT_BOL);
+	case '$':
+		return assertion(ps, AT_EOL);
+	case '*':
+	case '+':
+	case '?':
+		return fail(ps, "Invalid preceding regular expression");
+	case '\\':
+		return parseEscape(ps);
+	}
+	return literal(ps);
+}
+
+static int parseNumber(struct parser *ps, int *n) {
+	const uint8_t *start = ps->p;
+	*n = 0;
+	while (ps->p < ps->end && isdigit(*ps->p)) {
+		if (*n <= RE_MAX_REPEAT)
+			*n = *n * 10 + (*ps->p - '0');
+		ps->p++;
+	}
+	return ps->p > start;
+}
+
+/* A bound {m}, {m,}, {,n} or {m,n} at ps->p, moved past.  Anything else
+ * is not a bound, and leaves the { to be a plain char. */
+static int parseBound(struct parser *ps, int *min, int *max) {
+	const uint8_t *start = ps->p;
+	ps->p++;
+	int has_min = parseNumber(ps, min);
+	int has_max = has_min;
+	*max = *min;
+	if (ps->p < ps->end && *ps->p == ',') {
+		ps->p++;
+		has_max = parseNumber(ps, max);
+		if (!has_max)
+			*max = -1;
+	}
+	if (!(has_min || has_max) || ps->p >= ps->end || *ps->p != '}') {
+		ps->p = start;
+		return 0;
+	}
+	ps->p++;
+	if (*min > RE_MAX_REPEAT || *max > RE_MAX_REPEAT ||
+	    (*max >= 0 && *max < *min)) {
+		fail(ps, "Invalid content of \\{\\}");
+		return 0;
+	}
+	return 1;
+}
+
+static struct node *parseRepeat(struct parser *ps) {
+	struct node *n = parseAtom(ps);
+	int depth = 0;
+	while (n && ps->p < ps->end) {
+		int min = 0, max = -1;
+		if (*ps->p == '+') {
+			min = 1;
+		} else if (*ps->p == '?') {
+			max = 1;
+		} else if (*ps->p != '*') {
+			if (*ps->p != '{' || !parseBound(ps, &min, &max))
+				break;
+			ps->p--;
+		}
+		ps->p++;
+		if (++depth > RE_MAX_DEPTH)
+			return fail(ps, "Regular expression too big");
+		n = wrap(ps, NODE_REPEAT, n);
+		n->min = min;
+		n->max = max;
+		n->greedy = 1;
+		if (ps->p < ps->end && *ps->p == '?') {
+			n->greedy = 0;
+			ps->p++;
+		}
+	}
+	return ps->error ? NULL : n;
+}
+
+static struct node *parseCat(struct parser *ps) {
+	struct node *cat = newNode(ps, NODE_CAT);
+	while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+		struct node *n = parseRepeat(ps);
+		if (!n)
+			return NULL;
+		addKid(cat, n);
+	}
+	if (cat->nkids == 0)
+		cat->type = NODE_EMPTY;
+	return cat->nkids == 1 ? cat->kids[0] : cat;
+}
+
+static struct node *parseAlt(struct parser *ps) {
+	struct node *n = parseCat(ps);
+	if (!n || ps->p >= ps->end || *ps->p != '|')
+		return n;
+	struct node *alt = wrap(ps, NODE_ALT, n);
+	while (ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		if (!(n = parseCat(ps)))
+			return NULL;
+		addKid(alt, n);
+	}
+	return alt;
+}
+
+/*** Compiling ***/
+
+enum {
+	OP_RANGE, /* a byte from lo to hi */
+	OP_BYTES, /* a byte in bitmap x */
+	OP_SPLIT, /* go on at x, and at y failing that */
+	OP_JMP,
+	OP_SAVE, /* note the place in group slot x */
+	OP_ASSERT,
+	OP_MATCH,
+};
+
+struct inst {
+	uint8_t op;
+	uint8_t lo, hi;
+	int x, y;
+};
+
+/* Context of a place in the text, from the bytes either side of it */
+enum {
+	CTX_EDGE,
+	CTX_NEWLINE,
+	CTX_OTHER,
+	CTX_WORD,
+	CTX_LEAD, /* a byte that starts a UTF-8 sequence */
+	CTX_CONTINUATION,
+};
+#define NCTX 6
+#define IS_WORD(ctx) ((ctx) >= CTX_WORD)
+
+/* A thread of the Pike VM, or a step of working out a closure */
+struct frame {
+	int pc;
+	int slot; /* a group slot to put back to old, if not -1 */
+	long old;
+};
+
+/* The threads at one place in the text, and their groups */
+struct threads {
+	int n;
+	int *pc;
+	long *slots;
+};
+
+struct dstate {
+	int pcs; /* in dpcs: where the threads are, before any closure */
+	int npcs;
+	int ctx; /* of the byte before, or after when run backwards */
+	int anchored; /* no thread is started at each byte */
+	int chain;
+};
+
+struct re {
+	struct inst *prog;
+	int ninst;
+	uint32_t (*bitmaps)[8];
+	int nbitmaps;
+	int ngroups; /* counting the whole match */
+	int nslots; /* of those, the ends of the ones a search finds */
+	uint8_t ctx[256];
+	uint8_t first[256]; /* the bytes a match can start with */
+	int nfirst; /* 256 if a match can be empty */
+	uint8_t firstbyte; /* the one when nfirst is 1 */
+	uint8_t literal[RE_MAX_LITERAL]; /* a part of every match */
+	size_t nliteral;
+	int fold;
+	int reverse; /* compiled backwards, to be run from the end of a match */
+	struct re *rev; /* the same regex compiled backwards */
+
+	unsigned *seen; /* instructions met in this closure */
+	unsigned gen;
+	struct frame *stack;
+	struct threads lists[2];
+	long *slots;
+	int *out;
+
+	struct dstate *dstates;
+	int ndstates;
+	int *dnext; /* per state 256 bytes and the end, state << 1 | match */
+	int *dpcs;
+	int ndpcs;
+	int capdpcs;
+	int dhash[DFA_HASH];
+	int dstart[2][NCTX]; /* unanchored and anchored */
+	int flushes;
+};
+
+static int emit(struct re *re, int op, int x, int y) {
+	if (re->ninst >= RE_MAX_INSTS)
+		return -1;
+	if ((re->ninst & (re->ninst - 1)) == 0)
+		re->prog = xrealloc(re->prog, (re->ninst ? re->ninst * 2 : 1) *
+						      sizeof(*re->prog));
+	struct inst *in = &re->prog[re->ninst];
+	in->op = op;
+	in->lo = in->hi = 0;
+	in->x = x;
+	in->y = y;
+	return re->ninst++;
+}
+
+static int emitRange(struct re *re, int lo, int hi) {
+	int pc = emit(re, OP_RANGE, 0, 0);
+	if (pc >= 0) {
+		re->prog[pc].lo = lo;
+		re->prog[pc].hi = hi;
+	}
+	return pc;
+}
+
+/* Match a byte of those from lo to hi in bits, if any are */
+static int emitBytes(struct re *re, const uint32_t *bits, int lo, int hi) {
+	uint32_t b[8] = { 0 };
+	int n = 0, min = -1, max = -1;
+	for (int c = lo; c < hi; c++) {
+		if (HAS_BYTE(bits, c)) {
+			b[c >> 5] |= 1u << (c & 31);
+			if (min < 0)
+				min = c;
+			max = c;
+			n++;
+		}
+	}
+	if (n == 0)
+		return 0;
+	if (n == max - min + 1)
+		return emitRange(re, min, max) >= 0;
+	if ((re->nbitmaps & (re->nbitmaps - 1)) == 0)
+		re->bitmaps = xrealloc(re->bitmaps,
+				       (re->nbitmaps ? re->nbitmaps * 2 : 1) *
+					       sizeof(*re->bitmaps));
+	memcpy(re->bitmaps[re->nbitmaps], b, sizeof(b));
+	return emit(re, OP_BYTES, re->nbitmaps++, 0) >= 0;
+}
+
+/*
+ * A set is the alternatives: an ASCII char, a char outside ASCII as one
+ * of its byte sequences, and last, as the least preferred, a stray byte.
+ * A byte that starts a sequence is only stray if the sequence is cut
+ * short at the next byte, so that . takes a char it does not match
+ * neither whole nor in part.  JMPs to the end are chained through x
+ * while they are being emitted.
+ */
+static int emitSet(struct re *re, const struct charSet *s) {
+	int alts = s->nseqs, jmps = -1;
+	int ascii = 0, stray = 0, lead = 0;
+	for (int c = 0; c < 256; c++) {
+		if (HAS_BYTE(s->bytes, c))
+			*(c < 0x80 ? &ascii : utf8_nBytes(c) > 1 ? &lead :
+								  &stray) = 1;
+	}
+	alts += ascii + stray + lead;
+	if (alts == 0)
+		return emitRange(re, 1, 0) >= 0;
+	for (int i = 0; i < alts; i++) {
+		int split = -1;
+		if (i < alts - 1 && (split = emit(re, OP_SPLIT, 0, 0)) < 0)
+			return 0;
+		if (split >= 0)
+			re->prog[split].x = split + 1;
+		int k = i - ascii;
+		if (k < 0) {
+			if (!emitBytes(re, s->bytes, 0, 0x80))
+				return 0;
+		} else if (k < s->nseqs) {
+			for (int j = 0; j < s->seqs[k].n; j++) {
+				int b = re->reverse ? s->seqs[k].n - 1 - j : j;
+				if (emitRange(re, s->seqs[k].lo[b],
+					      s->seqs[k].hi[b]) < 0)
+					return 0;
+			}
+		} else if (k == s->nseqs && stray) {
+			uint32_t bits[8];
+			memcpy(bits, s->bytes, sizeof(bits));
+			for (int c = 0xc2; c <= 0xf4; c++)
+				bits[c >> 5] &= ~(1u << (c & 31));
+			if (!emitBytes(re, bits, 0x80, 0x100))
+				return 0;
+		} else if ((re->reverse &&
+			    emit(re, OP_ASSERT, AT_NOT_CONTINUED, 0) < 0) ||
+			   !emitBytes(re, s->bytes, 0xc2, 0xf5) ||
+			   (!re->reverse &&
+			    emit(re, OP_ASSERT, AT_NOT_CONTINUED, 0) < 0)) {
+			return 0;
+		}
+		if (split >= 0) {
+			if ((jmps = emit(re, OP_JMP, jmps, 0)) < 0)
+				return 0;
+			re->prog[split].y = re->ninst;
+		}
+	}
+	while (jmps >= 0) {
+		int next = re->prog[jmps].x;
+		re->prog[jmps].x = re->ninst;
+		jmps = next;
+	}
+	return 1;
+}
+
+static int emitNode(struct re *re, const struct node *n);
+
+/* x{min,max}: min copies, then one looped back to or max - min that can
+ * each be left out.  The SPLITs out of those are chained through y. */
+static int emitRepeat(struct re *re, const struct node *n) {
+	int last = re->ninst, splits = -1;
+	if (n->min == 0 && n->max < 0) {
+		int split = emit(re, OP_SPLIT, 0, 0);
+		if (split < 0 || !emitNode(re, n->kids[0]) ||
+		    emit(re, OP_JMP, split, 0) < 0)
+			return 0;
+		re->prog[split].x = n->greedy ? split + 1 : re->ninst;
+		re->prog[split].y = n->greedy ? re->ninst : split + 1;
+		return 1;
+	}
+	for (int i = 0; i < n->min; i++) {
+		last = re->ninst;
+		if (!emitNode(re, n->kids[0]))
+			return 0;
+	}
+	if (n->max < 0) {
+		int split = emit(re, OP_SPLIT, 0, 0);
+		if (split < 0)
+			return 0;
+		re->prog[split].x = n->greedy ? last : split + 1;
+		re->prog[split].y = n->greedy ? split + 1 : last;
+		return 1;
+	}
+	for (int i = n->min; i < n->max; i++) {
+		if ((splits = emit(re, OP_SPLIT, 0, splits)) < 0 ||
+		    !emitNode(re, n->kids[0]))
+			return 0;
+	}
+	while (splits >= 0) {
+		struct inst *in = &re->prog[splits];
+		int next = in->y;
+		in->x = n->greedy ? splits + 1 : re->ninst;
+		in->y = n->greedy ? re->ninst : splits + 1;
+		splits = next;
+	}
+	return 1;
+}
+
+static int emitNode(struct re *re, const struct node *n) {
+	int jmps = -1;
+	switch (n->type) {
+	case NODE_SET:
+		return emitSet(re, &n->set);
+	case NODE_CAT:
+		for (int i = 0; i < n->nkids; i++) {
+			int k = re->reverse ? n->nkids - 1 - i : i;
+			if (!emitNode(re, n->kids[k]))
+				return 0;
+		}
+		return 1;
+	case NODE_ALT:
+		for (int i = 0; i < n->nkids; i++) {
+			int split = -1;
+			if (i < n->nkids - 1 &&
+			    (split = emit(re, OP_SPLIT, 0, 0)) < 0)
+				return 0;
+			if (split >= 0)
+				re->prog[split].x = split + 1;
+			if (!emitNode(re, n->kids[i]))
+				return 0;
+			if (split >= 0) {
+				if ((jmps = emit(re, OP_JMP, jmps, 0)) < 0)
+					return 0;
+				re->prog[split].y = re->ninst;
+			}
+		}
+		while (jmps >= 0) {
+			int next = re->prog[jmps].x;
+			re->prog[jmps].x = re->ninst;
+			jmps = next;
+		}
+		return 1;
+	case NODE_REPEAT:
+		return emitRepeat(re, n);
+	case NODE_GROUP:
+		return emit(re, OP_SAVE, 2 * n->n + re->reverse, 0) >= 0 &&
+		       emitNode(re, n->kids[0]) &&
+		       emit(re, OP_SAVE, 2 * n->n + !re->reverse, 0) >= 0;
+	case NODE_ASSERT:
+		return emit(re, OP_ASSERT, n->n, 0) >= 0;
+	}
+	return 1;
+}
+
+/* The whole program: a match starts at a character, and its place is
+ * noted as group 0 */
+static int emitProgram(struct re *re, const struct node *tree) {
+	if (re->reverse)
+		return emit(re, OP_SAVE, 1, 0) >= 0 && emitNode(re, tree) &&
+		       emit(re, OP_SAVE, 0, 0) >= 0 &&
+		       emit(re, OP_ASSERT, AT_CHAR_START, 0) >= 0 &&
+		       emit(re, OP_MATCH, 0, 0) >= 0;
+	return emit(re, OP_ASSERT, AT_CHAR_START, 0) >= 0 &&
+	       emit(re, OP_SAVE, 0, 0) >= 0 && emitNode(re, tree) &&
+	       emit(re, OP_SAVE, 1, 0) >= 0 && emit(re, OP_MATCH, 0, 0) >= 0;
+}
+
+/* The bytes a match can start with, taking every assertion to hold */
+static void firstBytes(struct re *re) {
+	int sp = 0;
+	memset(re->first, 0, sizeof(re->first));
+	re->gen++;
+	re->stack[sp++].pc = 0;
+	while (sp > 0) {
+		int pc = re->stack[--sp].pc;
+		if (re->seen[pc] == re->gen)
+			continue;
+		re->seen[pc] = re->gen;
+		const struct inst *in = &re->prog[pc];
+		switch (in->op) {
+		case OP_RANGE:
+			for (int c = in->lo; c <= in->hi; c++)
+				re->first[c] = 1;
+			break;
+		case OP_BYTES:
+			for (int c = 0; c < 256; c++) {
+				if (HAS_BYTE(re->bitmaps[in->x], c))
+					re->first[c] = 1;
+			}
+			break;
+		case OP_SPLIT:
+			re->stack[sp++].pc = in->y;
+			/* fall through */
+		case OP_JMP:
+			re->stack[sp++].pc = in->x;
+			break;
+		case OP_MATCH:
+			memset(re->first, 1, sizeof(re->first));
+			break;
+		default:
+			re->stack[sp++].pc = pc + 1;
+		}
+	}
+	re->nfirst = 0;
+	for (int c = 0; c < 256; c++) {
+		if (re->first[c]) {
+			re->firstbyte = c;
+			re->nfirst++;
+		}
+	}
+}
+
+/*** The literal every match has ***/
+
+struct literal {
+	uint8_t s[RE_MAX_LITERAL];
+	int n;
+	int exact; /* the node matches s and nothing else */
+	int full; /* s was cut short */
+};
+
+static void append(struct literal *to, const uint8_t *s, int n) {
+	if (n > RE_MAX_LITERAL - to->n) {
+		n = RE_MAX_LITERAL - to->n;
+		to->full = 1;
+	}
+	memcpy(to->s + to->n, s, n);
+	to->n += n;
+}
+
+static void keepLonger(struct literal *best, const struct literal *l) {
+	if (l->n > best->n)
+		*best = *l;
+}
+
+/* The char a set matches, folded if fold, if it matches only one */
+static int setChar(const struct charSet *s, int fold, uint8_t *out) {
+	long c = -1;
+	int n = 0;
+	for (int b = 0; b < 256; b++) {
+		if (!HAS_BYTE(s->bytes, b))
+			continue;
+		if (b >= 0x80 && fold)
+			return 0;
+		if (c >= 0 && (!fold || emsys_fold_char(b) != c))
+			return 0;
+		c = fold && b < 0x80 ? emsys_fold_char(b) : b;
+		n++;
+	}
+	if (n > 0 && c >= 0x80) {
+		/* A stray byte */
+		if (s->n > 0)
+			return 0;
+		out[0] = c;
+		return 1;
+	}
+	for (int i = 0; i < s->n; i++) {
+		if (s->ranges[i].hi - s->ranges[i].lo > 4)
+			return 0;
+		for (uint32_t u = s->ranges[i].lo; u <= s->ranges[i].hi; u++) {
+			long f = fold ? emsys_fold_char(u) : (long)u;
+			if (c >= 0 && f != c)
+				return 0;
+			c = f;
+		}
+	}
+	return c < 0 ? 0 : encodeUtf8(c, out);
+}
+
+static void required(const struct node *n, int fold, struct literal *out) {
+	struct literal kid, run;
+	uint8_t buf[4];
+	int len, exact = 1;
+	out->n = out->full = 0;
+	out->exact = 1;
+	switch (n->type) {
+	case NODE_SET:
+		if ((len = setChar(&n->set, fold, buf)) > 0)
+			append(out, buf, len);
+		else
+			out->exact = 0;
+		break;
+	case NODE_CAT:
+		run = *out;
+		for (int i = 0; i < n->nkids; i++) {
+			required(n->kids[i], fold, &kid);
+			if (kid.exact && !run.full) {
+				append(&run, kid.s, kid.n);
+				continue;
+			}
+			exact = 0;
+			keepLonger(out, &run);
+			keepLonger(out, &kid);
+			run.n = run.full = 0;
+		}
+		keepLonger(out, &run);
+		out->exact = exact && !run.full;
+		break;
+	case NODE_ALT:
+		out->exact = 0;
+		break;
+	case NODE_REPEAT:
+		if (n->min == 0) {
+			out->exact = 0;
+			break;
+		}
+		required(n->kids[0], fold, &kid);
+		if (!kid.exact || n->min != n->max) {
+			*out = kid;
+			out->exact = 0;
+			break;
+		}
+		for (int i = 0; i < n->min && !out->full; i++)
+			append(out, kid.s, kid.n);
+		out->exact = !out->full;
+		break;
+	case NODE_GROUP:
+		required(n->kids[0], fold, out);
+		break;
+	}
+}
+
+/*** Searching ***/
+
+static unsigned nextGen(struct re *re) {
+	if (++re->gen == 0) {
+		memset(re->seen, 0, re->ninst * sizeof(*re->seen));
+		re->gen = 1;
+	}
+	return re->gen;
+}
+
+static int holds(int kind, int before, int after) {
+	switch (kind) {
+	case AT_BOL:
+		return before == CTX_EDGE || before == CTX_NEWLINE;
+	case AT_EOL:
+		return after == CTX_EDGE || after == CTX_NEWLINE;
+	case AT_TEXT_START:
+		return before == CTX_EDGE;
+	case AT_TEXT_END:
+		return after == CTX_EDGE;
+	case AT_WORD_BOUNDARY:
+		return IS_WORD(before) != IS_WORD(after);
+	case AT_NOT_WORD_BOUNDARY:
+		return IS_WORD(before) == IS_WORD(after);
+	case AT_WORD_START:
+		return !IS_WORD(before) && IS_WORD(after);
+	case AT_WORD_END:
+		return IS_WORD(before) && !IS_WORD(after);
+	case AT_NOT_CONTINUED:
+		return after != CTX_CONTINUATION;
+	}
+	return after != CTX_CONTINUATION ||
+	       (before != CTX_LEAD && before != CTX_CONTINUATION);
+}
+
+static int accepts(const struct re *re, const struct inst *in, int c) {
+	if (in->op == OP_RANGE)
+		return c >= in->lo && c <= in->hi;
+	return in->op == OP_BYTES && HAS_BYTE(re->bitmaps[in->x], c);
+}
+
+/* The first place from pos on a match can start at */
+static size_t skipTo(const struct re *re, const uint8_t *text, size_t len,
+		     size_t pos) {
+	if (re->nfirst == 1 && pos < len) {
+		const uint8_t *p = memchr(text + pos, re->firstbyte, len - pos);
+		return p ? (size_t)(p - text) : len;
+	}
+	while (pos < len && !re->first[text[pos]])
+		pos++;
+	return pos;
+}
+
+/* Backwards, the last place up to pos a match can end at, where the
+ * program compiled backwards can start, or 0 */
+static size_t skipBack(const struct re *rev, const uint8_t *text,
+		       size_t pos) {
+	while (pos > 0 && !rev->first[text[pos - 1]])
+		pos--;
+	return pos;
+}
+
+/*
+ * The lazy DFA.  A state is where the threads are after a byte, before
+ * following their SPLITs and JMPs, along with the context that byte
+ * makes: the closure depends on the byte after as well, for assertions,
+ * so it is worked out on a transition.  A new thread is started at each
+ * byte, which makes the search unanchored, until there is a match.  The
+ * threads are kept in the order the Pike VM would prefer them, and those
+ * after a match are dropped, so that run on until none are left the DFA
+ * ends where the VM would.  Backwards, every thread is kept, for the
+ * longest match, or for every place a match starts.  Once the tables are
+ * full they are thrown away and started again.
+ */
+
+static void dfaFlush(struct re *re) {
+	re->ndstates = 0;
+	re->ndpcs = 0;
+	for (int i = 0; i < DFA_HASH; i++)
+		re->dhash[i] = -1;
+	for (int i = 0; i < NCTX; i++)
+		re->dstart[0][i] = re->dstart[1][i] = -1;
+	re->flushes++;
+}
+
+static int comparePcs(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static int dfaState(struct re *re, const int *pcs, int n, int ctx,
+		    int anchored) {
+	uint32_t h = 2166136261u ^ (ctx << 1 | anchored);
+	for (int i = 0; i < n; i++)
+		h = (h ^ pcs[i]) * 16777619u;
+	h %= DFA_HASH;
+	for (int s = re->dhash[h]; s >= 0; s = re->dstates[s].chain) {
+		const struct dstate *d = &re->dstates[s];
+		if (d->ctx == ctx && d->anchored == anchored && d->npcs == n &&
+		    memcmp(re->dpcs + d->pcs, pcs, n * sizeof(*pcs)) == 0)
+			return s;
+	}
+	if (re->ndstates == DFA_MAX_STATES) {
+		dfaFlush(re);
+		return dfaState(re, pcs, n, ctx, anchored);
+	}
+	if (re->ndpcs + n > re->capdpcs) {
+		re->capdpcs = (re->ndpcs + n) * 2;
+		re->dpcs = xrealloc(re->dpcs, re->capdpcs * sizeof(*re->dpcs));
+	}
+	int s = re->ndstates++;
+	if ((s & (s - 1)) == 0) {
+		int cap = s ? s * 2 : 1;
+		re->dstates = xrealloc(re->dstates, cap * sizeof(*re->dstates));
+		re->dnext = xrealloc(re->dnext, cap * 257 * sizeof(int));
+	}
+	struct dstate *d = &re->dstates[s];
+	memcpy(re->dpcs + re->ndpcs, pcs, n * sizeof(*pcs));
+	d->pcs = re->ndpcs;
+	d->npcs = n;
+	d->ctx = ctx;
+	d->anchored = anchored;
+	d->chain = re->dhash[h];
+	re->dhash[h] = s;
+	re->ndpcs += n;
+	memset(re->dnext + s * 257, 0xff, 257 * sizeof(int));
+	return s;
+}
+
+/* The state a thread is started from at each byte, or anchored, the one
+ * with a single thread at the start */
+static int dfaStart(struct re *re, int ctx, int anchored) {
+	if (re->dstart[anchored][ctx] < 0) {
+		int pc = 0;
+		re->dstart[anchored][ctx] =
+			dfaState(re, &pc, anchored, ctx, anchored);
+	}
+	return re->dstart[anchored][ctx];
+}
+
+/* Work out the transition from s on c, or at the end for -1 */
+static int dfaNext(struct re *re, int s, int c) {
+	const struct dstate *d = &re->dstates[s];
+	const int *pcs = re->dpcs + d->pcs;
+	int next = c < 0 ? CTX_EDGE : re->ctx[c];
+	int before = re->reverse ? next : d->ctx;
+	int after = re->reverse ? d->ctx : next;
+	int anchored = d->anchored;
+	int sp = 0, n = 0, match = 0;
+	unsigned gen = nextGen(re);
+
+	if (!anchored)
+		re->stack[sp++].pc = 0;
+	for (int i = d->npcs - 1; i >= 0; i--)
+		re->stack[sp++].pc = pcs[i];
+	while (sp > 0 && (re->reverse || !match)) {
+		int pc = re->stack[--sp].pc;
+		while (re->seen[pc] != gen) {
+			const struct inst *in = &re->prog[pc];
+			re->seen[pc] = gen;
+			if (in->op == OP_SPLIT) {
+				re->stack[sp++].pc = in->y;
+				pc = in->x;
+			} else if (in->op == OP_JMP) {
+				pc = in->x;
+			} else if (in->op == OP_SAVE) {
+				pc++;
+			} else if (in->op == OP_ASSERT) {
+				if (!holds(in->x, before, after))
+					break;
+				pc++;
+			} else {
+				if (in->op == OP_MATCH)
+					match = 1;
+				else if (c >= 0 && accepts(re, in, c))
+					re->out[n++] = pc + 1;
+				break;
+			}
+		}
+	}
+	if (c < 0) {
+		re->dnext[s * 257 + 256] = match;
+		return match;
+	}
+	if (re->reverse)
+		qsort(re->out, n, sizeof(*re->out), comparePcs);
+	int flushes = re->flushes;
+	if (match && !re->reverse)
+		anchored = 1;
+	int t = dfaState(re, re->out, n, re->ctx[c], anchored) << 1 | match;
+	if (re->flushes == flushes)
+		re->dnext[s * 257 + c] = t;
+	return t;
+}
+
+/* Where the leftmost-first match from the text at from on ends, or -1
+ * if there is none; with first, where the first match the DFA comes to
+ * ends, which is as good for telling whether there is one */
+static long dfaSearch(struct re *re, const uint8_t *text, size_t len,
+		      size_t from, int first) {
+	int skip = re->nfirst <= 8;
+	long end = -1;
+	int s = dfaStart(re, from > 0 ? re->ctx[text[from - 1]] : CTX_EDGE, 0);
+	for (size_t i = from; i < len; i++) {
+		const struct dstate *d = &re->dstates[s];
+		if (d->npcs == 0 && d->anchored)
+			return end;
+		if (skip && d->npcs == 0) {
+			size_t p = skipTo(re, text, len, i);
+			if (p == len)
+				return -1;
+			if (p > i)
+				s = dfaStart(re, re->ctx[text[p - 1]], 0);
+			i = p;
+		}
+		int t = re->dnext[s * 257 + text[i]];
+		if (t < 0)
+			t = dfaNext(re, s, text[i]);
+		if (t & 1) {
+			end = i;
+			if (first)
+				return end;
+		}
+		s = t >> 1;
+	}
+	int t = re->dnext[s * 257 + 256];
+	if (t < 0)
+		t = dfaNext(re, s, -1);
+	return t & 1 ? (long)len : end;
+}
+
+/*
+ * Run the program compiled backwards from end back to from.  Anchored,
+ * this finds where the match that ends at end starts: the longest match
+ * back, since a start before the leftmost-first one would have been the
+ * leftmost.  Otherwise a thread is started at each byte, and the first
+ * place before limit a match starts at is the last there is.
+ */
+static long dfaSearchBack(struct re *rev, const uint8_t *text, size_t len,
+			  size_t from, size_t end, size_t limit,
+			  int anchored) {
+	int skip = !anchored && rev->nfirst < 256;
+	long start = -1;
+	int s = dfaStart(rev, end < len ? rev->ctx[text[end]] : CTX_EDGE,
+			 anchored);
+	for (size_t i = end;; i--) {
+		if (skip && rev->dstates[s].npcs == 0) {
+			size_t p = skipBack(rev, text, i);
+			if (p <= from)
+				return -1;
+			if (p < i)
+				s = dfaStart(rev, rev->ctx[text[p]], 0);
+			i = p;
+		}
+		int c = i > 0 ? text[i - 1] : 256;
+		int t = rev->dnext[s * 257 + c];
+		if (t < 0)
+			t = dfaNext(rev, s, c < 256 ? c : -1);
+		if ((t & 1) && i < limit) {
+			start = i;
+			if (!anchored)
+				break;
+		}
+		if (i == from || c == 256)
+			break;
+		s = t >> 1;
+		if (anchored && rev->dstates[s].npcs == 0)
+			break;
+	}
+	return start;
+}
+
+/*
+ * Add the thread at pc to l, and the threads its SPLITs and JMPs lead to,
+ * in the order of preference, noting pos in the group slots they pass.
+ * The slots are set in place and put back as the stack unwinds.
+ */
+static void addThread(struct re *re, struct threads *l, int pc, long *slots,
+		      int nslots, const uint8_t *text, size_t len, size_t pos) {
+	int before = pos > 0 ? re->ctx[text[pos - 1]] : CTX_EDGE;
+	int after = pos < len ? re->ctx[text[pos]] : CTX_EDGE;
+	int sp = 0;
+	re->stack[sp].pc = pc;
+	re->stack[sp++].slot = -1;
+	while (sp > 0) {
+		struct frame f = re->stack[--sp];
+		if (f.slot >= 0) {
+			slots[f.slot] = f.old;
+			continue;
+		}
+		pc = f.pc;
+		while (re->seen[pc] != re->gen) {
+			const struct inst *in = &re->prog[pc];
+			re->seen[pc] = re->gen;
+			if (in->op == OP_SPLIT) {
+				re->stack[sp].pc = in->y;
+				re->stack[sp++].slot = -1;
+				pc = in->x;
+			} else if (in->op == OP_JMP) {
+				pc = in->x;
+			} else if (in->op == OP_SAVE) {
+				if (in->x < nslots) {
+					re->stack[sp].slot = in->x;
+					re->stack[sp++].old = slots[in->x];
+					slots[in->x] = pos;
+				}
+				pc++;
+			} else if (in->op == OP_ASSERT) {
+				if (!holds(in->x, before, after))
+					break;
+				pc++;
+			} else {
+				l->pc[l->n] = pc;
+				memcpy(l->slots + l->n * nslots, slots,
+				       nslots * sizeof(*slots));
+				l->n++;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * The Pike VM: every thread steps over a byte together, in the order of
+ * preference, and a new one is started at each byte until one matches.
+ * The threads after a match in that order are dropped, and the rest run
+ * on to see if they match longer.
+ */
+static int pikeSearch(struct re *re, const uint8_t *text, size_t len,
+		      size_t from, long *match, int nslots) {
+	struct threads *clist = &re->lists[0], *nlist = &re->lists[1];
+	int matched = 0;
+	size_t pos = re->nfirst < 256 ? skipTo(re, text, len, from) : from;
+
+	if (pos == len && re->nfirst < 256)
+		return 0;
+	clist->n = 0;
+	nextGen(re);
+	for (int i = 0; i < nslots; i++)
+		re->slots[i] = -1;
+	addThread(re, clist, 0, re->slots, nslots, text, len, pos);
+	for (;;) {
+		int c = pos < len ? text[pos] : -1;
+		nlist->n = 0;
+		nextGen(re);
+		for (int i = 0; i < clist->n; i++) {
+			const struct inst *in = &re->prog[clist->pc[i]];
+			long *slots = clist->slots + i * nslots;
+			if (in->op == OP_MATCH) {
+				memcpy(match, slots, nslots * sizeof(*slots));
+				matched = 1;
+				break;
+			}
+			if (c >= 0 && accepts(re, in, c))
+				addThread(re, nlist, clist->pc[i] + 1, slots,
+					  nslots, text, len, pos + 1);
+		}
+		if (c < 0)
+			break;
+		pos++;
+		if (!matched) {
+			if (nlist->n == 0 && re->nfirst < 256) {
+				size_t p = skipTo(re, text, len, pos);
+				if (p == len)
+					break;
+				if (p > pos)
+					nextGen(re);
+				pos = p;
+			}
+			for (int i = 0; i < nslots; i++)
+				re->slots[i] = -1;
+			addThread(re, nlist, 0, re->slots, nslots, text, len,
+				  pos);
+		}
+		struct threads *t = clist;
+		clist = nlist;
+		nlist = t;
+		if (matched && clist->n == 0)
+			break;
+	}
+	return matched;
+}
+
+/*** Interface ***/
+
+/* Make the tables a compiled program is searched with */
+static void prepare(struct re *re) {
+	int nslots = 2 * re->ngroups;
+	re->nslots = nslots < RE_MAX_SLOTS ? nslots : RE_MAX_SLOTS;
+	nslots = re->nslots;
+	re->seen = xcalloc(re->ninst, sizeof(*re->seen));
+	re->stack = xmalloc((2 * re->ninst + 2) * sizeof(*re->stack));
+	for (int i = 0; i < 2 && !re->reverse; i++) {
+		re->lists[i].pc = xmalloc(re->ninst * sizeof(int));
+		re->lists[i].slots =
+			xmalloc(re->ninst * nslots * sizeof(long));
+	}
+	re->slots = xmalloc(nslots * sizeof(*re->slots));
+	re->out = xmalloc(re->ninst * sizeof(*re->out));
+	re->capdpcs = re->ninst;
+	re->dpcs = xmalloc(re->capdpcs * sizeof(*re->dpcs));
+	for (int c = 0; c < 256; c++) {
+		if (c == '\n')
+			re->ctx[c] = CTX_NEWLINE;
+		else if (utf8_isCont(c))
+			re->ctx[c] = CTX_CONTINUATION;
+		else if (utf8_nBytes(c) > 1)
+			re->ctx[c] = CTX_LEAD;
+		else if (c >= 0x80 || isalnum(c) || c == '_')
+			re->ctx[c] = CTX_WORD;
+		else
+			re->ctx[c] = CTX_OTHER;
+	}
+	firstBytes(re);
+	dfaFlush(re);
+	re->flushes = 0;
+}
+
+/* Compile pattern, or put why it cannot be in error and return NULL */
+struct re *reCompile(const uint8_t *pattern, size_t len, int flags,
+		     char *error, size_t errlen) {
+	struct parser ps = { .p = pattern, .end = pattern + len };
+	ps.fold = flags & RE_FOLD;
+	struct node *tree = parseAlt(&ps);
+	if (tree && ps.p < ps.end)
+		fail(&ps, "Unmatched ) or \\)");
+
+	struct re *re = xcalloc(1, sizeof(*re));
+	re->ngroups = ps.ngroups + 1;
+	re->fold = ps.fold;
+	re->rev = xcalloc(1, sizeof(*re->rev));
+	re->rev->ngroups = re->ngroups;
+	re->rev->reverse = 1;
+	if (!ps.error &&
+	    (!emitProgram(re, tree) || !emitProgram(re->rev, tree)))
+		fail(&ps, "Regular expression too big");
+	if (ps.error) {
+		emsys_strlcpy(error, ps.error, errlen);
+		freeNodes(ps.all);
+		reFree(re);
+		return NULL;
+	}
+
+	struct literal lit;
+	required(tree, re->fold, &lit);
+	memcpy(re->literal, lit.s, lit.n);
+	re->nliteral = lit.n;
+	freeNodes(ps.all);
+
+	prepare(re);
+	prepare(re->rev);
+	return re;
+}
+
+void reFree(struct re *re) {
+	if (!re)
+		return;
+	free(re->prog);
+	free(re->bitmaps);
+	free(re->seen);
+	free(re->stack);
+	for (int i = 0; i < 2; i++) {
+		free(re->lists[i].pc);
+		free(re->lists[i].slots);
+	}
+	free(re->slots);
+	free(re->out);
+	free(re->dstates);
+	free(re->dnext);
+	free(re->dpcs);
+	reFree(re->rev);
+	free(re);
+}
+
+/* How many groups a match has, the whole match being group 0 */
+int reGroups(const struct re *re) {
+	return re->ngroups;
+}
+
+/*
+ * Search the len bytes of text from from on, the text before from being
+ * context for ^ and \b and the like.  On a match, groups is filled with
+ * where the first ngroups groups are, and 1 is returned; groups past
+ * the ninth are not looked for.  Whether there is a match at all, with
+ * ngroups 0, and where, with 1, are told without running the VM.
+ */
+int reSearch(struct re *re, const uint8_t *text, size_t len, size_t from,
+	     struct reSpan *groups, int ngroups) {
+	if (from > len)
+		return 0;
+	if (re->nliteral > 0 &&
+	    !(re->fold ? emsys_memmem_fold : emsys_memmem)(
+		    text + from, len - from, re->literal, re->nliteral))
+		return 0;
+	if (ngroups <= 0)
+		return dfaSearch(re, text, len, from, 1) >= 0;
+	long end = dfaSearch(re, text, len, from, 0);
+	if (end < 0)
+		return 0;
+	long start = dfaSearchBack(re->rev, text, len, from, end, end + 1, 1);
+	if (ngroups == 1 && start >= 0) {
+		groups[0].start = start;
+		groups[0].end = end;
+		return 1;
+	}
+
+	long slots[RE_MAX_SLOTS];
+	int nslots = 2 * ngroups < re->nslots ? 2 * ngroups : re->nslots;
+	if (!pikeSearch(re, text, len, start >= 0 ? (size_t)start : from,
+			slots, nslots))
+		return 0;
+	for (int i = 0; i < ngroups; i++) {
+		int ok = 2 * i < nslots && slots[2 * i] >= 0 &&
+			 slots[2 * i + 1] >= 0;
+		groups[i].start = ok ? slots[2 * i] : -1;
+		groups[i].end = ok ? slots[2 * i + 1] : -1;
+	}
+	return 1;
+}
+
+/*
+ * Last match in text that starts before limit: where it starts is found
+ * in a single pass back from the end of the text, and where it ends by
+ * searching on from there.
+ */
+int reSearchLast(struct re *re, const uint8_t *text, size_t len,
+		 size_t limit, struct reSpan *match) {
+	if (re->nliteral > 0 &&
+	    !(re->fold ? emsys_memmem_fold : emsys_memmem)(
+		    text, len, re->literal, re->nliteral))
+		return 0;
+	long start = dfaSearchBack(re->rev, text, len, 0, len, limit, 0);
+	if (start < 0)
+		return 0;
+	match->start = start;
+	match->end = dfaSearch(re, text, len, start, 0);
+	return 1;
+}
+
+/* Whether text has a match anywhere */
+int reMatches(struct re *re, const uint8_t *text, size_t len) {
+	return reSearch(re, text, len, 0, NULL, 0);
+}
+
+/* The literal every match has in it, folded as emsys_fold folds if the
+ * regex ignores case; its length, 0 if there is none */
+size_t reRequired(const struct re *re, const uint8_t **literal) {
+	*literal = re->literal;
+	return re->nliteral;
+}
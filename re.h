@@ -0,0 +1,33 @@
+#ifndef EMSYS_RE_H
+#define EMSYS_RE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Regular expressions matched in time linear in the text; see re.c for
+ * the syntax.  A compiled regex keeps the state of its last search, so a
+ * thread searching alongside others needs one of its own.
+ */
+
+#define RE_FOLD 1 /* ignore case */
+
+/* Where a match or one of its groups is; -1 for a group left out */
+struct reSpan {
+	long start;
+	long end;
+};
+
+struct re;
+
+struct re *reCompile(const uint8_t *pattern, size_t len, int flags,
+		     char *error, size_t errlen);
+void reFree(struct re *re);
+int reGroups(const struct re *re);
+int reSearch(struct re *re, const uint8_t *text, size_t len, size_t from,
+	     struct reSpan *groups, int ngroups);
+int reSearchLast(struct re *re, const uint8_t *text, size_t len,
+		 size_t limit, struct reSpan *match);
+int reMatches(struct re *re, const uint8_t *text, size_t len);
+size_t reRequired(const struct re *re, const uint8_t **literal);
+
+#endif
@@ -2,7 +2,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <regex.h>
 #include "emsys.h"
 #include "region.h"
 #include "buffer.h"
@@ -10,6 +9,9 @@
 #include "display.h"
 #include "history.h"
 #include "prompt.h"
+#include "search.h"
+#include "unicode.h"
+#include "unused.h"
 #include "util.h"
 
 extern struct editorConfig E;
@@ -135,19 +137,19 @@ void editorKillRegion(struct editorConfig *ed, struct editorBuffer *buf) {
 		row->size -= buf->markx - buf->cx;
 		row->chars[row->size] = 0;
 	} else {
-		for (int i = buf->cy + 1; i < buf->marky; i++) {
-			editorDelRow(buf, buf->cy + 1);
-		}
+		editorDelRows(buf, buf->cy + 1, buf->marky - buf->cy - 1);
 		struct erow *last = &buf->row[buf->cy + 1];
 		row->size = buf->cx;
 		row->size += last->size - buf->markx;
-		row->chars = xrealloc(row->chars, row->size);
+		row->chars = xrealloc(row->chars, row->size + 1);
 		memcpy(&row->chars[buf->cx], &last->chars[buf->markx],
 		       last->size - buf->markx);
+		row->chars[row->size] = 0;
 		editorDelRow(buf, buf->cy + 1);
 	}
 
 	buf->dirty = 1;
+	invalidateRow(buf, buf->cy);
 	editorUpdateBuffer(buf);
 }
 
@@ -304,13 +306,262 @@ void editorTransformRegion(struct editorConfig *ed, struct editorBuffer *buf,
 	ed->kill = okill;
 }
 
+/* Finish the replacements in the region recorded in undo, leaving point
+ * at endx on its last row, and return how many there were */
+static int endReplacements(struct editorBuffer *buf, struct editorUndo *undo,
+			   int endx) {
+	int replaced = undo->nreplaced;
+	editorUndoReplaceEnd(buf, undo);
+	if (replaced > 0) {
+		int starty = buf->cy, startx = buf->cx;
+		buf->cy = buf->marky;
+		buf->cx = endx;
+		buf->marky = starty;
+		buf->markx = startx;
+	}
+	return replaced;
+}
+
+/*
+ * Replace orig with repl throughout the region, rewriting each row with a
+ * match once and in place, and recording the replacements rather than
+ * the region for undo.  orig is matched as a search matches it, ignoring
+ * case unless it has capitals.  Neither may hold a newline.  Leaves the
+ * region round the result, point at its end, and returns how many were
+ * made.
+ */
+int editorReplaceInRegion(struct editorBuffer *buf, const uint8_t *orig,
+			  const uint8_t *repl, int repllen) {
+	normalizeRegion(buf);
+	if (orig[0] == '\0')
+		return 0;
+	searchSetPattern(orig, 0);
+
+	struct editorUndo *undo = editorUndoReplaceBegin(buf);
+	struct abuf line = ABUF_INIT;
+	int endx = buf->markx;
+	for (int at = buf->cy; at <= buf->marky; at++) {
+		erow *row = &buf->row[at];
+		int from = at == buf->cy ? buf->cx : 0;
+		int limit = at == buf->marky ? buf->markx : row->size;
+		int copied = 0, start, end;
+		line.len = 0;
+		while (from < limit && searchNext(buf, at, from, &start, &end) &&
+		       end <= limit) {
+			abAppend(&line, (char *)&row->chars[copied],
+				 start - copied);
+			editorUndoReplaced(undo, at, line.len,
+					   &row->chars[start], end - start,
+					   repl, repllen);
+			abAppend(&line, (char *)repl, repllen);
+			copied = from = end;
+		}
+		if (copied == 0)
+			continue;
+		if (at == buf->marky)
+			endx += line.len - copied;
+		abAppend(&line, (char *)&row->chars[copied],
+			 row->size - copied);
+		rowSetString(buf, row, line.b ? line.b : "", line.len);
+	}
+	abFree(&line);
+
+	return endReplacements(buf, undo, endx);
+}
+
+/* Text of buf from (fromy, fromx) to (toy, tox), rows joined by newlines */
+static void appendSpan(struct abuf *ab, struct editorBuffer *buf, int fromy,
+		       int fromx, int toy, int tox) {
+	for (int i = fromy; i <= toy; i++) {
+		erow *row = &buf->row[i];
+		int start = i == fromy ? fromx : 0;
+		int end = i == toy ? tox : row->size;
+		if (i > fromy)
+			abAppend(ab, "\n", 1);
+		abAppend(ab, (char *)&row->chars[start], end - start);
+	}
+}
+
+#define REPLACE_GROUPS 10
+
+/* Where to look on from after an empty match at x, so as to step over
+ * the character there */
+static int pastEmptyMatch(erow *row, int x) {
+	return x < row->size ? x + utf8_nBytes(row->chars[x]) : x + 1;
+}
+
+/* The replacement puts in a newline, or \n for one as a regex may */
+static int replacementSpansRows(const uint8_t *repl) {
+	for (; *repl; repl++) {
+		if (*repl == '\n' || (repl[0] == '\\' && repl[1] == 'n'))
+			return 1;
+		if (repl[0] == '\\' && repl[1])
+			repl++;
+	}
+	return 0;
+}
+
+/*
+ * Append repl to ab with \& or \0 standing for the match found in row at,
+ * \1 to \9 for its groups, \n for a newline and \\ for a backslash.  A
+ * group that took no part in the match stands for nothing.
+ */
+static void appendReplacement(struct abuf *ab, struct editorBuffer *buf,
+			      int at, const uint8_t *repl,
+			      const struct reSpan *groups) {
+	const uint8_t *copied = repl, *p;
+	for (p = repl; *p; p++) {
+		int group = -1;
+		const char *escaped = NULL;
+		if (*p != '\\')
+			continue;
+		if (p[1] == '&')
+			group = 0;
+		else if (p[1] >= '0' && p[1] <= '9')
+			group = p[1] - '0';
+		else if (p[1] == 'n')
+			escaped = "\n";
+		else if (p[1] == '\\')
+			escaped = "\\";
+		else
+			continue;
+		abAppend(ab, (char *)copied, p - copied);
+		if (escaped) {
+			abAppend(ab, escaped, 1);
+		} else if (groups[group].start >= 0) {
+			int fromy, fromx, toy, tox;
+			searchEndPosition(buf, at, groups[group].start, &fromy,
+					  &fromx);
+			searchEndPosition(buf, at, groups[group].end, &toy,
+					  &tox);
+			appendSpan(ab, buf, fromy, fromx, toy, tox);
+		}
+		copied = ++p + 1;
+	}
+	abAppend(ab, (char *)copied, p - copied);
+}
+
+/*
+ * Replace the matches of a pattern that stays within rows, rewriting each
+ * row once as editorReplaceInRegion does.  An empty match is not made
+ * right where the one before it ended.
+ */
+static int replaceRegexInRows(struct editorBuffer *buf,
+			      const uint8_t *repl) {
+	struct reSpan groups[REPLACE_GROUPS];
+	struct editorUndo *undo = editorUndoReplaceBegin(buf);
+	struct abuf line = ABUF_INIT;
+	int endx = buf->markx;
+	for (int at = buf->cy; at <= buf->marky; at++) {
+		erow *row = &buf->row[at];
+		int from = at == buf->cy ? buf->cx : 0;
+		int limit = at == buf->marky ? buf->markx : row->size;
+		int copied = 0, last = -1;
+		line.len = 0;
+		while (from <= limit &&
+		       searchNextGroups(buf, at, from, groups,
+					REPLACE_GROUPS)) {
+			int start = groups[0].start, end = groups[0].end;
+			if (end > limit)
+				break;
+			if (start == end && start == last) {
+				from = pastEmptyMatch(row, from);
+				continue;
+			}
+			abAppend(&line, (char *)&row->chars[copied],
+				 start - copied);
+			int col = line.len;
+			appendReplacement(&line, buf, at, repl, groups);
+			editorUndoReplaced(undo, at, col, &row->chars[start],
+					   end - start,
+					   line.len > col ?
+						   (uint8_t *)&line.b[col] :
+						   (uint8_t *)"",
+					   line.len - col);
+			copied = last = end;
+			from = end > start ? end : pastEmptyMatch(row, end);
+		}
+		if (last < 0)
+			continue;
+		if (at == buf->marky)
+			endx += line.len - copied;
+		abAppend(&line, (char *)&row->chars[copied],
+			 row->size - copied);
+		rowSetString(buf, row, line.b ? line.b : "", line.len);
+	}
+	abFree(&line);
+	return endReplacements(buf, undo, endx);
+}
+
+static uint8_t *regexReplaced;
+
+static uint8_t *transformerRegexReplaced(uint8_t *UNUSED(input)) {
+	return regexReplaced;
+}
+
+/*
+ * Replace the matches of a pattern with \n in it, or with a replacement
+ * that has one, by building the new text of the whole region and
+ * swapping it in as one undoable step.  Matches are found row by row, a
+ * regex seeing only as many rows on as it needs.
+ */
+static int replaceRegexAcrossRows(struct editorConfig *ed,
+				  struct editorBuffer *buf,
+				  const uint8_t *repl) {
+	struct reSpan groups[REPLACE_GROUPS];
+	struct abuf result = ABUF_INIT;
+	int replaced = 0;
+	int y = buf->cy, x = buf->cx; /* copied up to here */
+	int at = buf->cy, from = buf->cx;
+	while (at <= buf->marky) {
+		int start, end, endy, endx;
+		if (from > buf->row[at].size ||
+		    !searchNextGroups(buf, at, from, groups, REPLACE_GROUPS)) {
+			at++;
+			from = 0;
+			continue;
+		}
+		start = groups[0].start;
+		end = groups[0].end;
+		searchEndPosition(buf, at, end, &endy, &endx);
+		if (endy > buf->marky ||
+		    (endy == buf->marky && endx > buf->markx))
+			break;
+		if (start == end && replaced > 0 && at == y && start == x) {
+			from = pastEmptyMatch(&buf->row[at], from);
+			continue;
+		}
+		appendSpan(&result, buf, y, x, at, start);
+		appendReplacement(&result, buf, at, repl, groups);
+		replaced++;
+		y = at = endy;
+		x = from = endx;
+		if (start == end)
+			from = pastEmptyMatch(&buf->row[at], endx);
+	}
+	if (replaced == 0) {
+		abFree(&result);
+		return 0;
+	}
+	appendSpan(&result, buf, y, x, buf->marky, buf->markx);
+	abAppend(&result, "", 1);
+
+	regexReplaced = (uint8_t *)result.b;
+	editorTransformRegion(ed, buf, transformerRegexReplaced);
+	regexReplaced = NULL;
+	return replaced;
+}
+
+/*
+ * Replace every match of a regex in the region, \1 to \9 in the
+ * replacement standing for what the groups matched.
+ */
 void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 	if (markInvalid())
 		return;
 	normalizeRegion(buf);
 
 	const char *cancel = "Canceled regex-replace.";
-	int madeReplacements = 0;
 
 	uint8_t *regex =
 		editorPrompt(buf, "Regex replace: %s", PROMPT_BASIC, NULL);
@@ -329,154 +580,25 @@ void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 		editorSetStatusMessage(cancel);
 		return;
 	}
-	int replen = strlen((char *)repl);
 
-	uint8_t *okill = NULL;
-	if (ed->kill != NULL) {
-		okill = xmalloc(strlen((char *)ed->kill) + 1);
-		emsys_strlcpy(okill, ed->kill, strlen((char *)ed->kill) + 1);
-	}
-	editorCopyRegion(ed, buf);
-
-	/* This is a transformation, so create a delete undo. However, we're not
-	 * actually doing any deletion yet in this case. */
-	struct editorUndo *new = newUndo();
-	new->startx = buf->cx;
-	new->starty = buf->cy;
-	new->endx = buf->markx;
-	new->endy = buf->marky;
-	new->datalen = strlen((char *)ed->kill);
-	if (new->datasize < new->datalen + 1) {
-		new->datasize = new->datalen + 1;
-		new->data = xrealloc(new->data, new->datasize);
-	}
-	for (int i = 0; i < new->datalen; i++) {
-		new->data[i] = ed->kill[new->datalen - i - 1];
-	}
-	new->data[new->datalen] = 0;
-	new->append = 0;
-	new->delete = 1;
-	new->prev = buf->undo;
-	buf->undo = new;
-
-	/* Create insert undo */
-	new = newUndo();
-	new->startx = buf->cx;
-	new->starty = buf->cy;
-	new->endy = buf->marky;
-	new->datalen = buf->undo->datalen;
-	if (new->datasize < new->datalen + 1) {
-		new->datasize = new->datalen + 1;
-		new->data = xrealloc(new->data, new->datasize);
-	}
-	new->prev = buf->undo;
-	new->append = 0;
-	new->delete = 0;
-	new->paired = 1;
-	buf->undo = new;
-
-	/* Regex boilerplate & setup */
-	regex_t pattern;
-	regmatch_t matches[1];
-	int regcomp_result = regcomp(&pattern, (char *)regex, REG_EXTENDED);
-	if (regcomp_result != 0) {
-		char error_msg[256];
-		regerror(regcomp_result, &pattern, error_msg,
-			 sizeof(error_msg));
-		editorSetStatusMessage("Regex error: %s", error_msg);
+	const char *error = searchSetPattern(regex, 1);
+	if (error) {
+		editorSetStatusMessage("Regex error: %s", error);
 		free(regex);
 		free(repl);
 		return;
 	}
 
-	for (int i = buf->cy; i <= buf->marky; i++) {
-		struct erow *row = &buf->row[i];
-		int regexec_result =
-			regexec(&pattern, (char *)row->chars, 1, matches, 0);
-		int match_idx = (regexec_result == 0) ? matches[0].rm_so : -1;
-		int match_length = (regexec_result == 0) ? (matches[0].rm_eo -
-							    matches[0].rm_so) :
-							   0;
-		if (i != 0)
-			emsys_strlcat((char *)new->data, "\n", new->datasize);
-		if (match_idx < 0) {
-			if (buf->cy == buf->marky) {
-				strncat((char *)new->data,
-					(char *)&row->chars[buf->cx],
-					buf->markx - buf->cx);
-			} else if (i == buf->cy) {
-				emsys_strlcat((char *)new->data,
-					      (char *)&row->chars[buf->cx],
-					      new->datasize);
-			} else if (i == buf->marky) {
-				strncat((char *)new->data, (char *)row->chars,
-					buf->markx);
-			} else {
-				emsys_strlcat((char *)new->data,
-					      (char *)row->chars,
-					      new->datasize);
-			}
-			continue;
-		} else if (i == buf->cy && match_idx < buf->cx) {
-			emsys_strlcat((char *)new->data,
-				      (char *)&row->chars[buf->cx],
-				      new->datasize);
-			continue;
-		} else if (i == buf->marky &&
-			   match_idx + match_length > buf->markx) {
-			strncat((char *)new->data, (char *)row->chars,
-				buf->markx);
-			continue;
-		}
-		madeReplacements++;
-		/* Replace row data */
-		row = &buf->row[i];
-		int extra = replen - match_length;
-		if (extra > 0) {
-			row->chars =
-				xrealloc(row->chars, row->size + 1 + extra);
-			new->datasize += extra;
-			new->data = xrealloc(new->data, new->datasize);
-		}
-		memmove(&row->chars[match_idx + replen],
-			&row->chars[match_idx + match_length],
-			row->size - (match_idx + match_length));
-		memcpy(&row->chars[match_idx], repl, replen);
-		row->size += extra;
-		row->chars[row->size] = 0;
-		if (buf->cy == buf->marky) {
-			buf->markx += extra;
-			strncat((char *)new->data, (char *)&row->chars[buf->cx],
-				buf->markx - buf->cx);
-		} else if (i == buf->cy) {
-			emsys_strlcat((char *)new->data,
-				      (char *)&row->chars[buf->cx],
-				      new->datasize);
-		} else if (i == buf->marky) {
-			buf->markx += extra;
-			strncat((char *)new->data, (char *)row->chars,
-				buf->markx);
-		} else {
-			emsys_strlcat((char *)new->data, (char *)row->chars,
-				      new->datasize);
-		}
-	}
-	/* Now take care of insert undo */
-	new->data[new->datasize - 1] = 0;
-	new->datalen = strlen((char *)new->data);
-	new->endx = buf->markx;
-
-	buf->cx = new->endx;
-	buf->cy = new->endy;
-
-	editorUpdateBuffer(buf);
-	regfree(&pattern);
+	int replaced;
+	if (searchSpansRows() || replacementSpansRows(repl))
+		replaced = replaceRegexAcrossRows(ed, buf, repl);
+	else
+		replaced = replaceRegexInRows(buf, repl);
 	free(regex);
 	free(repl);
 
-	ed->kill = okill;
-
-	editorSetStatusMessage("Replaced %d instances", madeReplacements);
+	editorSetStatusMessage("Replaced %d instance%s", replaced,
+			       replaced == 1 ? "" : "s");
 }
 
 /*** Rectangles ***/
@@ -653,6 +775,8 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->datalen = strlen((char *)new->data);
 
 	buf->dirty = 1;
+	for (int i = topy; i <= boty; i++)
+		invalidateRow(buf, i);
 	editorUpdateBuffer(buf);
 	editorClearMarkQuiet();
 	ed->kill = okill;
@@ -903,6 +1027,8 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->datalen = strlen((char *)new->data);
 
 	buf->dirty = 1;
+	for (int i = topy; i <= boty; i++)
+		invalidateRow(buf, i);
 	editorUpdateBuffer(buf);
 	editorClearMarkQuiet();
 	ed->kill = okill;
@@ -1082,6 +1208,8 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->datalen = strlen((char *)new->data);
 
 	buf->dirty = 1;
+	for (int i = topy; i <= boty; i++)
+		invalidateRow(buf, i);
 	editorUpdateBuffer(buf);
 	editorClearMarkQuiet();
 	ed->kill = okill;
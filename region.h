@@ -26,6 +26,9 @@ void editorYankPop(struct editorConfig *ed, struct editorBuffer *buf);
 void editorTransformRegion(struct editorConfig *ed, struct editorBuffer *buf,
 			   uint8_t *(*transformer)(uint8_t *));
 
+int editorReplaceInRegion(struct editorBuffer *buf, const uint8_t *orig,
+			  const uint8_t *repl, int repllen);
+
 void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf);
 
 void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf);
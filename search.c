@@ -0,0 +1,935 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef EMSYS_DISABLE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include "emsys.h"
+#include "buffer.h"
+#include "display.h"
+#include "re.h"
+#include "search.h"
+#include "trigram.h"
+#include "unicode.h"
+#include "unused.h"
+#include "util.h"
+
+/*
+ * Lazy highlighting of every isearch match on screen.
+ *
+ * The query is compiled once and shared by all rows, and with isearch
+ * itself.  Matches are only
+ * looked for in rows being drawn, and are kept as render column spans in
+ * a small direct-mapped cache keyed by row generation and pattern.  The
+ * looking is capped per frame: once LAZY_FRAME_BUDGET has been spent,
+ * the remaining rows are drawn plain and picked up by later frames, so
+ * a pathological pattern slows the highlighting rather than the typing.
+ */
+
+#define LAZY_CACHE_SLOTS 512
+#define LAZY_FRAME_BUDGET 20000000L /* nanoseconds */
+
+/* A query ready to match; search workers each compile their own */
+struct matcher {
+	const uint8_t *query;
+	size_t len;
+	int regex;
+	int lines; /* newlines in a regex */
+	int fold; /* case is ignored */
+	uint8_t *folded; /* a literal query folded, if fold */
+	struct re *re; /* a regex query compiled, or NULL */
+	struct abuf window; /* rows joined for a regex with newlines */
+	uint8_t *required; /* literal in every match, or NULL */
+	size_t required_len;
+	struct trigramFilter *filter; /* rows the literal may be in */
+	int shared_filter; /* filter belongs to the search job */
+};
+
+/* Searches ignore case when the query has no capitals, as in Emacs */
+static int case_fold = 1;
+
+static struct {
+	uint8_t *query;
+	struct matcher m;
+	int case_fold; /* as it was when m was compiled */
+	char error[80]; /* why a regex query does not compile */
+	unsigned int id; /* changes with query or regex */
+} pattern;
+
+struct lazyMatches {
+	unsigned int gen;
+	unsigned int pattern;
+	struct hlSpan *spans;
+	int n;
+	int capacity;
+};
+
+static struct lazyMatches cache[LAZY_CACHE_SLOTS];
+static long frame_spent;
+
+static long nanosSince(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+	       (now.tv_nsec - start->tv_nsec);
+}
+
+void searchStartFrame(void) {
+	frame_spent = 0;
+}
+
+/*
+ * A regex may name a newline as \n, and then matches across rows: the
+ * row a match starts in is searched joined by newlines to as many of the
+ * rows after it as the pattern has newlines.  The whole buffer is never
+ * joined, and a match can only run past its first row as far as that.
+ */
+
+/* How many times the regex names a newline */
+static int countNewlines(const uint8_t *query) {
+	int lines = 0;
+	while (*query) {
+		if (query[0] == '\\' && query[1] == 'n')
+			lines++;
+		query += query[0] == '\\' && query[1] ? 2 : 1;
+	}
+	return lines;
+}
+
+/* The trigram index only folds ASCII, so a folding search can only go
+ * by the longest ASCII run of its literal */
+static void asciiRequired(struct matcher *m) {
+	size_t best = 0, best_at = 0, run = 0;
+	for (size_t i = 0; i <= m->required_len; i++) {
+		if (i < m->required_len && m->required[i] < 0x80) {
+			run++;
+			continue;
+		}
+		if (run > best) {
+			best = run;
+			best_at = i - run;
+		}
+		run = 0;
+	}
+	memmove(m->required, &m->required[best_at], best);
+	m->required_len = best;
+}
+
+/* Get m ready to match query, which it keeps a pointer to, folding case
+ * if fold is set and query has no capitals.  Returns -1 and copies why
+ * into error if the regex does not compile, or 0. */
+static int matcherInit(struct matcher *m, const uint8_t *query, int regex,
+		       int fold, char *error, size_t errlen) {
+	struct abuf window = ABUF_INIT;
+	m->query = query;
+	m->len = strlen((char *)query);
+	m->regex = regex;
+	m->lines = 0;
+	m->re = NULL;
+	m->fold = fold && !emsys_has_upper(query, m->len, regex);
+	m->folded = NULL;
+	m->window = window;
+	m->required = NULL;
+	m->required_len = 0;
+	m->filter = NULL;
+	m->shared_filter = 0;
+	if (!regex) {
+		m->required = (uint8_t *)xstrdup((char *)query);
+		m->required_len = m->len;
+		if (m->fold) {
+			m->folded = (uint8_t *)xstrdup((char *)query);
+			emsys_fold(m->folded, m->len);
+		}
+	} else {
+		m->lines = countNewlines(query);
+		m->re = reCompile(query, m->len, m->fold ? RE_FOLD : 0, error,
+				  errlen);
+
+		/* A match in joined rows may have its literal in a later
+		 * row */
+		const uint8_t *literal;
+		if (m->re && m->lines == 0 &&
+		    (m->required_len = reRequired(m->re, &literal)) > 0) {
+			m->required = xmalloc(m->required_len);
+			memcpy(m->required, literal, m->required_len);
+		}
+	}
+
+	if (m->required && m->fold) {
+		asciiRequired(m);
+		emsys_fold(m->required, m->required_len);
+	}
+	if (m->required && m->required_len == 0) {
+		free(m->required);
+		m->required = NULL;
+	}
+	return regex && !m->re ? -1 : 0;
+}
+
+static void matcherFree(struct matcher *m) {
+	reFree(m->re);
+	m->re = NULL;
+	abFree(&m->window);
+	m->window.b = NULL;
+	m->window.len = m->window.capacity = 0;
+	free(m->required);
+	m->required = NULL;
+	free(m->folded);
+	m->folded = NULL;
+	if (!m->shared_filter)
+		trigramFilterFree(m->filter);
+	m->filter = NULL;
+	m->shared_filter = 0;
+}
+
+/*
+ * Row at cannot match, going by the trigram index of buf.  m's filter
+ * is made again when the index has moved on too far from it; the one a
+ * search worker shares is made for the job and is left alone.
+ */
+static int matcherSkips(struct matcher *m, struct editorBuffer *buf, int at) {
+	if (!buf->trigrams || !m->required)
+		return 0;
+	if (!trigramFilterCurrent(m->filter, buf)) {
+		if (m->shared_filter)
+			return 0;
+		trigramFilterFree(m->filter);
+		m->filter = trigramFilterNew(buf, m->required, m->required_len);
+	}
+	return trigramFilterSkips(m->filter, &buf->row[at]);
+}
+
+/*
+ * Make query the pattern searched for, compiling it if it is a regex and
+ * it changed.  Returns NULL, or why the regex does not compile; an
+ * invalid pattern matches nothing.
+ */
+const char *searchSetPattern(const uint8_t *query, int regex) {
+	if (pattern.query && pattern.m.regex == regex &&
+	    pattern.case_fold == case_fold &&
+	    strcmp((char *)pattern.query, (char *)query) == 0)
+		return pattern.error[0] ? pattern.error : NULL;
+
+	matcherFree(&pattern.m);
+	free(pattern.query);
+	pattern.query = (uint8_t *)xstrdup((char *)query);
+	pattern.error[0] = 0;
+	pattern.case_fold = case_fold;
+	matcherInit(&pattern.m, pattern.query, regex, case_fold, pattern.error,
+		    sizeof(pattern.error));
+	if (++pattern.id == 0)
+		pattern.id = 1;
+	return pattern.error[0] ? pattern.error : NULL;
+}
+
+int searchCaseFold(void) {
+	return case_fold;
+}
+
+/* Whether a search for query ignores case */
+int searchFoldsCase(const uint8_t *query, int regex) {
+	return case_fold &&
+	       !emsys_has_upper(query, strlen((char *)query), regex);
+}
+
+void searchSetCaseFold(int fold) {
+	case_fold = fold;
+}
+
+/* The pattern can match across rows */
+int searchSpansRows(void) {
+	return pattern.m.lines > 0;
+}
+
+/* Row at and the rows after it that a match starting there may reach,
+ * joined by newlines; *len is set to their length */
+static const uint8_t *joinRows(struct matcher *m, struct editorBuffer *buf,
+			       int at, size_t *len) {
+	int last = at + m->lines;
+	if (last >= buf->numrows)
+		last = buf->numrows - 1;
+	m->window.len = 0;
+	for (int i = at; i <= last; i++) {
+		if (i > at)
+			abAppend(&m->window, "\n", 1);
+		abAppend(&m->window, (char *)buf->row[i].chars,
+			 buf->row[i].size);
+	}
+	*len = m->window.len;
+	return (uint8_t *)m->window.b;
+}
+
+/* First match of regex m in row at from byte from, with its groups */
+static int matcherGroups(struct matcher *m, struct editorBuffer *buf, int at,
+			 int from, struct reSpan *groups, int ngroups) {
+	erow *row = &buf->row[at];
+	const uint8_t *text = row->chars;
+	size_t len = row->size;
+	if (m->lines > 0)
+		text = joinRows(m, buf, at, &len);
+	if (!m->re || !reSearch(m->re, text, len, from, groups, ngroups))
+		return 0;
+	/* Matches starting in later rows are found from those */
+	return groups[0].start <= row->size;
+}
+
+static int matcherNext(struct matcher *m, struct editorBuffer *buf, int at,
+		       int from, int *start, int *end) {
+	erow *row = &buf->row[at];
+	if (matcherSkips(m, buf, at))
+		return 0;
+	if (m->regex) {
+		struct reSpan match;
+		if (!matcherGroups(m, buf, at, from, &match, 1))
+			return 0;
+		*start = match.start;
+		*end = match.end;
+		return 1;
+	}
+
+	uint8_t *hit;
+	if (m->fold)
+		hit = emsys_memmem_fold(&row->chars[from], row->size - from,
+					m->folded, m->len);
+	else
+		hit = emsys_memmem(&row->chars[from], row->size - from,
+				   m->query, m->len);
+	if (!hit)
+		return 0;
+	*start = hit - row->chars;
+	*end = *start + m->len;
+	return 1;
+}
+
+/*
+ * First match of the pattern starting in row at or after byte from, as
+ * [*start, *end).  A match across rows ends past the row's size, *end
+ * counting on through the following rows with a byte for each newline;
+ * see searchEndPosition.
+ */
+int searchNext(struct editorBuffer *buf, int at, int from, int *start,
+	       int *end) {
+	return matcherNext(&pattern.m, buf, at, from, start, end);
+}
+
+/* Last match starting in row at before byte limit, or anywhere in the
+ * row when limit is negative */
+static int matcherLast(struct matcher *m, struct editorBuffer *buf, int at,
+		       int limit, int *start, int *end) {
+	erow *row = &buf->row[at];
+	if (limit < 0 || limit > row->size + 1)
+		limit = row->size + 1;
+	if (matcherSkips(m, buf, at))
+		return 0;
+	if (m->regex) {
+		struct reSpan match;
+		const uint8_t *text = row->chars;
+		size_t len = row->size;
+		if (m->lines > 0)
+			text = joinRows(m, buf, at, &len);
+		if (!m->re || !reSearchLast(m->re, text, len, limit, &match))
+			return 0;
+		*start = match.start;
+		*end = match.end;
+		return 1;
+	}
+
+	int found = 0, from = 0, s, e;
+	while (from < limit && matcherNext(m, buf, at, from, &s, &e) &&
+	       s < limit) {
+		*start = s;
+		*end = e;
+		found = 1;
+		from = s + 1;
+	}
+	return found;
+}
+
+/*
+ * As searchNext, for a regex pattern, with its first ngroups groups as
+ * byte offsets from the start of row at; groups that took no part in
+ * the match are -1.
+ */
+int searchNextGroups(struct editorBuffer *buf, int at, int from,
+		     struct reSpan *groups, int ngroups) {
+	if (!pattern.m.regex || matcherSkips(&pattern.m, buf, at))
+		return 0;
+	return matcherGroups(&pattern.m, buf, at, from, groups, ngroups);
+}
+
+/* Last match of the pattern starting in row at before byte limit, or
+ * anywhere in the row if limit is negative; as searchNext otherwise */
+int searchLast(struct editorBuffer *buf, int at, int limit, int *start,
+	       int *end) {
+	return matcherLast(&pattern.m, buf, at, limit, start, end);
+}
+
+/*
+ * A pattern of its own, for a caller that searches alongside isearch
+ * rather than with its pattern.  Returns NULL and copies why into error
+ * if the regex does not compile.
+ */
+struct matcher *searchMatcherNew(const uint8_t *query, int regex,
+				 char *error, size_t errlen) {
+	struct matcher *m = xmalloc(sizeof(*m));
+	uint8_t *copy = (uint8_t *)xstrdup((char *)query);
+	if (matcherInit(m, copy, regex, case_fold, error, errlen) < 0) {
+		free(copy);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* As searchNext, with m for the pattern */
+int searchMatcherNext(struct matcher *m, struct editorBuffer *buf, int at,
+		      int from, int *start, int *end) {
+	return matcherNext(m, buf, at, from, start, end);
+}
+
+/* m matches in the len bytes of line */
+static int lineMatches(struct matcher *m, const uint8_t *line, size_t len) {
+	if (!m->regex && m->fold)
+		return emsys_memmem_fold(line, len, m->folded, m->len) != NULL;
+	if (!m->regex)
+		return emsys_memmem(line, len, m->query, m->len) != NULL;
+	return m->re && reMatches(m->re, line, len);
+}
+
+/*
+ * The next line of the n bytes of text, from byte from on, that m
+ * matches in, put as [*start, *end) without its newline.  The literal
+ * every match has is looked for first, and only the lines it turns up in
+ * are matched, so most of the text is passed over at memmem speed.
+ */
+int searchMatcherNextLine(struct matcher *m, uint8_t *text, size_t n,
+			  size_t from, size_t *start, size_t *end) {
+	while (from < n) {
+		size_t at = from;
+		if (m->required) {
+			uint8_t *hit;
+			if (m->fold)
+				hit = emsys_memmem_fold(text + from, n - from,
+							m->required,
+							m->required_len);
+			else
+				hit = emsys_memmem(text + from, n - from,
+						   m->required,
+						   m->required_len);
+			if (!hit)
+				return 0;
+			at = hit - text;
+			while (at > from && text[at - 1] != '\n')
+				at--;
+		}
+		uint8_t *eol = memchr(text + at, '\n', n - at);
+		size_t stop = eol ? (size_t)(eol - text) : n;
+		if (lineMatches(m, text + at, stop - at)) {
+			*start = at;
+			*end = stop;
+			return 1;
+		}
+		from = stop + 1;
+	}
+	return 0;
+}
+
+void searchMatcherFree(struct matcher *m) {
+	if (!m)
+		return;
+	matcherFree(m);
+	free((uint8_t *)m->query);
+	free(m);
+}
+
+/* Row and byte where a match from searchNext that started in row at and
+ * ended at byte end of it comes to an end */
+void searchEndPosition(struct editorBuffer *buf, int at, int end, int *endrow,
+		       int *endx) {
+	while (at < buf->numrows - 1 && end > buf->row[at].size) {
+		end -= buf->row[at].size + 1;
+		at++;
+	}
+	*endrow = at;
+	*endx = end;
+}
+
+/* Render column of byte target, walking on from an earlier (*byte, *col)
+ * since matches come in order; far jumps go through the row checkpoints */
+static int columnAt(erow *row, int target, int *byte, int *col) {
+	if (target - *byte > 4096) {
+		*col = charsToDisplayColumn(row, target);
+		*byte = target;
+	}
+	while (*byte < target && *byte < row->size) {
+		int i = *byte;
+		*col = nextScreenX(row->chars, &i, *col);
+		*byte = i + 1;
+	}
+	return *col;
+}
+
+/* Render cache key for spans that may change while their row does not */
+static unsigned int spansKey(const struct hlSpan *spans, int n) {
+	unsigned int h = pattern.id * 2654435761u;
+	for (int i = 0; i < n; i++)
+		h = (h ^ spans[i].start ^ (unsigned int)spans[i].end << 16) *
+		    16777619u;
+	return h ? h : 1;
+}
+
+/*
+ * Render column spans of every match of buf's isearch query in row, or
+ * NULL when there is no query, no match, or no time left this frame.
+ * *key identifies the spans for the render cache; 0 means none.  A match
+ * running on into the next rows is shown up to the end of the row it
+ * starts in; such matches depend on more than the row, so they are
+ * found afresh every frame.
+ */
+const struct hlSpan *searchRowMatches(struct editorBuffer *buf, erow *row,
+				      int *nmatches, unsigned int *key) {
+	*nmatches = 0;
+	*key = 0;
+	if (!buf->query || !buf->query[0])
+		return NULL;
+	if (searchSetPattern(buf->query, buf->query_regex))
+		return NULL;
+
+	struct lazyMatches *slot = &cache[row->gen % LAZY_CACHE_SLOTS];
+	if (slot->gen != row->gen || slot->pattern != pattern.id ||
+	    pattern.m.lines > 0) {
+		if (frame_spent >= LAZY_FRAME_BUDGET)
+			return NULL;
+
+		struct timespec started;
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		slot->gen = 0;
+		slot->n = 0;
+
+		int at = row - buf->row;
+		int from = 0, start, end, complete = 1;
+		int byte = 0, col = 0;
+		while (from <= row->size &&
+		       searchNext(buf, at, from, &start, &end)) {
+			if (end > start) {
+				if (slot->n == slot->capacity) {
+					slot->capacity = slot->capacity ?
+								 slot->capacity * 2 :
+								 8;
+					slot->spans = xrealloc(
+						slot->spans,
+						slot->capacity *
+							sizeof(struct hlSpan));
+				}
+				slot->spans[slot->n].start =
+					columnAt(row, start, &byte, &col);
+				slot->spans[slot->n].end = columnAt(
+					row, end < row->size ? end : row->size,
+					&byte, &col);
+				slot->n++;
+				from = end;
+			} else if (start < row->size) {
+				from = start + utf8_nBytes(row->chars[start]);
+			} else {
+				from = start + 1;
+			}
+			if (slot->n % 64 == 0 &&
+			    frame_spent + nanosSince(&started) >=
+				    LAZY_FRAME_BUDGET) {
+				complete = 0;
+				break;
+			}
+		}
+		frame_spent += nanosSince(&started);
+		if (!complete)
+			return NULL;
+		slot->gen = row->gen;
+		slot->pattern = pattern.id;
+	}
+
+	if (slot->n == 0)
+		return NULL;
+	*nmatches = slot->n;
+	*key = pattern.m.lines > 0 ? spansKey(slot->spans, slot->n) :
+				     pattern.id;
+	return slot->spans;
+}
+
+/*
+ * Scans over many rows for searchJobStart.  The rows are cut into chunks
+ * taken in scan order by a pool of worker threads, each with its own
+ * compiled copy of the pattern.  The buffer is read, never written, so it
+ * must not change while a job runs: a job belongs to the prompt that
+ * started it and is cancelled or waited for before the prompt returns.
+ * A match is only reported once every chunk before its own has been
+ * found to have none.  Without threads, searchJobPoll scans the chunks
+ * itself, one per call.
+ */
+
+#define SEARCH_CHUNK_ROWS 4096
+#define SEARCH_CANCEL_ROWS 256 /* rows between looks at job.cancel */
+#define SEARCH_MAX_WORKERS 8
+
+struct chunkResult {
+	int done;
+	int row; /* of the match, or -1 */
+	int start;
+	long count;
+	long before; /* of those, before the mark */
+};
+
+static struct {
+	struct editorBuffer *buf;
+	uint8_t *query;
+	int regex;
+	int case_fold;
+	struct trigramFilter *filter; /* made for the job, or NULL */
+	int mode;
+	int first; /* row scanned first */
+	int nrows;
+	int direction;
+	int mark; /* scan position of point's row when the job started */
+	int mark_x; /* and point in it */
+	int nchunks;
+	int next; /* chunk to hand out next */
+	int found; /* first chunk known to hold a match, nchunks if none */
+	int settled; /* chunks before this are done without a match */
+	int chunks_done;
+	long count;
+	long before;
+	struct chunkResult *chunks;
+	int active; /* started and neither cancelled nor reported done */
+	int cancel;
+	int running; /* workers busy with the job */
+	unsigned int gen; /* bumped for every job started */
+} job;
+
+/* The pattern as compiled for scans run on the main thread */
+static struct matcher own;
+static int own_ready;
+
+/* Have m skip rows by the job's filter rather than make its own */
+static void shareFilter(struct matcher *m) {
+	if (job.filter && m->required) {
+		m->filter = job.filter;
+		m->shared_filter = 1;
+	}
+}
+
+/* Row looked in at position k of the scan */
+static int jobRow(int k) {
+	int row = (job.first + job.direction * (long)k) % job.buf->numrows;
+	return row < 0 ? row + job.buf->numrows : row;
+}
+
+#ifndef EMSYS_DISABLE_THREADS
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_started = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_progress = PTHREAD_COND_INITIALIZER;
+static int nworkers = -1; /* -1 until the pool is started */
+
+#define LOCK() pthread_mutex_lock(&job_lock)
+#define UNLOCK() pthread_mutex_unlock(&job_lock)
+#else
+#define LOCK() ((void)0)
+#define UNLOCK() ((void)0)
+#endif
+
+/* The chunk can be given up: the job was cancelled, or an earlier chunk
+ * has the match */
+static int chunkMoot(int chunk) {
+	LOCK();
+	int moot = job.cancel || (job.mode == SEARCH_FIND && job.found < chunk);
+	UNLOCK();
+	return moot;
+}
+
+static void scanChunk(struct matcher *m, int chunk, struct chunkResult *r) {
+	int k = chunk * SEARCH_CHUNK_ROWS;
+	int end = k + SEARCH_CHUNK_ROWS < job.nrows ? k + SEARCH_CHUNK_ROWS :
+						      job.nrows;
+	r->row = -1;
+	r->count = 0;
+	r->before = 0;
+	for (; k < end; k++) {
+		if (k % SEARCH_CANCEL_ROWS == 0 && chunkMoot(chunk))
+			return;
+		int at = jobRow(k);
+		erow *row = &job.buf->row[at];
+		int from = 0, start, end_byte;
+		if (job.mode == SEARCH_FIND) {
+			int hit;
+			if (job.direction > 0)
+				hit = matcherNext(m, job.buf, at, 0, &start,
+						  &end_byte);
+			else
+				hit = matcherLast(m, job.buf, at, -1, &start,
+						  &end_byte);
+			if (hit) {
+				r->row = at;
+				r->start = start;
+				return;
+			}
+			continue;
+		}
+		while (from <= row->size &&
+		       matcherNext(m, job.buf, at, from, &start, &end_byte)) {
+			r->count++;
+			if (k < job.mark ||
+			    (k == job.mark && start < job.mark_x))
+				r->before++;
+			if (end_byte > start)
+				from = end_byte;
+			else if (start < row->size)
+				from = start + utf8_nBytes(row->chars[start]);
+			else
+				from = start + 1;
+		}
+	}
+}
+
+/* Record a scanned chunk; called with the lock held */
+static void chunkDone(int chunk, const struct chunkResult *r) {
+	job.chunks[chunk] = *r;
+	job.chunks[chunk].done = 1;
+	job.chunks_done++;
+	job.count += r->count;
+	job.before += r->before;
+	if (r->row >= 0 && chunk < job.found)
+		job.found = chunk;
+}
+
+#ifndef EMSYS_DISABLE_THREADS
+static void *searchWorker(void *UNUSED(arg)) {
+	unsigned int seen = 0;
+	LOCK();
+	for (;;) {
+		while (job.gen == seen)
+			pthread_cond_wait(&job_started, &job_lock);
+		seen = job.gen;
+		if (!job.active || job.cancel)
+			continue;
+
+		struct matcher m;
+		uint8_t *query = (uint8_t *)xstrdup((char *)job.query);
+		job.running++;
+		UNLOCK();
+		matcherInit(&m, query, job.regex, job.case_fold, NULL, 0);
+		LOCK();
+		shareFilter(&m);
+		while (!job.cancel && job.next < job.nchunks &&
+		       (job.mode == SEARCH_COUNT || job.next < job.found)) {
+			int chunk = job.next++;
+			struct chunkResult r;
+			UNLOCK();
+			scanChunk(&m, chunk, &r);
+			LOCK();
+			if (!job.cancel)
+				chunkDone(chunk, &r);
+			pthread_cond_broadcast(&job_progress);
+		}
+		job.running--;
+		pthread_cond_broadcast(&job_progress);
+		UNLOCK();
+		matcherFree(&m);
+		free(query);
+		LOCK();
+	}
+	return NULL;
+}
+#endif
+
+/* Worker threads searches run on, started the first time; 0 if none */
+int searchWorkers(void) {
+#ifndef EMSYS_DISABLE_THREADS
+	if (nworkers >= 0)
+		return nworkers;
+	nworkers = 0;
+	long cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (cpus <= 1)
+		return nworkers;
+	if (cpus > SEARCH_MAX_WORKERS)
+		cpus = SEARCH_MAX_WORKERS;
+
+	/* Signals are for the main thread */
+	sigset_t all, saved;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (int i = 0; i < cpus; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, searchWorker, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		nworkers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return nworkers;
+#else
+	return 0;
+#endif
+}
+
+/* Stop the job, if any, waiting for the workers to let go of it */
+void searchJobCancel(void) {
+	LOCK();
+	if (job.chunks) {
+		job.cancel = 1;
+#ifndef EMSYS_DISABLE_THREADS
+		while (job.running > 0)
+			pthread_cond_wait(&job_progress, &job_lock);
+#endif
+		if (own_ready)
+			matcherFree(&own);
+		own_ready = 0;
+		trigramFilterFree(job.filter);
+		free(job.chunks);
+		free(job.query);
+		job.filter = NULL;
+		job.chunks = NULL;
+		job.query = NULL;
+		job.active = 0;
+	}
+	UNLOCK();
+}
+
+/*
+ * Scan nrows rows of buf for the current pattern, from row first on in
+ * direction and wrapping round the ends.  SEARCH_FIND looks for the first
+ * match in the scan, taking the last match in a row going backward;
+ * SEARCH_COUNT counts every match, and apart those before point, that is
+ * in rows scanned before point's and before it in its row.
+ */
+void searchJobStart(struct editorBuffer *buf, int mode, int first, int nrows,
+		    int direction) {
+	searchJobCancel();
+	searchWorkers();
+
+	LOCK();
+	job.buf = buf;
+	job.query = (uint8_t *)xstrdup((char *)pattern.query);
+	job.regex = pattern.m.regex;
+	job.case_fold = pattern.case_fold;
+	job.filter = NULL;
+	if (buf->trigrams && pattern.m.required)
+		job.filter = trigramFilterNew(buf, pattern.m.required,
+					      pattern.m.required_len);
+	job.mode = mode;
+	job.first = first;
+	job.nrows = buf->numrows > 0 ? nrows : 0;
+	job.direction = direction;
+	job.mark = (buf->cy - first) * direction;
+	if (job.mark < 0)
+		job.mark += buf->numrows;
+	job.mark_x = buf->cx;
+	job.nchunks = (job.nrows + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+	job.next = 0;
+	job.found = job.nchunks;
+	job.settled = 0;
+	job.chunks_done = 0;
+	job.count = 0;
+	job.before = 0;
+	job.chunks = xcalloc(job.nchunks + 1, sizeof(struct chunkResult));
+	job.cancel = 0;
+	job.active = 1;
+	job.gen++;
+#ifndef EMSYS_DISABLE_THREADS
+	pthread_cond_broadcast(&job_started);
+#endif
+	UNLOCK();
+}
+
+/* Fill in res if the job has its answer; called with the lock held */
+static int jobAnswer(struct searchResult *res) {
+	res->count = job.count;
+	res->before = job.before;
+	res->placed = 0;
+	res->found = 0;
+	if (job.mode == SEARCH_COUNT) {
+		/* The count before point is whole once the chunks up to
+		 * point's are */
+		while (job.settled < job.nchunks &&
+		       job.chunks[job.settled].done)
+			job.settled++;
+		res->placed = job.settled * SEARCH_CHUNK_ROWS > job.mark ||
+			      job.settled == job.nchunks;
+		return job.chunks_done == job.nchunks;
+	}
+
+	while (job.settled < job.nchunks && job.chunks[job.settled].done &&
+	       job.chunks[job.settled].row < 0)
+		job.settled++;
+	if (job.settled == job.nchunks)
+		return 1;
+	if (!job.chunks[job.settled].done)
+		return 0;
+
+	struct chunkResult *r = &job.chunks[job.settled];
+	res->found = 1;
+	res->row = r->row;
+	res->start = r->start;
+	/* Position of the row in the scan */
+	res->index = (r->row - job.first) * job.direction;
+	if (res->index < 0)
+		res->index += job.buf->numrows;
+	return 1;
+}
+
+/*
+ * Wait up to wait_ms for the job started last to have its answer.
+ * Returns 1 and fills in res once it has, after which the job is over;
+ * res->count is kept up to date while counting.
+ */
+int searchJobPoll(struct searchResult *res, int wait_ms) {
+	int answered;
+	LOCK();
+	if (!job.active) {
+		UNLOCK();
+		res->found = 0;
+		res->count = 0;
+		res->before = 0;
+		res->placed = 1;
+		return 1;
+	}
+#ifndef EMSYS_DISABLE_THREADS
+	if (nworkers > 0) {
+		if (!jobAnswer(res)) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += wait_ms * 1000000L;
+			until.tv_sec += until.tv_nsec / 1000000000L;
+			until.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&job_progress, &job_lock,
+					       &until);
+		}
+	} else
+#endif
+	{
+		(void)wait_ms;
+		if (job.next < job.nchunks &&
+		    (job.mode == SEARCH_COUNT || job.next < job.found)) {
+			struct chunkResult r;
+			int chunk = job.next++;
+			UNLOCK();
+			if (!own_ready) {
+				matcherInit(&own, job.query, job.regex,
+					    job.case_fold, NULL, 0);
+				shareFilter(&own);
+				own_ready = 1;
+			}
+			scanChunk(&own, chunk, &r);
+			LOCK();
+			chunkDone(chunk, &r);
+		}
+	}
+	answered = jobAnswer(res);
+	UNLOCK();
+	if (answered)
+		searchJobCancel();
+	return answered;
+}
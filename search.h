@@ -0,0 +1,54 @@
+#ifndef EMSYS_SEARCH_H
+#define EMSYS_SEARCH_H
+#include <stdint.h>
+#include "emsys.h"
+#include "display.h"
+#include "re.h"
+
+const char *searchSetPattern(const uint8_t *query, int regex);
+int searchNext(struct editorBuffer *buf, int at, int from, int *start,
+	       int *end);
+int searchNextGroups(struct editorBuffer *buf, int at, int from,
+		     struct reSpan *groups, int ngroups);
+int searchLast(struct editorBuffer *buf, int at, int limit, int *start,
+	       int *end);
+int searchSpansRows(void);
+int searchCaseFold(void);
+int searchFoldsCase(const uint8_t *query, int regex);
+void searchSetCaseFold(int fold);
+void searchEndPosition(struct editorBuffer *buf, int at, int end, int *endrow,
+		       int *endx);
+void searchStartFrame(void);
+
+struct matcher;
+struct matcher *searchMatcherNew(const uint8_t *query, int regex,
+				 char *error, size_t errlen);
+int searchMatcherNext(struct matcher *m, struct editorBuffer *buf, int at,
+		      int from, int *start, int *end);
+int searchMatcherNextLine(struct matcher *m, uint8_t *text, size_t n,
+			  size_t from, size_t *start, size_t *end);
+void searchMatcherFree(struct matcher *m);
+
+/* Scans over many rows, see searchJobStart */
+#define SEARCH_FIND 0
+#define SEARCH_COUNT 1
+
+struct searchResult {
+	int found;
+	int row; /* where the match is */
+	int start;
+	int index; /* how far into the scan the row is */
+	long count; /* matches counted so far */
+	long before; /* of those, matches before point */
+	int placed; /* every match before point is in before */
+};
+
+int searchWorkers(void);
+void searchJobStart(struct editorBuffer *buf, int mode, int first, int nrows,
+		    int direction);
+int searchJobPoll(struct searchResult *res, int wait_ms);
+void searchJobCancel(void);
+const struct hlSpan *searchRowMatches(struct editorBuffer *buf, erow *row,
+				      int *nmatches, unsigned int *key);
+
+#endif
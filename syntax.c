@@ -0,0 +1,318 @@
+#include <stdint.h>
+#include <string.h>
+#include "emsys.h"
+#include "syntax.h"
+
+/*
+ * Table-driven syntax highlighting.
+ *
+ * A row is lexed from the state the lexer was in at the end of the row
+ * above it: normal, inside a block comment, or inside a string.  Each
+ * row keeps that start state in hl_state.  An edit only marks the rows
+ * whose start state may have moved (hl_changed) and lowers the buffer's
+ * hl_valid_rows; the next redraw re-lexes forward from there, and stops
+ * re-lexing as soon as a row's recomputed start state matches the one it
+ * already had.  Rows are only ever brought up to date as far as the
+ * last row on screen, and only on-screen rows are coloured.
+ */
+
+#define SYN_NORMAL 0
+#define SYN_COMMENT 1
+#define SYN_STRING 2 /* plus the index of the quote in syn->quotes */
+
+static const char *const c_files[] = { ".c", ".h", NULL };
+static const struct syntaxWord c_words[] = {
+	{ "auto", HL_KEYWORD },	    { "break", HL_KEYWORD },
+	{ "case", HL_KEYWORD },	    { "const", HL_KEYWORD },
+	{ "continue", HL_KEYWORD }, { "default", HL_KEYWORD },
+	{ "do", HL_KEYWORD },	    { "else", HL_KEYWORD },
+	{ "enum", HL_KEYWORD },	    { "extern", HL_KEYWORD },
+	{ "for", HL_KEYWORD },	    { "goto", HL_KEYWORD },
+	{ "if", HL_KEYWORD },	    { "inline", HL_KEYWORD },
+	{ "register", HL_KEYWORD }, { "restrict", HL_KEYWORD },
+	{ "return", HL_KEYWORD },   { "sizeof", HL_KEYWORD },
+	{ "static", HL_KEYWORD },   { "struct", HL_KEYWORD },
+	{ "switch", HL_KEYWORD },   { "typedef", HL_KEYWORD },
+	{ "union", HL_KEYWORD },    { "volatile", HL_KEYWORD },
+	{ "while", HL_KEYWORD },    { "NULL", HL_KEYWORD },
+	{ "char", HL_TYPE },	    { "double", HL_TYPE },
+	{ "float", HL_TYPE },	    { "int", HL_TYPE },
+	{ "long", HL_TYPE },	    { "short", HL_TYPE },
+	{ "signed", HL_TYPE },	    { "unsigned", HL_TYPE },
+	{ "void", HL_TYPE },	    { "_Bool", HL_TYPE },
+	{ "size_t", HL_TYPE },	    { "ssize_t", HL_TYPE },
+	{ "int8_t", HL_TYPE },	    { "int16_t", HL_TYPE },
+	{ "int32_t", HL_TYPE },	    { "int64_t", HL_TYPE },
+	{ "uint8_t", HL_TYPE },	    { "uint16_t", HL_TYPE },
+	{ "uint32_t", HL_TYPE },    { "uint64_t", HL_TYPE },
+	{ "FILE", HL_TYPE },	    { NULL, 0 },
+};
+
+static const char *const sh_files[] = { ".sh", ".bash", ".bashrc", ".profile",
+					NULL };
+static const struct syntaxWord sh_words[] = {
+	{ "if", HL_KEYWORD },	    { "then", HL_KEYWORD },
+	{ "else", HL_KEYWORD },	    { "elif", HL_KEYWORD },
+	{ "fi", HL_KEYWORD },	    { "case", HL_KEYWORD },
+	{ "esac", HL_KEYWORD },	    { "for", HL_KEYWORD },
+	{ "while", HL_KEYWORD },    { "until", HL_KEYWORD },
+	{ "do", HL_KEYWORD },	    { "done", HL_KEYWORD },
+	{ "in", HL_KEYWORD },	    { "function", HL_KEYWORD },
+	{ "return", HL_KEYWORD },   { "local", HL_KEYWORD },
+	{ "export", HL_KEYWORD },   { "readonly", HL_KEYWORD },
+	{ "break", HL_KEYWORD },    { "continue", HL_KEYWORD },
+	{ "exit", HL_KEYWORD },	    { NULL, 0 },
+};
+
+static const char *const json_files[] = { ".json", NULL };
+static const struct syntaxWord json_words[] = {
+	{ "true", HL_KEYWORD },
+	{ "false", HL_KEYWORD },
+	{ "null", HL_KEYWORD },
+	{ NULL, 0 },
+};
+
+static const char *const diff_files[] = { ".diff", ".patch", NULL };
+/* First match wins, so the longer prefixes come first */
+static const struct syntaxWord diff_prefixes[] = {
+	{ "diff ", HL_HEADER }, { "index ", HL_HEADER }, { "+++", HL_HEADER },
+	{ "---", HL_HEADER },	{ "@@", HL_HUNK },	 { "+", HL_ADDED },
+	{ "-", HL_REMOVED },	{ NULL, 0 },
+};
+
+static const char *const log_files[] = { ".log", NULL };
+static const struct syntaxWord log_words[] = {
+	{ "FATAL", HL_ERROR },	   { "fatal", HL_ERROR },
+	{ "PANIC", HL_ERROR },	   { "CRITICAL", HL_ERROR },
+	{ "CRIT", HL_ERROR },	   { "crit", HL_ERROR },
+	{ "ERROR", HL_ERROR },	   { "error", HL_ERROR },
+	{ "WARNING", HL_WARNING }, { "WARN", HL_WARNING },
+	{ "warning", HL_WARNING }, { "warn", HL_WARNING },
+	{ "NOTICE", HL_INFO },	   { "notice", HL_INFO },
+	{ "INFO", HL_INFO },	   { "info", HL_INFO },
+	{ "DEBUG", HL_DEBUG },	   { "debug", HL_DEBUG },
+	{ "TRACE", HL_DEBUG },	   { "trace", HL_DEBUG },
+	{ NULL, 0 },
+};
+
+static const struct editorSyntax syntaxes[] = {
+	{ "C", c_files, c_words, NULL, "//", "/*", "*/", "\"'",
+	  HL_NUMBERS | HL_DIRECTIVES },
+	{ "Shell", sh_files, sh_words, NULL, "#", NULL, NULL, "\"'`",
+	  HL_NUMBERS | HL_COMMENT_AT_WORD | HL_MULTILINE_STRINGS |
+		  HL_RAW_SINGLE_QUOTES },
+	{ "JSON", json_files, json_words, NULL, NULL, NULL, NULL, "\"",
+	  HL_NUMBERS },
+	{ "Diff", diff_files, NULL, diff_prefixes, NULL, NULL, NULL, NULL, 0 },
+	{ "Log", log_files, log_words, NULL, NULL, NULL, NULL, NULL, 0 },
+};
+
+const struct editorSyntax *syntaxForFilename(const char *filename) {
+	if (!filename)
+		return NULL;
+	size_t len = strlen(filename);
+	for (size_t s = 0; s < sizeof(syntaxes) / sizeof(syntaxes[0]); s++) {
+		for (const char *const *m = syntaxes[s].filematch; *m; m++) {
+			size_t mlen = strlen(*m);
+			if (mlen <= len &&
+			    strcmp(filename + len - mlen, *m) == 0)
+				return &syntaxes[s];
+		}
+	}
+	return NULL;
+}
+
+static int isWordChar(uint8_t c) {
+	return ('0' <= c && c <= '9') || ('a' <= c && c <= 'z') ||
+	       ('A' <= c && c <= 'Z') || c == '_' || c >= 0x80;
+}
+
+static int startsAt(const uint8_t *chars, int size, int i, const char *s) {
+	int len = strlen(s);
+	return i + len <= size && memcmp(&chars[i], s, len) == 0;
+}
+
+static unsigned char wordClass(const struct syntaxWord *words,
+			       const uint8_t *s, int len) {
+	if (!words)
+		return HL_NORMAL;
+	for (; words->word; words++) {
+		if (words->word[0] == s[0] &&
+		    strncmp(words->word, (const char *)s, len) == 0 &&
+		    words->word[len] == '\0')
+			return words->cls;
+	}
+	return HL_NORMAL;
+}
+
+static void mark(unsigned char *cls, int at, int len, unsigned char c) {
+	if (cls)
+		memset(&cls[at], c, len);
+}
+
+/*
+ * Lex one row starting in state, filling cls (if not NULL) with a class
+ * per byte, and return the state at the end of the row.
+ */
+unsigned char syntaxLexRow(const struct editorSyntax *syn,
+			   const uint8_t *chars, int size, unsigned char state,
+			   unsigned char *cls) {
+	int word_start = 1;
+	int i = 0;
+
+	if (syn->prefixes) {
+		const struct syntaxWord *p = syn->prefixes;
+		while (p->word && !startsAt(chars, size, 0, p->word))
+			p++;
+		mark(cls, 0, size, p->word ? p->cls : HL_NORMAL);
+		return SYN_NORMAL;
+	}
+
+	while (i < size) {
+		uint8_t c = chars[i];
+
+		if (state == SYN_COMMENT) {
+			if (startsAt(chars, size, i, syn->block_end)) {
+				int len = strlen(syn->block_end);
+				mark(cls, i, len, HL_COMMENT);
+				i += len;
+				state = SYN_NORMAL;
+				word_start = 1;
+			} else {
+				mark(cls, i++, 1, HL_COMMENT);
+			}
+			continue;
+		}
+
+		if (state >= SYN_STRING) {
+			uint8_t quote = syn->quotes[state - SYN_STRING];
+			int len = 1;
+			if (c == '\\' && i + 1 < size &&
+			    !(quote == '\'' &&
+			      (syn->flags & HL_RAW_SINGLE_QUOTES))) {
+				len = 2;
+			} else if (c == quote) {
+				state = SYN_NORMAL;
+				word_start = 1;
+			}
+			mark(cls, i, len, HL_STRING);
+			i += len;
+			continue;
+		}
+
+		if (syn->line_comment &&
+		    startsAt(chars, size, i, syn->line_comment) &&
+		    (!(syn->flags & HL_COMMENT_AT_WORD) || i == 0 ||
+		     chars[i - 1] == ' ' || chars[i - 1] == '\t')) {
+			mark(cls, i, size - i, HL_COMMENT);
+			break;
+		}
+
+		if (syn->block_start &&
+		    startsAt(chars, size, i, syn->block_start)) {
+			int len = strlen(syn->block_start);
+			mark(cls, i, len, HL_COMMENT);
+			i += len;
+			state = SYN_COMMENT;
+			continue;
+		}
+
+		if (syn->quotes && c && strchr(syn->quotes, c)) {
+			state = SYN_STRING + (strchr(syn->quotes, c) - syn->quotes);
+			mark(cls, i++, 1, HL_STRING);
+			continue;
+		}
+
+		if ((syn->flags & HL_DIRECTIVES) && c == '#') {
+			int j = 0;
+			while (j < i && (chars[j] == ' ' || chars[j] == '\t'))
+				j++;
+			if (j == i) {
+				int end = i + 1;
+				while (end < size &&
+				       (chars[end] == ' ' || chars[end] == '\t'))
+					end++;
+				while (end < size && isWordChar(chars[end]))
+					end++;
+				mark(cls, i, end - i, HL_PREPROC);
+				i = end;
+				continue;
+			}
+		}
+
+		if (word_start && isWordChar(c)) {
+			int end = i;
+			while (end < size && isWordChar(chars[end]))
+				end++;
+			unsigned char wc;
+			if ((syn->flags & HL_NUMBERS) && '0' <= c && c <= '9')
+				wc = HL_NUMBER;
+			else
+				wc = wordClass(syn->words, &chars[i], end - i);
+			mark(cls, i, end - i, wc);
+			i = end;
+			word_start = 0;
+			continue;
+		}
+
+		mark(cls, i++, 1, HL_NORMAL);
+		word_start = !isWordChar(c);
+	}
+
+	/* Unterminated strings end with the line unless escaped */
+	if (state >= SYN_STRING && !(syn->flags & HL_MULTILINE_STRINGS) &&
+	    !(size > 0 && chars[size - 1] == '\\'))
+		state = SYN_NORMAL;
+	return state;
+}
+
+/*
+ * Rows from..to may no longer start in the state they have recorded,
+ * because the row above them (or they themselves, when inserted) changed.
+ */
+void syntaxInvalidate(struct editorBuffer *buf, int from, int to) {
+	if (from < 0)
+		from = 0;
+	if (to >= buf->numrows)
+		to = buf->numrows - 1;
+	for (int i = from; i <= to; i++)
+		buf->row[i].hl_changed = 1;
+	if (buf->hl_valid_rows > from)
+		buf->hl_valid_rows = from;
+}
+
+/* Bring the start states of rows 0..upto up to date */
+void syntaxUpdateStates(struct editorBuffer *buf, int upto) {
+	const struct editorSyntax *syn = buf->syntax;
+	if (!syn || buf->numrows == 0)
+		return;
+	if (upto >= buf->numrows)
+		upto = buf->numrows - 1;
+
+	int r = buf->hl_valid_rows;
+	if (r > upto)
+		return;
+	if (r == 0) {
+		buf->row[0].hl_state = SYN_NORMAL;
+		buf->row[0].hl_changed = 0;
+		r = 1;
+	}
+
+	/* moved: the row above got a new start state, so re-lex it */
+	int moved = 0;
+	for (; r <= upto; r++) {
+		erow *row = &buf->row[r];
+		if (!moved && !row->hl_changed)
+			continue;
+		erow *above = row - 1;
+		unsigned char state = syntaxLexRow(syn, above->chars,
+						   above->size,
+						   above->hl_state, NULL);
+		moved = state != row->hl_state;
+		row->hl_state = state;
+		row->hl_changed = 0;
+	}
+	if (moved && upto + 1 < buf->numrows)
+		buf->row[upto + 1].hl_changed = 1;
+	buf->hl_valid_rows = upto + 1;
+}
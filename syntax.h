@@ -0,0 +1,57 @@
+#ifndef EMSYS_SYNTAX_H
+#define EMSYS_SYNTAX_H
+#include <stdint.h>
+#include "emsys.h"
+
+/* Highlight classes, one per byte of a lexed row */
+enum syntaxClass {
+	HL_NORMAL,
+	HL_COMMENT,
+	HL_KEYWORD,
+	HL_TYPE,
+	HL_STRING,
+	HL_NUMBER,
+	HL_PREPROC,
+	HL_ADDED,
+	HL_REMOVED,
+	HL_HEADER,
+	HL_HUNK,
+	HL_ERROR,
+	HL_WARNING,
+	HL_INFO,
+	HL_DEBUG,
+	HL_NCLASSES,
+};
+
+/* Lexer flags */
+#define HL_NUMBERS (1 << 0)
+#define HL_DIRECTIVES (1 << 1)	      /* # at line start, as in C */
+#define HL_COMMENT_AT_WORD (1 << 2)   /* line comment only after a space */
+#define HL_MULTILINE_STRINGS (1 << 3) /* strings run on past line ends */
+#define HL_RAW_SINGLE_QUOTES (1 << 4) /* no escapes inside '...' */
+
+struct syntaxWord {
+	const char *word;
+	unsigned char cls;
+};
+
+struct editorSyntax {
+	const char *name;
+	const char *const *filematch; /* ".ext" suffixes or base names */
+	const struct syntaxWord *words;
+	const struct syntaxWord *prefixes; /* whole-line classes, as in diff */
+	const char *line_comment;
+	const char *block_start;
+	const char *block_end;
+	const char *quotes;
+	int flags;
+};
+
+const struct editorSyntax *syntaxForFilename(const char *filename);
+unsigned char syntaxLexRow(const struct editorSyntax *syn,
+			   const uint8_t *chars, int size, unsigned char state,
+			   unsigned char *cls);
+void syntaxInvalidate(struct editorBuffer *buf, int from, int to);
+void syntaxUpdateStates(struct editorBuffer *buf, int upto);
+
+#endif
@@ -10,16 +10,163 @@
 #include <sys/termios.h>
 #endif
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include <string.h>
 #include "unicode.h"
 #include "keymap.h"
 #include "display.h"
+#include "buffer.h"
+#include "output.h"
 
 extern struct editorConfig E;
 void editorDeserializeUnicode(void);
 
+/*
+ * Screen output.  Frames are encoded against what the terminal shows (see
+ * output.c) and handed over without blocking: whatever the terminal does
+ * not take at once waits in out and is sent from editorReadKey as the
+ * terminal drains.  Frames arriving meanwhile are not queued behind it;
+ * only the latest is kept, and it is encoded once out has gone, so a slow
+ * link skips frames rather than falling behind.
+ */
+
+/* Frames at least this long are wrapped in synchronized update markers */
+#define SYNC_FRAME_MIN 4096
+
+static struct abuf out = ABUF_INIT;
+static int out_off; /* out.b[out_off, out.len) is still to be written */
+
+static struct {
+	struct abuf frame;
+	int rows;
+	int cols;
+	int pending;
+} next = { ABUF_INIT, 0, 0, 0 };
+
+static struct outputEncoder encoder;
+static struct abuf encoded = ABUF_INIT;
+static int sync_updates; /* terminal reported DEC mode 2026 */
+
+/* The resize handler redraws, which must not happen halfway through */
+static void holdSignals(sigset_t *saved) {
+#ifdef SIGWINCH
+	sigset_t winch;
+	sigemptyset(&winch);
+	sigaddset(&winch, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &winch, saved);
+#else
+	sigemptyset(saved);
+#endif
+}
+
+static void releaseSignals(const sigset_t *saved) {
+#ifdef SIGWINCH
+	sigprocmask(SIG_SETMASK, saved, NULL);
+#else
+	(void)saved;
+#endif
+}
+
+static void queueOutput(const char *s, int len, int rows, int cols,
+			int full) {
+	encoded.len = 0;
+	outputEncode(&encoder, s, len, rows, cols, full, &encoded);
+
+	if (out_off > 0) {
+		memmove(out.b, &out.b[out_off], out.len - out_off);
+		out.len -= out_off;
+		out_off = 0;
+	}
+	int wrap = sync_updates && encoded.len >= SYNC_FRAME_MIN;
+	if (wrap)
+		abAppend(&out, CSI "?2026h", 8);
+	if (encoded.len)
+		abAppend(&out, encoded.b, encoded.len);
+	if (wrap)
+		abAppend(&out, CSI "?2026l", 8);
+}
+
+/* Write pending output; unless block, stop as soon as the terminal is full.
+ * Returns 0 once everything is written. */
+int editorFlushOutput(int block) {
+	if (out_off == out.len && !next.pending)
+		return 0;
+
+	sigset_t saved;
+	holdSignals(&saved);
+	int flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (!block && flags != -1)
+		fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+
+	for (;;) {
+		if (out_off == out.len) {
+			if (!next.pending)
+				break;
+			next.pending = 0;
+			queueOutput(next.frame.b, next.frame.len, next.rows,
+				    next.cols, 1);
+			continue;
+		}
+		ssize_t n = write(STDOUT_FILENO, &out.b[out_off],
+				  out.len - out_off);
+		if (n > 0) {
+			out_off += n;
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && errno == EAGAIN && block) {
+			fd_set wfds;
+			FD_ZERO(&wfds);
+			FD_SET(STDOUT_FILENO, &wfds);
+			select(STDOUT_FILENO + 1, NULL, &wfds, NULL, NULL);
+		} else if (n == -1 && errno == EAGAIN) {
+			break;
+		} else {
+			/* The terminal is gone; nothing left to show it */
+			out_off = out.len;
+			next.pending = 0;
+		}
+	}
+
+	if (!block && flags != -1)
+		fcntl(STDOUT_FILENO, F_SETFL, flags);
+	releaseSignals(&saved);
+	return out_off < out.len || next.pending;
+}
+
+/* Queue a complete screen update, replacing one still waiting to start */
+void editorWriteFrame(const char *s, int len) {
+	sigset_t saved;
+	holdSignals(&saved);
+	if (out_off < out.len) {
+		next.frame.len = 0;
+		abAppend(&next.frame, s, len);
+		next.rows = E.screenrows;
+		next.cols = E.screencols;
+		next.pending = 1;
+	} else {
+		queueOutput(s, len, E.screenrows, E.screencols, 1);
+	}
+	editorFlushOutput(0);
+	releaseSignals(&saved);
+}
+
+/* Queue output that belongs to the last frame, e.g. a cursor move */
+void editorWriteOutput(const char *s, int len) {
+	sigset_t saved;
+	holdSignals(&saved);
+	if (next.pending)
+		abAppend(&next.frame, s, len);
+	else
+		queueOutput(s, len, E.screenrows, E.screencols, 0);
+	editorFlushOutput(0);
+	releaseSignals(&saved);
+}
+
 void die(const char *s) {
+	editorFlushOutput(1);
 	write(STDOUT_FILENO, CSI "2J", 4);
 	write(STDOUT_FILENO, CSI "H", 3);
 	perror(s);
@@ -30,6 +177,7 @@ void die(const char *s) {
 void disableRawMode(void) {
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
 		die("disableRawMode tcsetattr");
+	editorFlushOutput(1);
 	if (write(STDOUT_FILENO, CSI "?1049l", 8) == -1)
 		die("disableRawMode write");
 }
@@ -38,6 +186,7 @@ void enableRawMode(void) {
 	/* Saves the screen and switches to an alt screen */
 	if (write(STDOUT_FILENO, CSI "?1049h", 8) == -1)
 		die("enableRawMode write");
+	outputInvalidate(&encoder);
 
 	/*
 	 * I looked into it. It's possible, but not easy, to do it
@@ -58,12 +207,19 @@ void enableRawMode(void) {
 	raw.c_cc[VTIME] = 0;
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
 		die("enableRawMode tcsetattr");
+
+	/* Ask whether synchronized updates are supported, and what the
+	 * terminal is; the replies are picked up by editorReadKey */
+	if (write(STDOUT_FILENO, CSI "?2026$p" CSI "c", 12) == -1)
+		die("write");
 }
 
 int getCursorPosition(int *rows, int *cols) {
 	char buf[32];
 	int i = 0;
 
+	editorFlushOutput(1);
+	outputInvalidate(&encoder);
 	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
 		return -1;
 
@@ -88,6 +244,7 @@ int getWindowSize(int *rows, int *cols) {
 	struct winsize ws;
 
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+		editorFlushOutput(1);
 		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
 			return -1;
 		return getCursorPosition(rows, cols);
@@ -107,7 +264,31 @@ void editorDeserializeUnicode(void) {
 }
 
 /* Raw reading a keypress - terminal layer only handles raw byte reading and escape sequences */
+/* A key read ahead by a poller and handed back with editorUnreadKey */
+static int unread = -1;
+
+/* A key is waiting to be read */
+int editorInputPending(void) {
+	if (unread != -1)
+		return 1;
+	fd_set rfds;
+	struct timeval now = { 0, 0 };
+	FD_ZERO(&rfds);
+	FD_SET(STDIN_FILENO, &rfds);
+	return select(STDIN_FILENO + 1, &rfds, NULL, NULL, &now) > 0;
+}
+
+/* Give back a key so that the next editorReadKey returns it again */
+void editorUnreadKey(int key) {
+	unread = key;
+}
+
 int editorReadKey(void) {
+	if (unread != -1) {
+		int ret = unread;
+		unread = -1;
+		return ret;
+	}
 	if (E.playback) {
 		int ret = E.macro.keys[E.playback++];
 		if (ret == UNICODE) {
@@ -117,6 +298,31 @@ int editorReadKey(void) {
 	}
 	int nread;
 	uint8_t c;
+READ_KEY:
+	while (editorFlushOutput(0)) {
+		/* Keep feeding a slow terminal until there is a key to read */
+		fd_set rfds, wfds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(STDIN_FILENO, &rfds);
+		FD_SET(STDOUT_FILENO, &wfds);
+		int maxfd = STDIN_FILENO > STDOUT_FILENO ? STDIN_FILENO :
+							   STDOUT_FILENO;
+		if (select(maxfd + 1, &rfds, &wfds, NULL, NULL) == -1 &&
+		    errno != EINTR)
+			die("select");
+		if (FD_ISSET(STDIN_FILENO, &rfds))
+			break;
+	}
+	/* Catch up on deferred work a step at a time until a key comes */
+	for (;;) {
+		sigset_t saved;
+		holdSignals(&saved);
+		int more = !editorInputPending() && extendScreenCaches();
+		releaseSignals(&saved);
+		if (!more)
+			break;
+	}
 	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
 		if (nread == -1 && errno != EAGAIN)
 			die("read");
@@ -134,6 +340,27 @@ int editorReadKey(void) {
 		if (seq[0] == '[') {
 			if (read(STDIN_FILENO, &seq[1], 1) != 1)
 				goto ESC_UNKNOWN;
+			if (seq[1] == '?') {
+				/* A report, answering enableRawMode */
+				char rep[32];
+				int n = 0;
+				while (read(STDIN_FILENO, &c, 1) == 1 &&
+				       (c < 0x40 || c > 0x7e)) {
+					if (n < (int)sizeof(rep) - 1)
+						rep[n++] = c;
+				}
+				rep[n] = 0;
+				int mode, state;
+				if (c == 'y' &&
+				    sscanf(rep, "%d;%d", &mode, &state) == 2 &&
+				    mode == 2026)
+					sync_updates = state == 1 || state == 2;
+				/* Device attributes: REP came with VT420
+				 * level emulations such as xterm and VTE */
+				if (c == 'c' && sscanf(rep, "%d", &mode) == 1)
+					encoder.rep = mode >= 64;
+				goto READ_KEY;
+			}
 			if (seq[1] >= '0' && seq[1] <= '9') {
 				if (read(STDIN_FILENO, &seq[2], 1) != 1)
 					goto ESC_UNKNOWN;
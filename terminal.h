@@ -2,11 +2,16 @@
 #define TERMINAL_H
 
 void die(const char *s);
+void editorWriteFrame(const char *s, int len);
+void editorWriteOutput(const char *s, int len);
+int editorFlushOutput(int block);
 void disableRawMode(void);
 void enableRawMode(void);
 int getCursorPosition(int *rows, int *cols);
 int getWindowSize(int *rows, int *cols);
+int editorInputPending(void);
 int editorReadKey(void);
+void editorUnreadKey(int key);
 void editorDeserializeUnicode(void);
 
 #endif /* TERMINAL_H */
@@ -0,0 +1,632 @@
+/* Micro-benchmarks for emsys core routines.
+ *
+ * Built and run by tests/run_bench.sh (make bench).  Each benchmark is a
+ * named function in the table at the bottom; pass names on the command
+ * line to run only those. */
+#include "../emsys.h"
+#include "../re.h"
+#include "../syntax.h"
+#include "../unicode.h"
+#include "../util.h"
+#include "../wcwidth.h"
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct benchFile {
+	const char *path;
+	uint8_t *data;
+	size_t len;
+};
+
+static struct benchFile files[] = {
+	{ "txt/UTF-8-demo.txt", NULL, 0 },
+	{ "txt/emoji-sequences.txt", NULL, 0 },
+};
+
+#define NFILES (sizeof(files) / sizeof(files[0]))
+
+/* Keeps results live so the compiler cannot drop the measured work */
+static volatile long bench_sink;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void loadFile(struct benchFile *f) {
+	FILE *fp = fopen(f->path, "rb");
+	if (!fp) {
+		perror(f->path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	/* NUL-terminated, with slack so a truncated sequence at the end
+	 * cannot read past the buffer */
+	f->data = calloc(len + 4, 1);
+	if (!f->data || fread(f->data, 1, len, fp) != (size_t)len) {
+		fprintf(stderr, "%s: read failed\n", f->path);
+		exit(1);
+	}
+	f->len = len;
+	fclose(fp);
+}
+
+/* Run fn over data until at least a quarter second has passed and report
+ * the per-pass time, and the throughput when there is data. */
+static void measure(const char *name, const char *label,
+		    long (*fn)(uint8_t *, size_t), uint8_t *data, size_t len) {
+	long passes = 0;
+	double start = now(), elapsed;
+	do {
+		bench_sink += fn(data, len);
+		passes++;
+		elapsed = now() - start;
+	} while (elapsed < 0.25);
+	double per = elapsed / passes;
+	printf("%-12s %-30s %10.1f us/pass", name, label, per * 1e6);
+	if (len > 0)
+		printf(" %8.1f MB/s", len / per / 1e6);
+	printf("\n");
+}
+
+/* Baseline: decode each sequence and ask mk_wcwidth, as
+ * charInStringWidth did before the generated table. */
+static int decodeUCS(uint8_t *str, int idx) {
+	uint8_t ch = str[idx];
+	if (utf8_is2Char(ch)) {
+		return ((ch & 0x1F) << 6) | (str[idx + 1] & 0x3F);
+	} else if (utf8_is3Char(ch)) {
+		return ((ch & 0x0F) << 12) | ((str[idx + 1] & 0x3F) << 6) |
+		       (str[idx + 2] & 0x3F);
+	} else if (utf8_is4Char(ch)) {
+		return ((ch & 0x07) << 18) | ((str[idx + 1] & 0x3F) << 12) |
+		       ((str[idx + 2] & 0x3F) << 6) | (str[idx + 3] & 0x3F);
+	}
+	return ch;
+}
+
+static int bisectCharWidth(uint8_t *str, int idx) {
+	if (str[idx] < 0x20 || str[idx] == 0x7f) {
+		return 2;
+	} else if (str[idx] < 0x7f) {
+		return 1;
+	}
+	return mk_wcwidth(decodeUCS(str, idx));
+}
+
+/* Both variants are called through this pointer so neither is inlined
+ * into the loop and only the lookup itself differs. */
+static int (*volatile charWidth)(uint8_t *, int);
+
+static long widthLoop(uint8_t *data, size_t len) {
+	int (*fn)(uint8_t *, int) = charWidth;
+	long total = 0;
+	for (size_t i = 0; i < len; i += utf8_nBytes(data[i])) {
+		total += fn(data, i);
+	}
+	return total;
+}
+
+static void benchWidth(const char *name) {
+	for (size_t i = 0; i < NFILES; i++) {
+		char label[64];
+		const char *base = strrchr(files[i].path, '/') + 1;
+		snprintf(label, sizeof(label), "%s (bisect)", base);
+		charWidth = bisectCharWidth;
+		measure(name, label, widthLoop, files[i].data, files[i].len);
+		snprintf(label, sizeof(label), "%s (table)", base);
+		charWidth = charInStringWidth;
+		measure(name, label, widthLoop, files[i].data, files[i].len);
+	}
+}
+
+/*
+ * Typing into the middle of a 100k-line C buffer: each pass is one
+ * keystroke at the start of the middle row followed by what a redraw of
+ * a screen starting there needs, i.e. row states and classes for the
+ * rows on screen.  "full" re-lexes from the top of the buffer every
+ * time, as a highlighter without per-row state would.
+ */
+#define SYNTAX_ROWS 100000
+#define SCREEN_ROWS 40
+
+static struct benchFile c_source = { "buffer.c", NULL, 0 };
+static struct editorBuffer syntax_buf;
+static int typing_row = SYNTAX_ROWS / 2;
+static const char *typing; /* typed, then deleted again, in turns */
+static unsigned char syntax_classes[4096];
+
+static void loadSyntaxBuffer(void) {
+	int nlines = 0;
+	uint8_t **lines = NULL;
+
+	loadFile(&c_source);
+	for (uint8_t *p = c_source.data; *p;) {
+		uint8_t *eol = (uint8_t *)strchr((char *)p, '\n');
+		if (!eol)
+			break;
+		*eol = '\0';
+		lines = xrealloc(lines, (nlines + 1) * sizeof(*lines));
+		lines[nlines++] = p;
+		p = eol + 1;
+	}
+
+	syntax_buf.row = xcalloc(SYNTAX_ROWS, sizeof(erow));
+	syntax_buf.numrows = SYNTAX_ROWS;
+	for (int i = 0; i < SYNTAX_ROWS; i++) {
+		uint8_t *line = lines[i % nlines];
+		syntax_buf.row[i].chars = line;
+		syntax_buf.row[i].size = strlen((char *)line);
+	}
+	/* The edited row gets its own copy */
+	erow *row = &syntax_buf.row[typing_row];
+	row->chars = (uint8_t *)xstrdup((char *)row->chars);
+	syntax_buf.syntax = syntaxForFilename(c_source.path);
+	syntaxInvalidate(&syntax_buf, 0, SYNTAX_ROWS - 1);
+	free(lines);
+}
+
+static void typeKey(void) {
+	erow *row = &syntax_buf.row[typing_row];
+	int len = strlen(typing);
+
+	if (row->size >= len && memcmp(row->chars, typing, len) == 0) {
+		memmove(row->chars, row->chars + len, row->size - len + 1);
+		row->size -= len;
+	} else {
+		row->chars = xrealloc(row->chars, row->size + len + 1);
+		memmove(row->chars + len, row->chars, row->size + 1);
+		memcpy(row->chars, typing, len);
+		row->size += len;
+	}
+}
+
+static long colourScreen(void) {
+	long total = 0;
+	for (int i = typing_row; i < typing_row + SCREEN_ROWS; i++) {
+		erow *row = &syntax_buf.row[i];
+		if (row->size > (int)sizeof(syntax_classes))
+			continue;
+		syntaxLexRow(syntax_buf.syntax, row->chars, row->size,
+			     row->hl_state, syntax_classes);
+		total += syntax_classes[0];
+	}
+	return total;
+}
+
+static long typeIncremental(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	typeKey();
+	syntaxInvalidate(&syntax_buf, typing_row + 1, typing_row + 1);
+	syntaxUpdateStates(&syntax_buf, typing_row + SCREEN_ROWS - 1);
+	return colourScreen();
+}
+
+static long typeFull(uint8_t *data, size_t len) {
+	unsigned char state = 0;
+	(void)data;
+	(void)len;
+	typeKey();
+	for (int i = 0; i < typing_row + SCREEN_ROWS; i++) {
+		erow *row = &syntax_buf.row[i];
+		row->hl_state = state;
+		state = syntaxLexRow(syntax_buf.syntax, row->chars, row->size,
+				     state, NULL);
+	}
+	/* Leave the states as the incremental walk expects to find them */
+	syntaxInvalidate(&syntax_buf, typing_row + SCREEN_ROWS,
+			 typing_row + SCREEN_ROWS);
+	return colourScreen();
+}
+
+static void benchSyntax(const char *name) {
+	static const char *const keys[] = { "x", "/*" };
+
+	loadSyntaxBuffer();
+	syntaxUpdateStates(&syntax_buf, SYNTAX_ROWS - 1);
+	for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+		char label[64];
+		typing = keys[k];
+		snprintf(label, sizeof(label), "type \"%s\" (incremental)",
+			 typing);
+		measure(name, label, typeIncremental, NULL, 0);
+		snprintf(label, sizeof(label), "type \"%s\" (full)", typing);
+		measure(name, label, typeFull, NULL, 0);
+	}
+}
+
+/*
+ * Literal search of a 1 GB buffer of C rows for a needle that is only in
+ * the last row, the way isearch and query-replace walk a buffer: strstr
+ * on each row, as they used to, against emsys_memmem with the row length.
+ */
+#define LITERAL_BYTES (1024L * 1024 * 1024)
+
+static struct benchFile literal_source = { "buffer.c", NULL, 0 };
+static erow *literal_rows;
+static int literal_nrows;
+static const char *literal_needle;
+static size_t literal_needle_len;
+
+static void loadLiteralBuffer(void) {
+	static const char last[] = "\txyzzy(editorFrobnicate(row,          "
+				   "                      x));";
+
+	if (literal_rows)
+		return;
+	loadFile(&literal_source);
+	uint8_t *text = xmalloc(LITERAL_BYTES + sizeof(last));
+	size_t used = 0, at = 0;
+	int cap = 0;
+	while (used + 512 < LITERAL_BYTES) {
+		uint8_t *line = literal_source.data + at;
+		uint8_t *eol = memchr(line, '\n', literal_source.len - at);
+		size_t len = eol ? (size_t)(eol - line) :
+				   literal_source.len - at;
+		at = eol ? at + len + 1 : 0;
+		if (at >= literal_source.len)
+			at = 0;
+		if (literal_nrows == cap) {
+			cap = cap ? cap * 2 : 1024;
+			literal_rows = xrealloc(literal_rows, cap * sizeof(erow));
+		}
+		memcpy(text + used, line, len);
+		text[used + len] = '\0';
+		literal_rows[literal_nrows].chars = text + used;
+		literal_rows[literal_nrows].size = len;
+		literal_nrows++;
+		used += len + 1;
+	}
+	memcpy(text + used, last, sizeof(last));
+	literal_rows[literal_nrows - 1].chars = text + used;
+	literal_rows[literal_nrows - 1].size = sizeof(last) - 1;
+}
+
+static long strstrRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	for (int i = 0; i < literal_nrows; i++) {
+		char *hit = strstr((char *)literal_rows[i].chars, literal_needle);
+		if (hit)
+			return i + (hit - (char *)literal_rows[i].chars);
+	}
+	return -1;
+}
+
+static long memmemRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	for (int i = 0; i < literal_nrows; i++) {
+		uint8_t *hit = emsys_memmem(literal_rows[i].chars,
+					    literal_rows[i].size,
+					    literal_needle, literal_needle_len);
+		if (hit)
+			return i + (hit - literal_rows[i].chars);
+	}
+	return -1;
+}
+
+static void benchLiteral(const char *name) {
+	static const char *const needles[] = {
+		"xyzzy",
+		"editorFrobnicate(",
+		"                                x",
+	};
+
+	loadLiteralBuffer();
+	for (size_t n = 0; n < sizeof(needles) / sizeof(needles[0]); n++) {
+		char label[64];
+		literal_needle = needles[n];
+		literal_needle_len = strlen(needles[n]);
+		snprintf(label, sizeof(label), "%zu-byte needle (strstr)",
+			 literal_needle_len);
+		measure(name, label, strstrRows, NULL, LITERAL_BYTES);
+		snprintf(label, sizeof(label), "%zu-byte needle (memmem)",
+			 literal_needle_len);
+		measure(name, label, memmemRows, NULL, LITERAL_BYTES);
+	}
+}
+
+/*
+ * Backward regex search over the last 16 MB of the literal buffer, a row
+ * at a time from the bottom up the way C-M-r walks a buffer: the last
+ * match in each row by running regexec again one past every match found,
+ * against reSearchLast.  The same text is searched as its C rows
+ * and joined into 8 KB rows, where the matches in a row are many.
+ */
+#define BACKWARD_BYTES (16L * 1024 * 1024)
+#define BACKWARD_LONG_ROW 8192
+
+static regex_t backward_re;
+static struct re *backward_last;
+static erow *backward_rows;
+static int backward_nrows;
+
+static long againRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	long total = 0;
+	for (int i = backward_nrows - 1; i >= 0; i--) {
+		const char *text = (const char *)backward_rows[i].chars;
+		regmatch_t m;
+		int pos = 0, found = -1;
+		while (pos <= backward_rows[i].size &&
+		       regexec(&backward_re, &text[pos], 1, &m,
+			       pos > 0 ? REG_NOTBOL : 0) == 0) {
+			found = pos + m.rm_so;
+			pos = found + 1;
+		}
+		total += found;
+	}
+	return total;
+}
+
+static long lastRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	long total = 0;
+	for (int i = backward_nrows - 1; i >= 0; i--) {
+		struct reSpan m;
+		if (reSearchLast(backward_last, backward_rows[i].chars,
+				 backward_rows[i].size,
+				 backward_rows[i].size + 1, &m))
+			total += m.start;
+		else
+			total--;
+	}
+	return total;
+}
+
+/* The rows from first on joined with spaces into rows of about size */
+static erow *joinBackwardRows(int first, int size, int *nrows) {
+	erow *rows = NULL;
+	int n = 0;
+	for (int i = first; i < literal_nrows; n++) {
+		rows = xrealloc(rows, (n + 1) * sizeof(erow));
+		uint8_t *text = xmalloc(size + 1024);
+		int used = 0;
+		while (i < literal_nrows && used < size) {
+			memcpy(text + used, literal_rows[i].chars,
+			       literal_rows[i].size);
+			used += literal_rows[i].size;
+			text[used++] = ' ';
+			i++;
+		}
+		text[used] = '\0';
+		rows[n].chars = text;
+		rows[n].size = used;
+	}
+	*nrows = n;
+	return rows;
+}
+
+static void benchBackward(const char *name) {
+	static const char *const patterns[] = {
+		"[A-Za-z_]+\\(",
+		"[^;]+;",
+		"\\(.*\\)",
+		"e",
+		"x+y+z+",
+	};
+
+	loadLiteralBuffer();
+	size_t bytes = 0;
+	int first = literal_nrows;
+	while (first > 0 && bytes < BACKWARD_BYTES)
+		bytes += literal_rows[--first].size + 1;
+	int long_nrows;
+	erow *long_rows = joinBackwardRows(first, BACKWARD_LONG_ROW,
+					   &long_nrows);
+
+	for (size_t n = 0; n < sizeof(patterns) / sizeof(patterns[0]); n++) {
+		char label[64], error[128];
+		backward_last = reCompile((const uint8_t *)patterns[n],
+					  strlen(patterns[n]), 0, error,
+					  sizeof(error));
+		if (regcomp(&backward_re, patterns[n], REG_EXTENDED) != 0 ||
+		    !backward_last) {
+			fprintf(stderr, "%s: bad pattern\n", patterns[n]);
+			exit(1);
+		}
+		backward_rows = literal_rows + first;
+		backward_nrows = literal_nrows - first;
+		snprintf(label, sizeof(label), "%s (again)", patterns[n]);
+		measure(name, label, againRows, NULL, bytes);
+		snprintf(label, sizeof(label), "%s (last)", patterns[n]);
+		measure(name, label, lastRows, NULL, bytes);
+		backward_rows = long_rows;
+		backward_nrows = long_nrows;
+		snprintf(label, sizeof(label), "%s long rows (again)",
+			 patterns[n]);
+		measure(name, label, againRows, NULL, bytes);
+		snprintf(label, sizeof(label), "%s long rows (last)",
+			 patterns[n]);
+		measure(name, label, lastRows, NULL, bytes);
+		regfree(&backward_re);
+		reFree(backward_last);
+	}
+}
+
+/*
+ * Case-insensitive literal search over the literal buffer, the way users
+ * got it before: a regex with a bracket of both cases for each letter, or
+ * REG_ICASE, against emsys_memmem_fold.
+ */
+static regex_t fold_re;
+
+static long regexRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	for (int i = 0; i < literal_nrows; i++) {
+		regmatch_t m;
+		if (regexec(&fold_re, (const char *)literal_rows[i].chars, 1, &m,
+			    0) == 0)
+			return i + m.rm_so;
+	}
+	return -1;
+}
+
+static long foldRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	for (int i = 0; i < literal_nrows; i++) {
+		uint8_t *hit = emsys_memmem_fold(literal_rows[i].chars,
+						 literal_rows[i].size,
+						 literal_needle,
+						 literal_needle_len);
+		if (hit)
+			return i + (hit - literal_rows[i].chars);
+	}
+	return -1;
+}
+
+static void benchFold(const char *name) {
+	static const char *const needles[] = {
+		"xyzzy",
+		"editorfrobnicate(",
+		"                                x",
+	};
+
+	loadLiteralBuffer();
+	for (size_t n = 0; n < sizeof(needles) / sizeof(needles[0]); n++) {
+		char label[64], classes[256];
+		size_t at = 0;
+		for (const char *c = needles[n]; *c; c++) {
+			if (*c >= 'a' && *c <= 'z')
+				at += sprintf(classes + at, "[%c%c]", *c & 0x5f,
+					      *c);
+			else if (*c == '(')
+				at += sprintf(classes + at, "\\(");
+			else
+				classes[at++] = *c;
+		}
+		classes[at] = '\0';
+		literal_needle = needles[n];
+		literal_needle_len = strlen(needles[n]);
+
+		regcomp(&fold_re, classes, REG_EXTENDED);
+		snprintf(label, sizeof(label), "%zu-byte needle ([Aa] regex)",
+			 literal_needle_len);
+		measure(name, label, regexRows, NULL, LITERAL_BYTES);
+		regfree(&fold_re);
+		regcomp(&fold_re, classes, REG_EXTENDED | REG_ICASE);
+		snprintf(label, sizeof(label), "%zu-byte needle (REG_ICASE)",
+			 literal_needle_len);
+		measure(name, label, regexRows, NULL, LITERAL_BYTES);
+		regfree(&fold_re);
+		snprintf(label, sizeof(label), "%zu-byte needle (fold)",
+			 literal_needle_len);
+		measure(name, label, foldRows, NULL, LITERAL_BYTES);
+	}
+}
+
+/*
+ * Forward regex search over the first 16 MB of the literal buffer, a row
+ * at a time the way
+ isearch and replace-regexp walk a buffer: the first match in every
+ * row, with the C library's regexec against reSearch.  The patterns run
+ * from one with a literal every match has in it, to one without, to one
+ * that makes a backtracking matcher try every way of splitting the row.
+ */
+#define FORWARD_BYTES (16L * 1024 * 1024)
+
+static regex_t forward_re;
+static struct re *forward_fast;
+static int forward_nrows;
+
+static long regexecRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	long total = 0;
+	for (int i = 0; i < forward_nrows; i++) {
+		regmatch_t m;
+		if (regexec(&forward_re, (const char *)literal_rows[i].chars, 1,
+			    &m, 0) == 0)
+			total += m.rm_so;
+	}
+	return total;
+}
+
+static long reSearchRows(uint8_t *data, size_t len) {
+	(void)data;
+	(void)len;
+	long total = 0;
+	for (int i = 0; i < forward_nrows; i++) {
+		struct reSpan m;
+		if (reSearch(forward_fast, literal_rows[i].chars,
+			     literal_rows[i].size, 0, &m, 1))
+			total += m.start;
+	}
+	return total;
+}
+
+static void benchRegex(const char *name) {
+	static const char *const patterns[] = {
+		"editor[A-Za-z]+\\(",
+		"[a-z]+ [0-9]{7}",
+		"[A-Za-z_]+\\(",
+		"(o|oo)+ q",
+	};
+
+	loadLiteralBuffer();
+	size_t bytes = 0;
+	while (forward_nrows < literal_nrows && bytes < FORWARD_BYTES)
+		bytes += literal_rows[forward_nrows++].size + 1;
+	for (size_t n = 0; n < sizeof(patterns) / sizeof(patterns[0]); n++) {
+		char label[64], error[128];
+		forward_fast = reCompile((const uint8_t *)patterns[n],
+					 strlen(patterns[n]), 0, error,
+					 sizeof(error));
+		if (regcomp(&forward_re, patterns[n], REG_EXTENDED) != 0 ||
+		    !forward_fast) {
+			fprintf(stderr, "%s: bad pattern\n", patterns[n]);
+			exit(1);
+		}
+		snprintf(label, sizeof(label), "%s (regexec)", patterns[n]);
+		measure(name, label, regexecRows, NULL, bytes);
+		snprintf(label, sizeof(label), "%s (reSearch)", patterns[n]);
+		measure(name, label, reSearchRows, NULL, bytes);
+		regfree(&forward_re);
+		reFree(forward_fast);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(const char *name);
+} benchmarks[] = {
+	{ "width", benchWidth },
+	{ "syntax", benchSyntax },
+	{ "literal", benchLiteral },
+	{ "backward", benchBackward },
+	{ "fold", benchFold },
+	{ "regex", benchRegex },
+};
+
+#define NBENCH (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv) {
+	for (size_t i = 0; i < NFILES; i++) {
+		loadFile(&files[i]);
+	}
+	for (size_t b = 0; b < NBENCH; b++) {
+		int wanted = argc < 2;
+		for (int a = 1; a < argc; a++) {
+			if (strcmp(argv[a], benchmarks[b].name) == 0) {
+				wanted = 1;
+			}
+		}
+		if (wanted) {
+			benchmarks[b].run(benchmarks[b].name);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Benchmarks for emsys core routines; results are also saved to
+# bench_output.txt.  Pass benchmark names to run a subset.
+set -e
+
+cc -std=c99 -O2 -D_DEFAULT_SOURCE -o bench_core tests/bench_core.c \
+    unicode.o wcwidth.o util.o syntax.o re.o || exit 1
+./bench_core "$@" | tee bench_output.txt
+rm -f bench_core
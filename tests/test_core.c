@@ -3,6 +3,9 @@
 #include "../unicode.h"
 #include "../wcwidth.h"
 #include "../emsys.h"
+#include "../syntax.h"
+#include "../output.h"
+#include "../re.h"
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
@@ -125,6 +128,42 @@ void test_char_in_string_width() {
     TEST_ASSERT_EQUAL_INT(2, charInStringWidth(del_str, 0));
 }
 
+/* The generated width table must agree with mk_wcwidth everywhere */
+void test_width_table() {
+    int mismatches = 0;
+    for (int ucs = 0; ucs < 0x110000; ucs++) {
+        if (ucsWidth(ucs) != mk_wcwidth(ucs)) {
+            mismatches++;
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(0, mismatches);
+    TEST_ASSERT_EQUAL_INT(2, ucsWidth(0x4E00));
+    TEST_ASSERT_EQUAL_INT(2, ucsWidth(0x1F607));
+    TEST_ASSERT_EQUAL_INT(0, ucsWidth(0x0301));
+    TEST_ASSERT_EQUAL_INT(mk_wcwidth(0x110000), ucsWidth(0x110000));
+}
+
+/* The vector pre-scan must stop exactly where a byte loop would */
+void test_ascii_prefix() {
+    uint8_t buf[80];
+    const uint8_t stops[] = { '\t', 0x01, 0x1f, 0x7f, 0x80, 0xC3, 0xFF };
+    memset(buf, 'a', sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(80, asciiPrefixLength(buf, 80));
+    TEST_ASSERT_EQUAL_INT(0, asciiPrefixLength(buf, 0));
+    TEST_ASSERT_EQUAL_INT(37, asciiPrefixLength(buf, 37));
+    for (size_t s = 0; s < sizeof(stops); s++) {
+        for (int pos = 0; pos < 80; pos++) {
+            memset(buf, ' ' + pos % 94, sizeof(buf));
+            buf[pos] = stops[s];
+            TEST_ASSERT_EQUAL_INT(pos, asciiPrefixLength(buf, 80));
+            TEST_ASSERT_EQUAL_INT(pos < 50 ? pos : 50,
+                                  asciiPrefixLength(buf, 50));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(1, asciiPrefixLength((uint8_t *)"~\x7f", 2));
+    TEST_ASSERT_EQUAL_INT(2, asciiPrefixLength((uint8_t *)" ~", 2));
+}
+
 /* Test nextScreenX function */
 void test_next_screen_x() {
     int idx;
@@ -156,6 +195,36 @@ void test_next_screen_x() {
     TEST_ASSERT_EQUAL_INT(2, nextScreenX(del, &idx, 0));
 }
 
+/* A wide character at the wrap column starts the next line whole */
+void test_wrap_line_starts() {
+    uint8_t row[128];
+    int starts[4];
+
+    /* 59 columns, then three characters two columns wide */
+    memset(row, 'a', 59);
+    memcpy(row + 59, "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", 9);
+    TEST_ASSERT_EQUAL_INT(1, wrapLineStarts(row, 68, 60, starts, 4));
+    TEST_ASSERT_EQUAL_INT(59, starts[0]);
+
+    /* One ending on the edge fits, and the next goes on */
+    TEST_ASSERT_EQUAL_INT(1, wrapLineStarts(row + 1, 61, 60, starts, 4));
+    TEST_ASSERT_EQUAL_INT(60, starts[0]);
+
+    /* ^X goes to the next line too, but a tab is split */
+    row[59] = 0x01;
+    TEST_ASSERT_EQUAL_INT(1, wrapLineStarts(row, 60, 60, starts, 4));
+    TEST_ASSERT_EQUAL_INT(59, starts[0]);
+    row[59] = '\t';
+    TEST_ASSERT_EQUAL_INT(1, wrapLineStarts(row, 60, 60, starts, 4));
+    TEST_ASSERT_EQUAL_INT(60, starts[0]);
+
+    /* Plain text wraps at every cols columns */
+    memset(row, 'b', 120);
+    TEST_ASSERT_EQUAL_INT(2, wrapLineStarts(row, 120, 60, starts, 4));
+    TEST_ASSERT_EQUAL_INT(120, starts[1]);
+    TEST_ASSERT_EQUAL_INT(2, wrapLineStarts(row, 120, 60, NULL, 0));
+}
+
 /* Test multi-byte UTF-8 sequence validation */
 void test_utf8_validation() {
     /* Valid 2-byte sequence */
@@ -327,6 +396,506 @@ void test_emsys_getline_multiple_reallocs() {
 void setUp(void) {}
 void tearDown(void) {}
 
+/* Syntax highlighting tests */
+static void set_row(struct editorBuffer *buf, int at, const char *text) {
+    free(buf->row[at].chars);
+    buf->row[at].chars = (uint8_t *)xstrdup(text);
+    buf->row[at].size = strlen(text);
+}
+
+static struct editorBuffer *syntax_buffer(const char *name,
+                                          const char **lines, int n) {
+    struct editorBuffer *buf = xcalloc(1, sizeof(*buf));
+    buf->row = xcalloc(n + 1, sizeof(erow));
+    buf->numrows = n;
+    for (int i = 0; i < n; i++)
+        set_row(buf, i, lines[i]);
+    buf->syntax = syntaxForFilename(name);
+    syntaxInvalidate(buf, 0, n - 1);
+    return buf;
+}
+
+/* Incremental states must match lexing every row from the top */
+static int states_match_full_lex(struct editorBuffer *buf) {
+    unsigned char state = 0;
+    syntaxUpdateStates(buf, buf->numrows - 1);
+    for (int i = 0; i < buf->numrows; i++) {
+        if (buf->row[i].hl_state != state)
+            return 0;
+        state = syntaxLexRow(buf->syntax, buf->row[i].chars,
+                             buf->row[i].size, state, NULL);
+    }
+    return 1;
+}
+
+void test_syntax_lex_c() {
+    const struct editorSyntax *c = syntaxForFilename("dir/file.c");
+    const char *line = "int x = 42; // \"hi\"";
+    unsigned char cls[32];
+    TEST_ASSERT_NOT_NULL(c);
+    TEST_ASSERT_EQUAL_INT(0, syntaxLexRow(c, (const uint8_t *)line,
+                                          strlen(line), 0, cls));
+    TEST_ASSERT_EQUAL_INT(HL_TYPE, cls[0]);
+    TEST_ASSERT_EQUAL_INT(HL_NORMAL, cls[4]);
+    TEST_ASSERT_EQUAL_INT(HL_NUMBER, cls[8]);
+    TEST_ASSERT_EQUAL_INT(HL_COMMENT, cls[12]);
+    TEST_ASSERT_EQUAL_INT(HL_COMMENT, cls[16]);
+
+    line = "a = \"/*\"; /* open";
+    unsigned char state = syntaxLexRow(c, (const uint8_t *)line,
+                                       strlen(line), 0, cls);
+    TEST_ASSERT_EQUAL_INT(HL_STRING, cls[5]);
+    TEST_ASSERT(state != 0);
+    line = "still */ if";
+    TEST_ASSERT_EQUAL_INT(0, syntaxLexRow(c, (const uint8_t *)line,
+                                          strlen(line), state, cls));
+    TEST_ASSERT_EQUAL_INT(HL_COMMENT, cls[0]);
+    TEST_ASSERT_EQUAL_INT(HL_KEYWORD, cls[9]);
+}
+
+void test_syntax_lex_others() {
+    unsigned char cls[32];
+    const struct editorSyntax *diff = syntaxForFilename("fix.patch");
+    syntaxLexRow(diff, (const uint8_t *)"+++ b/x", 7, 0, cls);
+    TEST_ASSERT_EQUAL_INT(HL_HEADER, cls[6]);
+    syntaxLexRow(diff, (const uint8_t *)"-old", 4, 0, cls);
+    TEST_ASSERT_EQUAL_INT(HL_REMOVED, cls[3]);
+
+    const struct editorSyntax *log = syntaxForFilename("app.log");
+    syntaxLexRow(log, (const uint8_t *)"12:00 WARN disk", 15, 0, cls);
+    TEST_ASSERT_EQUAL_INT(HL_WARNING, cls[6]);
+    TEST_ASSERT_EQUAL_INT(HL_NORMAL, cls[12]);
+
+    const struct editorSyntax *sh = syntaxForFilename("run.sh");
+    const char *line = "echo ${#x} # note";
+    syntaxLexRow(sh, (const uint8_t *)line, strlen(line), 0, cls);
+    TEST_ASSERT_EQUAL_INT(HL_NORMAL, cls[7]);
+    TEST_ASSERT_EQUAL_INT(HL_COMMENT, cls[11]);
+
+    const struct editorSyntax *json = syntaxForFilename("a.json");
+    syntaxLexRow(json, (const uint8_t *)"{\"k\": true}", 11, 0, cls);
+    TEST_ASSERT_EQUAL_INT(HL_STRING, cls[1]);
+    TEST_ASSERT_EQUAL_INT(HL_KEYWORD, cls[7]);
+
+    TEST_ASSERT_NULL(syntaxForFilename("README"));
+}
+
+void test_syntax_incremental() {
+    const char *lines[] = { "int a;", "", "/* one", "two */", "int b;",
+                            "char *s = \"x\";", "int c;" };
+    struct editorBuffer *buf = syntax_buffer("t.c", lines, 7);
+    TEST_ASSERT(states_match_full_lex(buf));
+
+    /* Opening a comment re-lexes until the old comment closes it */
+    set_row(buf, 1, "/*");
+    syntaxInvalidate(buf, 2, 2);
+    syntaxUpdateStates(buf, 3);
+    TEST_ASSERT(buf->row[2].hl_state != 0);
+    TEST_ASSERT(states_match_full_lex(buf));
+
+    set_row(buf, 4, "/* int b;");
+    syntaxInvalidate(buf, 5, 5);
+    TEST_ASSERT(states_match_full_lex(buf));
+
+    /* Only rows up to the one asked for are brought up to date */
+    set_row(buf, 1, "");
+    syntaxInvalidate(buf, 2, 2);
+    syntaxUpdateStates(buf, 2);
+    TEST_ASSERT_EQUAL_INT(3, buf->hl_valid_rows);
+    TEST_ASSERT(states_match_full_lex(buf));
+
+    for (int i = 0; i < buf->numrows; i++)
+        free(buf->row[i].chars);
+    free(buf->row);
+    free(buf);
+}
+
+static int same_screen(const struct vtScreen *a, const struct vtScreen *b) {
+    for (int i = 0; i < a->rows * a->cols; i++) {
+        const struct vtCell *x = &a->cells[i], *y = &b->cells[i];
+        if (x->len != y->len || x->width != y->width || x->attr != y->attr ||
+            memcmp(x->ch, y->ch, x->len) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Encode frame against enc, play the result on term and check it ends up
+ * showing what the frame alone would draw; returns bytes sent */
+static int encode_and_check(struct outputEncoder *enc, struct vtScreen *term,
+                            const char *frame) {
+    struct abuf ab = ABUF_INIT;
+    struct vtScreen want = { 0 };
+    int rows = term->rows, cols = term->cols;
+
+    outputEncode(enc, frame, strlen(frame), rows, cols, 1, &ab);
+    TEST_ASSERT(vtFeed(term, ab.b, ab.len));
+    vtInit(&want, rows, cols);
+    TEST_ASSERT(vtFeed(&want, frame, strlen(frame)));
+    TEST_ASSERT(same_screen(&want, term));
+    TEST_ASSERT_EQUAL_INT(want.y, term->y);
+    TEST_ASSERT_EQUAL_INT(want.x, term->x);
+    TEST_ASSERT_EQUAL_INT(want.cursor_visible, term->cursor_visible);
+    vtFree(&want);
+    abFree(&ab);
+    return ab.len;
+}
+
+void test_output_encoder() {
+    struct outputEncoder enc = { 0 };
+    struct vtScreen term = { 0 };
+    vtInit(&term, 4, 24);
+
+    const char *first = "\x1b[?25l\x1b[H\x1b[35mint\x1b[0m main(void) {\x1b[K\r\n"
+                        "    return 0;\x1b[K\r\n"
+                        "\x1b[7m-- a.c -----------------\x1b[m\r\n"
+                        "\x1b[K\x1b[J\x1b[2;1H\x1b[?25h";
+    encode_and_check(&enc, &term, first);
+
+    /* One changed character costs a few bytes, not a redraw */
+    const char *typed = "\x1b[?25l\x1b[H\x1b[35mint\x1b[0m main(void) {\x1b[K\r\n"
+                        "    return 1;\x1b[K\r\n"
+                        "\x1b[7m-- a.c -----------------\x1b[m\r\n"
+                        "\x1b[K\x1b[J\x1b[2;13H\x1b[?25h";
+    TEST_ASSERT(encode_and_check(&enc, &term, typed) < 24);
+    TEST_ASSERT_EQUAL_INT(0, encode_and_check(&enc, &term, typed));
+
+    /* Blank runs are erased, repeats repeated, wide characters kept whole */
+    enc.rep = 1;
+    const char *wide = "\x1b[?25l\x1b[H\xe6\xbc\xa2\xe5\xad\x97x\x1b[K\r\n"
+                       "a\xe6\xbc\xa2                 z\r\n"
+                       "\x1b[7m------------------------\x1b[m\r\n"
+                       "\x1b[K\x1b[J\x1b[1;1H\x1b[?25h";
+    encode_and_check(&enc, &term, wide);
+    const char *narrow = "\x1b[?25l\x1b[H ab\xe6\xbc\xa2\x1b[K\r\n"
+                         "\x1b[K\r\n"
+                         "\x1b[7m------------------------\x1b[m\r\n"
+                         "\x1b[K\x1b[J\x1b[4;1H\x1b[?25h";
+    encode_and_check(&enc, &term, narrow);
+
+    /* What the model cannot follow goes out as it is, and the next frame
+     * repaints */
+    struct abuf ab = ABUF_INIT;
+    outputEncode(&enc, "\x1b[H\x07", 4, 4, 24, 1, &ab);
+    TEST_ASSERT_EQUAL_INT(4, ab.len);
+    TEST_ASSERT(enc.valid == 0);
+    abFree(&ab);
+    vtInit(&term, 4, 24);
+    encode_and_check(&enc, &term, first);
+
+    vtFree(&term);
+    vtFree(&enc.front);
+    vtFree(&enc.back);
+}
+
+/* Test emsys_memmem against a naive search */
+static const uint8_t *naive_memmem(const uint8_t *hay, size_t n,
+                                   const uint8_t *needle, size_t m) {
+    for (size_t i = 0; i + m <= n; i++) {
+        if (memcmp(hay + i, needle, m) == 0)
+            return hay + i;
+    }
+    return NULL;
+}
+
+void test_emsys_memmem() {
+    /* Embedded NULs, and matches at both ends */
+    const uint8_t hay[] = "ab\0cd\0ab\0cdx";
+    TEST_ASSERT(emsys_memmem(hay, 12, "\0cd", 3) == hay + 2);
+    TEST_ASSERT(emsys_memmem(hay, 12, "ab", 2) == hay);
+    TEST_ASSERT(emsys_memmem(hay, 12, "cdx", 3) == hay + 9);
+    TEST_ASSERT(emsys_memmem(hay, 11, "cdx", 3) == NULL);
+    TEST_ASSERT(emsys_memmem(hay, 12, "", 0) == hay);
+    TEST_ASSERT(emsys_memmem(hay, 2, "abc", 3) == NULL);
+
+    /* Random small alphabets give many near misses, on both sides of
+     * the vector loops */
+    uint8_t text[300], pat[12];
+    srand(1);
+    for (int round = 0; round < 3000; round++) {
+        size_t n = rand() % sizeof(text), m = 1 + rand() % sizeof(pat);
+        for (size_t i = 0; i < n; i++)
+            text[i] = "ab\0"[rand() % 3];
+        for (size_t i = 0; i < m; i++)
+            pat[i] = "ab\0"[rand() % 3];
+        TEST_ASSERT(emsys_memmem(text, n, pat, m) ==
+                    naive_memmem(text, n, pat, m));
+    }
+
+    /* Needles whose first and last bytes are everywhere defeat the
+     * byte filter and hand over to two-way */
+    size_t big = 200000;
+    uint8_t *runs = malloc(big);
+    uint8_t needle[64];
+    memset(runs, 'a', big);
+    memset(needle, 'a', sizeof(needle));
+    needle[32] = 'b';
+    TEST_ASSERT(emsys_memmem(runs, big, needle, sizeof(needle)) == NULL);
+    runs[big - 40] = 'b';
+    TEST_ASSERT(emsys_memmem(runs, big, needle, sizeof(needle)) ==
+                runs + big - 72);
+    runs[big / 2] = 'b';
+    TEST_ASSERT(emsys_memmem(runs, big, needle, sizeof(needle)) ==
+                runs + big / 2 - 32);
+    for (size_t i = 0; i < big; i++)
+        runs[i] = "ab"[(i / 3) % 2 == 0 || i % 7 == 0];
+    for (int round = 0; round < 200; round++) {
+        size_t m = 2 + rand() % 40, at = rand() % (big - m);
+        memcpy(needle, runs + at, m);
+        TEST_ASSERT(emsys_memmem(runs, big, needle, m) ==
+                    naive_memmem(runs, big, needle, m));
+    }
+    free(runs);
+}
+
+/* Test emsys_memmem_fold against folding every window of the haystack */
+static const uint8_t *naive_memmem_fold(const uint8_t *hay, size_t n,
+                                        const uint8_t *needle, size_t m) {
+    uint8_t window[64];
+    for (size_t i = 0; i + m <= n; i++) {
+        memcpy(window, hay + i, m);
+        emsys_fold(window, m);
+        if (memcmp(window, needle, m) == 0)
+            return hay + i;
+    }
+    return NULL;
+}
+
+void test_emsys_memmem_fold() {
+    TEST_ASSERT(emsys_fold_char('Q') == 'q');
+    TEST_ASSERT(emsys_fold_char(0xc9) == 0xe9);     /* É */
+    TEST_ASSERT(emsys_fold_char(0x420) == 0x440);   /* Р */
+    TEST_ASSERT(emsys_fold_char(0x17d) == 0x17e);   /* Ž */
+    TEST_ASSERT(emsys_fold_char(0x212a) == 0x212a); /* KELVIN SIGN */
+    TEST_ASSERT(!emsys_has_upper((uint8_t *)"foo \\W", 6, 1));
+    TEST_ASSERT(emsys_has_upper((uint8_t *)"foo \\W", 6, 0));
+    TEST_ASSERT(emsys_has_upper((uint8_t *)"\xc3\x89t\xc3\xa9", 5, 0));
+
+    const uint8_t hay[] = "Caf\xc3\x89 \xd0\xa0\xd0\xb0\xd0\x97 x";
+    uint8_t needle[16];
+    memcpy(needle, "caf\xc3\xa9", 5);
+    TEST_ASSERT(emsys_memmem_fold(hay, sizeof(hay) - 1, needle, 5) == hay);
+    memcpy(needle, "\xd1\x80\xd0\xb0\xd0\xb7", 6);
+    TEST_ASSERT(emsys_memmem_fold(hay, sizeof(hay) - 1, needle, 6) ==
+                hay + 6);
+
+    /* Tokens of one and two bytes in both cases, so that matches may
+     * start inside a char as well as at one */
+    static const char *const tokens[] = {
+        "a", "A", "b", "\xc3\xa9", "\xc3\x89", "\xd0\x94", "\xd0\xb4",
+        "\xd0\xa0", "\xd1\x80",
+    };
+    int ntokens = sizeof(tokens) / sizeof(tokens[0]);
+    uint8_t text[400], pat[40];
+    srand(3);
+    for (int round = 0; round < 3000; round++) {
+        size_t n = 0, m = 0;
+        int tn = rand() % 150, tm = 1 + rand() % 8;
+        int alphabet = 2 + rand() % (ntokens - 1);
+        for (int i = 0; i < tn; i++) {
+            const char *t = tokens[rand() % alphabet];
+            memcpy(text + n, t, strlen(t));
+            n += strlen(t);
+        }
+        for (int i = 0; i < tm; i++) {
+            const char *t = tokens[rand() % alphabet];
+            memcpy(pat + m, t, strlen(t));
+            m += strlen(t);
+        }
+        emsys_fold(pat, m);
+        TEST_ASSERT(emsys_memmem_fold(text, n, pat, m) ==
+                    naive_memmem_fold(text, n, pat, m));
+    }
+
+    /* Periodic ASCII needles go to two-way over the folded haystack */
+    size_t big = 100000;
+    uint8_t *runs = malloc(big);
+    for (size_t i = 0; i < big; i++)
+        runs[i] = "aAbB"[((i / 3) % 2 == 0 || i % 7 == 0) * 2 + i % 2];
+    for (int round = 0; round < 100; round++) {
+        size_t m = 2 + rand() % 38, at = rand() % (big - m);
+        memcpy(pat, runs + at, m);
+        emsys_fold(pat, m);
+        TEST_ASSERT(emsys_memmem_fold(runs, big, pat, m) ==
+                    naive_memmem_fold(runs, big, pat, m));
+    }
+    free(runs);
+}
+
+/* replace-string and query-replace on mixed case: folded, every case of
+ * a lower-case string goes, and only the exact one when folding is off */
+void test_str_replace_fold() {
+    char rep[16] = "foo";
+    char *r = str_replace("foo Foo FOO fo", rep, "bar", 1);
+    TEST_ASSERT_EQUAL_STRING("bar bar bar fo", r);
+    free(r);
+    r = str_replace("foo Foo FOO fo", rep, "bar", 0);
+    TEST_ASSERT_EQUAL_STRING("bar Foo FOO fo", r);
+    free(r);
+
+    strcpy(rep, "\xc3\x89t\xc3\xa9\nX");
+    emsys_fold((uint8_t *)rep, strlen(rep));
+    r = str_replace("\xc3\xa9t\xc3\xa9\nx \xc3\x89T\xc3\x89\nX", rep,
+                    "-", 1);
+    TEST_ASSERT_EQUAL_STRING("- -", r);
+    free(r);
+}
+
+/* reSearch from 0 on text, as "start end" of groups 0 and 1 */
+static const char *re_find(const char *pattern, int flags, const char *text) {
+    static char out[64];
+    char error[80];
+    struct reSpan g[2];
+    struct re *re = reCompile((const uint8_t *)pattern, strlen(pattern),
+                              flags, error, sizeof(error));
+    if (!re)
+        return error[0] ? "error" : "";
+    if (!reSearch(re, (const uint8_t *)text, strlen(text), 0, g, 2))
+        strcpy(out, "none");
+    else
+        snprintf(out, sizeof(out), "%ld %ld %ld %ld", g[0].start, g[0].end,
+                 g[1].start, g[1].end);
+    reFree(re);
+    return out;
+}
+
+void test_re_syntax() {
+    TEST_ASSERT_EQUAL_STRING("1 4 -1 -1", re_find("b+c", 0, "abbcd"));
+    TEST_ASSERT_EQUAL_STRING("0 3 1 2", re_find("a(b|c)d", 0, "acd"));
+    TEST_ASSERT_EQUAL_STRING("none", re_find("a.c", 0, "a\nc"));
+    TEST_ASSERT_EQUAL_STRING("none", re_find("a[^b]c", 0, "a\nc"));
+    TEST_ASSERT_EQUAL_STRING("3 4 -1 -1", re_find("^c", 0, "ab\ncd"));
+    TEST_ASSERT_EQUAL_STRING("1 2 -1 -1", re_find("b$", 0, "ab\ncd"));
+    TEST_ASSERT_EQUAL_STRING("1 4 -1 -1", re_find("b\\nc", 0, "ab\ncd"));
+    TEST_ASSERT_EQUAL_STRING("0 3 -1 -1", re_find("a[^\\n]c", 0, "abc"));
+    TEST_ASSERT_EQUAL_STRING("5 8 -1 -1", re_find("\\bfoo\\b", 0, "xfoo foo"));
+    TEST_ASSERT_EQUAL_STRING("0 2 -1 -1", re_find("\\w+", 0, "ab-cd"));
+    TEST_ASSERT_EQUAL_STRING("1 3 -1 -1", re_find("[[:digit:]]{2}", 0, "a123"));
+    TEST_ASSERT_EQUAL_STRING("0 3 -1 -1", re_find("a{,3}", 0, "aaaa"));
+    TEST_ASSERT_EQUAL_STRING("0 2 -1 -1", re_find("a{", 0, "a{"));
+    TEST_ASSERT_EQUAL_STRING("0 2 0 1", re_find("(?:(a)|b)+", 0, "ab"));
+    TEST_ASSERT_EQUAL_STRING("error", re_find("(a", 0, ""));
+    TEST_ASSERT_EQUAL_STRING("error", re_find("a)", 0, ""));
+    TEST_ASSERT_EQUAL_STRING("error", re_find("[a", 0, ""));
+    TEST_ASSERT_EQUAL_STRING("error", re_find("*a", 0, ""));
+    TEST_ASSERT_EQUAL_STRING("error", re_find("(a)\\1", 0, ""));
+    TEST_ASSERT_EQUAL_STRING("error", re_find("a{3,2}", 0, ""));
+
+    /* Leftmost first, greedy or lazy */
+    TEST_ASSERT_EQUAL_STRING("0 1 0 1", re_find("(a|ab)", 0, "ab"));
+    TEST_ASSERT_EQUAL_STRING("0 4 0 3", re_find("(.*)c", 0, "abcc"));
+    TEST_ASSERT_EQUAL_STRING("0 3 0 2", re_find("(.*?)c", 0, "abcc"));
+    TEST_ASSERT_EQUAL_STRING("0 0 -1 -1", re_find("a??", 0, "a"));
+
+    /* Whole chars, and case folded as emsys_fold_char has it */
+    TEST_ASSERT_EQUAL_STRING("0 4 -1 -1", re_find("x.y", 0, "x\xc3\xa9y"));
+    TEST_ASSERT_EQUAL_STRING("0 5 -1 -1", re_find("x[\xc3\xa0-\xc3\xbf]+",
+                                                  0, "x\xc3\xa9\xc3\xa8"));
+    TEST_ASSERT_EQUAL_STRING("1 5 -1 -1", re_find("ab\xc3\xa9", RE_FOLD,
+                                                  "xAB\xc3\x89"));
+    TEST_ASSERT_EQUAL_STRING("0 2 -1 -1", re_find("[^\xd0\xb0]", RE_FOLD,
+                                                  "\xd0\xb1"));
+    TEST_ASSERT_EQUAL_STRING("none", re_find("[^\xd0\xb0]", RE_FOLD,
+                                             "\xd0\x90"));
+}
+
+void test_re_required() {
+    const uint8_t *lit;
+    char error[80];
+    struct re *re = reCompile((const uint8_t *)"x+(ab|cd)?HELLO.*z", 18,
+                              RE_FOLD, error, sizeof(error));
+    size_t n = reRequired(re, &lit);
+    TEST_ASSERT(n == 5 && memcmp(lit, "hello", 5) == 0);
+    reFree(re);
+    re = reCompile((const uint8_t *)"a|b", 3, 0, error, sizeof(error));
+    TEST_ASSERT(reRequired(re, &lit) == 0);
+    reFree(re);
+}
+
+/* A pattern a backtracker takes exponential time over */
+void test_re_linear() {
+    size_t n = 100000;
+    uint8_t *text = malloc(n);
+    memset(text, 'a', n);
+    char error[80];
+    const char *pattern = "(a*)*b|(a|aa)*c|(x+x+)+y";
+    struct re *re = reCompile((const uint8_t *)pattern, strlen(pattern), 0,
+                              error, sizeof(error));
+    struct reSpan m;
+    TEST_ASSERT(!reSearch(re, text, n, 0, &m, 1));
+    text[n - 1] = 'c';
+    TEST_ASSERT(reSearch(re, text, n, 0, &m, 1) && m.start == 0 &&
+                (size_t)m.end == n);
+    reFree(re);
+    free(text);
+}
+
+/* Test reSearchLast against trying every start from the right */
+static int naive_search_last(struct re *re, const char *text, size_t limit,
+                             struct reSpan *match) {
+    size_t len = strlen(text);
+    for (long pos = (limit <= len ? (long)limit - 1 : (long)len); pos >= 0;
+         pos--) {
+        struct reSpan m;
+        if (reSearch(re, (const uint8_t *)text, len, pos, &m, 1) &&
+            m.start == pos) {
+            *match = m;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct re *compile(const char *pattern) {
+    char error[80];
+    return reCompile((const uint8_t *)pattern, strlen(pattern), 0, error,
+                     sizeof(error));
+}
+
+void test_re_search_last() {
+    struct re *re;
+    struct reSpan m;
+
+    /* The last start may lie inside the last of the matches walked */
+    re = compile("aa");
+    TEST_ASSERT(reSearchLast(re, (const uint8_t *)"aaa", 3, 4, &m) &&
+                m.start == 1 && m.end == 3);
+    TEST_ASSERT(reSearchLast(re, (const uint8_t *)"aaa", 3, 1, &m) &&
+                m.start == 0);
+    TEST_ASSERT(!reSearchLast(re, (const uint8_t *)"aba", 3, 4, &m));
+    reFree(re);
+
+    re = compile("^x|y*");
+    TEST_ASSERT(reSearchLast(re, (const uint8_t *)"xyx", 3, 4, &m) &&
+                m.start == 3 && m.end == 3);
+    TEST_ASSERT(reSearchLast(re, (const uint8_t *)"xyx", 3, 1, &m) &&
+                m.start == 0 && m.end == 1);
+    reFree(re);
+
+    static const char *const patterns[] = {
+        "a+b", "[ab]*c", "ab|ba", "a(b|c)+a", "b*", "^a.", "c$",
+    };
+    char text[40];
+    srand(2);
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        re = compile(patterns[p]);
+        for (int round = 0; round < 500; round++) {
+            int n = rand() % (int)(sizeof(text) - 1);
+            for (int i = 0; i < n; i++)
+                text[i] = "abc"[rand() % 3];
+            text[n] = '\0';
+            size_t limit = rand() % (n + 2);
+            struct reSpan want;
+            int found = naive_search_last(re, text, limit, &want);
+            TEST_ASSERT(reSearchLast(re, (const uint8_t *)text, n, limit,
+                                     &m) == found);
+            if (found)
+                TEST_ASSERT(m.start == want.start && m.end == want.end);
+        }
+        reFree(re);
+    }
+}
+
 int main() {
     TEST_BEGIN();
     
@@ -339,9 +908,12 @@ int main() {
     RUN_TEST(test_char_width);
     RUN_TEST(test_string_width);
     RUN_TEST(test_char_in_string_width);
+    RUN_TEST(test_width_table);
+    RUN_TEST(test_ascii_prefix);
     
     /* Screen position tests */
     RUN_TEST(test_next_screen_x);
+    RUN_TEST(test_wrap_line_starts);
     RUN_TEST(test_utf8_validation);
     
     /* Other tests */
@@ -349,6 +921,12 @@ int main() {
     RUN_TEST(test_tab_stops);
     RUN_TEST(test_string_ops);
     
+    /* Syntax highlighting tests */
+    RUN_TEST(test_syntax_lex_c);
+    RUN_TEST(test_syntax_lex_others);
+    RUN_TEST(test_syntax_incremental);
+    RUN_TEST(test_output_encoder);
+
     /* emsys_getline tests */
     RUN_TEST(test_emsys_getline_short_line);
     RUN_TEST(test_emsys_getline_exact_120);
@@ -356,6 +934,13 @@ int main() {
     RUN_TEST(test_emsys_getline_no_final_newline);
     RUN_TEST(test_emsys_getline_empty_file);
     RUN_TEST(test_emsys_getline_multiple_reallocs);
+    RUN_TEST(test_emsys_memmem);
+    RUN_TEST(test_emsys_memmem_fold);
+    RUN_TEST(test_str_replace_fold);
+    RUN_TEST(test_re_syntax);
+    RUN_TEST(test_re_required);
+    RUN_TEST(test_re_linear);
+    RUN_TEST(test_re_search_last);
     
     return TEST_END();
 }
\ No newline at end of file
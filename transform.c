@@ -126,7 +126,7 @@ void editorWhitespaceCleanup(struct editorConfig *UNUSED(ed),
 				break;
 			}
 		}
-		row->render_valid = 0;
+		invalidateRow(buf, i);
 	}
 
 	if (buf->cx > buf->row[buf->cy].size) {
@@ -0,0 +1,332 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emsys.h"
+#include "display.h"
+#include "trigram.h"
+#include "unused.h"
+#include "util.h"
+
+extern struct editorConfig E;
+
+/*
+ * A per-buffer trigram index, for searching big buffers over and over.
+ *
+ * Every indexed row carries an id, and every trigram (three bytes, ASCII
+ * letters folded to lower case) a posting list of the ids of the rows it
+ * is in.  Ids are handed out in increasing order and never reused, so a
+ * list only ever grows at its end and is kept as varint deltas.  An edit
+ * just takes the row's id away (trigramForgetRow); its old postings are
+ * left to go stale, and the row is indexed afresh under a new id in
+ * between keys.  Once the stale ids outnumber the live ones the index
+ * starts over.
+ *
+ * A search for a literal intersects the lists of its rarest trigrams into
+ * a bitmap of ids.  A row whose id is not in it cannot match and is not
+ * looked at; a row with no id, or one newer than the bitmap, always is.
+ * Since every edit goes through trigramForgetRow, code that changes a
+ * row's chars in place has to call invalidateRow.
+ */
+
+#define TRIGRAM_BITS 16
+#define TRIGRAM_LISTS (1 << TRIGRAM_BITS)
+#define TRIGRAM_FILTER_LISTS 4 /* most lists intersected for a search */
+#define TRIGRAM_SLICE_NANOS 20000000L /* indexing in between keys */
+#define TRIGRAM_CLOCK_ROWS 256 /* rows indexed between looks at the clock */
+
+struct postingList {
+	uint8_t *data; /* ids as varint deltas, ascending */
+	uint32_t len;
+	uint32_t cap;
+	uint32_t last; /* last id added */
+	uint32_t count;
+};
+
+struct trigramIndex {
+	struct postingList lists[TRIGRAM_LISTS];
+	unsigned int epoch; /* unique to this index and its ids */
+	uint32_t next_id;
+	long live; /* rows with an id */
+	size_t bytes; /* memory held */
+	int pending; /* there may be rows without an id */
+	int cursor; /* next row for trigramStep */
+	long forgotten; /* ids taken away, so far */
+	long pass_forgotten; /* ... when the pass from row 0 began */
+	int built; /* the first build is done and has been reported */
+};
+
+struct trigramFilter {
+	unsigned int epoch;
+	uint32_t limit; /* ids from here on are newer than the filter */
+	uint8_t *bits; /* NULL if not worth filtering by */
+};
+
+static unsigned int last_epoch;
+
+static long nanosSince(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+	       (now.tv_nsec - start->tv_nsec);
+}
+
+static uint32_t fold(uint8_t c) {
+	return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static unsigned int listFor(uint32_t trigram) {
+	return (trigram * 2654435761u) >> (32 - TRIGRAM_BITS);
+}
+
+static void addPosting(struct trigramIndex *ix, struct postingList *l,
+		       uint32_t id) {
+	if (l->count && l->last == id)
+		return; /* the trigram comes up again in the same row */
+	if (l->len + 5 > l->cap) {
+		uint32_t cap = l->cap ? l->cap * 2 : 16;
+		l->data = xrealloc(l->data, cap);
+		ix->bytes += cap - l->cap;
+		l->cap = cap;
+	}
+	uint32_t delta = id - l->last;
+	while (delta >= 0x80) {
+		l->data[l->len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	l->data[l->len++] = delta;
+	l->last = id;
+	l->count++;
+}
+
+static void indexRow(struct trigramIndex *ix, erow *row) {
+	uint32_t id = ix->next_id++;
+	row->trigram_id = id;
+	ix->live++;
+	if (row->size < 3)
+		return;
+	uint32_t t = fold(row->chars[0]) << 8 | fold(row->chars[1]);
+	for (int i = 2; i < row->size; i++) {
+		t = (t << 8 | fold(row->chars[i])) & 0xffffff;
+		addPosting(ix, &ix->lists[listFor(t)], id);
+	}
+}
+
+static void clearIndex(struct editorBuffer *buf) {
+	struct trigramIndex *ix = buf->trigrams;
+	for (int i = 0; i < TRIGRAM_LISTS; i++)
+		free(ix->lists[i].data);
+	memset(ix->lists, 0, sizeof(ix->lists));
+	for (int i = 0; i < buf->numrows; i++)
+		buf->row[i].trigram_id = 0;
+	ix->epoch = ++last_epoch;
+	ix->next_id = 1;
+	ix->live = 0;
+	ix->bytes = sizeof(*ix);
+	ix->pending = 1;
+	ix->cursor = 0;
+	ix->forgotten = ix->pass_forgotten = 0;
+}
+
+void trigramFree(struct editorBuffer *buf) {
+	if (!buf->trigrams)
+		return;
+	clearIndex(buf);
+	free(buf->trigrams);
+	buf->trigrams = NULL;
+}
+
+/* Row is being changed or deleted: it needs indexing again, if at all */
+void trigramForgetRow(struct editorBuffer *buf, erow *row) {
+	struct trigramIndex *ix = buf->trigrams;
+	if (!ix)
+		return;
+	if (row->trigram_id) {
+		row->trigram_id = 0;
+		ix->live--;
+		ix->forgotten++;
+	}
+	ix->pending = 1;
+}
+
+int trigramPending(void) {
+	for (struct editorBuffer *b = E.headbuf; b; b = b->next) {
+		if (b->trigrams && b->trigrams->pending)
+			return 1;
+	}
+	return 0;
+}
+
+static void report(struct editorBuffer *buf, const char *what) {
+	struct trigramIndex *ix = buf->trigrams;
+	editorSetStatusMessage("Trigram index %s: %ld of %d rows, %.1f MB, "
+			       "%lu stale ids",
+			       what, ix->live, buf->numrows,
+			       ix->bytes / 1048576.0,
+			       (unsigned long)(ix->next_id - 1 - ix->live));
+}
+
+/* Index rows without an id for a slice of time */
+void trigramStep(void) {
+	struct editorBuffer *buf = E.headbuf;
+	while (buf && !(buf->trigrams && buf->trigrams->pending))
+		buf = buf->next;
+	if (!buf)
+		return;
+	struct trigramIndex *ix = buf->trigrams;
+
+	/* Too many stale ids, or about to run out of them */
+	if (ix->next_id - 1 > 2 * (uint32_t)ix->live + 1048576 ||
+	    ix->next_id > UINT32_MAX - (uint32_t)buf->numrows)
+		clearIndex(buf);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 1;; n++) {
+		if (ix->cursor >= buf->numrows) {
+			/* Done, unless rows were forgotten during the pass */
+			ix->cursor = 0;
+			if (ix->forgotten == ix->pass_forgotten) {
+				ix->pending = 0;
+				break;
+			}
+			ix->pass_forgotten = ix->forgotten;
+		}
+		erow *row = &buf->row[ix->cursor++];
+		if (!row->trigram_id)
+			indexRow(ix, row);
+		if (n % TRIGRAM_CLOCK_ROWS == 0 &&
+		    nanosSince(&start) > TRIGRAM_SLICE_NANOS)
+			break;
+	}
+	if (!ix->pending && !ix->built) {
+		ix->built = 1;
+		report(buf, "built");
+	}
+}
+
+void editorTrigramIndex(struct editorConfig *UNUSED(ed),
+			struct editorBuffer *buf) {
+	if (buf->trigrams) {
+		trigramFree(buf);
+		editorSetStatusMessage("Trigram index off");
+		return;
+	}
+	buf->trigrams = xcalloc(1, sizeof(*buf->trigrams));
+	clearIndex(buf);
+	editorSetStatusMessage("Trigram index on; building in the background");
+}
+
+void editorTrigramIndexStats(struct editorConfig *UNUSED(ed),
+			     struct editorBuffer *buf) {
+	if (!buf->trigrams) {
+		editorSetStatusMessage("No trigram index; M-x trigram-index "
+				       "turns it on");
+		return;
+	}
+	report(buf, buf->trigrams->pending ? "building" : "up to date");
+}
+
+/* Next id in a posting list being read at *pos */
+static uint32_t nextPosting(const struct postingList *l, uint32_t *pos,
+			    uint32_t id) {
+	uint32_t delta = 0;
+	int shift = 0;
+	while (l->data[*pos] & 0x80) {
+		delta |= (uint32_t)(l->data[(*pos)++] & 0x7f) << shift;
+		shift += 7;
+	}
+	delta |= (uint32_t)l->data[(*pos)++] << shift;
+	return id + delta;
+}
+
+static int byCount(const void *a, const void *b) {
+	uint32_t x = (*(const struct postingList *const *)a)->count;
+	uint32_t y = (*(const struct postingList *const *)b)->count;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The ids of the rows that have every trigram of lit, or a filter that
+ * rules nothing out when lit is too short for any or the trigrams are
+ * too common to be worth it.
+ */
+struct trigramFilter *trigramFilterNew(struct editorBuffer *buf,
+				       const uint8_t *lit, size_t len) {
+	struct trigramIndex *ix = buf->trigrams;
+	struct trigramFilter *f = xcalloc(1, sizeof(*f));
+	if (!ix)
+		return f;
+	f->epoch = ix->epoch;
+	f->limit = ix->next_id;
+	if (len < 3)
+		return f;
+
+	/* The distinct lists of lit's trigrams, rarest first */
+	const struct postingList *lists[TRIGRAM_FILTER_LISTS + 1];
+	const struct postingList **all = xmalloc((len - 2) * sizeof(*all));
+	int n = 0;
+	uint32_t t = fold(lit[0]) << 8 | fold(lit[1]);
+	for (size_t i = 2; i < len; i++) {
+		t = (t << 8 | fold(lit[i])) & 0xffffff;
+		const struct postingList *l = &ix->lists[listFor(t)];
+		int seen = 0;
+		for (int j = 0; j < n && !seen; j++)
+			seen = all[j] == l;
+		if (!seen)
+			all[n++] = l;
+	}
+	qsort(all, n, sizeof(*all), byCount);
+	if (n > TRIGRAM_FILTER_LISTS)
+		n = TRIGRAM_FILTER_LISTS;
+	memcpy(lists, all, n * sizeof(*all));
+	free(all);
+	if ((long)lists[0]->count > ix->live / 2)
+		return f;
+
+	/* Intersect, starting from the rarest */
+	uint32_t *ids = xmalloc((lists[0]->count + 1) * sizeof(*ids));
+	uint32_t nids = 0, pos = 0, id = 0;
+	for (uint32_t k = 0; k < lists[0]->count; k++)
+		ids[nids++] = id = nextPosting(lists[0], &pos, id);
+	for (int j = 1; j < n && nids > 0; j++) {
+		uint32_t kept = 0, k = 0;
+		pos = id = 0;
+		for (uint32_t c = 0; c < lists[j]->count && k < nids; c++) {
+			id = nextPosting(lists[j], &pos, id);
+			while (k < nids && ids[k] < id)
+				k++;
+			if (k < nids && ids[k] == id)
+				ids[kept++] = ids[k++];
+		}
+		nids = kept;
+	}
+
+	f->bits = xcalloc(f->limit / 8 + 1, 1);
+	for (uint32_t k = 0; k < nids; k++)
+		f->bits[ids[k] >> 3] |= 1 << (ids[k] & 7);
+	free(ids);
+	return f;
+}
+
+/* f still goes with the index of buf, and is not too far behind it */
+int trigramFilterCurrent(const struct trigramFilter *f,
+			 struct editorBuffer *buf) {
+	struct trigramIndex *ix = buf->trigrams;
+	return f && ix && f->epoch == ix->epoch &&
+	       ix->next_id - f->limit <= f->limit / 4;
+}
+
+int trigramFilterSkips(const struct trigramFilter *f, const erow *row) {
+	uint32_t id = row->trigram_id;
+	return f->bits && id && id < f->limit &&
+	       !(f->bits[id >> 3] & (1 << (id & 7)));
+}
+
+void trigramFilterFree(struct trigramFilter *f) {
+	if (!f)
+		return;
+	free(f->bits);
+	free(f);
+}
@@ -0,0 +1,25 @@
+#ifndef EMSYS_TRIGRAM_H
+#define EMSYS_TRIGRAM_H
+#include <stddef.h>
+#include <stdint.h>
+#include "emsys.h"
+
+void editorTrigramIndex(struct editorConfig *ed, struct editorBuffer *buf);
+void editorTrigramIndexStats(struct editorConfig *ed,
+			     struct editorBuffer *buf);
+int trigramPending(void);
+void trigramStep(void);
+void trigramForgetRow(struct editorBuffer *buf, erow *row);
+void trigramFree(struct editorBuffer *buf);
+
+/* The rows a search for a literal may match in, as far as the index
+ * knows */
+struct trigramFilter;
+struct trigramFilter *trigramFilterNew(struct editorBuffer *buf,
+				       const uint8_t *lit, size_t len);
+int trigramFilterCurrent(const struct trigramFilter *f,
+			 struct editorBuffer *buf);
+int trigramFilterSkips(const struct trigramFilter *f, const erow *row);
+void trigramFilterFree(struct trigramFilter *f);
+
+#endif
@@ -11,6 +11,9 @@
 #include "unused.h"
 #include "util.h"
 
+static void applyReplacements(struct editorBuffer *buf,
+			      struct editorUndo *undo, int redo);
+
 void editorDoUndo(struct editorBuffer *buf, int count) {
 	int times = count ? count : 1;
 	for (int j = 0; j < times; j++) {
@@ -21,7 +24,11 @@ void editorDoUndo(struct editorBuffer *buf, int count) {
 		int paired = buf->undo->paired;
 		buf->dirty = 1;
 
-		if (buf->undo->delete) {
+		if (buf->undo->replaced) {
+			applyReplacements(buf, buf->undo, 0);
+			buf->cx = buf->undo->startx;
+			buf->cy = buf->undo->starty;
+		} else if (buf->undo->delete) {
 			buf->cx = buf->undo->startx;
 			buf->cy = buf->undo->starty;
 			for (int i = buf->undo->datalen - 1; i >= 0; i--) {
@@ -48,11 +55,9 @@ void editorDoUndo(struct editorBuffer *buf, int count) {
 					buf->undo->endx - buf->undo->startx;
 				row->chars[row->size] = 0;
 			} else {
-				for (int i = buf->undo->starty + 1;
-				     i < buf->undo->endy; i++) {
-					editorDelRow(buf,
-						     buf->undo->starty + 1);
-				}
+				editorDelRows(buf, buf->undo->starty + 1,
+					      buf->undo->endy -
+						      buf->undo->starty - 1);
 				if (buf->undo->starty + 1 >= buf->numrows) {
 					return;
 				}
@@ -60,14 +65,17 @@ void editorDoUndo(struct editorBuffer *buf, int count) {
 					&buf->row[buf->undo->starty + 1];
 				row->size = buf->undo->startx;
 				row->size += last->size - buf->undo->endx;
-				row->chars = xrealloc(row->chars, row->size);
+				row->chars =
+					xrealloc(row->chars, row->size + 1);
 				memcpy(&row->chars[buf->undo->startx],
 				       &last->chars[buf->undo->endx],
 				       last->size - buf->undo->endx);
+				row->chars[row->size] = 0;
 				editorDelRow(buf, buf->undo->starty + 1);
 			}
 			buf->cx = buf->undo->startx;
 			buf->cy = buf->undo->starty;
+			invalidateRow(buf, buf->cy);
 		}
 
 		editorUpdateBuffer(buf);
@@ -108,7 +116,11 @@ void editorDoRedo(struct editorBuffer *buf, int count) {
 		}
 		buf->dirty = 1;
 
-		if (buf->redo->delete) {
+		if (buf->redo->replaced) {
+			applyReplacements(buf, buf->redo, 1);
+			buf->cx = buf->redo->endx;
+			buf->cy = buf->redo->endy;
+		} else if (buf->redo->delete) {
 			struct erow *row = &buf->row[buf->redo->starty];
 			if (buf->redo->starty == buf->redo->endy) {
 				memmove(&row->chars[buf->redo->startx],
@@ -118,23 +130,24 @@ void editorDoRedo(struct editorBuffer *buf, int count) {
 					buf->redo->endx - buf->redo->startx;
 				row->chars[row->size] = 0;
 			} else {
-				for (int i = buf->redo->starty + 1;
-				     i < buf->redo->endy; i++) {
-					editorDelRow(buf,
-						     buf->redo->starty + 1);
-				}
+				editorDelRows(buf, buf->redo->starty + 1,
+					      buf->redo->endy -
+						      buf->redo->starty - 1);
 				struct erow *last =
 					&buf->row[buf->redo->starty + 1];
 				row->size = buf->redo->startx;
 				row->size += last->size - buf->redo->endx;
-				row->chars = xrealloc(row->chars, row->size);
+				row->chars =
+					xrealloc(row->chars, row->size + 1);
 				memcpy(&row->chars[buf->redo->startx],
 				       &last->chars[buf->redo->endx],
 				       last->size - buf->redo->endx);
+				row->chars[row->size] = 0;
 				editorDelRow(buf, buf->redo->starty + 1);
 			}
 			buf->cx = buf->redo->startx;
 			buf->cy = buf->redo->starty;
+			invalidateRow(buf, buf->cy);
 		} else {
 			buf->cx = buf->redo->startx;
 			buf->cy = buf->redo->starty;
@@ -177,6 +190,9 @@ struct editorUndo *newUndo(void) {
 	ret->datasize = 22;
 	ret->data = xmalloc(ret->datasize);
 	ret->data[0] = 0;
+	ret->replaced = NULL;
+	ret->nreplaced = 0;
+	ret->replacedsize = 0;
 	return ret;
 }
 
@@ -186,6 +202,7 @@ static void freeUndos(struct editorUndo *first) {
 
 	while (cur != NULL) {
 		free(cur->data);
+		free(cur->replaced);
 		prev = cur;
 		cur = prev->prev;
 		free(prev);
@@ -203,6 +220,130 @@ void clearUndosAndRedos(struct editorBuffer *buf) {
 	clearRedos(buf);
 }
 
+/*
+ * Replace records keep the replacements a command made within rows, so
+ * that undoing or redoing them rewrites each row touched once, however
+ * many replacements it has, rather than deleting and reinserting the text
+ * between the first and the last.  Texts the same as the one before are
+ * kept once.
+ */
+
+/* Start a replace record, to be given the replacements as they are made
+ * and finished with editorUndoReplaceEnd */
+struct editorUndo *editorUndoReplaceBegin(struct editorBuffer *buf) {
+	clearRedos(buf);
+	if (buf->undo != NULL)
+		buf->undo->append = 0;
+	struct editorUndo *new = newUndo();
+	new->append = 0;
+	new->replacedsize = 16;
+	new->replaced = xmalloc(new->replacedsize * sizeof(*new->replaced));
+	new->prev = buf->undo;
+	buf->undo = new;
+	return new;
+}
+
+/* Offset of text in undo's data, added unless it is the last one */
+static int undoText(struct editorUndo *undo, int last, int lastlen,
+		    const uint8_t *text, int len) {
+	if (last >= 0 && lastlen == len &&
+	    memcmp(&undo->data[last], text, len) == 0)
+		return last;
+	if (undo->datalen + len >= undo->datasize) {
+		while (undo->datalen + len >= undo->datasize) {
+			if ((size_t)undo->datasize > INT_MAX / 2)
+				die("buffer size overflow");
+			undo->datasize *= 2;
+		}
+		undo->data = xrealloc(undo->data, undo->datasize);
+	}
+	memcpy(&undo->data[undo->datalen], text, len);
+	undo->datalen += len;
+	undo->data[undo->datalen] = 0;
+	return undo->datalen - len;
+}
+
+/* Record that old was replaced by new, which starts at col in row.
+ * Replacements must be recorded in buffer order. */
+void editorUndoReplaced(struct editorUndo *undo, int row, int col,
+			const uint8_t *old, int oldlen, const uint8_t *new,
+			int newlen) {
+	if (undo->nreplaced == undo->replacedsize) {
+		if (undo->replacedsize > INT_MAX / 2)
+			die("buffer size overflow");
+		undo->replacedsize *= 2;
+		undo->replaced =
+			xrealloc(undo->replaced,
+				 undo->replacedsize * sizeof(*undo->replaced));
+	}
+	struct editorReplacement *r = &undo->replaced[undo->nreplaced];
+	struct editorReplacement *prev = undo->nreplaced ? r - 1 : NULL;
+	r->row = row;
+	r->col = col;
+	r->old = undoText(undo, prev ? prev->old : -1, prev ? prev->oldlen : 0,
+			  old, oldlen);
+	r->oldlen = oldlen;
+	r->new = undoText(undo, prev ? prev->new : -1, prev ? prev->newlen : 0,
+			  new, newlen);
+	r->newlen = newlen;
+	undo->nreplaced++;
+}
+
+/* Finish a replace record: point goes to the first replacement on undo
+ * and past the last on redo.  A record of nothing is dropped. */
+void editorUndoReplaceEnd(struct editorBuffer *buf, struct editorUndo *undo) {
+	if (undo->nreplaced == 0) {
+		buf->undo = undo->prev;
+		undo->prev = NULL;
+		freeUndos(undo);
+		return;
+	}
+	struct editorReplacement *last = &undo->replaced[undo->nreplaced - 1];
+	undo->startx = undo->replaced[0].col;
+	undo->starty = undo->replaced[0].row;
+	undo->endx = last->col + last->newlen;
+	undo->endy = last->row;
+}
+
+/* Undo the replacements of undo, or redo them, a row at a time */
+static void applyReplacements(struct editorBuffer *buf,
+			      struct editorUndo *undo, int redo) {
+	struct abuf line = ABUF_INIT;
+	int i = 0;
+	while (i < undo->nreplaced) {
+		int at = undo->replaced[i].row;
+		if (at >= buf->numrows)
+			break;
+		erow *row = &buf->row[at];
+		int copied = 0, shift = 0;
+		line.len = 0;
+		for (; i < undo->nreplaced && undo->replaced[i].row == at;
+		     i++) {
+			struct editorReplacement *r = &undo->replaced[i];
+			/* Where the replaced text starts in the row as it is,
+			 * before or after the replacements */
+			int col = redo ? r->col - shift : r->col;
+			int len = redo ? r->oldlen : r->newlen;
+			if (col < copied || col + len > row->size)
+				continue;
+			abAppend(&line, (char *)&row->chars[copied],
+				 col - copied);
+			if (redo)
+				abAppend(&line, (char *)&undo->data[r->new],
+					 r->newlen);
+			else
+				abAppend(&line, (char *)&undo->data[r->old],
+					 r->oldlen);
+			copied = col + len;
+			shift += r->newlen - r->oldlen;
+		}
+		abAppend(&line, (char *)&row->chars[copied],
+			 row->size - copied);
+		rowSetString(buf, row, line.b ? line.b : "", line.len);
+	}
+	abFree(&line);
+}
+
 #define ALIGNED(x1, y1, x2, y2) ((x1 == x2) && (y1 == y2))
 
 void editorUndoAppendChar(struct editorBuffer *buf, uint8_t c) {
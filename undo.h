@@ -10,6 +10,11 @@ void editorUndoAppendUnicode(struct editorConfig *ed, struct editorBuffer *buf);
 void editorUndoBackSpace(struct editorBuffer *buf, uint8_t c);
 void editorUndoDelChar(struct editorBuffer *buf, erow *row);
 struct editorUndo *newUndo(void);
+struct editorUndo *editorUndoReplaceBegin(struct editorBuffer *buf);
+void editorUndoReplaced(struct editorUndo *undo, int row, int col,
+			const uint8_t *old, int oldlen, const uint8_t *new,
+			int newlen);
+void editorUndoReplaceEnd(struct editorBuffer *buf, struct editorUndo *undo);
 void clearRedos(struct editorBuffer *buf);
 void clearUndosAndRedos(struct editorBuffer *buf);
 #ifdef EMSYS_DEBUG_UNDO
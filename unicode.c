@@ -1,10 +1,17 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <wchar.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "wcwidth.h"
 #include "unicode.h"
 #include "emsys.h"
+#include "widthtab.h"
 
 /* The UCS format used by wcwidth.c. NOT a general purpose function. */
 static int utf8ToUCS(uint8_t *str, int idx) {
@@ -146,6 +153,17 @@ int stringWidth(uint8_t *str) {
 	return width;
 }
 
+/* Column width of a code point, as mk_wcwidth() would return it, looked
+ * up in the generated page/leaf table instead of bisecting the ranges. */
+int ucsWidth(int ucs) {
+	if (ucs < 0 || ucs >= WIDTH_TABLE_LIMIT) {
+		return mk_wcwidth(ucs);
+	}
+	uint8_t packed = width_leaves[width_pages[ucs >> 8]][(ucs & 0xff) >> 2];
+	int code = (packed >> ((ucs & 3) * 2)) & 3;
+	return code == 3 ? -1 : code;
+}
+
 int charInStringWidth(uint8_t *str, int idx) {
 	if (str[idx] < 0x20) {
 		return 2;
@@ -156,7 +174,7 @@ int charInStringWidth(uint8_t *str, int idx) {
 		return 2;
 	} else {
 		int rune = utf8ToUCS(str, idx);
-		return mk_wcwidth(rune);
+		return ucsWidth(rune);
 	}
 }
 
@@ -190,6 +208,55 @@ int utf8_isCont(uint8_t ch) {
 	return (0x80 <= ch && ch <= 0xBF);
 }
 
+/*
+ * Length of the run of printable ASCII (0x20-0x7e) at the start of str.
+ * Rows made only of such bytes are one column per byte and render as
+ * themselves, so this is checked a vector or word at a time.
+ */
+int asciiPrefixLength(const uint8_t *str, int len) {
+	int i = 0;
+
+#if defined(__SSE2__)
+	/* Signed compares: bytes >= 0x80 are negative and fail the first */
+	const __m128i below = _mm_set1_epi8(0x1f);
+	const __m128i above = _mm_set1_epi8(0x7f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, below),
+					   _mm_cmplt_epi8(v, above));
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			break;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t lowest = vdupq_n_u8(0x20);
+	const uint8x16_t highest = vdupq_n_u8(0x7e);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(str + i);
+		uint8x16_t ok = vandq_u8(vcgeq_u8(v, lowest),
+					 vcleq_u8(v, highest));
+		if (vminvq_u8(ok) != 0xff)
+			break;
+	}
+#else
+	/* Eight bytes at a time: any high bit, any byte below 0x20, or
+	 * any byte equal to 0x7f ends the run */
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v, del;
+		memcpy(&v, str + i, 8);
+		del = v ^ (ones * 0x7f);
+		if ((v & highs) || ((v - ones * 0x20) & ~v & highs) ||
+		    ((del - ones) & ~del & highs))
+			break;
+	}
+#endif
+
+	while (i < len && str[i] >= 0x20 && str[i] < 0x7f)
+		i++;
+	return i;
+}
+
 int nextScreenX(uint8_t *str, int *idx, int screen_x) {
 	uint8_t ch = str[*idx];
 
@@ -213,3 +280,33 @@ int nextScreenX(uint8_t *str, int *idx, int screen_x) {
 
 	return screen_x;
 }
+
+/*
+ * The render columns the lines of str start at, after the first, when it
+ * is wrapped to lines of cols columns.  A character that does not fit in
+ * what is left of a line goes to the start of the next one, leaving the
+ * end of the line blank; only a tab is split over the edge.  A line is
+ * started past a last character that ends on the edge, for the end of
+ * the text to be on.  Up to max starts go in starts; returns how many
+ * there are.
+ */
+int wrapLineStarts(uint8_t *str, int len, int cols, int *starts, int max) {
+	int n = 0, start = 0, x = 0;
+	for (int i = 0; i < len; i++) {
+		int tab = str[i] == '\t';
+		int next = nextScreenX(str, &i, x);
+		while (next > start + cols) {
+			start = !tab && x > start ? x : start + cols;
+			if (n < max)
+				starts[n] = start;
+			n++;
+		}
+		x = next;
+	}
+	if (x >= start + cols) {
+		if (n < max)
+			starts[n] = start + cols;
+		n++;
+	}
+	return n;
+}
@@ -4,6 +4,8 @@ int unicodeTest(void);
 
 int stringWidth(uint8_t *str);
 
+int ucsWidth(int ucs);
+
 int charInStringWidth(uint8_t *str, int idx);
 
 int utf8_is2Char(uint8_t ch);
@@ -16,4 +18,8 @@ int utf8_nBytes(uint8_t ch);
 
 int utf8_isCont(uint8_t ch);
 
+int asciiPrefixLength(const uint8_t *str, int len);
+
 int nextScreenX(uint8_t *str, int *idx, int screen_x);
+
+int wrapLineStarts(uint8_t *str, int len, int cols, int *starts, int max);
@@ -2,8 +2,13 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <stdint.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
 
 void *xmalloc(size_t size) {
 	void *ptr = malloc(size);
@@ -45,6 +50,29 @@ char *xstrdup(const char *s) {
 	return ptr;
 }
 
+void abAppend(struct abuf *ab, const char *s, int len) {
+	if (len <= 0)
+		return;
+	if (ab->len + len > ab->capacity) {
+		int new_capacity = ab->capacity == 0 ? 1024 : ab->capacity * 2;
+		while (new_capacity < ab->len + len) {
+			if (new_capacity > INT_MAX / 2) {
+				fprintf(stderr, "abAppend: buffer size overflow\n");
+				abort();
+			}
+			new_capacity *= 2;
+		}
+		ab->b = xrealloc(ab->b, new_capacity);
+		ab->capacity = new_capacity;
+	}
+	memcpy(&ab->b[ab->len], s, len);
+	ab->len += len;
+}
+
+void abFree(struct abuf *ab) {
+	free(ab->b);
+}
+
 ssize_t emsys_getline(char **lineptr, size_t *n, FILE *stream) {
 	char *ptr, *eptr;
 
@@ -147,3 +175,442 @@ size_t emsys_strlcat(char *dst, const char *src, size_t dsize) {
 
 	return (dlen + (src - osrc)); /* count does not include NUL */
 }
+
+/*
+ * emsys_memmem: memmem, which POSIX 2001 lacks, for haystacks that may
+ * hold NULs.  Candidate positions are those where both the first and the
+ * last byte of the needle match, tested 16 at a time with SSE2 where the
+ * compiler has it and 8 at a time in a word otherwise, and each is checked
+ * with memcmp.  Should the checking cost more than a few times the bytes
+ * passed over, as with needles like "aaab" in runs of 'a', the rest of
+ * the haystack goes to the two-way algorithm, which is linear always.
+ */
+
+/* Start of the maximal suffix of x under the byte order, or its reverse;
+ * *period is the period of that suffix */
+static long maximalSuffix(const uint8_t *x, long m, long *period,
+			  int reverse) {
+	long ms = -1, j = 0, k = 1;
+	*period = 1;
+	while (j + k < m) {
+		uint8_t a = x[j + k], b = x[ms + k];
+		if (reverse ? a > b : a < b) {
+			j += k;
+			k = 1;
+			*period = j - ms;
+		} else if (a == b) {
+			if (k != *period) {
+				k++;
+			} else {
+				j += *period;
+				k = 1;
+			}
+		} else {
+			ms = j;
+			j = ms + 1;
+			k = *period = 1;
+		}
+	}
+	return ms;
+}
+
+/* c with ASCII letters in lower case */
+#define FOLD_ASCII(c) ((uint8_t)((c) - 'A') < 26 ? (c) | 0x20 : (c))
+
+/* Two-way search for x in y, or in y with its ASCII folded if fold is set
+ * and x is already */
+static const uint8_t *twoWay(const uint8_t *y, long n, const uint8_t *x,
+			     long m, int fold) {
+#define Y(k) (fold ? FOLD_ASCII(y[k]) : y[k])
+	long p, q, per;
+	long i = maximalSuffix(x, m, &p, 0);
+	long j = maximalSuffix(x, m, &q, 1);
+	long ell = i > j ? i : j;
+	per = i > j ? p : q;
+
+	if (memcmp(x, x + per, ell + 1) == 0) {
+		/* Periodic needle: remember how much of it is known to match */
+		long memory = -1;
+		j = 0;
+		while (j <= n - m) {
+			i = (ell > memory ? ell : memory) + 1;
+			while (i < m && x[i] == Y(i + j))
+				i++;
+			if (i >= m) {
+				i = ell;
+				while (i > memory && x[i] == Y(i + j))
+					i--;
+				if (i <= memory)
+					return y + j;
+				j += per;
+				memory = m - per - 1;
+			} else {
+				j += i - ell;
+				memory = -1;
+			}
+		}
+		return NULL;
+	}
+
+	per = (ell + 1 > m - ell - 1 ? ell + 1 : m - ell - 1) + 1;
+	j = 0;
+	while (j <= n - m) {
+		i = ell + 1;
+		while (i < m && x[i] == Y(i + j))
+			i++;
+		if (i >= m) {
+			i = ell;
+			while (i >= 0 && x[i] == Y(i + j))
+				i--;
+			if (i < 0)
+				return y + j;
+			j += per;
+		} else {
+			j += i - ell;
+		}
+	}
+	return NULL;
+#undef Y
+}
+
+/* 0x80 in each byte of w that is zero, and perhaps in bytes above one */
+#define WORD_ONES ((uint64_t)0x0101010101010101ULL)
+#define ZERO_BYTES(w) (((w) - WORD_ONES) & ~(w) & (WORD_ONES << 7))
+
+void *emsys_memmem(const void *haystack, size_t n, const void *needle,
+		   size_t m) {
+	const uint8_t *y = haystack, *x = needle;
+
+	if (m == 0)
+		return (void *)y;
+	if (m > n)
+		return NULL;
+	if (m == 1)
+		return memchr(y, x[0], n);
+
+	uint8_t first = x[0], last = x[m - 1];
+	size_t end = n - m + 1; /* candidates are [0, end) */
+	size_t i = 0, checked = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	__m128i vfirst = _mm_set1_epi8((char)first);
+	__m128i vlast = _mm_set1_epi8((char)last);
+	for (; i + 16 <= end; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(y + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(y + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, vfirst), _mm_cmpeq_epi8(b, vlast)));
+		while (mask) {
+			size_t at = i + __builtin_ctz(mask);
+			if (memcmp(y + at + 1, x + 1, m - 2) == 0)
+				return (void *)(y + at);
+			checked += m;
+			mask &= mask - 1;
+		}
+		if (checked > 4 * i + 4096)
+			return (void *)twoWay(y + i, n - i, x, m, 0);
+	}
+#else
+	uint64_t wfirst = WORD_ONES * first, wlast = WORD_ONES * last;
+	for (; i + 8 <= end; i += 8) {
+		uint64_t a, b;
+		memcpy(&a, y + i, 8);
+		memcpy(&b, y + i + m - 1, 8);
+		a ^= wfirst;
+		b ^= wlast;
+		if (!ZERO_BYTES(a) || !ZERO_BYTES(b))
+			continue;
+		for (size_t at = i; at < i + 8; at++) {
+			if (y[at] == first && y[at + m - 1] == last) {
+				if (memcmp(y + at + 1, x + 1, m - 2) == 0)
+					return (void *)(y + at);
+				checked += m;
+			}
+		}
+		if (checked > 4 * i + 4096)
+			return (void *)twoWay(y + i, n - i, x, m, 0);
+	}
+#endif
+	for (; i < end; i++) {
+		if (y[i] == first && y[i + m - 1] == last &&
+		    memcmp(y + i + 1, x + 1, m - 2) == 0)
+			return (void *)(y + i);
+	}
+	return NULL;
+}
+
+/*
+ * Case folding for searches.  Unicode simple case folding is followed for
+ * Latin-1, Latin Extended-A, Greek, Cyrillic and Armenian, where it takes
+ * a char to one as long in UTF-8; the few mappings that change the length
+ * (such as KELVIN SIGN to k) are left out, so that a folded match is
+ * always as long as the text it matched and rows need no folded copies.
+ */
+
+/* Pairs of capital and small letters, capital first */
+#define FOLD_PAIRS(c, lo, hi) \
+	((c) >= (lo) && (c) <= (hi) && !(((c) - (lo)) & 1))
+
+int emsys_fold_char(int c) {
+	if (c < 0x80)
+		return FOLD_ASCII(c);
+	if ((c >= 0xc0 && c <= 0xde && c != 0xd7) ||
+	    (c >= 0x391 && c <= 0x3ab && c != 0x3a2) ||
+	    (c >= 0x410 && c <= 0x42f))
+		return c + 0x20;
+	if (c == 0xb5)
+		return 0x3bc;
+	if (c == 0x178)
+		return 0xff;
+	if (FOLD_PAIRS(c, 0x100, 0x12f) || FOLD_PAIRS(c, 0x132, 0x137) ||
+	    FOLD_PAIRS(c, 0x139, 0x148) || FOLD_PAIRS(c, 0x14a, 0x177) ||
+	    FOLD_PAIRS(c, 0x179, 0x17e) || FOLD_PAIRS(c, 0x460, 0x481) ||
+	    FOLD_PAIRS(c, 0x48a, 0x4bf) || FOLD_PAIRS(c, 0x4d0, 0x52f))
+		return c + 1;
+	if (c == 0x386)
+		return 0x3ac;
+	if (c >= 0x388 && c <= 0x38a)
+		return c + 0x25;
+	if (c == 0x38c)
+		return 0x3cc;
+	if (c == 0x38e || c == 0x38f)
+		return c + 0x3f;
+	if (c == 0x3c2)
+		return 0x3c3;
+	if (c >= 0x400 && c <= 0x40f)
+		return c + 0x50;
+	if (c >= 0x531 && c <= 0x556)
+		return c + 0x30;
+	return c;
+}
+
+/* The char at s, n bytes long at most, with its length in *len; a byte
+ * that does not start a whole char is a char of its own */
+static int decodeChar(const uint8_t *s, size_t n, int *len) {
+	int c = s[0], need = 0;
+	if (c >= 0xc2 && c <= 0xdf)
+		need = 1, c &= 0x1f;
+	else if (c >= 0xe0 && c <= 0xef)
+		need = 2, c &= 0x0f;
+	else if (c >= 0xf0 && c <= 0xf4)
+		need = 3, c &= 0x07;
+	if ((size_t)need >= n)
+		need = 0;
+	for (int i = 1; i <= need; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			*len = 1;
+			return s[0];
+		}
+		c = c << 6 | (s[i] & 0x3f);
+	}
+	*len = need + 1;
+	return need ? c : s[0];
+}
+
+/* Fold s in place, for emsys_memmem_fold */
+void emsys_fold(uint8_t *s, size_t n) {
+	for (size_t i = 0; i < n;) {
+		int len, c = decodeChar(&s[i], n - i, &len);
+		if (len == 1) {
+			s[i] = FOLD_ASCII(s[i]);
+		} else if (len == 2 && emsys_fold_char(c) != c) {
+			c = emsys_fold_char(c);
+			s[i] = 0xc0 | c >> 6;
+			s[i + 1] = 0x80 | (c & 0x3f);
+		}
+		i += len;
+	}
+}
+
+/* s has a capital letter, leaving out chars escaped by a backslash if it
+ * is a regex */
+int emsys_has_upper(const uint8_t *s, size_t n, int regex) {
+	for (size_t i = 0; i < n;) {
+		int len, c = decodeChar(&s[i], n - i, &len);
+		if (regex && c == '\\' && i + 1 < n) {
+			i += 2;
+			continue;
+		}
+		if (emsys_fold_char(c) != c && c != 0xb5 && c != 0x3c2)
+			return 1;
+		i += len;
+	}
+	return 0;
+}
+
+/* The m bytes at y fold to x */
+static int foldEqual(const uint8_t *y, const uint8_t *x, size_t m) {
+	for (size_t i = 0; i < m;) {
+		if (y[i] < 0x80) {
+			if (FOLD_ASCII(y[i]) != x[i])
+				return 0;
+			i++;
+			continue;
+		}
+		int ylen, xlen;
+		int cy = decodeChar(&y[i], m - i, &ylen);
+		int cx = decodeChar(&x[i], m - i, &xlen);
+		if (ylen != xlen || emsys_fold_char(cy) != cx)
+			return 0;
+		i += ylen;
+	}
+	return 1;
+}
+
+/*
+ * emsys_memmem_fold: emsys_memmem ignoring case, for a needle already
+ * folded with emsys_fold.  An ASCII needle is looked for as emsys_memmem
+ * looks, with its first and last bytes compared in both cases at once,
+ * and goes to the two-way algorithm over the folded haystack if checking
+ * gets costly.  Any other needle is tried where its first ASCII byte, if
+ * it has one, could be, and compared a char at a time.
+ */
+void *emsys_memmem_fold(const void *haystack, size_t n, const void *needle,
+			size_t m) {
+	const uint8_t *y = haystack, *x = needle;
+	size_t anchor = 0, i = 0, checked = 0;
+
+	if (m == 0)
+		return (void *)y;
+	if (m > n)
+		return NULL;
+	while (anchor < m && x[anchor] >= 0x80)
+		anchor++;
+	size_t end = n - m + 1; /* candidates are [0, end) */
+
+	if (anchor == m) {
+		/* Nothing to go by but the chars themselves */
+		for (; i < end; i++) {
+			if ((y[i] & 0xc0) != 0x80 && foldEqual(y + i, x, m))
+				return (void *)(y + i);
+		}
+		return NULL;
+	}
+
+	int ascii = 1;
+	for (size_t k = anchor; k < m && ascii; k++)
+		ascii = x[k] < 0x80;
+	uint8_t first = x[anchor], last = ascii ? x[m - 1] : first;
+	size_t lastat = ascii ? m - 1 : anchor;
+	uint8_t ufirst = first >= 'a' && first <= 'z' ? first & 0x5f : first;
+	uint8_t ulast = last >= 'a' && last <= 'z' ? last & 0x5f : last;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	__m128i vfirst = _mm_set1_epi8((char)first);
+	__m128i vufirst = _mm_set1_epi8((char)ufirst);
+	__m128i vlast = _mm_set1_epi8((char)last);
+	__m128i vulast = _mm_set1_epi8((char)ulast);
+	for (; i + 16 <= end; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(y + i + anchor));
+		__m128i b = _mm_loadu_si128((const __m128i *)(y + i + lastat));
+		a = _mm_or_si128(_mm_cmpeq_epi8(a, vfirst),
+				 _mm_cmpeq_epi8(a, vufirst));
+		b = _mm_or_si128(_mm_cmpeq_epi8(b, vlast),
+				 _mm_cmpeq_epi8(b, vulast));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+		while (mask) {
+			size_t at = i + __builtin_ctz(mask);
+			if (foldEqual(y + at, x, m))
+				return (void *)(y + at);
+			checked += m;
+			mask &= mask - 1;
+		}
+		if (ascii && checked > 4 * i + 4096)
+			return (void *)twoWay(y + i, n - i, x, m, 1);
+	}
+#endif
+	for (; i < end; i++) {
+		uint8_t a = y[i + anchor], b = y[i + lastat];
+		if ((a == first || a == ufirst) && (b == last || b == ulast)) {
+			if (foldEqual(y + i, x, m))
+				return (void *)(y + i);
+			checked += m;
+			if (ascii && checked > 4 * i + 4096)
+				return (void *)twoWay(y + i, n - i, x, m, 1);
+		}
+	}
+	return NULL;
+}
+
+// https://stackoverflow.com/a/779960
+// You must free the result if result is non-NULL.
+// With fold, case is ignored, and rep must be folded with emsys_fold.
+char *str_replace(char *orig, char *rep, char *with, int fold) {
+	char *result;	  // the return string
+	char *ins;	  // the next insert point
+	char *tmp;	  // varies
+	size_t len_rep;	  // length of rep (the string to remove)
+	size_t len_with;  // length of with (the string to replace rep with)
+	size_t len_front; // distance between rep and end of last rep
+	size_t count;	  // number of replacements
+	void *(*find)(const void *, size_t, const void *, size_t) =
+		fold ? emsys_memmem_fold : emsys_memmem;
+
+	// sanity checks and initialization
+	if (!orig || !rep)
+		return NULL;
+	len_rep = strlen(rep);
+	if (len_rep == 0)
+		return NULL; // empty rep causes infinite loop during count
+	if (!with)
+		with = "";
+	len_with = strlen(with);
+	size_t orig_len = strlen(orig);
+	char *orig_end = orig + orig_len;
+
+	// count the number of replacements needed
+	ins = orig;
+	for (count = 0;
+	     (tmp = find(ins, orig_end - ins, rep, len_rep));
+	     ++count) {
+		ins = tmp + len_rep;
+	}
+
+	// Check for potential overflow
+	size_t result_size;
+	if (len_with > len_rep) {
+		// Check if multiplication would overflow
+		size_t diff = len_with - len_rep;
+		if (count > 0 && diff > (SIZE_MAX - orig_len - 1) / count) {
+			return NULL; // Overflow would occur
+		}
+		result_size = orig_len + diff * count + 1;
+	} else if (len_with < len_rep) {
+		// Shrinking - need to handle underflow
+		size_t diff = len_rep - len_with;
+		if (diff * count > orig_len) {
+			// Would result in negative size
+			return NULL;
+		}
+		result_size = orig_len - diff * count + 1;
+	} else {
+		// len_with == len_rep, no size change
+		result_size = orig_len + 1;
+	}
+	tmp = result = xmalloc(result_size);
+
+	if (!result)
+		return NULL;
+
+	// first time through the loop, all the variable are set correctly
+	// from here on,
+	//    tmp points to the end of the result string
+	//    ins points to the next occurrence of rep in orig
+	//    orig points to the remainder of orig after "end of rep"
+	while (count--) {
+		ins = find(orig, orig_end - orig, rep, len_rep);
+		len_front = ins - orig;
+		size_t remaining = result_size - (tmp - result);
+		memcpy(tmp, orig, len_front);
+		tmp += len_front;
+		remaining = result_size - (tmp - result);
+		int written = snprintf(tmp, remaining, "%s", with);
+		if (written >= 0 && (size_t)written < remaining) {
+			tmp += written;
+		}
+		orig += len_front + len_rep; // move to next "end of rep"
+	}
+	size_t final_remaining = result_size - (tmp - result);
+	snprintf(tmp, final_remaining, "%s", orig);
+	return result;
+}
@@ -1,6 +1,7 @@
 #ifndef EMSYS_UTIL_H
 #define EMSYS_UTIL_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -12,6 +13,18 @@ void *xrealloc(void *ptr, size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 char *xstrdup(const char *s);
 
+/* Append buffer for efficient screen updates */
+struct abuf {
+	char *b;
+	int len;
+	int capacity;
+};
+
+#define ABUF_INIT { NULL, 0, 0 }
+
+void abAppend(struct abuf *ab, const char *s, int len);
+void abFree(struct abuf *ab);
+
 /* Portable getline implementation */
 ssize_t emsys_getline(char **lineptr, size_t *n, FILE *stream);
 
@@ -19,4 +32,18 @@ ssize_t emsys_getline(char **lineptr, size_t *n, FILE *stream);
 size_t emsys_strlcpy(char *dst, const char *src, size_t dsize);
 size_t emsys_strlcat(char *dst, const char *src, size_t dsize);
 
+/* memmem, which is not in POSIX 2001 */
+void *emsys_memmem(const void *haystack, size_t n, const void *needle,
+		   size_t m);
+
+/* Case folding for searches, and memmem with it */
+int emsys_fold_char(int c);
+void emsys_fold(uint8_t *s, size_t n);
+int emsys_has_upper(const uint8_t *s, size_t n, int regex);
+void *emsys_memmem_fold(const void *haystack, size_t n, const void *needle,
+			size_t m);
+
+/* orig with every rep in it replaced by with, in a new string */
+char *str_replace(char *orig, char *rep, char *with, int fold);
+
 #endif /* EMSYS_UTIL_H */